@@ -0,0 +1,164 @@
+// Frustum test and inputs shared by the cull passes
+// Bindings 2, 3 and 4 are the outputs of the including pass
+
+struct ObjectData {
+    vec3 translation;
+    uint boundsIndex;
+    vec4 rotation;
+    vec3 scale;
+};
+
+struct MeshBoundsData {
+    // vec4(center, radius)
+    vec4 sphere;
+    vec4 extents;
+};
+
+// Same layout as CullGlobals in vulkan_objects.hpp, a transient buffer written every frame
+// NOTE:
+// not push constants, so the camera moving doesn't invalidate the recorded command buffers
+layout(set = 0, binding = 20) uniform CullGlobals {
+    uint totalInstanceCount;
+    float nearD;
+    float farD;
+    float ratio;
+    float sphereFactorX;
+    float sphereFactorY;
+    float tang;
+    float minPixelSize;
+    vec3 X;
+    float viewportWidth;
+    vec3 Y;
+    float viewportHeight;
+    vec3 Z;
+    float lodPixelSize;
+    vec3 camPos;
+    uint meshletItemCount;
+    uint meshletDrawCount;
+};
+
+layout(set = 0, binding = 0) readonly buffer Instances { uint instances[]; };
+// vec4(center, radius)
+layout(set = 0, binding = 1) readonly buffer CullData { vec4 cullData[]; };
+layout(std140, set = 0, binding = 5) readonly buffer Objects { ObjectData objects[]; };
+layout(set = 0, binding = 6) readonly buffer MeshBounds { MeshBoundsData meshBounds[]; };
+// lod | lodCount << 16 of the draw that owns the slot
+layout(set = 0, binding = 10) readonly buffer SlotLods { uint slotLods[]; };
+
+const uint OUTSIDE = 0;
+const uint INTERSECT = 1;
+const uint INSIDE = 2;
+
+// radar frustum culling implementation from
+// http://www.lighthouse3d.com/tutorials/view-frustum-culling/radar-approach-implementation-ii/
+uint sphereInFrustum(vec3 p, float radius) {
+
+    float d;
+    float az, ax, ay;
+    uint result = INSIDE;
+
+    vec3 v = p - camPos;
+
+    az = dot(v, -Z);
+    if (az > farD + radius || az < nearD - radius)
+        return OUTSIDE;
+
+    if (az > farD - radius || az < nearD + radius)
+        result = INTERSECT;
+
+    // Contribution culling, the sphere is radius * viewportHeight / (az * tang) pixels across
+    // Only spheres entirely in front of the camera, where the projection can't blow up
+    if (az > radius && radius * viewportHeight < minPixelSize * az * tang)
+        return OUTSIDE;
+
+    ay = dot(v, Y);
+    d = sphereFactorY * radius;
+    az *= tang;
+    if (ay > az + d || ay < -az - d)
+        return OUTSIDE;
+
+    if (ay > az - d || ay < -az + d)
+        result = INTERSECT;
+
+    ax = dot(v, X);
+    az *= ratio;
+    d = sphereFactorX * radius;
+    if (ax > az + d || ax < -az - d)
+        return OUTSIDE;
+
+    if (ax > az - d || ax < -az + d)
+        result = INTERSECT;
+
+    return result;
+}
+
+// https://www.geeks3d.com/20141201/how-to-rotate-a-vertex-by-a-quaternion-in-glsl/
+vec3 rotate_vertex_position(vec3 position, vec4 rotation) {
+    return position + 2.0 * cross(rotation.xyz, cross(rotation.xyz, position) + rotation.w * position);
+}
+
+// Tests the oriented box against the same planes as sphereInFrustum
+// Every plane is dot(w, p - camPos) + k >= 0 inside,
+// the box is outside if its furthest point along w is still outside
+bool boxInFrustum(vec3 center, vec3 axisX, vec3 axisY, vec3 axisZ) {
+    vec3 v = center - camPos;
+    vec3 planes[6] = vec3[6](-Z, Z, -Z * tang - Y, -Z * tang + Y, -Z * tang * ratio - X, -Z * tang * ratio + X);
+    float offsets[6] = float[6](-nearD, farD, 0, 0, 0, 0);
+    for (uint i = 0; i < 6; ++i) {
+        vec3 w = planes[i];
+        float extent = abs(dot(w, axisX)) + abs(dot(w, axisY)) + abs(dot(w, axisZ));
+        if (dot(w, v) + offsets[i] + extent < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The LOD for the projected size of the sphere
+// LOD 0 down to lodPixelSize pixels across, then the next LOD every time the size halves
+uint selectLod(vec4 sphere, uint lodCount) {
+    float az = dot(sphere.xyz - camPos, -Z);
+    if (lodPixelSize <= 0.0 || az <= sphere.w) {
+        return 0u;
+    }
+    float pixels = sphere.w * viewportHeight / (az * tang);
+    float lod = floor(log2(lodPixelSize / pixels)) + 1.0;
+    return uint(clamp(lod, 0.0, float(lodCount - 1u)));
+}
+
+// Every LOD draw has a slot for every instance of the mesh, only the slot of the selected LOD is kept
+bool lodSelected(uint index, vec4 sphere) {
+    uint slotLod = slotLods[index];
+    uint lodCount = slotLod >> 16;
+    return lodCount <= 1u || selectLod(sphere, lodCount) == (slotLod & 0xFFFFu);
+}
+
+// Marks an unused instance slot
+const uint INVALID_INSTANCE = 0xFFFFFFFF;
+
+bool isVisible(uint index) {
+    uint instance = instances[index];
+    if (instance == INVALID_INSTANCE) {
+        return false;
+    }
+    vec4 sphere = cullData[instance];
+    // before the frustum test, most slots of a mesh with LODs fail this
+    if (!lodSelected(index, sphere)) {
+        return false;
+    }
+    uint sphereResult = sphereInFrustum(sphere.xyz, sphere.w);
+    if (sphereResult != INTERSECT) {
+        return sphereResult == INSIDE;
+    }
+    // The sphere is on a frustum edge, refine with the mesh aabb transformed by the instance
+    ObjectData object = objects[instance];
+    MeshBoundsData bounds = meshBounds[object.boundsIndex];
+    // NOTE:
+    // scale.x to match triangle.vert, which only supports uniform scaling
+    float scale = abs(object.scale.x);
+    vec3 center = object.translation + rotate_vertex_position(bounds.sphere.xyz, object.rotation) * object.scale.x;
+    vec3 axisX = rotate_vertex_position(vec3(1, 0, 0), object.rotation) * bounds.extents.x * scale;
+    vec3 axisY = rotate_vertex_position(vec3(0, 1, 0), object.rotation) * bounds.extents.y * scale;
+    vec3 axisZ = rotate_vertex_position(vec3(0, 0, 1), object.rotation) * bounds.extents.z * scale;
+    return boxInFrustum(center, axisX, axisY, axisZ);
+}
@@ -0,0 +1,142 @@
+// Culls the meshlets of the visible instances of the meshlet draws, one invocation per meshlet and instance slot
+// Every meshlet and instance that passes is appended as its own draw after the draws of cull_draw_pass.comp,
+// compacted with a scan so the draws keep the order of the work items
+// The including shader declares the spec constants and local size, enables the subgroup extensions of scan.glsl,
+// and defines MESHLET_OCCLUSION after including occlusion.glsl to also test against the depth pyramid
+
+struct MeshletData {
+    // local space vec4(center, radius)
+    vec4 sphere;
+    // local space vec4(axis, cutoff), cutoff 1 never culls
+    vec4 cone;
+    uint firstIndex;
+    uint indexCount;
+    uint drawIndex;
+    uint pad;
+};
+
+// Same layout as VulkanObjects::MeshletDraw
+struct MeshletDrawData {
+    // the draw owns the work items [firstItem, firstItem + meshletCount * capacity), slot major
+    uint firstItem;
+    uint firstMeshlet;
+    uint meshletCount;
+    uint drawIndex;
+};
+
+struct DrawCommand {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+};
+
+layout(set = 0, binding = 2) readonly buffer PrefixSum { uint prefixSum[]; };
+layout(set = 0, binding = 4) readonly buffer CulledInstanceIndices { uint culledInstanceIndices[]; };
+layout(set = 0, binding = 11) readonly buffer Meshlets { MeshletData meshlets[]; };
+layout(set = 0, binding = 12) readonly buffer DrawCommands { DrawCommand drawCommands[]; };
+layout(set = 0, binding = 13) readonly buffer MaterialIndices { uint materialIndices[]; };
+layout(set = 0, binding = 14) writeonly buffer CulledMaterialIndices { uint culledMaterialIndices[]; };
+layout(set = 0, binding = 15) writeonly buffer CulledDrawCommands { DrawCommand culledDrawCommands[]; };
+// Holds the number of draws written by cull_draw_pass.comp, the last work item adds the meshlet draws
+layout(set = 0, binding = 16) coherent buffer CulledDrawIndirectCount { uint culledDrawIndirectCount; };
+// First triangle of every culled draw relative to its uncompacted draw, for the visibility buffer IDs
+layout(set = 0, binding = 17) writeonly buffer CulledDrawTriangleOffsets { uint culledDrawTriangleOffsets[]; };
+layout(set = 0, binding = 18) readonly buffer MeshletDraws { MeshletDrawData meshletDraws[]; };
+// Same layout as ScanStates in cull_frustum_pass.comp, but scans the visible meshlets
+layout(set = 0, binding = 19) coherent buffer MeshletScanStates { uint meshletScanStates[]; };
+
+#define SCAN_STATES meshletScanStates
+#include "scan.glsl"
+
+// Cone test from
+// https://zeux.io/2023/04/28/triangle-backface-culling/
+// True if every triangle of the meshlet faces away from the camera
+bool coneCulled(vec3 center, float radius, vec3 axis, float cutoff) {
+    vec3 view = center - camPos;
+    return dot(view, axis) >= cutoff * length(view) + radius;
+}
+
+// The last meshlet draw whose first work item isn't after item
+uint findMeshletDraw(uint item) {
+    uint low = 0u;
+    uint high = meshletDrawCount;
+    while (high - low > 1u) {
+        uint middle = (low + high) / 2u;
+        if (meshletDraws[middle].firstItem <= item) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool meshletVisible(MeshletData meshlet, ObjectData object) {
+    // NOTE:
+    // scale.x to match triangle.vert, which only supports uniform scaling
+    float scale = object.scale.x;
+    vec3 center = object.translation + rotate_vertex_position(meshlet.sphere.xyz, object.rotation) * scale;
+    float radius = meshlet.sphere.w * abs(scale);
+    // The box around the sphere, sphereInFrustum would also apply the contribution culling meant for whole instances
+    if (!boxInFrustum(center, vec3(radius, 0, 0), vec3(0, radius, 0), vec3(0, 0, radius))) {
+        return false;
+    }
+    // a negative scale mirrors the triangles, the cone only holds without it
+    if (scale > 0.0 && meshlet.cone.w < 1.0 &&
+        coneCulled(center, radius, rotate_vertex_position(meshlet.cone.xyz, object.rotation), meshlet.cone.w)) {
+        return false;
+    }
+#ifdef MESHLET_OCCLUSION
+    if (isOccluded(vec4(center, radius))) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+void main() {
+    // NOTE:
+    // no early return, every invocation has to take part in the scan
+    uint item = scanTicket() * gl_WorkGroupSize.x + gl_LocalInvocationID.x;
+    bool itemVisible = false;
+    MeshletData meshlet;
+    DrawCommand draw;
+    uint culledInstance;
+    if (item < meshletItemCount) {
+        MeshletDrawData meshletDraw = meshletDraws[findMeshletDraw(item)];
+        // slot major, so neighbouring invocations test the meshlets of the same instance
+        uint localItem = item - meshletDraw.firstItem;
+        uint localSlot = localItem / meshletDraw.meshletCount;
+        uint localMeshlet = localItem % meshletDraw.meshletCount;
+        draw = drawCommands[meshletDraw.drawIndex];
+        uint slot = draw.firstInstance + localSlot;
+        // The slot is visible if the prefix sum counted it, the count before it is its culled instance
+        culledInstance = slot > 0u ? prefixSum[slot - 1u] : 0u;
+        if (localSlot < draw.instanceCount && prefixSum[slot] != culledInstance) {
+            if (localMeshlet == 0u) {
+                culledMaterialIndices[culledInstance] = materialIndices[draw.firstInstance];
+            }
+            meshlet = meshlets[meshletDraw.firstMeshlet + localMeshlet];
+            itemVisible = meshletVisible(meshlet, objects[culledInstanceIndices[culledInstance]]);
+        }
+    }
+    // NOTE:
+    // Read before the scan, the last work item only writes the total after the look-back has seen every earlier workgroup
+    uint firstDraw = culledDrawIndirectCount;
+    // Compacting with a scan instead of an atomicAdd keeps the meshlet draws in work item order,
+    // so the output is the same every frame for the same visibility
+    uint drawSum = scanInclusive(itemVisible);
+
+    if (itemVisible) {
+        uint culledDraw = firstDraw + drawSum - 1u;
+        // firstInstance is the culled instance, so gl_InstanceIndex and gl_BaseInstance work as for the whole draws
+        culledDrawCommands[culledDraw] = DrawCommand(meshlet.indexCount, 1u, meshlet.firstIndex, draw.vertexOffset, culledInstance);
+        culledDrawTriangleOffsets[culledDraw] = (meshlet.firstIndex - draw.firstIndex) / 3u;
+    }
+
+    if (item == meshletItemCount - 1u) {
+        culledDrawIndirectCount = firstDraw + drawSum;
+    }
+}
@@ -0,0 +1,22 @@
+#version 460
+
+// Depth only version of triangle.vert, only reads the position attribute
+
+#include "vertex_position.glsl"
+
+layout(binding = 0) uniform Globals {
+    mat4 projView;
+    vec3 camPos;
+};
+
+layout(std140, set = 1, binding = 0) readonly buffer Objects { ObjectData objects[]; };
+layout(set = 1, binding = 1) readonly buffer CulledInstanceIndices { uint culledInstanceIndices[]; };
+
+layout(location = 0) in vec3 inPosition;
+
+invariant gl_Position;
+
+void main() {
+    ObjectData object = objects[culledInstanceIndices[gl_InstanceIndex]];
+    gl_Position = projView * worldPosition(inPosition, object);
+}
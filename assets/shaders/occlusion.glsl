@@ -0,0 +1,50 @@
+// Occlusion test against the depth pyramid of the early draws
+// The including shader must include cull.glsl first for CullGlobals
+
+// Max depth of the draws of cull_early_pass.comp, see VulkanSwapChain::createDepthPyramid
+layout(set = 0, binding = 8) uniform texture2D depthPyramid;
+layout(set = 0, binding = 9) uniform Globals {
+    mat4 projView;
+    vec3 globalsCamPos;
+};
+
+// Returns true if every pixel the sphere covers has depth in front of it
+// Projects the corners of the box around the sphere, so the result is conservative
+bool isOccluded(vec4 sphere) {
+    vec2 ndcMin = vec2(1.0);
+    vec2 ndcMax = vec2(-1.0);
+    float nearestDepth = 1.0;
+    for (uint i = 0; i < 8; ++i) {
+        vec3 corner = sphere.xyz + sphere.w * vec3((i & 1u) == 0u ? -1.0 : 1.0, (i & 2u) == 0u ? -1.0 : 1.0, (i & 4u) == 0u ? -1.0 : 1.0);
+        vec4 clip = projView * vec4(corner, 1.0);
+        // crosses the near plane, the projection isn't bounded
+        if (clip.w <= nearD) {
+            return false;
+        }
+        vec3 ndc = clip.xyz / clip.w;
+        ndcMin = min(ndcMin, ndc.xy);
+        ndcMax = max(ndcMax, ndc.xy);
+        nearestDepth = min(nearestDepth, ndc.z);
+    }
+    // NOTE:
+    // y is flipped since the vertex shaders are compiled with setInvertY
+    vec2 viewport = vec2(viewportWidth, viewportHeight);
+    vec2 pixelMin = vec2(ndcMin.x, -ndcMax.y) * 0.5 + 0.5;
+    vec2 pixelMax = vec2(ndcMax.x, -ndcMin.y) * 0.5 + 0.5;
+    ivec2 pixelLimit = ivec2(viewport) - 1;
+    ivec2 pMin = clamp(ivec2(floor(pixelMin * viewport)), ivec2(0), pixelLimit);
+    ivec2 pMax = clamp(ivec2(floor(pixelMax * viewport)), ivec2(0), pixelLimit);
+
+    // Lowest level where the pixels fit in 2x2 texels
+    // texel x of level n covers the pixels [x << (n + 1), (x + 1) << (n + 1)),
+    // so the loop always ends by the last level, which is a single texel
+    int level = 0;
+    while (any(greaterThan((pMax >> (level + 1)) - (pMin >> (level + 1)), ivec2(1)))) {
+        ++level;
+    }
+    ivec2 tMin = pMin >> (level + 1);
+    ivec2 tMax = pMax >> (level + 1);
+    float occluderDepth = max(max(texelFetch(depthPyramid, tMin, level).r, texelFetch(depthPyramid, ivec2(tMax.x, tMin.y), level).r),
+                              max(texelFetch(depthPyramid, ivec2(tMin.x, tMax.y), level).r, texelFetch(depthPyramid, tMax, level).r));
+    return nearestDepth > occluderDepth;
+}
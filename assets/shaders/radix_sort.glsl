@@ -0,0 +1,28 @@
+// Stable LSD radix sort of uint key value pairs, RADIX_BITS per pass
+// Every pass is radix_sort_count.comp, radix_sort_scan.comp and radix_sort_scatter.comp, see VulkanRenderGraph::sort
+// Even passes move the pairs from SortKeys and SortValues to SortKeysTemp and SortValuesTemp, odd passes move them back,
+// so an even number of passes leaves the sorted pairs where they started
+
+const uint RADIX_BITS = 8;
+const uint RADIX_SIZE = 1u << RADIX_BITS;
+// NOTE:
+// Must match VulkanRenderGraph::sortGroupSize and sortItemsPerInvocation
+const uint SORT_GROUP_SIZE = 256;
+const uint SORT_ITEMS_PER_INVOCATION = 4;
+// Elements per workgroup of the count and scatter passes
+const uint SORT_TILE_SIZE = SORT_GROUP_SIZE * SORT_ITEMS_PER_INVOCATION;
+
+layout(push_constant) uniform constants {
+    uint count;
+    // lowest bit of the digit sorted by this pass
+    uint shift;
+    // workgroups of the count and scatter passes
+    uint groupCount;
+};
+
+uint digitOf(uint key) { return (key >> shift) & (RADIX_SIZE - 1u); }
+
+// The histograms are digit major, so their exclusive scan is the first output index of every digit of every tile
+uint histogramIndex(uint digit, uint group) { return digit * groupCount + group; }
+
+bool readsTemp() { return (shift / RADIX_BITS) % 2u == 1u; }
@@ -0,0 +1,112 @@
+// Workgroup wide inclusive scan with decoupled look-back across workgroups
+// https://research.nvidia.com/publication/2016-03_single-pass-parallel-prefix-scan-decoupled-look-back
+// The workgroup local scan is from
+// https://cachemiss.xyz/blog/parallel-reduce-and-scan-on-the-GPU
+//
+// The including shader must:
+// enable GL_KHR_shader_subgroup_arithmetic, GL_KHR_shader_subgroup_basic and GL_KHR_shader_subgroup_ballot,
+// declare the SUBGROUP_SIZE spec constant,
+// and #define SCAN_STATES as a coherent uint array that is cleared to 0 before every dispatch,
+// [0] hands out the workgroup tickets, [1 + ticket] holds the scan state of that workgroup
+
+// A scan state is a flag in the top 2 bits and a count in the lower 30 bits,
+// so both are published with a single atomic and a reader never sees one without the other
+// NOTE:
+// limits the scanned total to 2^30
+const uint STATE_AGGREGATE = 1u << 30;
+const uint STATE_PREFIX = 2u << 30;
+const uint STATE_FLAG_MASK = 3u << 30;
+const uint STATE_VALUE_MASK = ~STATE_FLAG_MASK;
+
+shared uint scanSubgroupSums[SUBGROUP_SIZE];
+shared uint scanGroupIndex;
+shared uint scanGroupExclusive;
+
+// Workgroups aren't guaranteed to start in gl_WorkGroupID order,
+// scanning in ticket order makes sure every workgroup waited on in scanLookBack has started
+// Must be called once from uniform control flow, use the result instead of gl_WorkGroupID
+uint scanTicket() {
+    if (gl_LocalInvocationID.x == 0) {
+        scanGroupIndex = atomicAdd(SCAN_STATES[0], 1);
+    }
+
+    memoryBarrierShared();
+    barrier();
+
+    return scanGroupIndex;
+}
+
+// Walks back over the states of the previous workgroups until one has published its inclusive prefix
+// Returns the total of all workgroups before groupIndex
+uint scanLookBack(uint groupIndex) {
+    uint exclusive = 0;
+    uint previous = groupIndex;
+    while (previous > 0) {
+        // atomicOr with 0 as an atomic load
+        uint state = atomicOr(SCAN_STATES[previous], 0);
+        uint flag = state & STATE_FLAG_MASK;
+        // Spin until the previous workgroup has published at least its aggregate,
+        // it has taken its ticket earlier so it is already running
+        if (flag == 0) {
+            continue;
+        }
+        exclusive += state & STATE_VALUE_MASK;
+        if (flag == STATE_PREFIX) {
+            break;
+        }
+        --previous;
+    }
+    return exclusive;
+}
+
+// Adds the sums of the previous subgroups and workgroups to sum, the inclusive subgroup scan of this invocation
+uint scanWorkgroupInclusive(uint sum) {
+    if (gl_SubgroupInvocationID == gl_SubgroupSize - 1) {
+        scanSubgroupSums[gl_SubgroupID] = sum;
+    }
+
+    memoryBarrierShared();
+    barrier();
+
+    if (gl_SubgroupID == 0) {
+        // NOTE:
+        // gl_NumSubgroups must be <= gl_SubgroupSize, VulkanDevice::scanWorkGroupSize() caps the local size to match
+        uint warpSum = gl_SubgroupInvocationID < gl_NumSubgroups ? scanSubgroupSums[gl_SubgroupInvocationID] : 0;
+        warpSum = subgroupInclusiveAdd(warpSum);
+        scanSubgroupSums[gl_SubgroupInvocationID] = warpSum;
+    }
+
+    memoryBarrierShared();
+    barrier();
+
+    if (gl_SubgroupID > 0) {
+        sum += scanSubgroupSums[gl_SubgroupID - 1];
+    }
+
+    // The last invocation holds the workgroup total
+    if (gl_LocalInvocationID.x == gl_WorkGroupSize.x - 1) {
+        uint exclusive = 0;
+        if (scanGroupIndex == 0) {
+            atomicExchange(SCAN_STATES[1], STATE_PREFIX | sum);
+        } else {
+            // Publish the aggregate first so later workgroups can continue past this one without waiting for the look-back
+            atomicExchange(SCAN_STATES[1 + scanGroupIndex], STATE_AGGREGATE | sum);
+            exclusive = scanLookBack(scanGroupIndex);
+            atomicExchange(SCAN_STATES[1 + scanGroupIndex], STATE_PREFIX | (exclusive + sum));
+        }
+        scanGroupExclusive = exclusive;
+    }
+
+    memoryBarrierShared();
+    barrier();
+
+    return sum + scanGroupExclusive;
+}
+
+// Returns the number of active invocations up to and including this one, over all workgroups in ticket order
+// Must be called once from uniform control flow after scanTicket
+uint scanInclusive(bool active) { return scanWorkgroupInclusive(subgroupBallotInclusiveBitCount(subgroupBallot(active))); }
+
+// Returns the sum of value up to and including this invocation, over all workgroups in ticket order
+// Must be called once from uniform control flow after scanTicket
+uint scanInclusiveAdd(uint value) { return scanWorkgroupInclusive(subgroupInclusiveAdd(value)); }
@@ -1,16 +1,12 @@
 #version 460
 
+#include "vertex_position.glsl"
+
 layout(binding = 0) uniform Globals {
     mat4 projView;
     vec3 camPos;
 };
 
-struct ObjectData {
-    vec3 translation;
-    vec4 rotation;
-    vec3 scale;
-};
-
 struct MaterialData {
     vec4 baseColorFactor;
     uint samplerIndex;
@@ -49,21 +45,14 @@ layout(location = 11) out float metallicFactor;
 layout(location = 12) out float roughnessFactor;
 layout(location = 13) out float occulsionStrength;
 
-// https://www.geeks3d.com/20141201/how-to-rotate-a-vertex-by-a-quaternion-in-glsl/
-vec3 rotate_vertex_position(vec3 position, vec4 rotation)
-{
-  return position + 2.0 * cross(rotation.xyz, cross(rotation.xyz, position) + rotation.w * position);
-}
-
+invariant gl_Position;
 
 void main() {
     MaterialData material = materials[culledMaterialIndices[gl_BaseInstance]];
 
     ObjectData object = objects[culledInstanceIndices[gl_InstanceIndex]];
 
-    // FIXME:
-    // only supports uniform scaling
-    vec4 vertPos = vec4(rotate_vertex_position(inPosition, object.rotation) * object.scale.x + object.translation, 1.0);
+    vec4 vertPos = worldPosition(inPosition, object);
 
     gl_Position = projView * vertPos;
 
@@ -0,0 +1,21 @@
+// World position of a vertex, shared by every vertex shader that draws the culled instances
+// Both passes of the depth prepass must compute bit identical positions for the EQUAL depth test,
+// so the including shaders also declare gl_Position invariant
+
+struct ObjectData {
+    vec3 translation;
+    vec4 rotation;
+    vec3 scale;
+};
+
+// https://www.geeks3d.com/20141201/how-to-rotate-a-vertex-by-a-quaternion-in-glsl/
+vec3 rotate_vertex_position(vec3 position, vec4 rotation)
+{
+  return position + 2.0 * cross(rotation.xyz, cross(rotation.xyz, position) + rotation.w * position);
+}
+
+vec4 worldPosition(vec3 position, ObjectData object) {
+    // FIXME:
+    // only supports uniform scaling
+    return vec4(rotate_vertex_position(position, object.rotation) * object.scale.x + object.translation, 1.0);
+}
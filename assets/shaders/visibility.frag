@@ -0,0 +1,10 @@
+#version 460
+
+layout(location = 0) flat in uint visibilityBase;
+
+layout(location = 0) out uint outID;
+
+void main() {
+    // gl_PrimitiveID restarts at 0 for every draw
+    outID = visibilityBase + gl_PrimitiveID;
+}
@@ -0,0 +1,30 @@
+#version 460
+
+// Visibility buffer version of triangle.vert, only reads the position attribute
+// The ID of a triangle is culledInstanceIndex << triangleBits | triangle,
+// the triangle counted from the firstIndex of the uncompacted draw so meshlet draws resolve like whole draws
+
+#include "vertex_position.glsl"
+
+layout(binding = 0) uniform Globals {
+    mat4 projView;
+    vec3 camPos;
+};
+
+layout(std140, set = 1, binding = 0) readonly buffer Objects { ObjectData objects[]; };
+layout(set = 1, binding = 1) readonly buffer CulledInstanceIndices { uint culledInstanceIndices[]; };
+layout(set = 1, binding = 2) readonly buffer CulledDrawTriangleOffsets { uint culledDrawTriangleOffsets[]; };
+
+layout(push_constant) uniform constants { uint triangleBits; };
+
+layout(location = 0) in vec3 inPosition;
+
+layout(location = 0) flat out uint visibilityBase;
+
+invariant gl_Position;
+
+void main() {
+    ObjectData object = objects[culledInstanceIndices[gl_InstanceIndex]];
+    gl_Position = projView * worldPosition(inPosition, object);
+    visibilityBase = gl_InstanceIndex << triangleBits | culledDrawTriangleOffsets[gl_DrawID];
+}
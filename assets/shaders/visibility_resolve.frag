@@ -0,0 +1,210 @@
+#version 460
+#extension GL_EXT_nonuniform_qualifier : require
+#extension GL_GOOGLE_include_directive : require
+
+// Shades the triangle IDs of visibility.frag, see visibility.vert for the layout of the IDs
+// The vertices are fetched from the vertex and index buffers and interpolated with barycentrics computed per pixel
+
+#include "pbr.glsl"
+#include "vertex_position.glsl"
+
+struct MaterialData {
+    vec4 baseColorFactor;
+    uint samplerIndex;
+    uint imageIndex;
+    uint normalIndex;
+    float normalScale;
+    uint metallicRoughnessIndex;
+    float metallicFactor;
+    float roughnessFactor;
+    uint aoIndex;
+    float occlusionStrength;
+};
+
+struct DrawCommand {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+};
+
+// Same as visibilityClearValue in vulkan_rendergraph.hpp
+const uint noTriangle = 0xFFFFFFFFu;
+// Floats per Vertex in vulkan_node.hpp, pos at 0, texCoord at 3 and normal at 5
+const uint vertexFloats = 12u;
+
+layout(set = 0, binding = 0) uniform Globals {
+    mat4 projView;
+    vec3 camPos;
+};
+layout(set = 0, binding = 1) uniform utexture2D visibilityImage;
+
+layout(std140, set = 1, binding = 0) readonly buffer Objects { ObjectData objects[]; };
+layout(std140, set = 1, binding = 1) readonly buffer Materials { MaterialData materials[]; };
+layout(set = 1, binding = 2) readonly buffer CulledInstanceIndices { uint culledInstanceIndices[]; };
+layout(set = 1, binding = 3) readonly buffer DrawCommands { DrawCommand drawCommands[]; };
+layout(set = 1, binding = 4) readonly buffer PrefixSum { uint prefixSum[]; };
+layout(set = 1, binding = 5) readonly buffer MaterialIndices { uint materialIndices[]; };
+layout(set = 1, binding = 6) readonly buffer Vertices { float vertices[]; };
+layout(set = 1, binding = 7) readonly buffer Indices { uint indices[]; };
+
+layout(set = 2, binding = 0) uniform sampler samplers[];
+layout(set = 2, binding = 1) uniform texture2D images[];
+layout(set = 2, binding = 2) uniform texture2D normals[];
+layout(set = 2, binding = 3) uniform texture2D metallicRoughnesses[];
+layout(set = 2, binding = 4) uniform texture2D aos[];
+
+layout(push_constant) uniform constants {
+    uint triangleBits;
+    uint drawCount;
+};
+
+layout(location = 0) out vec4 outColor;
+
+// The end of the culled instances of a draw, the same ranges as cull_draw_pass.comp
+uint endVisible(uint drawIndex) {
+    DrawCommand draw = drawCommands[drawIndex];
+    uint end = draw.firstInstance + draw.instanceCount;
+    return end > 0u ? prefixSum[end - 1u] : 0u;
+}
+
+// The draws are sorted by firstInstance, so the draw of a culled instance is the first one whose culled instances end after it
+uint findDraw(uint culledInstance) {
+    uint low = 0u;
+    uint high = drawCount - 1u;
+    while (low < high) {
+        uint mid = (low + high) / 2u;
+        if (endVisible(mid) > culledInstance) {
+            high = mid;
+        } else {
+            low = mid + 1u;
+        }
+    }
+    return low;
+}
+
+vec3 vertexVec3(uint vertex, uint offset) {
+    uint base = vertex * vertexFloats + offset;
+    return vec3(vertices[base], vertices[base + 1u], vertices[base + 2u]);
+}
+
+vec2 vertexVec2(uint vertex, uint offset) {
+    uint base = vertex * vertexFloats + offset;
+    return vec2(vertices[base], vertices[base + 1u]);
+}
+
+// Perspective correct barycentrics of the pixel and their screen space derivatives
+// http://filmicworlds.com/blog/visibility-buffer-rendering-with-material-graphs/
+struct Barycentrics {
+    vec3 lambda;
+    vec3 ddx;
+    vec3 ddy;
+};
+
+Barycentrics barycentrics(vec4 clip0, vec4 clip1, vec4 clip2, vec2 pixelNdc, vec2 viewport) {
+    vec3 invW = 1.0 / vec3(clip0.w, clip1.w, clip2.w);
+    vec2 ndc0 = clip0.xy * invW.x;
+    vec2 ndc1 = clip1.xy * invW.y;
+    vec2 ndc2 = clip2.xy * invW.z;
+
+    float invDet = 1.0 / determinant(mat2(ndc2 - ndc1, ndc0 - ndc1));
+    vec3 ddx = vec3(ndc1.y - ndc2.y, ndc2.y - ndc0.y, ndc0.y - ndc1.y) * invDet * invW;
+    vec3 ddy = vec3(ndc2.x - ndc1.x, ndc0.x - ndc2.x, ndc1.x - ndc0.x) * invDet * invW;
+    float ddxSum = dot(ddx, vec3(1.0));
+    float ddySum = dot(ddy, vec3(1.0));
+
+    vec2 delta = pixelNdc - ndc0;
+    float interpInvW = invW.x + delta.x * ddxSum + delta.y * ddySum;
+    float interpW = 1.0 / interpInvW;
+
+    Barycentrics result;
+    result.lambda = interpW * (vec3(invW.x, 0.0, 0.0) + delta.x * ddx + delta.y * ddy);
+
+    // NOTE:
+    // One pixel is 2 / viewport in NDC, and y already points down since the clip positions match the rasterizer's
+    ddx *= 2.0 / viewport.x;
+    ddy *= 2.0 / viewport.y;
+    ddxSum *= 2.0 / viewport.x;
+    ddySum *= 2.0 / viewport.y;
+    result.ddx = (1.0 / (interpInvW + ddxSum)) * (result.lambda * interpInvW + ddx) - result.lambda;
+    result.ddy = (1.0 / (interpInvW + ddySum)) * (result.lambda * interpInvW + ddy) - result.lambda;
+    return result;
+}
+
+vec3 interpolate(Barycentrics b, vec3 v0, vec3 v1, vec3 v2) { return mat3(v0, v1, v2) * b.lambda; }
+vec2 interpolate(Barycentrics b, vec2 v0, vec2 v1, vec2 v2) { return mat3x2(v0, v1, v2) * b.lambda; }
+
+void main() {
+    uint id = texelFetch(visibilityImage, ivec2(gl_FragCoord.xy), 0).r;
+    // NOTE:
+    // Discarding keeps the color of the previous resolve, the late occlusion pass only draws some of the pixels
+    if (id == noTriangle) {
+        discard;
+    }
+    uint culledInstance = id >> triangleBits;
+    uint triangle = id & ((1u << triangleBits) - 1u);
+
+    DrawCommand draw = drawCommands[findDraw(culledInstance)];
+    MaterialData material = materials[materialIndices[draw.firstInstance]];
+    ObjectData object = objects[culledInstanceIndices[culledInstance]];
+
+    uint vertexIndices[3];
+    vec3 worldPositions[3];
+    vec4 clipPositions[3];
+    for (uint k = 0u; k < 3u; ++k) {
+        vertexIndices[k] = uint(int(indices[draw.firstIndex + triangle * 3u + k]) + draw.vertexOffset);
+        worldPositions[k] = worldPosition(vertexVec3(vertexIndices[k], 0u), object).xyz;
+        clipPositions[k] = projView * vec4(worldPositions[k], 1.0);
+        // NOTE:
+        // The shaders are compiled with an inverted y, the vertex shaders of the visibility pass rasterized -y
+        clipPositions[k].y = -clipPositions[k].y;
+    }
+
+    vec2 viewport = vec2(textureSize(visibilityImage, 0));
+    Barycentrics b = barycentrics(clipPositions[0], clipPositions[1], clipPositions[2], gl_FragCoord.xy / viewport * 2.0 - 1.0, viewport);
+
+    vec3 WorldPos = interpolate(b, worldPositions[0], worldPositions[1], worldPositions[2]);
+    // NOTE:
+    // Unrotated like the Normal of triangle.vert
+    vec3 Normal = interpolate(b, vertexVec3(vertexIndices[0], 5u), vertexVec3(vertexIndices[1], 5u), vertexVec3(vertexIndices[2], 5u));
+    vec2 uv0 = vertexVec2(vertexIndices[0], 3u);
+    vec2 uv1 = vertexVec2(vertexIndices[1], 3u);
+    vec2 uv2 = vertexVec2(vertexIndices[2], 3u);
+    vec2 texCoord = interpolate(b, uv0, uv1, uv2);
+    vec2 texCoordDx = mat3x2(uv0, uv1, uv2) * b.ddx;
+    vec2 texCoordDy = mat3x2(uv0, uv1, uv2) * b.ddy;
+
+    uint samplerIndex = material.samplerIndex;
+    vec3 albedo = pow(vec3(material.baseColorFactor) *
+                          textureGrad(sampler2D(images[nonuniformEXT(material.imageIndex)], samplers[nonuniformEXT(samplerIndex)]),
+                                      texCoord, texCoordDx, texCoordDy)
+                              .rgb,
+                      vec3(2.2));
+
+    vec4 metallicRoughnessTexture =
+        textureGrad(sampler2D(metallicRoughnesses[nonuniformEXT(material.metallicRoughnessIndex)], samplers[nonuniformEXT(samplerIndex)]),
+                    texCoord, texCoordDx, texCoordDy);
+    float metallic = material.metallicFactor * metallicRoughnessTexture.b;
+    float roughness = material.roughnessFactor * metallicRoughnessTexture.g;
+
+    float ao = material.occlusionStrength *
+               textureGrad(sampler2D(aos[nonuniformEXT(material.aoIndex)], samplers[nonuniformEXT(samplerIndex)]), texCoord,
+                           texCoordDx, texCoordDy)
+                   .r;
+
+    vec3 N = Normal;
+    // fix for default normal map, same as triangle.frag
+    if (material.normalIndex != 0u) {
+        vec3 tangentNormal = (material.normalScale *
+                              textureGrad(sampler2D(normals[nonuniformEXT(material.normalIndex)], samplers[nonuniformEXT(samplerIndex)]),
+                                          texCoord, texCoordDx, texCoordDy)
+                                  .rgb) *
+                                 2.0 -
+                             1.0;
+        mat3 worldMatrix = mat3(worldPositions[0], worldPositions[1], worldPositions[2]);
+        N = perturbNormal(tangentNormal, Normal, worldMatrix * b.ddx, worldMatrix * b.ddy, texCoordDx, texCoordDy);
+    }
+
+    outColor = vec4(shadePBR(albedo, metallic, roughness, ao, N, WorldPos, camPos), 1.0);
+}
@@ -32,8 +32,52 @@ inline uint32_t getGroupCount(uint32_t threadCount, uint32_t localSize) { return
 struct Settings {
     uint32_t extraObjectCount = 10000;
     uint32_t randLimit = 100;
+    // objects despawned and spawned every frame, for stress testing runtime instance management
+    uint32_t churnPerFrame = 0;
+    // sort instances by the morton code of their position at load
+    bool mortonOrder = false;
+    // LODs per primitive including the full resolution one, simplified at load, 1 to disable
+    uint32_t lodCount = 1;
     bool showFPS = true;
     bool pauseOnMinimization = false;
+    // print the average cull and draw time and the CPU time of recording the commands over this many frames and exit, 0 to disable
+    // Measures the load order and then the morton order of the instances, mortonOrder is ignored
+    uint32_t benchmarkFrames = 0;
+    // compare the cull results against the host reference from this many random camera positions and exit, 0 to disable
+    uint32_t validateCullingFrames = 0;
+    // compare the GPU radix sort of random keys against std::stable_sort for this many frames and exit, 0 to disable
+    uint32_t validateSortFrames = 0;
+    // cull with CpuCull instead of the compute passes, always on for devices without subgroup ballot support
+    bool cpuCulling = false;
+    // draw last frame's visible instances first and cull the rest against their depth, GPU culling only
+    bool occlusionCulling = false;
+    // cull instances whose bounding sphere covers fewer pixels across than this, 0 to disable
+    float minPixelSize = 0.0f;
+    // instances whose bounding sphere covers fewer pixels across than this draw LOD 1, every halving the next LOD, 0 to disable
+    float lodPixelSize = 0.0f;
+    // split large primitives into meshlets and cull them per instance against the frustum, their normal cone and with
+    // occlusionCulling the depth pyramid, GPU culling only
+    bool meshletCulling = false;
+    // draw the culled instances depth only first, then shade them with an EQUAL depth test so every pixel is shaded once
+    bool depthPrepass = false;
+    // draw the culled triangle IDs into a visibility image and shade every pixel once in a full screen pass,
+    // GPU culling without MSAA only, ignores depthPrepass
+    bool visibilityBuffer = false;
+    // let the render graph infer the buffer barriers from the shader reflection instead of using the manual ones
+    bool autoBarriers = false;
+    // report the missing and redundant manual barriers when the render graph is compiled, keeps the manual barriers
+    bool validateBarriers = false;
+    // keep a recorded command buffer per frame in flight and swap chain image and submit it again
+    // until the graph, its push constants or dynamic counts change, the uploads go in a command buffer recorded every frame
+    // the camera and cull inputs are transient buffers, so a moving camera keeps the command buffers
+    bool reuseCommandBuffers = false;
+    // run the GPU cull passes on a dedicated compute queue if the device has one, on the graphics queue otherwise
+    bool asyncCompute = false;
+    // record the graphics queue commands into this many secondary command buffers in parallel, split between the passes,
+    // 0 records them into the primary command buffer on the main thread
+    uint32_t recordingThreads = 0;
+    // let the scratch buffers of the render graph that are never accessed at the same time share memory
+    bool aliasScratchBuffers = false;
 };
 
 static std::string getFileExtension(std::string filePath) {
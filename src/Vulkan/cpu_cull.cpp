@@ -0,0 +1,367 @@
+#include "cpu_cull.hpp"
+#include "common.hpp"
+#include "vulkan_objects.hpp"
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <glm/gtx/quaternion.hpp>
+#include <numeric>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// radar frustum culling implementation from
+// http://www.lighthouse3d.com/tutorials/view-frustum-culling/radar-approach-implementation-ii/
+CpuCull::Result CpuCull::sphereInFrustum(const CullGlobals& frustum, glm::vec4 sphere) {
+    float radius = sphere.w;
+    Result result = INSIDE;
+
+    glm::vec3 v = glm::vec3(sphere) - frustum.camPos;
+
+    float az = glm::dot(v, -frustum.Z);
+    if (az > frustum.farD + radius || az < frustum.nearD - radius)
+        return OUTSIDE;
+
+    if (az > frustum.farD - radius || az < frustum.nearD + radius)
+        result = INTERSECT;
+
+    // Same contribution test as cull.glsl
+    if (az > radius && radius * frustum.viewportHeight < frustum.minPixelSize * az * frustum.tang)
+        return OUTSIDE;
+
+    float ay = glm::dot(v, frustum.Y);
+    float d = frustum.sphereFactorY * radius;
+    az *= frustum.tang;
+    if (ay > az + d || ay < -az - d)
+        return OUTSIDE;
+
+    if (ay > az - d || ay < -az + d)
+        result = INTERSECT;
+
+    float ax = glm::dot(v, frustum.X);
+    az *= frustum.ratio;
+    d = frustum.sphereFactorX * radius;
+    if (ax > az + d || ax < -az - d)
+        return OUTSIDE;
+
+    if (ax > az - d || ax < -az + d)
+        result = INTERSECT;
+
+    return result;
+}
+
+// Same planes as boxInFrustum in cull_frustum_pass.comp
+bool CpuCull::boxInFrustum(const CullGlobals& frustum, const Input& input, uint32_t instance, float margin) {
+    const SSBOData& object = input.objects[instance];
+    const MeshBounds& bounds = input.meshBounds[object.boundsIndex];
+    // NOTE:
+    // scale.x to match triangle.vert, which only supports uniform scaling
+    float scale = glm::abs(object.scale.x) * (1.0f + margin);
+    glm::vec3 center = object.translation + (object.rotation * glm::vec3(bounds.sphere)) * object.scale.x;
+    glm::vec3 axisX = (object.rotation * glm::vec3(1, 0, 0)) * bounds.extents.x * scale;
+    glm::vec3 axisY = (object.rotation * glm::vec3(0, 1, 0)) * bounds.extents.y * scale;
+    glm::vec3 axisZ = (object.rotation * glm::vec3(0, 0, 1)) * bounds.extents.z * scale;
+
+    glm::vec3 v = center - frustum.camPos;
+    const glm::vec3 planes[6] = {-frustum.Z,
+                                 frustum.Z,
+                                 -frustum.Z * frustum.tang - frustum.Y,
+                                 -frustum.Z * frustum.tang + frustum.Y,
+                                 -frustum.Z * frustum.tang * frustum.ratio - frustum.X,
+                                 -frustum.Z * frustum.tang * frustum.ratio + frustum.X};
+    const float offsets[6] = {-frustum.nearD, frustum.farD, 0, 0, 0, 0};
+    for (uint32_t i = 0; i < 6; ++i) {
+        glm::vec3 w = planes[i];
+        float extent = glm::abs(glm::dot(w, axisX)) + glm::abs(glm::dot(w, axisY)) + glm::abs(glm::dot(w, axisZ));
+        if (glm::dot(w, v) + offsets[i] + extent < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t CpuCull::selectLod(const CullGlobals& frustum, glm::vec4 sphere, uint32_t lodCount) {
+    float az = glm::dot(glm::vec3(sphere) - frustum.camPos, -frustum.Z);
+    if (frustum.lodPixelSize <= 0.0f || az <= sphere.w) {
+        return 0;
+    }
+    float pixels = sphere.w * frustum.viewportHeight / (az * frustum.tang);
+    float lod = std::floor(std::log2(frustum.lodPixelSize / pixels)) + 1.0f;
+    return uint32_t(glm::clamp(lod, 0.0f, float(lodCount - 1)));
+}
+
+bool CpuCull::lodSelected(const CullGlobals& frustum, const Input& input, uint32_t index, glm::vec4 sphere) {
+    uint32_t slotLod = input.slotLods[index];
+    uint32_t lodCount = slotLod >> 16;
+    return lodCount <= 1 || selectLod(frustum, sphere, lodCount) == (slotLod & 0xFFFF);
+}
+
+bool CpuCull::isVisible(const CullGlobals& frustum, const Input& input, uint32_t index, float margin) {
+    uint32_t instance = input.instances[index];
+    if (instance == SSBOBuffers::invalidInstance) {
+        return false;
+    }
+    glm::vec4 sphere = input.cullData[instance];
+    sphere.w *= 1.0f + margin;
+    if (!lodSelected(frustum, input, index, sphere)) {
+        return false;
+    }
+    Result sphereResult = sphereInFrustum(frustum, sphere);
+    if (sphereResult != INTERSECT) {
+        return sphereResult == INSIDE;
+    }
+    return boxInFrustum(frustum, input, instance, margin);
+}
+
+void CpuCull::inclusiveScan(const std::vector<uint32_t>& in, std::vector<uint32_t>& out) {
+    out.resize(in.size());
+    uint32_t sum = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        sum += in[i];
+        out[i] = sum;
+    }
+}
+
+void CpuCull::sphereResultsScalar(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results) {
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t instance = input.instances[first + i];
+        results[i] = instance == SSBOBuffers::invalidInstance ? OUTSIDE : sphereInFrustum(frustum, input.cullData[instance]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// NOTE:
+// helpers of sphereResultsAVX2 need the same target, lambdas don't inherit it
+__attribute__((target("avx2,fma"))) static inline __m256 dotAVX2(__m256 x, __m256 y, __m256 z, glm::vec3 axis) {
+    return _mm256_fmadd_ps(x, _mm256_set1_ps(axis.x), _mm256_fmadd_ps(y, _mm256_set1_ps(axis.y), _mm256_mul_ps(z, _mm256_set1_ps(axis.z))));
+}
+
+// value > upper || value < lower
+__attribute__((target("avx2,fma"))) static inline __m256 outsideRangeAVX2(__m256 value, __m256 upper, __m256 lower) {
+    return _mm256_or_ps(_mm256_cmp_ps(value, upper, _CMP_GT_OQ), _mm256_cmp_ps(value, lower, _CMP_LT_OQ));
+}
+
+// The same tests as sphereInFrustum for 8 slots at a time
+// Every plane test is evaluated instead of returning early, a lane that is outside of any plane is OUTSIDE
+__attribute__((target("avx2,fma"))) void CpuCull::sphereResultsAVX2(const CullGlobals& frustum, const Input& input, uint32_t first,
+                                                                    uint32_t count, uint8_t* results) {
+    const float* cullData = reinterpret_cast<const float*>(input.cullData);
+    const __m256i invalid = _mm256_set1_epi32(SSBOBuffers::invalidInstance);
+    const __m256 camX = _mm256_set1_ps(frustum.camPos.x);
+    const __m256 camY = _mm256_set1_ps(frustum.camPos.y);
+    const __m256 camZ = _mm256_set1_ps(frustum.camPos.z);
+    const __m256 nearD = _mm256_set1_ps(frustum.nearD);
+    const __m256 farD = _mm256_set1_ps(frustum.farD);
+    const __m256 tang = _mm256_set1_ps(frustum.tang);
+    const __m256 ratio = _mm256_set1_ps(frustum.ratio);
+    const __m256 sphereFactorX = _mm256_set1_ps(frustum.sphereFactorX);
+    const __m256 sphereFactorY = _mm256_set1_ps(frustum.sphereFactorY);
+    const __m256 viewportHeight = _mm256_set1_ps(frustum.viewportHeight);
+    const __m256 minPixelSize = _mm256_set1_ps(frustum.minPixelSize);
+    const __m256i resultInside = _mm256_set1_epi32(INSIDE);
+    const __m256i resultIntersect = _mm256_set1_epi32(INTERSECT);
+    const __m256i resultOutside = _mm256_set1_epi32(OUTSIDE);
+
+    uint32_t i = 0;
+    alignas(32) uint32_t laneResults[8];
+    for (; i + 8 <= count; i += 8) {
+        __m256i instances = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input.instances + first + i));
+        __m256 invalidMask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(instances, invalid));
+        // gather from instance 0 for unused slots, their result is overwritten below
+        // NOTE:
+        // the gather offsets are signed 32 bit, so instance ids must stay below 2^29
+        __m256i offsets = _mm256_slli_epi32(_mm256_andnot_si256(_mm256_castps_si256(invalidMask), instances), 2);
+        __m256 x = _mm256_sub_ps(_mm256_i32gather_ps(cullData, offsets, 4), camX);
+        __m256 y = _mm256_sub_ps(_mm256_i32gather_ps(cullData + 1, offsets, 4), camY);
+        __m256 z = _mm256_sub_ps(_mm256_i32gather_ps(cullData + 2, offsets, 4), camZ);
+        __m256 radius = _mm256_i32gather_ps(cullData + 3, offsets, 4);
+
+        __m256 az = dotAVX2(x, y, z, -frustum.Z);
+        __m256 outside = outsideRangeAVX2(az, _mm256_add_ps(farD, radius), _mm256_sub_ps(nearD, radius));
+        __m256 intersect = outsideRangeAVX2(az, _mm256_sub_ps(farD, radius), _mm256_add_ps(nearD, radius));
+
+        __m256 inFront = _mm256_cmp_ps(az, radius, _CMP_GT_OQ);
+        __m256 ay = dotAVX2(x, y, z, frustum.Y);
+        __m256 d = _mm256_mul_ps(sphereFactorY, radius);
+        az = _mm256_mul_ps(az, tang);
+        __m256 small = _mm256_cmp_ps(_mm256_mul_ps(radius, viewportHeight), _mm256_mul_ps(minPixelSize, az), _CMP_LT_OQ);
+        outside = _mm256_or_ps(outside, _mm256_and_ps(inFront, small));
+        __m256 negAz = _mm256_sub_ps(_mm256_setzero_ps(), az);
+        outside = _mm256_or_ps(outside, outsideRangeAVX2(ay, _mm256_add_ps(az, d), _mm256_sub_ps(negAz, d)));
+        intersect = _mm256_or_ps(intersect, outsideRangeAVX2(ay, _mm256_sub_ps(az, d), _mm256_add_ps(negAz, d)));
+
+        __m256 ax = dotAVX2(x, y, z, frustum.X);
+        az = _mm256_mul_ps(az, ratio);
+        negAz = _mm256_sub_ps(_mm256_setzero_ps(), az);
+        d = _mm256_mul_ps(sphereFactorX, radius);
+        outside = _mm256_or_ps(outside, outsideRangeAVX2(ax, _mm256_add_ps(az, d), _mm256_sub_ps(negAz, d)));
+        intersect = _mm256_or_ps(intersect, outsideRangeAVX2(ax, _mm256_sub_ps(az, d), _mm256_add_ps(negAz, d)));
+
+        outside = _mm256_or_ps(outside, invalidMask);
+        __m256i result = _mm256_castps_si256(
+            _mm256_blendv_ps(_mm256_castsi256_ps(resultInside), _mm256_castsi256_ps(resultIntersect), intersect));
+        result = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(result), _mm256_castsi256_ps(resultOutside), outside));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(laneResults), result);
+        for (uint32_t lane = 0; lane < 8; ++lane) {
+            results[i + lane] = laneResults[lane];
+        }
+    }
+    sphereResultsScalar(frustum, input, first + i, count - i, results + i);
+}
+#endif
+
+#if defined(__aarch64__)
+// The same tests as sphereInFrustum for 4 slots at a time, see sphereResultsAVX2
+void CpuCull::sphereResultsNEON(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results) {
+    const float32x4_t nearD = vdupq_n_f32(frustum.nearD);
+    const float32x4_t farD = vdupq_n_f32(frustum.farD);
+    const float32x4_t tang = vdupq_n_f32(frustum.tang);
+    const float32x4_t ratio = vdupq_n_f32(frustum.ratio);
+    const float32x4_t sphereFactorX = vdupq_n_f32(frustum.sphereFactorX);
+    const float32x4_t sphereFactorY = vdupq_n_f32(frustum.sphereFactorY);
+    const float32x4_t viewportHeight = vdupq_n_f32(frustum.viewportHeight);
+    const float32x4_t minPixelSize = vdupq_n_f32(frustum.minPixelSize);
+
+    auto dot = [](float32x4_t x, float32x4_t y, float32x4_t z, glm::vec3 axis) {
+        return vfmaq_n_f32(vfmaq_n_f32(vmulq_n_f32(z, axis.z), y, axis.y), x, axis.x);
+    };
+    auto outsideRange = [](float32x4_t value, float32x4_t upper, float32x4_t lower) {
+        return vorrq_u32(vcgtq_f32(value, upper), vcltq_f32(value, lower));
+    };
+
+    uint32_t i = 0;
+    uint32_t laneResults[4];
+    for (; i + 4 <= count; i += 4) {
+        // NEON has no gather, load the spheres of the 4 lanes and transpose them
+        uint32_t validLanes[4];
+        float32x4x4_t spheres;
+        for (uint32_t lane = 0; lane < 4; ++lane) {
+            uint32_t instance = input.instances[first + i + lane];
+            validLanes[lane] = instance != SSBOBuffers::invalidInstance ? UINT32_MAX : 0;
+            glm::vec4 sphere = validLanes[lane] ? input.cullData[instance] : glm::vec4(0.0f);
+            spheres.val[lane] = vld1q_f32(&sphere.x);
+        }
+        uint32x4_t valid = vld1q_u32(validLanes);
+        float32x4x2_t low = vtrnq_f32(spheres.val[0], spheres.val[1]);
+        float32x4x2_t high = vtrnq_f32(spheres.val[2], spheres.val[3]);
+        float32x4_t x = vsubq_f32(vcombine_f32(vget_low_f32(low.val[0]), vget_low_f32(high.val[0])), vdupq_n_f32(frustum.camPos.x));
+        float32x4_t y = vsubq_f32(vcombine_f32(vget_low_f32(low.val[1]), vget_low_f32(high.val[1])), vdupq_n_f32(frustum.camPos.y));
+        float32x4_t z = vsubq_f32(vcombine_f32(vget_high_f32(low.val[0]), vget_high_f32(high.val[0])), vdupq_n_f32(frustum.camPos.z));
+        float32x4_t radius = vcombine_f32(vget_high_f32(low.val[1]), vget_high_f32(high.val[1]));
+
+        float32x4_t az = dot(x, y, z, -frustum.Z);
+        uint32x4_t outside = outsideRange(az, vaddq_f32(farD, radius), vsubq_f32(nearD, radius));
+        uint32x4_t intersect = outsideRange(az, vsubq_f32(farD, radius), vaddq_f32(nearD, radius));
+
+        uint32x4_t inFront = vcgtq_f32(az, radius);
+        float32x4_t ay = dot(x, y, z, frustum.Y);
+        float32x4_t d = vmulq_f32(sphereFactorY, radius);
+        az = vmulq_f32(az, tang);
+        uint32x4_t small = vcltq_f32(vmulq_f32(radius, viewportHeight), vmulq_f32(minPixelSize, az));
+        outside = vorrq_u32(outside, vandq_u32(inFront, small));
+        float32x4_t negAz = vnegq_f32(az);
+        outside = vorrq_u32(outside, outsideRange(ay, vaddq_f32(az, d), vsubq_f32(negAz, d)));
+        intersect = vorrq_u32(intersect, outsideRange(ay, vsubq_f32(az, d), vaddq_f32(negAz, d)));
+
+        float32x4_t ax = dot(x, y, z, frustum.X);
+        az = vmulq_f32(az, ratio);
+        negAz = vnegq_f32(az);
+        d = vmulq_f32(sphereFactorX, radius);
+        outside = vorrq_u32(outside, outsideRange(ax, vaddq_f32(az, d), vsubq_f32(negAz, d)));
+        intersect = vorrq_u32(intersect, outsideRange(ax, vsubq_f32(az, d), vaddq_f32(negAz, d)));
+
+        outside = vorrq_u32(outside, vmvnq_u32(valid));
+        uint32x4_t result = vbslq_u32(intersect, vdupq_n_u32(INTERSECT), vdupq_n_u32(INSIDE));
+        result = vbslq_u32(outside, vdupq_n_u32(OUTSIDE), result);
+        vst1q_u32(laneResults, result);
+        for (uint32_t lane = 0; lane < 4; ++lane) {
+            results[i + lane] = laneResults[lane];
+        }
+    }
+    sphereResultsScalar(frustum, input, first + i, count - i, results + i);
+}
+#endif
+
+void CpuCull::sphereResults(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (hasAVX2) {
+        sphereResultsAVX2(frustum, input, first, count, results);
+        return;
+    }
+#elif defined(__aarch64__)
+    sphereResultsNEON(frustum, input, first, count, results);
+    return;
+#endif
+    sphereResultsScalar(frustum, input, first, count, results);
+}
+
+void CpuCull::cull(const CullGlobals& frustum, const Input& input, const Output& output) {
+    uint32_t chunkCount = getGroupCount(input.instanceCount, chunkSize);
+    visibility.resize(input.instanceCount);
+    chunks.resize(chunkCount);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    chunkOffsets.resize(chunkCount);
+
+    // cull_frustum_pass.comp, the chunks take the place of the workgroups
+    std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](uint32_t chunk) {
+        uint32_t first = chunk * chunkSize;
+        uint32_t count = std::min(chunkSize, input.instanceCount - first);
+        uint8_t* chunkVisibility = visibility.data() + first;
+        sphereResults(frustum, input, first, count, chunkVisibility);
+        uint32_t visibleCount = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (chunkVisibility[i] != OUTSIDE && !lodSelected(frustum, input, first + i, input.cullData[input.instances[first + i]])) {
+                chunkVisibility[i] = 0;
+            } else if (chunkVisibility[i] == INTERSECT) {
+                chunkVisibility[i] = boxInFrustum(frustum, input, input.instances[first + i], 0.0f);
+            } else {
+                chunkVisibility[i] = chunkVisibility[i] == INSIDE;
+            }
+            visibleCount += chunkVisibility[i];
+        }
+        chunkOffsets[chunk] = visibleCount;
+    });
+
+    uint32_t total = 0;
+    for (uint32_t& chunkOffset : chunkOffsets) {
+        uint32_t visibleCount = chunkOffset;
+        chunkOffset = total;
+        total += visibleCount;
+    }
+
+    std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](uint32_t chunk) {
+        uint32_t first = chunk * chunkSize;
+        uint32_t count = std::min(chunkSize, input.instanceCount - first);
+        uint32_t sum = chunkOffsets[chunk];
+        for (uint32_t i = first; i < first + count; ++i) {
+            sum += visibility[i];
+            output.prefixSum[i] = sum;
+            if (visibility[i]) {
+                output.culledInstanceIndices[sum - 1] = input.instances[i];
+            }
+        }
+    });
+
+    // cull_draw_pass.comp
+    uint32_t culledDrawCount = 0;
+    for (uint32_t drawIndex = 0; drawIndex < input.drawCount; ++drawIndex) {
+        VkDrawIndexedIndirectCommand draw = input.draws[drawIndex];
+        if (draw.instanceCount == 0 || draw.indexCount == 0) {
+            continue;
+        }
+        uint32_t firstVisible = draw.firstInstance > 0 ? output.prefixSum[draw.firstInstance - 1] : 0;
+        uint32_t visibleCount = output.prefixSum[draw.firstInstance + draw.instanceCount - 1] - firstVisible;
+        if (visibleCount == 0) {
+            continue;
+        }
+        output.culledMaterialIndices[firstVisible] = input.materialIndices[draw.firstInstance];
+        draw.instanceCount = visibleCount;
+        draw.firstInstance = firstVisible;
+        output.culledDraws[culledDrawCount++] = draw;
+    }
+    *output.culledDrawCount = culledDrawCount;
+}
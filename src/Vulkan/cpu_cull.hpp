@@ -0,0 +1,82 @@
+#ifndef CPU_CULL_H_
+#define CPU_CULL_H_
+
+#include "vulkan_buffer.hpp"
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+struct CullGlobals;
+
+// Host version of the cull pipeline,
+// cull_frustum_pass.comp followed by cull_draw_pass.comp with the same inputs and outputs
+// Used as a fallback for devices without subgroup ballot support and as a reference to validate the GPU results
+class CpuCull {
+  public:
+    // Same values as cull_frustum_pass.comp
+    enum Result : uint8_t { OUTSIDE = 0, INTERSECT = 1, INSIDE = 2 };
+
+    // Host copies of the buffers the cull shaders read
+    struct Input {
+        // Instances, indexed by slot
+        const uint32_t* instances;
+        uint32_t instanceCount;
+        // CullData, Objects and MeshBounds, indexed by instance id
+        const glm::vec4* cullData;
+        const SSBOData* objects;
+        const MeshBounds* meshBounds;
+        // MaterialIndices and SlotLods, indexed by slot
+        const uint32_t* materialIndices;
+        const uint32_t* slotLods;
+        // DrawCommands
+        const VkDrawIndexedIndirectCommand* draws;
+        uint32_t drawCount;
+    };
+
+    // Host copies of the buffers the cull shaders write
+    // prefixSum and culledInstanceIndices need instanceCount elements, culledDraws needs drawCount elements
+    struct Output {
+        uint32_t* prefixSum;
+        uint32_t* culledInstanceIndices;
+        uint32_t* culledMaterialIndices;
+        VkDrawIndexedIndirectCommand* culledDraws;
+        uint32_t* culledDrawCount;
+    };
+
+    // sphere is vec4(center, radius)
+    static Result sphereInFrustum(const CullGlobals& frustum, glm::vec4 sphere);
+    // Same as selectLod in cull.glsl
+    static uint32_t selectLod(const CullGlobals& frustum, glm::vec4 sphere, uint32_t lodCount);
+    // Same as isVisible in cull_frustum_pass.comp
+    // margin grows (> 0) or shrinks (< 0) the bounds by a fraction of their size,
+    // used by the validator to tell float differences from real mismatches
+    static bool isVisible(const CullGlobals& frustum, const Input& input, uint32_t index, float margin = 0.0f);
+    // out[i] = in[0] + ... + in[i], matching the PrefixSum buffer which starts at 1
+    static void inclusiveScan(const std::vector<uint32_t>& in, std::vector<uint32_t>& out);
+
+    // Runs the whole pipeline, the sphere tests are vectorized and the slots are split over threads
+    void cull(const CullGlobals& frustum, const Input& input, const Output& output);
+
+  private:
+    // Slots per task, large enough that a task outweighs the scheduling
+    static constexpr uint32_t chunkSize = 16384;
+    // Writes the sphere test result of the slots [first, first + count) to results
+    // Unused slots are OUTSIDE
+    static void sphereResults(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results);
+    static void sphereResultsScalar(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results);
+#if defined(__x86_64__) || defined(__i386__)
+    static void sphereResultsAVX2(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results);
+#endif
+#if defined(__aarch64__)
+    static void sphereResultsNEON(const CullGlobals& frustum, const Input& input, uint32_t first, uint32_t count, uint8_t* results);
+#endif
+    static bool lodSelected(const CullGlobals& frustum, const Input& input, uint32_t index, glm::vec4 sphere);
+    static bool boxInFrustum(const CullGlobals& frustum, const Input& input, uint32_t instance, float margin);
+
+    std::vector<uint8_t> visibility;
+    std::vector<uint32_t> chunks;
+    std::vector<uint32_t> chunkOffsets;
+};
+
+#endif // CPU_CULL_H_
@@ -0,0 +1,242 @@
+#include "mesh_simplifier.hpp"
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <tuple>
+#include <unordered_map>
+
+void MeshSimplifier::Quadric::addPlane(glm::dvec3 normal, double distance) {
+    a00 += normal.x * normal.x;
+    a01 += normal.x * normal.y;
+    a02 += normal.x * normal.z;
+    a03 += normal.x * distance;
+    a11 += normal.y * normal.y;
+    a12 += normal.y * normal.z;
+    a13 += normal.y * distance;
+    a22 += normal.z * normal.z;
+    a23 += normal.z * distance;
+    a33 += distance * distance;
+}
+
+void MeshSimplifier::Quadric::add(const Quadric& other) {
+    a00 += other.a00;
+    a01 += other.a01;
+    a02 += other.a02;
+    a03 += other.a03;
+    a11 += other.a11;
+    a12 += other.a12;
+    a13 += other.a13;
+    a22 += other.a22;
+    a23 += other.a23;
+    a33 += other.a33;
+}
+
+// v^T * Q * v with v = vec4(p, 1)
+double MeshSimplifier::Quadric::evaluate(glm::dvec3 p) const {
+    return a00 * p.x * p.x + 2 * a01 * p.x * p.y + 2 * a02 * p.x * p.z + 2 * a03 * p.x + a11 * p.y * p.y + 2 * a12 * p.y * p.z +
+           2 * a13 * p.y + a22 * p.z * p.z + 2 * a23 * p.z + a33;
+}
+
+std::vector<uint32_t> MeshSimplifier::simplify(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+                                               uint32_t targetIndexCount) {
+    if (indices.size() <= targetIndexCount) {
+        return indices;
+    }
+    const uint32_t invalidVertex = UINT32_MAX;
+    uint32_t triangleCount = indices.size() / 3;
+
+    // Weld the vertices by position, glTF splits vertices on normal and uv seams
+    // The collapses work on the welded positions and move every vertex of a position together
+    std::vector<uint32_t> order(positions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return std::tie(positions[a].x, positions[a].y, positions[a].z) < std::tie(positions[b].x, positions[b].y, positions[b].z);
+    });
+    std::vector<uint32_t> vertexPositions(positions.size());
+    std::vector<glm::dvec3> welded;
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        if (i == 0 || positions[order[i]] != positions[order[i - 1]]) {
+            welded.push_back(positions[order[i]]);
+        }
+        vertexPositions[order[i]] = welded.size() - 1;
+    }
+    uint32_t positionCount = welded.size();
+
+    std::vector<uint32_t> triangles(indices.begin(), indices.begin() + triangleCount * 3);
+    std::vector<bool> triangleAlive(triangleCount, true);
+    uint32_t aliveCount = triangleCount;
+    std::vector<std::vector<uint32_t>> positionTriangles(positionCount);
+    std::vector<Quadric> quadrics(positionCount);
+    std::unordered_map<uint64_t, uint32_t> edgeUses;
+    auto edgeKey = [](uint32_t a, uint32_t b) { return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a; };
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        uint32_t p[3] = {vertexPositions[triangles[t * 3]], vertexPositions[triangles[t * 3 + 1]], vertexPositions[triangles[t * 3 + 2]]};
+        if (p[0] == p[1] || p[1] == p[2] || p[2] == p[0]) {
+            triangleAlive[t] = false;
+            --aliveCount;
+            continue;
+        }
+        glm::dvec3 normal = glm::cross(welded[p[1]] - welded[p[0]], welded[p[2]] - welded[p[0]]);
+        double length = glm::length(normal);
+        if (length > 0) {
+            normal /= length;
+            for (uint32_t k = 0; k < 3; ++k) {
+                quadrics[p[k]].addPlane(normal, -glm::dot(normal, welded[p[0]]));
+            }
+        }
+        for (uint32_t k = 0; k < 3; ++k) {
+            positionTriangles[p[k]].push_back(t);
+            ++edgeUses[edgeKey(p[k], p[(k + 1) % 3])];
+        }
+    }
+
+    // An edge with a single triangle is on an open border, moving its positions would open holes
+    std::vector<bool> locked(positionCount, false);
+    for (const auto& [key, uses] : edgeUses) {
+        if (uses == 1) {
+            locked[key >> 32] = true;
+            locked[key & UINT32_MAX] = true;
+        }
+    }
+
+    std::vector<uint32_t> versions(positionCount, 0);
+    std::vector<bool> removed(positionCount, false);
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+    auto pushCollapse = [&](uint32_t from, uint32_t to) {
+        if (locked[from]) {
+            return;
+        }
+        Quadric quadric = quadrics[from];
+        quadric.add(quadrics[to]);
+        queue.push({quadric.evaluate(welded[to]), from, to, versions[from], versions[to]});
+    };
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        if (!triangleAlive[t]) {
+            continue;
+        }
+        for (uint32_t k = 0; k < 3; ++k) {
+            uint32_t a = vertexPositions[triangles[t * 3 + k]];
+            uint32_t b = vertexPositions[triangles[t * 3 + (k + 1) % 3]];
+            pushCollapse(a, b);
+            pushCollapse(b, a);
+        }
+    }
+
+    std::vector<uint32_t> remap(positions.size(), invalidVertex);
+    std::vector<uint32_t> remapped;
+    while (aliveCount * 3 > targetIndexCount && !queue.empty()) {
+        Collapse collapse = queue.top();
+        queue.pop();
+        if (removed[collapse.from] || removed[collapse.to] || versions[collapse.from] != collapse.fromVersion ||
+            versions[collapse.to] != collapse.toVersion) {
+            continue;
+        }
+
+        // Every vertex of the removed position moves to a vertex of the kept position it shares a triangle with,
+        // a vertex without one is on a seam that doesn't continue along this edge
+        for (uint32_t t : positionTriangles[collapse.from]) {
+            if (!triangleAlive[t]) {
+                continue;
+            }
+            for (uint32_t k = 0; k < 3; ++k) {
+                uint32_t from = triangles[t * 3 + k];
+                if (vertexPositions[from] != collapse.from || remap[from] != invalidVertex) {
+                    continue;
+                }
+                for (uint32_t j = 0; j < 3; ++j) {
+                    uint32_t to = triangles[t * 3 + j];
+                    if (vertexPositions[to] == collapse.to) {
+                        remap[from] = to;
+                        remapped.push_back(from);
+                        break;
+                    }
+                }
+            }
+        }
+
+        bool valid = true;
+        for (uint32_t t : positionTriangles[collapse.from]) {
+            if (!triangleAlive[t] || !valid) {
+                continue;
+            }
+            glm::dvec3 oldPositions[3];
+            glm::dvec3 newPositions[3];
+            bool degenerates = false;
+            for (uint32_t k = 0; k < 3; ++k) {
+                uint32_t vertex = triangles[t * 3 + k];
+                uint32_t position = vertexPositions[vertex];
+                if (position == collapse.from && remap[vertex] == invalidVertex) {
+                    valid = false;
+                }
+                degenerates |= position == collapse.to;
+                oldPositions[k] = welded[position];
+                newPositions[k] = position == collapse.from ? welded[collapse.to] : welded[position];
+            }
+            // The triangles that don't degenerate must keep facing the same way
+            if (!degenerates) {
+                glm::dvec3 oldNormal = glm::cross(oldPositions[1] - oldPositions[0], oldPositions[2] - oldPositions[0]);
+                glm::dvec3 newNormal = glm::cross(newPositions[1] - newPositions[0], newPositions[2] - newPositions[0]);
+                if (glm::dot(oldNormal, newNormal) <= 0) {
+                    valid = false;
+                }
+            }
+        }
+
+        if (valid) {
+            std::vector<uint32_t> fromTriangles = std::move(positionTriangles[collapse.from]);
+            for (uint32_t t : fromTriangles) {
+                if (!triangleAlive[t]) {
+                    continue;
+                }
+                bool degenerates = false;
+                for (uint32_t k = 0; k < 3; ++k) {
+                    degenerates |= vertexPositions[triangles[t * 3 + k]] == collapse.to;
+                }
+                if (degenerates) {
+                    triangleAlive[t] = false;
+                    --aliveCount;
+                    continue;
+                }
+                for (uint32_t k = 0; k < 3; ++k) {
+                    uint32_t vertex = triangles[t * 3 + k];
+                    if (vertexPositions[vertex] == collapse.from) {
+                        triangles[t * 3 + k] = remap[vertex];
+                    }
+                }
+                positionTriangles[collapse.to].push_back(t);
+            }
+            quadrics[collapse.to].add(quadrics[collapse.from]);
+            removed[collapse.from] = true;
+            ++versions[collapse.to];
+
+            // The costs of every edge of the kept position changed
+            for (uint32_t t : positionTriangles[collapse.to]) {
+                if (!triangleAlive[t]) {
+                    continue;
+                }
+                for (uint32_t k = 0; k < 3; ++k) {
+                    uint32_t position = vertexPositions[triangles[t * 3 + k]];
+                    if (position != collapse.to) {
+                        pushCollapse(collapse.to, position);
+                        pushCollapse(position, collapse.to);
+                    }
+                }
+            }
+        }
+
+        for (uint32_t vertex : remapped) {
+            remap[vertex] = invalidVertex;
+        }
+        remapped.clear();
+    }
+
+    std::vector<uint32_t> simplified;
+    simplified.reserve(aliveCount * 3);
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        if (triangleAlive[t]) {
+            simplified.insert(simplified.end(), triangles.begin() + t * 3, triangles.begin() + t * 3 + 3);
+        }
+    }
+    return simplified;
+}
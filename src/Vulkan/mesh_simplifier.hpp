@@ -0,0 +1,43 @@
+#ifndef MESH_SIMPLIFIER_H_
+#define MESH_SIMPLIFIER_H_
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Edge collapse simplification with quadric error metrics
+// https://www.cs.cmu.edu/~garland/Papers/quadrics.pdf
+// Every collapse moves a vertex onto one of its neighbours, so the simplified indices reuse the original vertices
+// and a LOD only needs a new index range
+class MeshSimplifier {
+  public:
+    // Collapses the cheapest edges until at most targetIndexCount indices are left or no edge can be collapsed
+    // Vertices with the same position are collapsed together, so attribute seams stay closed,
+    // vertices on open borders are never moved
+    static std::vector<uint32_t> simplify(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+                                          uint32_t targetIndexCount);
+
+  private:
+    // Symmetric 4x4 matrix, the sum of the squared distances to a set of planes
+    struct Quadric {
+        double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+        double a11 = 0, a12 = 0, a13 = 0;
+        double a22 = 0, a23 = 0;
+        double a33 = 0;
+        void addPlane(glm::dvec3 normal, double distance);
+        void add(const Quadric& other);
+        double evaluate(glm::dvec3 p) const;
+    };
+
+    struct Collapse {
+        double cost;
+        uint32_t from;
+        uint32_t to;
+        // versions of both positions when the cost was computed, stale collapses are skipped
+        uint32_t fromVersion;
+        uint32_t toVersion;
+        bool operator>(const Collapse& other) const { return cost > other.cost; }
+    };
+};
+
+#endif // MESH_SIMPLIFIER_H_
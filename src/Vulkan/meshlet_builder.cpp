@@ -0,0 +1,89 @@
+#include "meshlet_builder.hpp"
+#include <algorithm>
+
+void MeshletBuilder::build(const std::vector<glm::vec3>& positions, const uint32_t* indices, uint32_t indexCount, uint32_t firstIndex,
+                           uint32_t drawIndex, std::vector<Meshlet>& meshlets) {
+    // NOTE:
+    // Greedy in index order, glTF exporters mostly write triangles with good locality
+    // A linear search is enough for 64 vertices
+    std::vector<uint32_t> meshletVertices;
+    meshletVertices.reserve(maxVertices);
+    uint32_t meshletStart = 0;
+    auto finishMeshlet = [&](uint32_t end) {
+        Meshlet meshlet = bounds(positions, indices + meshletStart, end - meshletStart);
+        meshlet.firstIndex = firstIndex + meshletStart;
+        meshlet.indexCount = end - meshletStart;
+        meshlet.drawIndex = drawIndex;
+        meshlets.push_back(meshlet);
+        meshletStart = end;
+        meshletVertices.clear();
+    };
+    for (uint32_t i = 0; i + 2 < indexCount; i += 3) {
+        uint32_t newVertices = 0;
+        for (uint32_t k = 0; k < 3; ++k) {
+            bool found = std::find(meshletVertices.begin(), meshletVertices.end(), indices[i + k]) != meshletVertices.end();
+            // a triangle can repeat a vertex
+            for (uint32_t j = 0; j < k && !found; ++j) {
+                found = indices[i + j] == indices[i + k];
+            }
+            newVertices += !found;
+        }
+        if (meshletVertices.size() + newVertices > maxVertices || (i - meshletStart) / 3 == maxTriangles) {
+            finishMeshlet(i);
+        }
+        for (uint32_t k = 0; k < 3; ++k) {
+            if (std::find(meshletVertices.begin(), meshletVertices.end(), indices[i + k]) == meshletVertices.end()) {
+                meshletVertices.push_back(indices[i + k]);
+            }
+        }
+    }
+    if (meshletStart < indexCount / 3 * 3) {
+        finishMeshlet(indexCount / 3 * 3);
+    }
+}
+
+Meshlet MeshletBuilder::bounds(const std::vector<glm::vec3>& positions, const uint32_t* indices, uint32_t indexCount) {
+    Meshlet meshlet{};
+    glm::vec3 min = positions[indices[0]];
+    glm::vec3 max = min;
+    for (uint32_t i = 1; i < indexCount; ++i) {
+        min = glm::min(min, positions[indices[i]]);
+        max = glm::max(max, positions[indices[i]]);
+    }
+    glm::vec3 center = (min + max) * 0.5f;
+    float radius = 0.0f;
+    for (uint32_t i = 0; i < indexCount; ++i) {
+        radius = glm::max(radius, glm::length(positions[indices[i]] - center));
+    }
+    meshlet.sphere = glm::vec4(center, radius);
+
+    // Normal cone from
+    // https://zeux.io/2023/04/28/triangle-backface-culling/
+    std::vector<glm::vec3> normals;
+    normals.reserve(indexCount / 3);
+    glm::vec3 axis{0.0f};
+    for (uint32_t i = 0; i + 2 < indexCount; i += 3) {
+        glm::vec3 a = positions[indices[i]];
+        glm::vec3 normal = glm::cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+        float area = glm::length(normal);
+        if (area > 0.0f) {
+            normals.push_back(normal / area);
+            axis += normals.back();
+        }
+    }
+    float axisLength = glm::length(axis);
+    if (normals.empty() || axisLength == 0.0f) {
+        meshlet.cone = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+        return meshlet;
+    }
+    axis /= axisLength;
+    float minDot = 1.0f;
+    for (const glm::vec3& normal : normals) {
+        minDot = glm::min(minDot, glm::dot(axis, normal));
+    }
+    // NOTE:
+    // Normals more than 90 degrees apart always have a front facing triangle, cutoff 1 never culls
+    float cutoff = minDot <= 0.0f ? 1.0f : glm::sqrt(1.0f - minDot * minDot);
+    meshlet.cone = glm::vec4(axis, cutoff);
+    return meshlet;
+}
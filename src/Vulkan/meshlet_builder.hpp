@@ -0,0 +1,36 @@
+#ifndef MESHLET_BUILDER_H_
+#define MESHLET_BUILDER_H_
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Same layout as MeshletData in cull_meshlet.glsl
+struct Meshlet {
+    // local space vec4(center, radius)
+    glm::vec4 sphere;
+    // local space vec4(axis, cutoff) of the cone around the triangle normals, cutoff 1 if the normals are too spread to cull
+    glm::vec4 cone;
+    // absolute range in the index buffer
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint32_t drawIndex;
+    uint32_t pad;
+};
+
+// Splits an index range into meshlets of consecutive triangles
+// The triangles keep their order, so every meshlet is a contiguous index range that the existing indexed draws can use
+// without mesh shaders
+class MeshletBuilder {
+  public:
+    static const uint32_t maxVertices = 64;
+    static const uint32_t maxTriangles = 124;
+    // indices are relative to positions, firstIndex is the offset of indices in the index buffer
+    static void build(const std::vector<glm::vec3>& positions, const uint32_t* indices, uint32_t indexCount, uint32_t firstIndex,
+                      uint32_t drawIndex, std::vector<Meshlet>& meshlets);
+
+  private:
+    static Meshlet bounds(const std::vector<glm::vec3>& positions, const uint32_t* indices, uint32_t indexCount);
+};
+
+#endif // MESHLET_BUILDER_H_
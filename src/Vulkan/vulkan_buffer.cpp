@@ -2,11 +2,14 @@
 #include "common.hpp"
 #include "vulkan_device.hpp"
 #include "vulkan_image.hpp"
+#include "vulkan_swapchain.hpp"
+#include <algorithm>
 #include <cstring>
 #include <glm/fwd.hpp>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
 #include <vulkan/vulkan_core.h>
 
 VulkanBuffer::VulkanBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize size, VkBufferUsageFlags usage,
@@ -16,10 +19,37 @@ VulkanBuffer::VulkanBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize si
     _bufferInfo.range = size;
     _bufferInfo.offset = 0;
     _usageFlags = usage;
+    _memoryProperties = properties;
+}
+
+std::shared_ptr<VulkanBuffer> VulkanBuffer::UnboundBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize size,
+                                                          VkBufferUsageFlags usage, VkMemoryPropertyFlags properties) {
+    // NOTE:
+    // make_shared can't use the private constructor
+    std::shared_ptr<VulkanBuffer> buffer(new VulkanBuffer(device));
+    device->createBuffer(size, usage, buffer->buffer());
+    buffer->_bufferInfo.range = size;
+    buffer->_bufferInfo.offset = 0;
+    buffer->_usageFlags = usage;
+    buffer->_memoryProperties = properties;
+    buffer->ownsMemory = false;
+    return buffer;
+}
+
+VkMemoryRequirements VulkanBuffer::memoryRequirements() {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device->device(), buffer(), &requirements);
+    return requirements;
+}
+
+void VulkanBuffer::bind(VkDeviceMemory memory, VkDeviceSize offset) {
+    vkBindBufferMemory(device->device(), buffer(), memory, offset);
+    _memory = memory;
+    memoryOffset = offset;
 }
 
 void VulkanBuffer::map() {
-    checkResult(vkMapMemory(device->device(), memory(), 0, size(), 0, &_mapped), "memory map failed");
+    checkResult(vkMapMemory(device->device(), memory(), memoryOffset, size(), 0, &_mapped), "memory map failed");
     isMapped = true;
 }
 
@@ -36,22 +66,25 @@ VulkanBuffer::~VulkanBuffer() {
     if (isMapped)
         unmap();
     vkDestroyBuffer(device->device(), buffer(), nullptr);
-    vkFreeMemory(device->device(), memory(), nullptr);
+    if (ownsMemory) {
+        vkFreeMemory(device->device(), memory(), nullptr);
+    }
 }
 
 std::shared_ptr<VulkanBuffer> VulkanBuffer::StagedBuffer(std::shared_ptr<VulkanDevice> device, void* data, VkDeviceSize size,
                                                          VkBufferUsageFlags usageFlags) {
 
-    VulkanBuffer stagingBuffer(device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    stagingBuffer.map();
-    stagingBuffer.write(data, size, 0);
-    stagingBuffer.unmap();
+    std::shared_ptr<VulkanBuffer> stagingBuffer = std::make_shared<VulkanBuffer>(
+        device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    stagingBuffer->map();
+    stagingBuffer->write(data, size, 0);
+    stagingBuffer->unmap();
 
     std::shared_ptr<VulkanBuffer> stagedBuffer =
         std::make_shared<VulkanBuffer>(device, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usageFlags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-    device->singleTimeCommands().copyBuffer(stagingBuffer.buffer(), stagedBuffer->buffer(), size).run();
+    // the frames wait for the copy on the timeline, the staging buffer is freed once it finished
+    device->singleTimeCommands().copyBuffer(stagingBuffer->buffer(), stagedBuffer->buffer(), size).keepAlive(stagingBuffer).submit();
 
     return stagedBuffer;
 }
@@ -78,6 +111,218 @@ std::shared_ptr<VulkanBuffer> VulkanBuffer::StorageBuffer(std::shared_ptr<Vulkan
     return storageBuffer;
 }
 
+namespace {
+// Sorts [first, end) element ranges and merges the overlapping and neighbouring ones, dropping the empty ones
+void coalesceRanges(std::vector<std::pair<uint32_t, uint32_t>>& ranges) {
+    std::sort(ranges.begin(), ranges.end());
+    size_t merged = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (ranges[i].first >= ranges[i].second) {
+            continue;
+        }
+        if (merged > 0 && ranges[i].first <= ranges[merged - 1].second) {
+            ranges[merged - 1].second = std::max(ranges[merged - 1].second, ranges[i].second);
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    ranges.resize(merged);
+}
+} // namespace
+
+DirtyRangeBuffer::DirtyRangeBuffer(std::shared_ptr<VulkanDevice> device, uint32_t count, VkDeviceSize stride, VkBufferUsageFlags usage)
+    : device{device}, _count{count}, _stride{stride} {
+    // TRANSFER_SRC so grow() can copy the old contents
+    _usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | usage;
+    staleRanges.resize(1);
+    _buffer = createDeviceBuffer(count);
+    stagingBuffers.resize(VulkanSwapChain::MAX_FRAMES_IN_FLIGHT);
+    fullStagingBuffers.resize(VulkanSwapChain::MAX_FRAMES_IN_FLIGHT);
+    hostData.resize(count * stride);
+    dirtyFlags = std::make_unique<std::atomic<bool>[]>(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        dirtyFlags[i].store(false, std::memory_order_relaxed);
+    }
+    dirtyIndices.resize(count);
+}
+
+std::shared_ptr<VulkanBuffer> DirtyRangeBuffer::createStagingBuffer(VkDeviceSize size) {
+    // NOTE:
+    // Coherent memory, so no vkFlushMappedMemoryRanges is needed
+    std::shared_ptr<VulkanBuffer> stagingBuffer = std::make_shared<VulkanBuffer>(
+        device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    stagingBuffer->map();
+    return stagingBuffer;
+}
+
+std::shared_ptr<VulkanBuffer> DirtyRangeBuffer::createDeviceBuffer(uint32_t count) {
+    VkDeviceSize size = count * _stride;
+    _frameStride = 0;
+    if (staleRanges.size() > 1) {
+        _frameStride = (size + frameAlignment - 1) / frameAlignment * frameAlignment;
+        size = _frameStride * staleRanges.size();
+    }
+    return std::make_shared<VulkanBuffer>(device, size, _usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+}
+
+void DirtyRangeBuffer::copyPerFrame(VkDeviceSize alignment) {
+    if (staleRanges.size() > 1) {
+        return;
+    }
+    frameAlignment = alignment;
+    staleRanges.resize(VulkanSwapChain::MAX_FRAMES_IN_FLIGHT);
+    _buffer = createDeviceBuffer(_count);
+    // NOTE:
+    // Nothing is copied from the old buffer, the first flush of every frame uploads its whole copy
+    for (std::vector<std::pair<uint32_t, uint32_t>>& ranges : staleRanges) {
+        ranges.assign(1, {0, _count});
+    }
+    staleCopies = true;
+}
+
+void DirtyRangeBuffer::grow(uint32_t newCount) {
+    if (newCount <= _count) {
+        return;
+    }
+    VkDeviceSize oldFrameStride = _frameStride;
+    std::shared_ptr<VulkanBuffer> newBuffer = createDeviceBuffer(newCount);
+    // NOTE:
+    // Copying on the GPU instead of re-uploading the host copy,
+    // so only the elements that are still dirty have to go through staging
+    // NOTE:
+    // Not waited for, the old buffer lives until the copy finished and the frames wait for it on the timeline
+    VulkanDevice::singleTimeBuilder& builder = device->singleTimeCommands();
+    for (size_t copy = 0; copy < staleRanges.size(); ++copy) {
+        builder.copyBuffer(_buffer->buffer(), newBuffer->buffer(), _count * _stride, copy * oldFrameStride, copy * _frameStride);
+    }
+    builder.keepAlive(_buffer).submit();
+    _buffer = newBuffer;
+
+    std::unique_ptr<std::atomic<bool>[]> newDirtyFlags = std::make_unique<std::atomic<bool>[]>(newCount);
+    for (uint32_t i = 0; i < newCount; ++i) {
+        newDirtyFlags[i].store(i < _count ? dirtyFlags[i].load(std::memory_order_relaxed) : false, std::memory_order_relaxed);
+    }
+    dirtyFlags = std::move(newDirtyFlags);
+    dirtyIndices.resize(newCount);
+    hostData.resize(newCount * _stride);
+    _count = newCount;
+    // The caller waited on the device timeline for the frames that used the old buffer, so none of them reads them anymore
+    for (std::shared_ptr<VulkanBuffer>& fullStagingBuffer : fullStagingBuffers) {
+        fullStagingBuffer.reset();
+    }
+}
+
+void DirtyRangeBuffer::markDirty(uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; ++i) {
+        // Each element is only appended once between flushes, so dirtyIndices can't overflow
+        if (!dirtyFlags[i].exchange(true, std::memory_order_relaxed)) {
+            dirtyIndices[dirtyCount.fetch_add(1, std::memory_order_relaxed)] = i;
+        }
+    }
+}
+
+void DirtyRangeBuffer::markRangeDirty(uint32_t first, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(rangesMutex);
+    dirtyRanges.push_back({first, first + count});
+    rangesDirty = true;
+}
+
+void DirtyRangeBuffer::flush(VkCommandBuffer commandBuffer, size_t frameIndex) {
+    uint32_t currDirtyCount = dirtyCount.load(std::memory_order_relaxed);
+    size_t copy = frameIndex % staleRanges.size();
+    if (currDirtyCount == 0 && !allDirty && !rangesDirty && staleRanges[copy].empty()) {
+        return;
+    }
+    // The frame that last used it has been waited on
+    fullStagingBuffers[frameIndex].reset();
+
+    // Sort so that neighbouring elements and ranges coalesce into a single copy region
+    // NOTE:
+    // Overlapping ranges are merged too, so no element is copied twice
+    if (allDirty) {
+        dirtyRanges.assign(1, {0, _count});
+    } else {
+        for (uint32_t i = 0; i < currDirtyCount; ++i) {
+            dirtyRanges.push_back({dirtyIndices[i], dirtyIndices[i] + 1});
+        }
+        coalesceRanges(dirtyRanges);
+    }
+    // every copy gets the changes, the other copies when their frames flush
+    for (std::vector<std::pair<uint32_t, uint32_t>>& ranges : staleRanges) {
+        ranges.insert(ranges.end(), dirtyRanges.begin(), dirtyRanges.end());
+    }
+    std::vector<std::pair<uint32_t, uint32_t>>& ranges = staleRanges[copy];
+    if (staleRanges.size() > 1) {
+        coalesceRanges(ranges);
+    }
+
+    copyRegions.clear();
+    VkDeviceSize stagingOffset = 0;
+    for (const std::pair<uint32_t, uint32_t>& range : ranges) {
+        VkDeviceSize size = (range.second - range.first) * _stride;
+        copyRegions.push_back({stagingOffset, copy * _frameStride + range.first * _stride, size});
+        stagingOffset += size;
+    }
+
+    std::shared_ptr<VulkanBuffer> staging;
+    if (stagingOffset == hostData.size()) {
+        fullStagingBuffers[frameIndex] = createStagingBuffer(stagingOffset);
+        staging = fullStagingBuffers[frameIndex];
+    } else {
+        // Doubling, so a slowly growing dirty set doesn't reallocate every frame
+        if (stagingBuffers[frameIndex] == nullptr || stagingBuffers[frameIndex]->size() < stagingOffset) {
+            VkDeviceSize capacity = stagingBuffers[frameIndex] == nullptr ? 0 : stagingBuffers[frameIndex]->size();
+            capacity = std::min<VkDeviceSize>(std::max(stagingOffset, capacity * 2), hostData.size());
+            stagingBuffers[frameIndex] = createStagingBuffer(capacity);
+        }
+        staging = stagingBuffers[frameIndex];
+    }
+
+    char* stagingData = reinterpret_cast<char*>(staging->mapped());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        memcpy(stagingData + copyRegions[i].srcOffset, hostData.data() + ranges[i].first * _stride, copyRegions[i].size);
+    }
+
+    for (uint32_t i = 0; i < currDirtyCount; ++i) {
+        dirtyFlags[dirtyIndices[i]].store(false, std::memory_order_relaxed);
+    }
+    dirtyCount.store(0, std::memory_order_relaxed);
+    allDirty = false;
+    dirtyRanges.clear();
+    rangesDirty = false;
+    ranges.clear();
+    staleCopies = std::any_of(staleRanges.begin(), staleRanges.end(),
+                              [](const std::vector<std::pair<uint32_t, uint32_t>>& stale) { return !stale.empty(); });
+
+    vkCmdCopyBuffer(commandBuffer, staging->buffer(), _buffer->buffer(), copyRegions.size(), copyRegions.data());
+}
+
+FrameRingBuffer::FrameRingBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize frameSize, VkBufferUsageFlags usage)
+    : _frameSize{frameSize} {
+    _buffer = std::make_shared<VulkanBuffer>(device, frameSize * VulkanSwapChain::MAX_FRAMES_IN_FLIGHT, usage,
+                                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    _buffer->map();
+    reset(0);
+}
+
+FrameRingBuffer::Allocation FrameRingBuffer::allocate(VkDeviceSize size, VkDeviceSize alignment) {
+    VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+    if (offset + size > end) {
+        throw std::runtime_error("FrameRingBuffer: " + std::to_string(size) + " bytes don't fit the " + std::to_string(_frameSize) +
+                                 " bytes of a frame");
+    }
+    head = offset + size;
+    return {offset, reinterpret_cast<char*>(_buffer->mapped()) + offset};
+}
+
+void FrameRingBuffer::reset(size_t frameIndex) {
+    head = frameIndex * _frameSize;
+    end = head + _frameSize;
+}
+
 SSBOBuffers::SSBOBuffers(std::shared_ptr<VulkanDevice> device) : device{device} {}
 
 void SSBOBuffers::createMaterialBuffer(uint32_t drawsCount) {
@@ -94,15 +339,22 @@ void SSBOBuffers::createMaterialBuffer(uint32_t drawsCount) {
     materialMapped[0] = materialData;
 }
 
-void SSBOBuffers::createInstanceBuffers(uint32_t instanceCount) {
+void SSBOBuffers::createInstanceBuffers(uint32_t instanceCount, uint32_t slotCount) {
     // NOTE:
-    // must only be called once after uniqueObjectID has been set
-    _ssboBuffer = VulkanBuffer::StorageBuffer(device, instanceCount * sizeof(SSBOData));
-    ssboMapped = reinterpret_cast<SSBOData*>(_ssboBuffer->mapped());
-    _instanceIndicesBuffer = VulkanBuffer::StorageBuffer(device, instanceCount * sizeof(uint32_t));
-    _materialIndicesBuffer = VulkanBuffer::StorageBuffer(device, instanceCount * sizeof(uint32_t));
-    _culledMaterialIndicesBuffer = VulkanBuffer::StorageBuffer(device, instanceCount * sizeof(uint32_t));
-
-    instanceIndicesMapped = reinterpret_cast<uint32_t*>(_instanceIndicesBuffer->mapped());
-    materialIndicesMapped = reinterpret_cast<uint32_t*>(_materialIndicesBuffer->mapped());
+    // called once after uniqueInstanceID has been set,
+    // the buffers are grown afterwards with DirtyRangeBuffer::grow
+    _ssboBuffer = std::make_shared<DirtyRangeBuffer>(device, instanceCount, sizeof(SSBOData), 0);
+    _cullBuffer = std::make_shared<DirtyRangeBuffer>(device, instanceCount, sizeof(glm::vec4), 0);
+    _instanceIndicesBuffer = std::make_shared<DirtyRangeBuffer>(device, slotCount, sizeof(uint32_t), 0);
+    _materialIndicesBuffer = std::make_shared<DirtyRangeBuffer>(device, slotCount, sizeof(uint32_t), 0);
+    _slotLodsBuffer = std::make_shared<DirtyRangeBuffer>(device, slotCount, sizeof(uint32_t), 0);
+    updateMapped();
+}
+
+void SSBOBuffers::updateMapped() {
+    ssboMapped = _ssboBuffer->data<SSBOData>();
+    cullMapped = _cullBuffer->data<glm::vec4>();
+    instanceIndicesMapped = _instanceIndicesBuffer->data<uint32_t>();
+    materialIndicesMapped = _materialIndicesBuffer->data<uint32_t>();
+    slotLodsMapped = _slotLodsBuffer->data<uint32_t>();
 }
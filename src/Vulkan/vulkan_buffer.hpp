@@ -8,6 +8,9 @@
 #include <glm/gtx/quaternion.hpp>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_core.h>
 
@@ -21,6 +24,11 @@ class VulkanBuffer {
     static std::shared_ptr<VulkanBuffer> StorageBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize size,
                                                        VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                                                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    // Creates the buffer without memory, bind() binds it into memory the caller owns and frees
+    static std::shared_ptr<VulkanBuffer> UnboundBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize size, VkBufferUsageFlags usage,
+                                                       VkMemoryPropertyFlags properties);
+    VkMemoryRequirements memoryRequirements();
+    void bind(VkDeviceMemory memory, VkDeviceSize offset);
     void map();
     void unmap();
     void write(void* data, VkDeviceSize size, VkDeviceSize offset = 0);
@@ -32,14 +40,115 @@ class VulkanBuffer {
     VkBuffer& buffer() { return _bufferInfo.buffer; }
     VkDeviceMemory& memory() { return _memory; }
     VkBufferUsageFlags usageFlags() { return _usageFlags; }
+    VkMemoryPropertyFlags memoryProperties() { return _memoryProperties; }
 
   private:
+    VulkanBuffer(std::shared_ptr<VulkanDevice> device) : device{device} {}
     std::shared_ptr<VulkanDevice> device;
     bool isMapped = false;
     void* _mapped = nullptr;
     VkDescriptorBufferInfo _bufferInfo{};
     VkDeviceMemory _memory = VK_NULL_HANDLE;
+    // false if bound into memory owned by someone else
+    bool ownsMemory = true;
+    VkDeviceSize memoryOffset = 0;
     VkBufferUsageFlags _usageFlags;
+    VkMemoryPropertyFlags _memoryProperties;
+};
+
+// Device local buffer written through a host side copy
+// Writers update data() and mark the changed elements dirty,
+// flush() packs only the dirty elements into the staging buffer of the current frame in flight
+// and applies them with coalesced vkCmdCopyBuffer regions,
+// so the cost of a frame scales with the number of changed elements and the GPU never reads memory the CPU is writing
+// The staging buffers are sized to the dirty bytes, only markAllDirty() stages the whole buffer
+// With copyPerFrame() the device buffer holds a copy per frame in flight and every flush() brings the copy of its frame up to date
+class DirtyRangeBuffer {
+  public:
+    DirtyRangeBuffer(std::shared_ptr<VulkanDevice> device, uint32_t count, VkDeviceSize stride, VkBufferUsageFlags usage);
+    template <typename T> T* data() { return reinterpret_cast<T*>(hostData.data()); }
+    // Thread safe, may be called concurrently from multiple threads between flushes
+    void markDirty(uint32_t first, uint32_t count = 1);
+    // One entry for the whole range instead of a flag per element, for large contiguous writes
+    // Thread safe, but takes a lock
+    void markRangeDirty(uint32_t first, uint32_t count);
+    void markAllDirty() { allDirty = true; }
+    // true if the next flush records copies
+    bool dirty() const { return allDirty || rangesDirty || dirtyCount.load(std::memory_order_relaxed) != 0 || staleCopies; }
+    // Records the copies into commandBuffer
+    // Must be called after the frame of frameIndex has been waited on
+    void flush(VkCommandBuffer commandBuffer, size_t frameIndex);
+    // Reallocates the device buffer and copies the old contents on the GPU
+    // Invalidates data() and buffer(), the frames that use the old buffer must have finished
+    // The copy isn't waited for, the frames after it wait for it on the device timeline
+    void grow(uint32_t newCount);
+    // Reallocates the device buffer with a copy per frame in flight, frameStride() bytes apart, for buffers the next frame
+    // uploads to while a frame in flight still reads them
+    // The copies are filled from the host copy by the next flush of their frames
+    // Invalidates buffer(), no submitted frame may still use it
+    void copyPerFrame(VkDeviceSize alignment);
+    std::shared_ptr<VulkanBuffer> buffer() { return _buffer; }
+    uint32_t count() { return _count; }
+    VkDeviceSize stride() { return _stride; }
+    // Offset of the copy of frame 1, 0 with a single copy
+    VkDeviceSize frameStride() { return _frameStride; }
+
+  private:
+    std::shared_ptr<VulkanDevice> device;
+    std::shared_ptr<VulkanBuffer> _buffer;
+    // Per frame in flight, grown to the most dirty bytes flushed through that frame
+    std::vector<std::shared_ptr<VulkanBuffer>> stagingBuffers;
+    // Per frame in flight, holds the staging of a markAllDirty() flush until that frame is flushed again
+    std::vector<std::shared_ptr<VulkanBuffer>> fullStagingBuffers;
+    std::vector<char> hostData;
+    uint32_t _count;
+    VkDeviceSize _stride;
+    VkBufferUsageFlags _usage;
+    std::shared_ptr<VulkanBuffer> createStagingBuffer(VkDeviceSize size);
+    // 0 until copyPerFrame()
+    VkDeviceSize frameAlignment = 0;
+    VkDeviceSize _frameStride = 0;
+    // Per copy of the device buffer, the [first, end) element ranges changed since the copy was last flushed
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> staleRanges;
+    // a copy other than the last flushed one has stale ranges
+    bool staleCopies = false;
+    // Allocates the device buffer for count elements per copy and sets _frameStride
+    std::shared_ptr<VulkanBuffer> createDeviceBuffer(uint32_t count);
+
+    std::unique_ptr<std::atomic<bool>[]> dirtyFlags;
+    std::vector<uint32_t> dirtyIndices;
+    std::atomic<uint32_t> dirtyCount = 0;
+    std::atomic<bool> allDirty = false;
+    // [first, end) element ranges from markRangeDirty
+    std::vector<std::pair<uint32_t, uint32_t>> dirtyRanges;
+    std::mutex rangesMutex;
+    std::atomic<bool> rangesDirty = false;
+    std::vector<VkBufferCopy> copyRegions;
+};
+
+// Linear allocator over one persistently mapped buffer with a region per frame in flight
+// Every frame allocates from the start of its own region again, so the host never writes memory a frame in flight reads
+class FrameRingBuffer {
+  public:
+    FrameRingBuffer(std::shared_ptr<VulkanDevice> device, VkDeviceSize frameSize, VkBufferUsageFlags usage);
+    struct Allocation {
+        // from the start of buffer()
+        VkDeviceSize offset;
+        void* data;
+    };
+    // Throws if the region of the current frame is full
+    Allocation allocate(VkDeviceSize size, VkDeviceSize alignment);
+    // Rewinds the region of frameIndex and makes it the current one
+    // Must be called after the frame of frameIndex has been waited on
+    void reset(size_t frameIndex);
+    std::shared_ptr<VulkanBuffer> buffer() { return _buffer; }
+    VkDeviceSize frameSize() { return _frameSize; }
+
+  private:
+    std::shared_ptr<VulkanBuffer> _buffer;
+    VkDeviceSize _frameSize;
+    VkDeviceSize head = 0;
+    VkDeviceSize end = 0;
 };
 
 struct UniformBufferObject {
@@ -49,12 +158,21 @@ struct UniformBufferObject {
 
 struct SSBOData {
     glm::vec3 translation;
-    uint pad;
+    // index into the MeshBounds buffer
+    uint boundsIndex;
     glm::quat rotation;
     glm::vec3 scale;
     uint pad2;
 };
 
+// Local space bounds of a mesh
+struct MeshBounds {
+    // vec4(center, radius), centered on the aabb
+    glm::vec4 sphere;
+    // xyz is half the size of the aabb
+    glm::vec4 extents;
+};
+
 struct MaterialData {
     alignas(16) glm::vec4 baseColorFactor;
     uint32_t samplerIndex;
@@ -72,13 +190,20 @@ class SSBOBuffers {
   public:
     SSBOBuffers(std::shared_ptr<VulkanDevice> device);
     void createMaterialBuffer(uint32_t drawsCount);
-    void createInstanceBuffers(uint32_t instanceCount);
-    std::shared_ptr<VulkanBuffer> ssboBuffer() { return _ssboBuffer; }
+    void createInstanceBuffers(uint32_t instanceCount, uint32_t slotCount);
+    // Must be called after any of the instance buffers have grown
+    void updateMapped();
+    std::shared_ptr<DirtyRangeBuffer> ssboBuffer() { return _ssboBuffer; }
+    std::shared_ptr<DirtyRangeBuffer> cullBuffer() { return _cullBuffer; }
     std::shared_ptr<VulkanBuffer> materialBuffer() { return _materialBuffer; }
-    std::shared_ptr<VulkanBuffer> instanceIndicesBuffer() { return _instanceIndicesBuffer; }
-    std::shared_ptr<VulkanBuffer> materialIndicesBuffer() { return _materialIndicesBuffer; }
-    std::shared_ptr<VulkanBuffer> culledMaterialIndicesBuffer() { return _culledMaterialIndicesBuffer; }
+    std::shared_ptr<DirtyRangeBuffer> instanceIndicesBuffer() { return _instanceIndicesBuffer; }
+    std::shared_ptr<DirtyRangeBuffer> materialIndicesBuffer() { return _materialIndicesBuffer; }
+    std::shared_ptr<DirtyRangeBuffer> slotLodsBuffer() { return _slotLodsBuffer; }
+    // host copy of ssboBuffer, changes must be marked with ssboBuffer()->markDirty
     SSBOData* ssboMapped;
+    // host copy of cullBuffer, vec4(center, radius) per instance id
+    // written together with ssboMapped and marked dirty with the same ranges
+    glm::vec4* cullMapped;
     MaterialData* materialMapped;
     // void* because VulkanImage depends on this header
     std::shared_ptr<void> defaultImage;
@@ -97,8 +222,13 @@ class SSBOBuffers {
     std::map<void*, int> uniqueMetallicRoughnessMapsMap;
     std::atomic<uint32_t> aoMapsCount = 1;
     std::map<void*, int> uniqueAoMapsMap;
+    // host copies of instanceIndicesBuffer and materialIndicesBuffer, indexed by slot
     uint32_t* instanceIndicesMapped;
     uint32_t* materialIndicesMapped;
+    // host copy of slotLodsBuffer, lod | lodCount << 16 of the draw that owns the slot
+    uint32_t* slotLodsMapped;
+    // Marks an unused slot, culling treats it as not visible
+    static const uint32_t invalidInstance = UINT32_MAX;
     std::atomic<uint32_t> uniqueInstanceID = 0;
     // starts at 1 since the default material is made in the constructor
     std::atomic<uint32_t> uniqueMaterialID = 1;
@@ -106,11 +236,12 @@ class SSBOBuffers {
     std::shared_ptr<VulkanDevice> device;
 
   private:
-    std::shared_ptr<VulkanBuffer> _ssboBuffer;
+    std::shared_ptr<DirtyRangeBuffer> _ssboBuffer;
+    std::shared_ptr<DirtyRangeBuffer> _cullBuffer;
     std::shared_ptr<VulkanBuffer> _materialBuffer;
-    std::shared_ptr<VulkanBuffer> _instanceIndicesBuffer;
-    std::shared_ptr<VulkanBuffer> _materialIndicesBuffer;
-    std::shared_ptr<VulkanBuffer> _culledMaterialIndicesBuffer;
+    std::shared_ptr<DirtyRangeBuffer> _instanceIndicesBuffer;
+    std::shared_ptr<DirtyRangeBuffer> _materialIndicesBuffer;
+    std::shared_ptr<DirtyRangeBuffer> _slotLodsBuffer;
 };
 
 #endif // VULKAN_BUFFER_H_
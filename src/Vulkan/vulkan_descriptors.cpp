@@ -49,12 +49,50 @@ void VulkanDescriptors::VulkanDescriptor::addBinding(uint32_t setID, uint32_t bi
     uniqueSetIDs.insert(setID);
 }
 
-void VulkanDescriptors::VulkanDescriptor::setImageInfos(uint32_t setID, uint32_t bindingID,
-                                                        std::vector<VkDescriptorImageInfo>* imageInfos) {
+void VulkanDescriptors::VulkanDescriptor::addDynamicBinding(uint32_t setID, uint32_t bindingID, VkDescriptorBufferInfo* bufferInfo,
+                                                           VkDescriptorType type) {
+    VkDescriptorSetLayoutBinding binding{};
+    binding.binding = bindingID;
+    binding.descriptorType = type;
+    binding.descriptorCount = 1;
+    binding.pImmutableSamplers = nullptr;
+    binding.stageFlags = _stageFlags;
+
+    bindings.insert({{setID, bindingID}, binding});
+    bufferInfos.insert({{setID, bindingID}, bufferInfo});
+    uniqueSetIDs.insert(setID);
+}
+
+bool VulkanDescriptors::VulkanDescriptor::replaceBuffer(std::shared_ptr<VulkanBuffer> oldBuffer, std::shared_ptr<VulkanBuffer> newBuffer) {
+    bool replaced = false;
+    for (auto& bufferInfo : bufferInfos) {
+        if (bufferInfo.second == oldBuffer->bufferInfo()) {
+            bufferInfo.second = newBuffer->bufferInfo();
+            replaced = true;
+        }
+    }
+    return replaced;
+}
+
+bool VulkanDescriptors::VulkanDescriptor::bindPerFrame(std::shared_ptr<VulkanBuffer> buffer) {
+    bool split = false;
+    for (auto& bufferInfo : bufferInfos) {
+        if (bufferInfo.second == buffer->bufferInfo()) {
+            frameBindings.insert(bufferInfo.first);
+            split = true;
+        }
+    }
+    return split;
+}
+
+void VulkanDescriptors::VulkanDescriptor::setImageInfos(uint32_t setID, uint32_t bindingID, std::vector<VkDescriptorImageInfo>* imageInfos,
+                                                        bool storageImage) {
 
     VkDescriptorType descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
 
-    if (imageInfos->at(0).imageView != VK_NULL_HANDLE) {
+    if (storageImage) {
+        descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    } else if (imageInfos->at(0).imageView != VK_NULL_HANDLE) {
         descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
     }
     VkDescriptorSetLayoutBinding binding{};
@@ -96,6 +134,9 @@ std::vector<VkDescriptorSetLayout> VulkanDescriptors::VulkanDescriptor::getLayou
 }
 
 void VulkanDescriptors::VulkanDescriptor::allocateSets() {
+    // NOTE:
+    // The sets without per frame bindings are copied as well, so a frame binds all its sets from one copy
+    sets.resize(frameBindings.empty() ? 1 : VulkanSwapChain::MAX_FRAMES_IN_FLIGHT);
     for (auto uniqueSetID : uniqueSetIDs) {
         createLayout(uniqueSetID);
         VkDescriptorSetAllocateInfo allocInfo{};
@@ -105,45 +146,63 @@ void VulkanDescriptors::VulkanDescriptor::allocateSets() {
         VkDescriptorSetLayout layout = layouts.at(uniqueSetID);
         allocInfo.pSetLayouts = &layout;
 
-        VkDescriptorSet set;
-        // TODO
-        // allocate multiple sets at once
-        checkResult(vkAllocateDescriptorSets(descriptorManager->device->device(), &allocInfo, &set), "failed to allocate descriptor sets");
-        sets[uniqueSetID] = set;
+        for (auto& frameSets : sets) {
+            VkDescriptorSet set;
+            // TODO
+            // allocate multiple sets at once
+            checkResult(vkAllocateDescriptorSets(descriptorManager->device->device(), &allocInfo, &set),
+                        "failed to allocate descriptor sets");
+            frameSets[uniqueSetID] = set;
+        }
     }
 }
 
 void VulkanDescriptors::VulkanDescriptor::update() {
     std::vector<VkWriteDescriptorSet> descriptorWrites;
-    for (auto binding : bindings) {
-        uint32_t setIndex = binding.first.first;
-        uint32_t bindingIndex = binding.first.second;
-        VkDescriptorSetLayoutBinding actualBinding = binding.second;
-
-        assert(bindingIndex == actualBinding.binding);
-
-        VkWriteDescriptorSet descriptorWrite{};
-        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrite.dstSet = sets.at(setIndex);
-        descriptorWrite.dstBinding = actualBinding.binding;
-        descriptorWrite.dstArrayElement = 0;
-        descriptorWrite.descriptorType = actualBinding.descriptorType;
-        // NOTE:
-        // might only support descriptor count of 1
-        descriptorWrite.descriptorCount = actualBinding.descriptorCount;
-        switch (actualBinding.descriptorType) {
-        case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
-        case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
-            descriptorWrite.pBufferInfo = bufferInfos.at({setIndex, bindingIndex});
-            break;
-        case VK_DESCRIPTOR_TYPE_SAMPLER:
-        case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
-            descriptorWrite.pImageInfo = _imageInfos.at({setIndex, bindingIndex})->data();
-            break;
-        default:
-            throw std::runtime_error("unknown descriptor type");
+    // the regions of the per frame bindings, reserved so the writes can point into it
+    std::vector<VkDescriptorBufferInfo> regionInfos;
+    regionInfos.reserve(frameBindings.size() * sets.size());
+    for (size_t frame = 0; frame < sets.size(); ++frame) {
+        for (auto binding : bindings) {
+            uint32_t setIndex = binding.first.first;
+            uint32_t bindingIndex = binding.first.second;
+            VkDescriptorSetLayoutBinding actualBinding = binding.second;
+
+            assert(bindingIndex == actualBinding.binding);
+
+            VkWriteDescriptorSet descriptorWrite{};
+            descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite.dstSet = sets[frame].at(setIndex);
+            descriptorWrite.dstBinding = actualBinding.binding;
+            descriptorWrite.dstArrayElement = 0;
+            descriptorWrite.descriptorType = actualBinding.descriptorType;
+            // NOTE:
+            // might only support descriptor count of 1
+            descriptorWrite.descriptorCount = actualBinding.descriptorCount;
+            switch (actualBinding.descriptorType) {
+            case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+            case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+                descriptorWrite.pBufferInfo = bufferInfos.at({setIndex, bindingIndex});
+                if (frameBindings.count({setIndex, bindingIndex}) == 1) {
+                    VkDescriptorBufferInfo region = *descriptorWrite.pBufferInfo;
+                    region.range /= VulkanSwapChain::MAX_FRAMES_IN_FLIGHT;
+                    region.offset += frame * region.range;
+                    regionInfos.push_back(region);
+                    descriptorWrite.pBufferInfo = &regionInfos.back();
+                }
+                break;
+            case VK_DESCRIPTOR_TYPE_SAMPLER:
+            case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+            case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+                descriptorWrite.pImageInfo = _imageInfos.at({setIndex, bindingIndex})->data();
+                break;
+            default:
+                throw std::runtime_error("unknown descriptor type");
+            }
+            descriptorWrites.push_back(descriptorWrite);
         }
-        descriptorWrites.push_back(descriptorWrite);
     }
     vkUpdateDescriptorSets(descriptorManager->device->device(), descriptorWrites.size(), descriptorWrites.data(), 0, nullptr);
 }
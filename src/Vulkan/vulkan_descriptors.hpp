@@ -8,6 +8,7 @@
 #include <set>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include <vulkan/vulkan_core.h>
 
 class VulkanDescriptors {
@@ -18,9 +19,20 @@ class VulkanDescriptors {
         ~VulkanDescriptor();
         void addBinding(uint32_t setID, uint32_t bindingID, std::vector<VkDescriptorImageInfo>& imageInfos);
         void addBinding(uint32_t setID, uint32_t bindingID, std::shared_ptr<VulkanBuffer> buffer);
-        void setImageInfos(uint32_t setID, uint32_t bindingID, std::vector<VkDescriptorImageInfo>* imageInfos);
+        // UNIFORM_BUFFER_DYNAMIC or STORAGE_BUFFER_DYNAMIC binding of bufferInfo, the dynamic offset is added when the set is bound
+        void addDynamicBinding(uint32_t setID, uint32_t bindingID, VkDescriptorBufferInfo* bufferInfo, VkDescriptorType type);
+        // storageImage binds the image views as storage images instead of sampled images
+        void setImageInfos(uint32_t setID, uint32_t bindingID, std::vector<VkDescriptorImageInfo>* imageInfos, bool storageImage = false);
+        // Points every binding of oldBuffer at newBuffer, returns true if a binding was changed
+        // update() must be called afterwards
+        bool replaceBuffer(std::shared_ptr<VulkanBuffer> oldBuffer, std::shared_ptr<VulkanBuffer> newBuffer);
+        // Splits buffer into MAX_FRAMES_IN_FLIGHT equal regions, the bindings of buffer in the sets of frame f bind region f
+        // Every frame in flight gets its own copy of the sets then, returns true if a binding was changed
+        // Must be called before allocateSets()
+        bool bindPerFrame(std::shared_ptr<VulkanBuffer> buffer);
         std::vector<VkDescriptorSetLayout> getLayouts();
-        const std::map<uint32_t, VkDescriptorSet>& getSets() { return sets; }
+        // The sets of frame, the same for every frame without per frame bindings
+        const std::map<uint32_t, VkDescriptorSet>& getSets(size_t frame) { return sets[frame % sets.size()]; }
         void allocateSets();
         void update();
         //        VkDescriptorSetLayout getLayout() const { return layout; }
@@ -32,9 +44,12 @@ class VulkanDescriptors {
         // Must be map to preserve setID ordering
         // Required because final pipline layout set ordering must be sequential
         std::map<uint32_t, VkDescriptorSetLayout> layouts;
-        std::map<uint32_t, VkDescriptorSet> sets;
+        // one copy per frame in flight with per frame bindings, a single copy otherwise
+        std::vector<std::map<uint32_t, VkDescriptorSet>> sets;
         std::set<uint32_t> uniqueSetIDs;
         std::map<std::pair<uint32_t, uint32_t>, VkDescriptorBufferInfo*> bufferInfos;
+        // bindings split by bindPerFrame()
+        std::set<std::pair<uint32_t, uint32_t>> frameBindings;
         std::map<std::pair<uint32_t, uint32_t>, std::vector<VkDescriptorImageInfo>*> _imageInfos;
         void createLayout(uint32_t setID);
         VkShaderStageFlags _stageFlags;
@@ -49,7 +64,10 @@ class VulkanDescriptors {
 
     static VkDescriptorType getType(VkBufferUsageFlags usageFlags);
 
-    static inline const std::map<VkBufferUsageFlags, VkDescriptorType> usageToTypes = {
+    // NOTE:
+    // A vector, a map keyed by the usage silently dropped the dynamic types so the pool had no room for them
+    // getType picks the first match, so the dynamic types are only used through addDynamicBinding
+    static inline const std::vector<std::pair<VkBufferUsageFlags, VkDescriptorType>> usageToTypes = {
         {VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER},
         {VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT, VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER},
         {VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER},
@@ -1,6 +1,7 @@
 #include "vulkan_device.hpp"
 #include "common.hpp"
 #include "vulkan_window.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
@@ -38,28 +39,69 @@ VkSampleCountFlagBits VulkanDevice::getMaxUsableSampleCount() {
     return VK_SAMPLE_COUNT_1_BIT;
 }
 
-VkFence VulkanDevice::getFence() {
-    uint32_t createCount = 10;
-    VkFence fence;
-    if (fencePool.size() == 0) {
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-        for (int i = 0; i < createCount; i++) {
-            checkResult(vkCreateFence(device_, &fenceInfo, nullptr, &fence), "failed to create single time fence");
-            fencePool.push_back(fence);
-        }
-        vkResetFences(device_, createCount, fencePool.data());
+void VulkanDevice::createTimeline() {
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &typeInfo;
+    checkResult(vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &timeline), "failed to create the device timeline semaphore");
+}
+
+uint64_t VulkanDevice::submitGraphics(const VkSubmitInfo2& submitInfo) {
+    std::vector<VkSemaphoreSubmitInfo> signalInfos(submitInfo.pSignalSemaphoreInfos,
+                                                   submitInfo.pSignalSemaphoreInfos + submitInfo.signalSemaphoreInfoCount);
+    VkSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.semaphore = timeline;
+    timelineInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    VkSubmitInfo2 timelineSubmitInfo = submitInfo;
+
+    std::lock_guard<std::mutex> lock(submitMutex);
+    timelineInfo.value = ++timelineValue;
+    signalInfos.push_back(timelineInfo);
+    timelineSubmitInfo.signalSemaphoreInfoCount = signalInfos.size();
+    timelineSubmitInfo.pSignalSemaphoreInfos = signalInfos.data();
+    checkResult(vkQueueSubmit2(graphicsQueue_, 1, &timelineSubmitInfo, VK_NULL_HANDLE), "failed to submit to the graphics queue");
+    return timelineInfo.value;
+}
+
+void VulkanDevice::waitTimeline(uint64_t value) {
+    if (value == 0) {
+        return;
     }
-    fence = fencePool.back();
-    fencePool.pop_back();
-    return fence;
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &timeline;
+    waitInfo.pValues = &value;
+    vkWaitSemaphores(device_, &waitInfo, UINT64_MAX);
 }
 
-void VulkanDevice::releaseFence(VkFence fence) {
-    vkResetFences(device_, 1, &fence);
-    fencePool.push_back(fence);
+uint64_t VulkanDevice::completedTimelineValue() {
+    uint64_t value = 0;
+    vkGetSemaphoreCounterValue(device_, timeline, &value);
+    return value;
+}
+
+void VulkanDevice::releaseCompletedCommands() {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    if (pendingCommands.empty()) {
+        return;
+    }
+    uint64_t completed = completedTimelineValue();
+    // NOTE:
+    // Submitted in increasing order, so the finished ones are at the front
+    size_t finished = 0;
+    while (finished < pendingCommands.size() && pendingCommands[finished].value <= completed) {
+        PendingCommands& pending = pendingCommands[finished++];
+        vkResetCommandBuffer(pending.commandBuffer, 0);
+        commandPoolAllocator->releaseBuffer(pending.commandPool, pending.commandBuffer);
+        commandPoolAllocator->releasePool(pending.commandPool);
+    }
+    pendingCommands.erase(pendingCommands.begin(), pendingCommands.begin() + finished);
 }
 
 VkImageView VulkanDevice::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels) {
@@ -91,19 +133,28 @@ QueueFamilyIndices VulkanDevice::findQueueFamilies(VkPhysicalDevice device) {
 
     int i = 0;
     for (const auto& queueFamily : queueFamilies) {
-        if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-            indices.graphicsFamily = i;
-        }
+        if (!indices.isComplete()) {
+            if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+                indices.graphicsFamily = i;
+            }
 
-        VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_, &presentSupport);
+            VkBool32 presentSupport = false;
+            if (headless()) {
+                presentSupport = queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT;
+            } else {
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_, &presentSupport);
+            }
 
-        if (presentSupport) {
-            indices.presentFamily = i;
+            if (presentSupport) {
+                indices.presentFamily = i;
+            }
         }
 
-        if (indices.isComplete()) {
-            break;
+        // NOTE:
+        // The cull timestamps are written on the compute queue
+        if (!indices.computeFamily.has_value() && (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+            !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) && queueFamily.timestampValidBits > 0) {
+            indices.computeFamily = i;
         }
 
         i++;
@@ -135,6 +186,9 @@ SwapChainSupportDetails VulkanDevice::querySwapChainSupport(VkPhysicalDevice dev
 }
 
 void VulkanDevice::createSurface() {
+    if (headless()) {
+        return;
+    }
     checkResult(glfwCreateWindowSurface(instance, window->getGLFWwindow(), nullptr, &surface_), "failed to create window surface");
 }
 
@@ -159,8 +213,8 @@ bool VulkanDevice::isDeviceSuitable(VkPhysicalDevice device) {
 
     bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = headless();
+    if (extensionsSupported && !headless()) {
         SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
         swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
     }
@@ -201,11 +255,13 @@ bool VulkanDevice::checkValidationLayerSupport() {
 }
 
 std::vector<const char*> VulkanDevice::getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    std::vector<const char*> extensions;
+    if (!headless()) {
+        uint32_t glfwExtensionCount = 0;
+        const char** glfwExtensions;
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 
     if (enableValidationLayers) {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -314,6 +370,11 @@ void VulkanDevice::pickPhysicalDevice() {
     vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 
     for (const auto& device : devices) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(device, &properties);
+        if (!deviceName.empty() && std::string(properties.deviceName).find(deviceName) == std::string::npos) {
+            continue;
+        }
         if (isDeviceSuitable(device)) {
             physicalDevice = device;
             if (msaaEnable == VK_TRUE)
@@ -324,7 +385,8 @@ void VulkanDevice::pickPhysicalDevice() {
     }
 
     if (physicalDevice == VK_NULL_HANDLE) {
-        throw std::runtime_error("failed to find a suitable GPU");
+        throw std::runtime_error(deviceName.empty() ? "failed to find a suitable GPU"
+                                                    : "failed to find a suitable GPU named " + deviceName);
     }
 }
 void VulkanDevice::createLogicalDevice() {
@@ -332,6 +394,9 @@ void VulkanDevice::createLogicalDevice() {
 
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
     std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+    if (indices.computeFamily.has_value()) {
+        uniqueQueueFamilies.insert(indices.computeFamily.value());
+    }
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -363,15 +428,23 @@ void VulkanDevice::createLogicalDevice() {
 
     vkGetDeviceQueue(device_, indices.graphicsFamily.value(), 0, &graphicsQueue_);
     vkGetDeviceQueue(device_, indices.presentFamily.value(), 0, &presentQueue_);
+    _graphicsFamily = indices.graphicsFamily.value();
+    if (indices.computeFamily.has_value()) {
+        _computeFamily = indices.computeFamily.value();
+        vkGetDeviceQueue(device_, _computeFamily, 0, &computeQueue_);
+    }
 }
 
 VkCommandPool VulkanDevice::createCommandPool(VkCommandPoolCreateFlags flags) {
     QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+    return createCommandPool(flags, queueFamilyIndices.graphicsFamily.value());
+}
 
+VkCommandPool VulkanDevice::createCommandPool(VkCommandPoolCreateFlags flags, uint32_t queueFamily) {
     VkCommandPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     poolInfo.flags = flags;
-    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    poolInfo.queueFamilyIndex = queueFamily;
 
     VkCommandPool pool;
     checkResult(vkCreateCommandPool(device_, &poolInfo, nullptr, &pool), "failed to create command pool");
@@ -390,27 +463,48 @@ uint32_t VulkanDevice::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags
 
 void VulkanDevice::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer,
                                 VkDeviceMemory& bufferMemory) {
+    createBuffer(size, usage, buffer);
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device_, buffer, &memRequirements);
+    bufferMemory = allocateMemory(memRequirements, properties);
+
+    vkBindBufferMemory(device_, buffer, bufferMemory, 0);
+}
+
+void VulkanDevice::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer) {
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
     bufferInfo.usage = usage;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // NOTE:
+    // Concurrent on both queue families with async compute, so its section and the graphics commands share buffers without
+    // ownership transfers
+    uint32_t queueFamilies[] = {_graphicsFamily, _computeFamily};
+    if (concurrentBuffers) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = 2;
+        bufferInfo.pQueueFamilyIndices = queueFamilies;
+    }
 
     checkResult(vkCreateBuffer(device_, &bufferInfo, nullptr, &buffer), "failed to create buffer");
-    VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(device_, buffer, &memRequirements);
+}
 
+VkDeviceMemory VulkanDevice::allocateMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties) {
     VkMemoryAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    checkResult(vkAllocateMemory(device_, &allocInfo, nullptr, &bufferMemory), "failed to allocated buffer memory");
+    allocInfo.allocationSize = requirements.size;
+    allocInfo.memoryTypeIndex = findMemoryType(requirements.memoryTypeBits, properties);
 
-    vkBindBufferMemory(device_, buffer, bufferMemory, 0);
+    VkDeviceMemory memory;
+    checkResult(vkAllocateMemory(device_, &allocInfo, nullptr, &memory), "failed to allocated buffer memory");
+    return memory;
 }
 
-VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeCommands() { return *(new singleTimeBuilder(this)); }
+VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeCommands() {
+    releaseCompletedCommands();
+    return *(new singleTimeBuilder(this));
+}
 
 VulkanDevice::singleTimeBuilder::singleTimeBuilder(VulkanDevice* vulkanDevice) : vulkanDevice(vulkanDevice) {
     commandPool = vulkanDevice->commandPoolAllocator->getPool();
@@ -426,43 +520,64 @@ void VulkanDevice::singleTimeBuilder::beginSingleTimeCommands() {
     vkBeginCommandBuffer(commandBuffer, &beginInfo);
 }
 
-std::mutex VulkanDevice::singleTimeBuilder::submitQueueMutex;
-
-void VulkanDevice::singleTimeBuilder::endSingleTimeCommands() {
+uint64_t VulkanDevice::singleTimeBuilder::endSingleTimeCommands() {
     vkEndCommandBuffer(commandBuffer);
 
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
+    VkCommandBufferSubmitInfo commandBufferInfo{};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+    commandBufferInfo.commandBuffer = commandBuffer;
 
-    submitQueueMutex.lock();
-    VkFence fence = vulkanDevice->getFence();
-    vkQueueSubmit(vulkanDevice->graphicsQueue(), 1, &submitInfo, fence);
-    submitQueueMutex.unlock();
-    vkWaitForFences(vulkanDevice->device(), 1, &fence, VK_TRUE, UINT64_MAX);
-    vulkanDevice->releaseFence(fence);
+    VkSubmitInfo2 submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.commandBufferInfoCount = 1;
+    submitInfo.pCommandBufferInfos = &commandBufferInfo;
 
-    vkResetCommandBuffer(commandBuffer, 0);
+    return vulkanDevice->submitGraphics(submitInfo);
 }
 
-void VulkanDevice::singleTimeBuilder::run() {
-    endSingleTimeCommands();
-    vulkanDevice->commandPoolAllocator->releaseBuffer(commandPool, commandBuffer);
-    vulkanDevice->commandPoolAllocator->releasePool(commandPool);
+VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::keepAlive(std::shared_ptr<void> resource) {
+    resources.push_back(resource);
+    return *this;
+}
+
+uint64_t VulkanDevice::singleTimeBuilder::submit() {
+    // NOTE:
+    // Under the lock, so the pending commands stay in the order of their values
+    std::lock_guard<std::mutex> lock(vulkanDevice->pendingMutex);
+    uint64_t value = endSingleTimeCommands();
+    vulkanDevice->pendingCommands.push_back({value, commandPool, commandBuffer, std::move(resources)});
+    vulkanDevice->_singleTimeTimelineValue.store(value, std::memory_order_relaxed);
     delete this;
+    return value;
+}
+
+void VulkanDevice::singleTimeBuilder::run() {
+    VulkanDevice* device = vulkanDevice;
+    device->waitTimeline(submit());
+    device->releaseCompletedCommands();
 }
 
-VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size,
+                                                                             VkDeviceSize srcOffset, VkDeviceSize dstOffset) {
     VkBufferCopy copyRegion{};
-    copyRegion.srcOffset = 0;
-    copyRegion.dstOffset = 0;
+    copyRegion.srcOffset = srcOffset;
+    copyRegion.dstOffset = dstOffset;
     copyRegion.size = size;
     vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 
     return *this;
 }
 
+VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::bufferBarriers(const std::vector<VkBufferMemoryBarrier2>& barriers) {
+    VkDependencyInfo dependencyInfo{};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.bufferMemoryBarrierCount = barriers.size();
+    dependencyInfo.pBufferMemoryBarriers = barriers.data();
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+    return *this;
+}
+
 void VulkanDevice::createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format,
                                VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image,
                                VkDeviceMemory& imageMemory) {
@@ -510,20 +625,27 @@ VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::transitionImag
 
 RenderOp VulkanDevice::transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
                                              VkImageSubresourceRange subresourceRange) {
-    VkImageMemoryBarrier2 barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = image;
+    return [=](VkCommandBuffer commandBuffer) { transitionImageLayout(commandBuffer, image, oldLayout, newLayout, subresourceRange); };
+}
 
-    barrier.subresourceRange = subresourceRange;
+RenderOp VulkanDevice::transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels) {
+    return transitionImageLayout(image, oldLayout, newLayout, VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1});
+}
+
+void VulkanDevice::transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+                                         VkImageSubresourceRange subresourceRange) {
+    VkImageMemoryBarrier2 barrier = actuallyTransitionImageLayout(image, oldLayout, newLayout, subresourceRange);
+    VkDependencyInfo dependencyInfo{};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    dependencyInfo.imageMemoryBarrierCount = 1;
+    dependencyInfo.pImageMemoryBarriers = &barrier;
 
-    return actuallyTransitionImageLayout(barrier, oldLayout, newLayout);
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
 }
 
-RenderOp VulkanDevice::transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels) {
+VkImageMemoryBarrier2 VulkanDevice::actuallyTransitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+                                                                   VkImageSubresourceRange subresourceRange) {
     VkImageMemoryBarrier2 barrier{};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
     barrier.oldLayout = oldLayout;
@@ -532,16 +654,7 @@ RenderOp VulkanDevice::transitionImageLayout(VkImage image, VkImageLayout oldLay
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = image;
 
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = mipLevels;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-
-    return actuallyTransitionImageLayout(barrier, oldLayout, newLayout);
-}
-
-RenderOp VulkanDevice::actuallyTransitionImageLayout(VkImageMemoryBarrier2 barrier, VkImageLayout oldLayout, VkImageLayout newLayout) {
+    barrier.subresourceRange = subresourceRange;
 
     if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL) {
         barrier.srcAccessMask = VK_ACCESS_2_NONE;
@@ -550,18 +663,50 @@ RenderOp VulkanDevice::actuallyTransitionImageLayout(VkImageMemoryBarrier2 barri
         barrier.dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
         barrier.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
 
+    } else if (oldLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+        barrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+        barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
     } else if (oldLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) {
         barrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
         barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
 
         barrier.dstAccessMask = VK_ACCESS_2_NONE;
         barrier.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+    } else if (oldLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+        barrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+        barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
     } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
         barrier.srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
         barrier.srcStageMask = VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
 
         barrier.dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
         barrier.dstStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT;
+    } else if (oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL &&
+               newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL) {
+        barrier.srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+
+        barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    } else if (oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL &&
+               newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
+        barrier.srcAccessMask = VK_ACCESS_2_NONE;
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+
+        barrier.dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+    } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_GENERAL) {
+        barrier.srcAccessMask = VK_ACCESS_2_NONE;
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+
+        barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
     } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
         barrier.srcAccessMask = VK_ACCESS_2_NONE;
         barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
@@ -577,16 +722,7 @@ RenderOp VulkanDevice::actuallyTransitionImageLayout(VkImageMemoryBarrier2 barri
     } else {
         throw std::invalid_argument("unsupported layout transition");
     }
-
-    return [&, barrier](VkCommandBuffer commandBuffer) {
-        VkDependencyInfo dependencyInfo{};
-        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
-        dependencyInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-        dependencyInfo.imageMemoryBarrierCount = 1;
-        dependencyInfo.pImageMemoryBarriers = &barrier;
-
-        vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
-    };
+    return barrier;
 }
 
 VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width,
@@ -609,6 +745,34 @@ VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::copyBufferToIm
     return *this;
 }
 
+VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::copyImageToBuffer(VkImage image, VkBuffer buffer, uint32_t width,
+                                                                                    uint32_t height) {
+    // NOTE:
+    // The image was written by an earlier submission, barriers cover everything earlier in submission order
+    VkMemoryBarrier2 barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+    VkDependencyInfo dependencyInfo{};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.memoryBarrierCount = 1;
+    dependencyInfo.pMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+    VkBufferImageCopy region{};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = {width, height, 1};
+
+    vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1, &region);
+
+    return *this;
+}
+
 VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth,
                                                                                   int32_t texHeight, uint32_t mipLevels) {
 
@@ -685,7 +849,11 @@ VulkanDevice::singleTimeBuilder& VulkanDevice::singleTimeBuilder::generateMipmap
     return *this;
 }
 
-VulkanDevice::VulkanDevice(VulkanWindow* window) : window{window} {
+VulkanDevice::VulkanDevice(VulkanWindow* window, std::string deviceName) : window{window}, deviceName{deviceName} {
+    if (headless()) {
+        deviceExtensions.clear();
+    }
+
     vk13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
     vk13_features.dynamicRendering = VK_TRUE;
     vk13_features.synchronization2 = VK_TRUE;
@@ -697,6 +865,8 @@ VulkanDevice::VulkanDevice(VulkanWindow* window) : window{window} {
     vk12_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
     vk12_features.drawIndirectCount = VK_TRUE;
     vk12_features.hostQueryReset = VK_TRUE;
+    // syncs the compute queue with the graphics queue
+    vk12_features.timelineSemaphore = VK_TRUE;
     // TODO
     // use scalar block layout
     //    vk12_features.scalarBlockLayout = VK_TRUE;
@@ -709,6 +879,8 @@ VulkanDevice::VulkanDevice(VulkanWindow* window) : window{window} {
     deviceFeatures.features.sampleRateShading = sampleShading;
     deviceFeatures.features.multiDrawIndirect = VK_TRUE;
     deviceFeatures.features.shaderFloat64 = VK_TRUE;
+    // depth pyramid levels are indexed by a push constant
+    deviceFeatures.features.shaderStorageImageArrayDynamicIndexing = VK_TRUE;
 
     deviceFeatures.pNext = &vk11_features;
     vk11_features.pNext = &vk12_features;
@@ -719,22 +891,38 @@ VulkanDevice::VulkanDevice(VulkanWindow* window) : window{window} {
     createSurface();
     pickPhysicalDevice();
     vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+    VkPhysicalDeviceVulkan11Properties vk11_properties{};
+    vk11_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
     VkPhysicalDeviceVulkan13Properties vk13_properties{};
     vk13_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_PROPERTIES;
+    vk13_properties.pNext = &vk11_properties;
     VkPhysicalDeviceProperties2 properties2{};
     properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
     properties2.pNext = &vk13_properties;
     vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
     std::cout << "Using device: " << properties2.properties.deviceID << " " << properties2.properties.deviceName << std::endl;
     _maxSubgroupSize = vk13_properties.maxSubgroupSize;
+    const VkSubgroupFeatureFlags scanOperations =
+        VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+    _supportsSubgroupScan = (vk11_properties.subgroupSupportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+                            (vk11_properties.subgroupSupportedOperations & scanOperations) == scanOperations;
     createLogicalDevice();
+    createTimeline();
     commandPool_ = createCommandPool(VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+    if (hasComputeQueue()) {
+        computeCommandPool_ = createCommandPool(VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, _computeFamily);
+    }
     commandPoolAllocator = new VulkanCommandPoolAllocator(this);
 
     VkPhysicalDeviceProperties physicalDeviceProperties;
     vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
     _timestampPeriod = physicalDeviceProperties.limits.timestampPeriod;
     _maxComputeWorkGroupInvocations = physicalDeviceProperties.limits.maxComputeWorkGroupInvocations;
+    // NOTE:
+    // the compute pipelines force maxSubgroupSize, so this bounds the subgroup count of a workgroup by the subgroup size
+    _scanWorkGroupSize = std::min(_maxComputeWorkGroupInvocations, _maxSubgroupSize * _maxSubgroupSize);
+    _minUniformBufferOffsetAlignment = physicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
+    _minStorageBufferOffsetAlignment = physicalDeviceProperties.limits.minStorageBufferOffsetAlignment;
 }
 
 bool VulkanDevice::checkFeatures(VkPhysicalDevice device) {
@@ -760,8 +948,9 @@ bool VulkanDevice::checkFeatures(VkPhysicalDevice device) {
            vk11_featuresCheck.shaderDrawParameters && vk12_featuresCheck.runtimeDescriptorArray &&
            vk12_featuresCheck.shaderSampledImageArrayNonUniformIndexing && vk13_featuresCheck.dynamicRendering &&
            vk13_featuresCheck.synchronization2 && vk12_featuresCheck.drawIndirectCount && vk12_featuresCheck.hostQueryReset &&
-           vk12_featuresCheck.scalarBlockLayout && vk13_featuresCheck.subgroupSizeControl && vk13_featuresCheck.maintenance4 &&
-           supportedFeaturesCheck.features.shaderFloat64;
+           vk12_featuresCheck.timelineSemaphore && vk12_featuresCheck.scalarBlockLayout && vk13_featuresCheck.subgroupSizeControl &&
+           vk13_featuresCheck.maintenance4 && supportedFeaturesCheck.features.shaderFloat64 &&
+           supportedFeaturesCheck.features.shaderStorageImageArrayDynamicIndexing;
 }
 
 void VulkanDevice::setDebugName(VkObjectType type, uint64_t handle, std::string name) {
@@ -778,10 +967,11 @@ void VulkanDevice::setDebugName(VkObjectType type, uint64_t handle, std::string
 }
 
 VulkanDevice::~VulkanDevice() {
-    for (VkFence fence : fencePool) {
-        vkDestroyFence(device_, fence, nullptr);
-    }
+    vkDestroySemaphore(device_, timeline, nullptr);
     vkDestroyCommandPool(device_, commandPool_, nullptr);
+    if (computeCommandPool_ != VK_NULL_HANDLE) {
+        vkDestroyCommandPool(device_, computeCommandPool_, nullptr);
+    }
     delete commandPoolAllocator;
     vkDestroyDevice(device_, nullptr);
 
@@ -789,6 +979,8 @@ VulkanDevice::~VulkanDevice() {
         DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
     }
 
-    vkDestroySurfaceKHR(instance, surface_, nullptr);
+    if (!headless()) {
+        vkDestroySurfaceKHR(instance, surface_, nullptr);
+    }
     vkDestroyInstance(instance, nullptr);
 }
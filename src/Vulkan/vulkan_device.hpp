@@ -3,11 +3,13 @@
 
 #include "common.hpp"
 #include "vulkan_window.hpp"
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan_core.h>
@@ -15,6 +17,8 @@
 struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
+    // A family with compute but without graphics, for running compute passes next to the graphics queue
+    std::optional<uint32_t> computeFamily;
 
     bool isComplete() { return graphicsFamily.has_value() && presentFamily.has_value(); }
 };
@@ -33,19 +37,38 @@ class VulkanDevice {
     const bool enableValidationLayers = true;
 #endif
 
-    VulkanDevice(VulkanWindow* window);
+    // deviceName picks the first suitable device whose name contains it, like "llvmpipe", any suitable device if empty
+    VulkanDevice(VulkanWindow* window, std::string deviceName = "");
     ~VulkanDevice();
 
     VkCommandPool getCommandPool() { return commandPool_; }
     VkDevice device() { return device_; }
     VkSurfaceKHR surface() { return surface_; }
+    // Without a surface or swap chain extension, the present queue is the graphics queue
+    bool headless() const { return window->headless(); }
     VkQueue graphicsQueue() { return graphicsQueue_; }
     VkQueue presentQueue() { return presentQueue_; }
+    // The dedicated compute queue, only valid if hasComputeQueue()
+    VkQueue computeQueue() { return computeQueue_; }
+    VkCommandPool getComputeCommandPool() { return computeCommandPool_; }
+    const bool hasComputeQueue() const { return computeQueue_ != VK_NULL_HANDLE; }
+    const uint32_t graphicsFamily() const { return _graphicsFamily; }
+    const uint32_t computeFamily() const { return _computeFamily; }
+    // Buffers created afterwards are shared concurrently by the graphics and compute families, for the async compute section
+    // Only takes effect with a dedicated compute queue, must be set before the buffers it shares are created
+    void enableConcurrentBuffers() { concurrentBuffers = hasComputeQueue(); }
     VkPhysicalDevice getPhysicalDevice() { return physicalDevice; }
     const VkSampleCountFlagBits getMsaaSamples() const { return msaaSamples; }
     const VkBool32 getSampleShading() const { return sampleShading; }
     const uint32_t maxSubgroupSize() const { return _maxSubgroupSize; }
     const uint32_t maxComputeWorkGroupInvocations() const { return _maxComputeWorkGroupInvocations; }
+    // Largest workgroup scan.glsl can scan, it needs gl_NumSubgroups <= gl_SubgroupSize
+    const uint32_t scanWorkGroupSize() const { return _scanWorkGroupSize; }
+    // Alignment of the offsets of uniform and storage buffer descriptors, dynamic offsets included
+    const VkDeviceSize minUniformBufferOffsetAlignment() const { return _minUniformBufferOffsetAlignment; }
+    const VkDeviceSize minStorageBufferOffsetAlignment() const { return _minStorageBufferOffsetAlignment; }
+    // The cull passes need basic, ballot and arithmetic subgroup operations in compute shaders
+    const bool supportsSubgroupScan() const { return _supportsSubgroupScan; }
 
     VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels);
     SwapChainSupportDetails getSwapChainSupport() { return querySwapChainSupport(physicalDevice); }
@@ -53,49 +76,82 @@ class VulkanDevice {
 
     void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer,
                       VkDeviceMemory& bufferMemory);
+    // Without memory, for buffers bound into memory they share with others
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer);
+    VkDeviceMemory allocateMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties);
 
     void createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format,
                      VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image,
                      VkDeviceMemory& imageMemory);
 
-    VkFence getFence();
-    void releaseFence(VkFence fence);
+    // Every graphics submission signals the device timeline with the next value, the frames wait for the values they got
+    // instead of fences and the single time commands are freed by theirs
+    // Returns the value the submission signals
+    uint64_t submitGraphics(const VkSubmitInfo2& submitInfo);
+    // Blocks until the submission that signals value finished, 0 returns right away
+    void waitTimeline(uint64_t value);
+    // The value of the last finished submission, doesn't block
+    uint64_t completedTimelineValue();
+    // For waiting on the graphics submissions on other queues
+    VkSemaphore timelineSemaphore() { return timeline; }
+    // The value of the last single time commands submitted without waiting, the frames wait for it before they read what the
+    // commands uploaded
+    uint64_t singleTimeTimelineValue() const { return _singleTimeTimelineValue.load(std::memory_order_relaxed); }
+    // Frees the command buffers and resources of the single time commands whose submissions finished, doesn't block
+    void releaseCompletedCommands();
 
     VkCommandPool createCommandPool(VkCommandPoolCreateFlags flags);
+    VkCommandPool createCommandPool(VkCommandPoolCreateFlags flags, uint32_t queueFamily);
 
     RenderOp transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels);
     RenderOp transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
                                    VkImageSubresourceRange subresourceRange);
+    // Records the transition right away, for the render ops that run every frame without building a RenderOp
+    void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+                               VkImageSubresourceRange subresourceRange);
 
     float timestampPeriod() const { return _timestampPeriod; }
 
     void setDebugName(VkObjectType type, uint64_t handle, std::string name);
 
   private:
-    RenderOp actuallyTransitionImageLayout(VkImageMemoryBarrier2 barrier, VkImageLayout oldLayout, VkImageLayout newLayout);
+    VkImageMemoryBarrier2 actuallyTransitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+                                                        VkImageSubresourceRange subresourceRange);
     PFN_vkSetDebugUtilsObjectNameEXT setDebugUtilsObjectName;
 
   public:
     class singleTimeBuilder {
       public:
         singleTimeBuilder(VulkanDevice* vulkanDevice);
-        singleTimeBuilder& copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+        singleTimeBuilder& copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size, VkDeviceSize srcOffset = 0,
+                                      VkDeviceSize dstOffset = 0);
+        singleTimeBuilder& bufferBarriers(const std::vector<VkBufferMemoryBarrier2>& barriers);
         singleTimeBuilder& transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels);
         singleTimeBuilder& transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
                                                  VkImageSubresourceRange subresourceRange);
         singleTimeBuilder& copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
+        // The image has to be in the transfer source layout, every earlier write on the queue finishes before the copy
+        singleTimeBuilder& copyImageToBuffer(VkImage image, VkBuffer buffer, uint32_t width, uint32_t height);
         singleTimeBuilder& generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
+        // Keeps resource alive until the commands finished, for staging buffers and the buffers the commands copy from
+        singleTimeBuilder& keepAlive(std::shared_ptr<void> resource);
+        // Submits without waiting and returns the device timeline value the submission signals
+        // The command buffer and the kept resources are freed by releaseCompletedCommands() once the value is reached
+        // Invalidates the builder
+        uint64_t submit();
+        // Submits and waits for the commands to finish, for reading back what they wrote
+        // Invalidates the builder
         void run();
 
       private:
         VkCommandPool commandPool;
         VkCommandBuffer commandBuffer;
         VulkanDevice* vulkanDevice;
-        static std::mutex submitQueueMutex;
+        std::vector<std::shared_ptr<void>> resources;
 
         singleTimeBuilder& actuallyTransitionImageLayout(VkImageMemoryBarrier2 barrier, VkImageLayout oldLayout, VkImageLayout newLayout);
         void beginSingleTimeCommands();
-        void endSingleTimeCommands();
+        uint64_t endSingleTimeCommands();
     };
 
   public:
@@ -103,15 +159,21 @@ class VulkanDevice {
 
   private:
     VulkanWindow* window;
+    std::string deviceName;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debugMessenger;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkCommandPool commandPool_;
 
     VkDevice device_;
-    VkSurfaceKHR surface_;
+    VkSurfaceKHR surface_ = VK_NULL_HANDLE;
     VkQueue graphicsQueue_;
     VkQueue presentQueue_;
+    VkQueue computeQueue_ = VK_NULL_HANDLE;
+    VkCommandPool computeCommandPool_ = VK_NULL_HANDLE;
+    uint32_t _graphicsFamily;
+    uint32_t _computeFamily = UINT32_MAX;
+    bool concurrentBuffers = false;
 
     VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
     static const VkBool32 msaaEnable = VK_FALSE;
@@ -123,6 +185,10 @@ class VulkanDevice {
     VkPhysicalDeviceVulkan13Features vk13_features{};
     uint32_t _maxSubgroupSize;
     uint32_t _maxComputeWorkGroupInvocations;
+    uint32_t _scanWorkGroupSize;
+    VkDeviceSize _minUniformBufferOffsetAlignment;
+    VkDeviceSize _minStorageBufferOffsetAlignment;
+    bool _supportsSubgroupScan;
 
     void createInstance();
     void setupDebugMessenger();
@@ -130,7 +196,21 @@ class VulkanDevice {
     void pickPhysicalDevice();
     void createLogicalDevice();
 
-    std::vector<VkFence> fencePool;
+    VkSemaphore timeline = VK_NULL_HANDLE;
+    // last value submitted, the mutex keeps the values in submission order across threads
+    uint64_t timelineValue = 0;
+    std::mutex submitMutex;
+    void createTimeline();
+    // Single time commands submitted without waiting, freed once the timeline reaches value
+    struct PendingCommands {
+        uint64_t value;
+        VkCommandPool commandPool;
+        VkCommandBuffer commandBuffer;
+        std::vector<std::shared_ptr<void>> resources;
+    };
+    std::vector<PendingCommands> pendingCommands;
+    std::mutex pendingMutex;
+    std::atomic<uint64_t> _singleTimeTimelineValue = 0;
 
     QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
     bool checkDeviceExtensionSupport(VkPhysicalDevice device);
@@ -142,7 +222,8 @@ class VulkanDevice {
     uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
     VkSampleCountFlagBits getMaxUsableSampleCount();
 
-    const std::vector<const char*> deviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    // the swap chain extension is dropped when headless
+    std::vector<const char*> deviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
     const std::vector<const char*> validationLayers = {"VK_LAYER_KHRONOS_validation"};
 
     float _timestampPeriod = 0;
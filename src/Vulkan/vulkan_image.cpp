@@ -178,12 +178,12 @@ void VulkanImage::loadPixels() {
     VkDeviceSize imageSize = texWidth * texHeight * 4;
     _mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
 
-    VulkanBuffer stagingBuffer(device, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    std::shared_ptr<VulkanBuffer> stagingBuffer = std::make_shared<VulkanBuffer>(
+        device, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
-    stagingBuffer.map();
-    stagingBuffer.write(pixels, imageSize);
-    stagingBuffer.unmap();
+    stagingBuffer->map();
+    stagingBuffer->write(pixels, imageSize);
+    stagingBuffer->unmap();
 
     device->createImage(texWidth, texHeight, _mipLevels, VK_SAMPLE_COUNT_1_BIT, _format, VK_IMAGE_TILING_OPTIMAL,
                         VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
@@ -191,11 +191,13 @@ void VulkanImage::loadPixels() {
 
     device->singleTimeCommands()
         .transitionImageLayout(_image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, _mipLevels)
-        .copyBufferToImage(stagingBuffer.buffer(), _image, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight))
+        .copyBufferToImage(stagingBuffer->buffer(), _image, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight))
         // TODO
         // Save and load mipmaps from a file
         .generateMipmaps(_image, _format, texWidth, texHeight, _mipLevels)
-        .run();
+        // the frames wait for the upload on the timeline, the staging buffer is freed once it finished
+        .keepAlive(stagingBuffer)
+        .submit();
 
     _imageView = device->createImageView(_image, _format, VK_IMAGE_ASPECT_COLOR_BIT, _mipLevels);
 
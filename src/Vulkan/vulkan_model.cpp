@@ -61,6 +61,12 @@ void VulkanModel::addInstance(uint32_t firstInstanceID, std::shared_ptr<SSBOBuff
     }
 }
 
+void VulkanModel::forEachInstance(uint32_t firstInstanceID, std::function<void(VulkanMesh*, uint32_t)> const& f) {
+    for (const auto node : rootNodes) {
+        node->forEachInstance(firstInstanceID, f);
+    }
+}
+
 std::optional<VulkanNode*> VulkanModel::findNode(int nodeID) {
     // TODO
     // Improve this
@@ -24,6 +24,7 @@ class VulkanModel {
     AABB aabb;
     uint32_t const totalInstanceCount() { return _totalInstanceCounter; }
     void addInstance(uint32_t firstInstanceID, std::shared_ptr<SSBOBuffers> ssboBuffers);
+    void forEachInstance(uint32_t firstInstanceID, std::function<void(VulkanMesh*, uint32_t)> const& f);
     void uploadModelMatrix(uint32_t firstInstanceID, glm::mat4 modelMatrix, std::shared_ptr<SSBOBuffers> ssboBuffers);
     void updateAnimations();
     bool hasAnimations() { return animatedNodes.size() != 0; }
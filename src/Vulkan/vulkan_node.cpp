@@ -1,5 +1,6 @@
 #include "vulkan_node.hpp"
 #include "aabb.hpp"
+#include "mesh_simplifier.hpp"
 #include "vulkan_buffer.hpp"
 #include "vulkan_image.hpp"
 #include <chrono>
@@ -51,6 +52,15 @@ void VulkanNode::addInstance(uint32_t& globalInstanceIDIterator, std::shared_ptr
     }
 }
 
+void VulkanNode::forEachInstance(uint32_t& globalInstanceIDIterator, std::function<void(VulkanMesh*, uint32_t)> const& f) {
+    if (mesh != nullptr) {
+        f(mesh.get(), globalInstanceIDIterator++);
+    }
+    for (const auto child : children) {
+        child->forEachInstance(globalInstanceIDIterator, f);
+    }
+}
+
 void VulkanNode::updateAABB(glm::mat4 parentMatrix, AABB& aabb) {
     glm::mat4 modelMatrix = parentMatrix * *_baseMatrix;
     if (mesh != nullptr) {
@@ -97,6 +107,11 @@ void VulkanNode::uploadModelMatrix(uint32_t& globalInstanceID, glm::mat4 parentM
         ssboBuffers->ssboMapped[globalInstanceID].translation = translation;
         ssboBuffers->ssboMapped[globalInstanceID].rotation = rotation;
         ssboBuffers->ssboMapped[globalInstanceID].scale = scale;
+        ssboBuffers->ssboMapped[globalInstanceID].boundsIndex = mesh->boundsIndex;
+        // NOTE:
+        // scale.x to match triangle.vert, which only supports uniform scaling
+        ssboBuffers->cullMapped[globalInstanceID] =
+            glm::vec4(translation + rotation * (glm::vec3(mesh->boundingSphere) * scale.x), mesh->boundingSphere.w * glm::abs(scale.x));
 
         ++globalInstanceID;
     }
@@ -182,6 +197,7 @@ VulkanMesh::VulkanMesh(GLTF* model, uint32_t meshID, std::unordered_map<int, int
         primitives.push_back(std::make_shared<VulkanMesh::Primitive>(model, meshID, primitiveID, materialIDMap, ssboBuffers));
         aabb.update(primitives.back()->aabb);
     }
+    boundingSphere = glm::vec4((aabb.min() + aabb.max()) * 0.5f, glm::length(aabb.max() - aabb.min()) * 0.5f);
 }
 
 VulkanMesh::Primitive::Primitive(GLTF* model, int meshID, int primitiveID, std::unordered_map<int, int>* materialIDMap,
@@ -448,3 +464,29 @@ void VulkanMesh::Primitive::uploadMaterial(std::shared_ptr<SSBOBuffers> ssboBuff
         ssboBuffers->materialMapped[materialIndex].occlusionStrength = occlusionStrength;
     }
 }
+
+void VulkanMesh::Primitive::generateLods(uint32_t lodCount) {
+    // below this many indices a LOD saves less than the extra slots cost the cull pass
+    const uint32_t minLodIndexCount = 3 * 64;
+    lodIndices.clear();
+    std::vector<glm::vec3> positions(vertices.size());
+    for (uint32_t i = 0; i < vertices.size(); ++i) {
+        positions[i] = vertices[i].pos;
+    }
+    for (uint32_t lod = 1; lod < lodCount; ++lod) {
+        const std::vector<uint32_t>& previous = lod == 1 ? indices : lodIndices.back();
+        // Every LOD is picked at half the projected size of the previous one,
+        // a quarter of the triangles keeps the triangle density on screen
+        uint32_t targetIndexCount = previous.size() / 12 * 3;
+        if (targetIndexCount < minLodIndexCount) {
+            break;
+        }
+        std::vector<uint32_t> simplified = MeshSimplifier::simplify(positions, previous, targetIndexCount);
+        // NOTE:
+        // stop once locked borders keep the simplification from paying off
+        if (simplified.size() > previous.size() * 3 / 4) {
+            break;
+        }
+        lodIndices.push_back(std::move(simplified));
+    }
+}
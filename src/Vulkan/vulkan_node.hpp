@@ -69,14 +69,22 @@ class VulkanMesh {
     std::mutex instanceIDsMutex;
     uint32_t const meshID() { return _meshID; };
     AABB aabb;
+    // vec4(center, radius) of aabb
+    glm::vec4 boundingSphere;
+    uint32_t boundsIndex = 0;
 
     class Primitive {
       public:
         Primitive(GLTF* model, int meshID, int primitiveID, std::unordered_map<int, int>* materialIDMap,
                   std::shared_ptr<SSBOBuffers> ssboBuffers);
         void uploadMaterial(std::shared_ptr<SSBOBuffers> ssboBuffers);
+        // Simplifies indices into up to lodCount - 1 coarser LODs,
+        // stops early once the simplification doesn't pay off
+        void generateLods(uint32_t lodCount);
         std::vector<Vertex> vertices;
         std::vector<uint32_t> indices;
+        // LOD 1 onwards, index the same vertices as indices
+        std::vector<std::vector<uint32_t>> lodIndices;
         int materialIndex = 0;
         MaterialData materialData{};
         std::shared_ptr<VulkanImage> image;
@@ -114,6 +122,8 @@ class VulkanNode {
     void updateAABB(glm::mat4 parentMatrix, AABB& aabb);
     std::shared_ptr<VulkanMesh> mesh = nullptr;
     void addInstance(uint32_t& instanceIDIterator, std::shared_ptr<SSBOBuffers> ssboBuffers);
+    // Visits instance IDs in the same order as addInstance
+    void forEachInstance(uint32_t& instanceIDIterator, std::function<void(VulkanMesh*, uint32_t)> const& f);
     void updateAnimation();
 
   protected:
@@ -17,21 +17,17 @@
 
 VulkanObject::VulkanObject(std::shared_ptr<VulkanModel> model, std::shared_ptr<SSBOBuffers> ssboBuffers, std::string const& name,
                            bool duplicate)
-    : model{model} {
-    _name = new char[name.size()];
-    for (int i = 0; i < name.size(); ++i) {
-        _name[i] = name[i];
-    }
+    : model{model}, _name{name} {
     // NOTE:
     // Preallocates instance ids from the total instance ids in the model
     firstInstanceID = ssboBuffers->uniqueInstanceID.fetch_add(model->totalInstanceCount(), std::memory_order_relaxed);
     model->addInstance(firstInstanceID, ssboBuffers);
 }
 
-VulkanObject::~VulkanObject() {
-    if (_name != nullptr) {
-        delete _name;
-    }
+VulkanObject::VulkanObject(std::shared_ptr<VulkanModel> model, std::shared_ptr<SSBOBuffers> ssboBuffers, std::string const& name,
+                           uint32_t firstInstanceID)
+    : model{model}, firstInstanceID{firstInstanceID}, _name{name} {
+    model->addInstance(firstInstanceID, ssboBuffers);
 }
 
 VulkanObject::VulkanObject() {}
@@ -90,6 +86,9 @@ void VulkanObject::updateModelMatrix(std::shared_ptr<SSBOBuffers> ssboBuffers) {
         glm::mat4 modelMatrix =
             glm::translate(glm::mat4(1.0f), position() - positionOffset) * glm::toMat4(rotation()) * glm::scale(scale());
         model->uploadModelMatrix(firstInstanceID, modelMatrix, ssboBuffers);
+        // instance IDs of an object are contiguous
+        ssboBuffers->ssboBuffer()->markDirty(firstInstanceID, model->totalInstanceCount());
+        ssboBuffers->cullBuffer()->markDirty(firstInstanceID, model->totalInstanceCount());
         _isBufferValid = 1;
     }
 }
@@ -13,8 +13,10 @@ class VulkanObject {
   public:
     VulkanObject(std::shared_ptr<VulkanModel> model, std::shared_ptr<SSBOBuffers> ssboBuffers, std::string const& name,
                  bool duplicate = false);
+    // Uses instance IDs that were already allocated, for example from a free list
+    VulkanObject(std::shared_ptr<VulkanModel> model, std::shared_ptr<SSBOBuffers> ssboBuffers, std::string const& name,
+                 uint32_t firstInstanceID);
     VulkanObject();
-    ~VulkanObject();
     std::string const name() { return _name; }
     void keyboardUpdate(GLFWwindow* window, float frameTime);
     glm::vec3 const position() const { return _position; }
@@ -29,7 +31,11 @@ class VulkanObject {
     glm::mat4 const modelMatrix() { return _modelMatrix; }
     void draw();
     uint32_t firstInstanceID = -1;
+    // index in VulkanObjects::objects, used for constant time removal
+    uint32_t objectIndex = -1;
     void updateModelMatrix(std::shared_ptr<SSBOBuffers> ssboBuffers);
+    // The next updateModelMatrix uploads even if the object didn't move, for example after its instance IDs changed
+    void invalidateBuffer() { _isBufferValid = 0; }
 
     std::shared_ptr<VulkanModel> model;
 
@@ -43,7 +49,7 @@ class VulkanObject {
     inline static const glm::vec3 rightVector = glm::vec3(-1.0f, 0.0, 0.0f);
 
   private:
-    char* _name = nullptr;
+    std::string _name;
 
     glm::vec3 _position{0.0f, 0.0f, 0.0f};
     glm::quat _rotation{1.0f, 0.0f, 0.0f, 0.0f};
@@ -1,6 +1,8 @@
 #include "vulkan_objects.hpp"
 #include "../glTF/base64.hpp"
 #include "common.hpp"
+#include "cpu_cull.hpp"
+#include "meshlet_builder.hpp"
 #include "vulkan_buffer.hpp"
 #include "vulkan_descriptors.hpp"
 #include "vulkan_device.hpp"
@@ -13,14 +15,45 @@
 #include <filesystem>
 #include <glm/gtx/string_cast.hpp>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <pstl/glue_execution_defs.h>
 #include <random>
+#include <sstream>
 #include <vulkan/vulkan_core.h>
 
+// Spreads the lower 10 bits of v so there are 2 zero bits between each bit
+// https://developer.nvidia.com/blog/thinking-parallel-part-iii-tree-construction-gpu/
+static uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30 bit morton code of a position normalized to [0, 1]
+static uint32_t mortonCode(glm::vec3 normalizedPosition) {
+    glm::uvec3 quantized(glm::clamp(normalizedPosition * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+    return (expandBits(quantized.x) << 2) | (expandBits(quantized.y) << 1) | expandBits(quantized.z);
+}
+
 VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderGraph* rg, std::shared_ptr<Settings> settings)
-    : device{device} {
+    : device{device}, rg{rg}, settings{settings} {
     _totalInstanceCount = 0;
+    hostCulling = settings->cpuCulling || !device->supportsSubgroupScan();
+    if (hostCulling) {
+        std::cout << "Culling on the host" << std::endl;
+    }
+    // NOTE:
+    // The validator can't reproduce the occlusion results on the host, it needs the frustum only passes
+    occlusionCulling = settings->occlusionCulling && !hostCulling && settings->validateCullingFrames == 0;
+    // NOTE:
+    // CpuCull has no meshlet pass, and the validator compares against it
+    meshletCulling = settings->meshletCulling && !hostCulling && settings->validateCullingFrames == 0;
+    cullGlobals.minPixelSize = settings->minPixelSize;
+    cullGlobals.lodPixelSize = settings->lodPixelSize;
     auto startTime = std::chrono::high_resolution_clock::now();
     // Load models
     uint32_t fileNum = 0;
@@ -61,6 +94,14 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
         }
     }
 
+    for (std::pair<std::string, std::shared_ptr<VulkanModel>> modelPair : models) {
+        for (std::pair<int, std::shared_ptr<VulkanMesh>> meshPair : modelPair.second->meshIDMap) {
+            std::shared_ptr<VulkanMesh> mesh = meshPair.second;
+            mesh->boundsIndex = meshBounds.size();
+            meshBounds.push_back({mesh->boundingSphere, glm::vec4((mesh->aabb.max() - mesh->aabb.min()) * 0.5f, 0.0f)});
+        }
+    }
+
     // NOTE:
     // Creating material buffer after all gltf files have been loaded
     // TODO:
@@ -151,6 +192,7 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
     std::vector<std::future<std::pair<std::vector<VulkanObject*>, std::vector<VulkanObject*>>>> futures;
     std::string filePath = baseDir + "Box.glb";
     std::shared_ptr<VulkanModel> vulkanModel = models[filePath];
+    extraObjectModel = filePath;
 
     for (int batch = 0; batch < threadCount; ++batch) {
         futures.push_back(
@@ -181,13 +223,21 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
         animatedObjects.insert(std::end(animatedObjects), std::begin(batchObjectsPair.second), std::end(batchObjectsPair.second));
     }
 
-    // TODO:
-    // better solution for calculating ssbo size than iterating over models and meshes twice
-    uint32_t instanceCount = 0;
+    // NOTE:
+    // The benchmark measures the load order first and applies the morton order itself
+    if (settings->mortonOrder && settings->benchmarkFrames == 0) {
+        mortonReorder();
+    }
+
+    for (uint32_t objectIndex = 0; objectIndex < objects.size(); ++objectIndex) {
+        objects[objectIndex]->objectIndex = objectIndex;
+    }
+    instanceSlots.resize(ssboBuffers->uniqueInstanceID);
+    staticObjectCount = objects.size() - extraObjectCount;
+
     for (std::pair<std::string, std::shared_ptr<VulkanModel>> model : models) {
         for (std::pair<int, std::shared_ptr<VulkanMesh>> meshPair : model.second->meshIDMap) {
             std::shared_ptr<VulkanMesh> mesh = meshPair.second;
-            instanceCount += mesh->instanceIDs.size() * mesh->primitives.size();
             // NOTE:
             // Uploading materials after material buffer has been generated
             // Material buffer needs to have a size in order to be generated
@@ -198,54 +248,112 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
         }
     }
 
-    ssboBuffers->createInstanceBuffers(instanceCount);
+    if (settings->lodCount > 1) {
+        auto lodStartTime = std::chrono::high_resolution_clock::now();
+        std::vector<VulkanMesh::Primitive*> primitives;
+        for (std::pair<std::string, std::shared_ptr<VulkanModel>> modelPair : models) {
+            for (std::pair<int, std::shared_ptr<VulkanMesh>> meshPair : modelPair.second->meshIDMap) {
+                for (std::shared_ptr<VulkanMesh::Primitive> primitive : meshPair.second->primitives) {
+                    primitives.push_back(primitive.get());
+                }
+            }
+        }
+        std::for_each(std::execution::par, primitives.begin(), primitives.end(),
+                      [this](VulkanMesh::Primitive* primitive) { primitive->generateLods(settings->lodCount); });
+        auto lodEndTime = std::chrono::high_resolution_clock::now();
+        std::cout << "Generated LODs in "
+                  << std::chrono::duration<float, std::chrono::milliseconds::period>(lodEndTime - lodStartTime).count() << "ms"
+                  << std::endl;
+    }
 
     for (std::pair<std::string, std::shared_ptr<VulkanModel>> modelPair : models) {
         std::shared_ptr<VulkanModel> model = modelPair.second;
         for (std::pair<int, std::shared_ptr<VulkanMesh>> meshPair : model->meshIDMap) {
             std::shared_ptr<VulkanMesh> mesh = meshPair.second;
             for (std::shared_ptr<VulkanMesh::Primitive> primitive : mesh->primitives) {
-                // increase size of indirect draws
-                indirectDraws.resize(indirectDraws.size() + 1);
+                // the LODs share the vertices of the primitive
+                int32_t vertexOffset = vertices.size();
+                vertices.insert(std::end(vertices), std::begin(primitive->vertices), std::end(primitive->vertices));
 
-                // copy indirect draw data from primitive
-                indirectDraws.back().indexCount = primitive->indices.size();
-                indirectDraws.back().instanceCount = mesh->instanceIDs.size();
+                // NOTE:
+                // One draw per LOD, every LOD draw gets its own slot range with all instances of the mesh
+                // and the cull pass only keeps an instance in the range of the LOD it picks
+                uint32_t lodCount = primitive->lodIndices.size() + 1;
+                for (uint32_t lod = 0; lod < lodCount; ++lod) {
+                    const std::vector<uint32_t>& lodIndices = lod == 0 ? primitive->indices : primitive->lodIndices[lod - 1];
+                    meshDraws[mesh.get()].push_back(indirectDraws.size());
+                    drawMeshes.push_back(mesh.get());
+                    drawMaterials.push_back(primitive->materialIndex);
+                    drawLods.push_back(lod | lodCount << 16);
 
-                // set indices and vertices
-                indirectDraws.back().firstIndex = indices.size();
-                indices.insert(std::end(indices), std::begin(primitive->indices), std::end(primitive->indices));
+                    // increase size of indirect draws
+                    indirectDraws.resize(indirectDraws.size() + 1);
 
-                indirectDraws.back().vertexOffset = vertices.size();
-                vertices.insert(std::end(vertices), std::begin(primitive->vertices), std::end(primitive->vertices));
+                    // copy indirect draw data from primitive
+                    indirectDraws.back().indexCount = lodIndices.size();
 
-                // set first instance
-                indirectDraws.back().firstInstance = _totalInstanceCount;
+                    // set indices
+                    indirectDraws.back().firstIndex = indices.size();
+                    indices.insert(std::end(indices), std::begin(lodIndices), std::end(lodIndices));
 
-                ssboBuffers->materialIndicesMapped[indirectDraws.back().firstInstance] = primitive->materialIndex;
-                // TODO
-                // IDs are now contiguous within a mesh, so this can be optimized
-                for (uint32_t i = 0; i < mesh->instanceIDs.size(); ++i) {
-                    ssboBuffers->instanceIndicesMapped[_totalInstanceCount + i] = mesh->instanceIDs[i];
+                    indirectDraws.back().vertexOffset = vertexOffset;
                 }
-                _totalInstanceCount += mesh->instanceIDs.size();
+            }
+            for (uint32_t slot = 0; slot < mesh->instanceIDs.size(); ++slot) {
+                instanceSlots[mesh->instanceIDs[slot]] = slot;
             }
         }
     }
+    drawCapacities.resize(indirectDraws.size());
+    drawMeshletCounts.resize(indirectDraws.size(), 0);
+    if (meshletCulling) {
+        buildMeshlets();
+    }
 
     // NOTE:
-    // sorting indirect draws by firstInstance so that the draw cull pass can get the culled instance count from the prefix sum and
+    // layoutDraws assigns instance ranges in draw order,
+    // so indirect draws are sorted by firstInstance and the draw cull pass can get the culled instance count from the prefix sum and
     // the previous draw
-    std::sort(indirectDraws.begin(), indirectDraws.end(),
-              [](VkDrawIndexedIndirectCommand a, VkDrawIndexedIndirectCommand b) { return a.firstInstance < b.firstInstance; });
+    layoutDraws();
+    ssboBuffers->createInstanceBuffers(ssboBuffers->uniqueInstanceID, _totalInstanceCount);
+    drawCommandsBuffer = std::make_shared<DirtyRangeBuffer>(device, indirectDraws.size(), sizeof(VkDrawIndexedIndirectCommand),
+                                                            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+    writeSlots();
+    if (meshletCulling) {
+        writeMeshletDraws();
+    }
 
     std::for_each(std::execution::par_unseq, objects.begin(), objects.end(),
                   [this](auto&& object) { object->updateModelMatrix(ssboBuffers); });
+    // every instance was just written, upload the whole buffer instead of sorting every index
+    ssboBuffers->ssboBuffer()->markAllDirty();
+    ssboBuffers->cullBuffer()->markAllDirty();
 
+    visibilityBuffer = settings->visibilityBuffer && !hostCulling;
+    if (visibilityBuffer) {
+        visibilityPushConstants.triangleBits = visibilityTriangleBits();
+        visibilityPushConstants.drawCount = indirectDraws.size();
+        // NOTE:
+        // The resolve reads the IDs with texelFetch, one per pixel
+        if (device->getMsaaSamples() != VK_SAMPLE_COUNT_1_BIT) {
+            std::cout << "Visibility buffer needs MSAA disabled, shading forward" << std::endl;
+            visibilityBuffer = false;
+        } else if (!fitsVisibilityIDs(_totalInstanceCount)) {
+            std::cout << "Visibility buffer IDs can't hold " << _totalInstanceCount << " instances with "
+                      << visibilityPushConstants.triangleBits << " triangle bits, shading forward" << std::endl;
+            visibilityBuffer = false;
+        }
+    }
+    // the resolve fetches the vertices of the visible triangles itself
+    VkBufferUsageFlags geometryUsage = visibilityBuffer ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : 0;
     vertexBuffer = VulkanBuffer::StagedBuffer(device, (void*)vertices.data(), sizeof(vertices[0]) * vertices.size(),
-                                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    indexBuffer =
-        VulkanBuffer::StagedBuffer(device, (void*)indices.data(), sizeof(indices[0]) * indices.size(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+                                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | geometryUsage);
+    indexBuffer = VulkanBuffer::StagedBuffer(device, (void*)indices.data(), sizeof(indices[0]) * indices.size(),
+                                             VK_BUFFER_USAGE_INDEX_BUFFER_BIT | geometryUsage);
+    if (visibilityBuffer) {
+        rg->buffer("Vertices", vertexBuffer);
+        rg->buffer("Indices", indexBuffer);
+    }
 
     // Get unique samplers and load into continuous vector
     samplerInfos.resize(ssboBuffers->uniqueSamplersMap.size());
@@ -270,25 +378,22 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
         aoMapInfos[it->second] = reinterpret_cast<VulkanImage*>(it->first)->imageInfo;
     }
 
-    rg->buffer("DrawCommands", indirectDraws, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
-        .buffer("CulledMaterialIndices", ssboBuffers->culledMaterialIndicesBuffer())
-        .buffer("MaterialIndices", ssboBuffers->materialIndicesBuffer())
-        .buffer("CulledDrawCommands", indirectDraws.size(), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, 0)
-        .buffer("CulledDrawIndirectCount", 1, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, 0)
-        .buffer("CulledInstanceIndices", _totalInstanceCount)
-        .buffer("Globals", 1)
-        .buffer("Materials", ssboBuffers->materialBuffer())
-        .buffer("Instances", ssboBuffers->instanceIndicesBuffer())
-        .buffer("Objects", ssboBuffers->ssboBuffer())
-        .buffer("PrefixSum", _totalInstanceCount)
-        .buffer("PartialSums", getGroupCount(_totalInstanceCount, device->maxComputeWorkGroupInvocations()),
-                VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
-        // NOTE:
-        // / 32 because ballot returns a uvec4, each uint in the vector is 32 bits long
-        // adding 32 - 1 ensures correct rounding
-        .buffer("ActiveLanes", (_totalInstanceCount + (32 - 1)) / 32);
+    // NOTE:
+    // Instances, MaterialIndices, SlotLods and CullData are only read by the cull passes,
+    // they are registered either way so relayout and spawn can resize them
+    globalsBuffer = rg->transientBuffer("Globals", sizeof(UniformBufferObject));
+    cullGlobalsBuffer = rg->transientBuffer("CullGlobals", sizeof(CullGlobals));
+    rg->buffer("Materials", ssboBuffers->materialBuffer());
+    graphBuffers.objects = rg->buffer("Objects", ssboBuffers->ssboBuffer());
+    graphBuffers.instances = rg->buffer("Instances", ssboBuffers->instanceIndicesBuffer());
+    graphBuffers.materialIndices = rg->buffer("MaterialIndices", ssboBuffers->materialIndicesBuffer());
+    graphBuffers.slotLods = rg->buffer("SlotLods", ssboBuffers->slotLodsBuffer());
+    graphBuffers.cullData = rg->buffer("CullData", ssboBuffers->cullBuffer());
 
-    computePushConstants.totalInstanceCount = _totalInstanceCount;
+    cullGlobals.totalInstanceCount = _totalInstanceCount;
+    slotBufferCount = _totalInstanceCount;
+    drawCount = indirectDraws.size();
+    updateMaxCulledDrawCount();
 
     const uint32_t queryCount = 4;
     VkQueryPoolCreateInfo queryPoolInfo{};
@@ -299,28 +404,165 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
     vkCreateQueryPool(device->device(), &queryPoolInfo, nullptr, &queryPool);
     vkResetQueryPool(device->device(), queryPool, 0, queryCount);
 
-    rg->queryReset(queryPool, 0, queryCount);
+    // NOTE:
+    // The early occlusion pass reads the depth pyramid, images are exclusive to the graphics queue family so it stays there
+    if (!hostCulling && !occlusionCulling) {
+        rg->beginAsyncCompute();
+    }
+    // the timestamps of the cull, the draw timestamps are reset on the queue that writes them
+    rg->queryReset(queryPool, 0, 2);
 
-    VulkanRenderGraph::ShaderOptions shaderOptions{};
-    shaderOptions.pushConstantData = &computePushConstants;
+    rg->imageInfos("samplers", &samplerInfos);
+    rg->imageInfos("images", &imageInfos);
+    rg->imageInfos("normals", &normalMapInfos);
+    rg->imageInfos("metallicRoughnesses", &metallicRoughnessMapInfos);
+    rg->imageInfos("aos", &aoMapInfos);
 
-    specData.local_size_x = device->maxComputeWorkGroupInvocations();
+    // NOTE:
+    // Both end with the draws, between timestamps 2 and 3
+    if (hostCulling) {
+        createHostCullOps();
+    } else {
+        createCullPasses();
+    }
+    if (settings->validateSortFrames > 0) {
+        // host visible so validateSort can write the input and read back the result
+        VkMemoryPropertyFlags hostProperties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        graphBuffers.sortValidationKeys = rg->buffer("SortValidationKeys", sortValidationCapacity, 0, hostProperties);
+        graphBuffers.sortValidationValues = rg->buffer("SortValidationValues", sortValidationCapacity, 0, hostProperties);
+        rg->sort(graphBuffers.sortValidationKeys, graphBuffers.sortValidationValues, &sortValidationCount);
+        rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_HOST_READ_BIT,
+                          VK_PIPELINE_STAGE_2_HOST_BIT);
+    }
+    rg->compile();
+    if (settings->validateSortFrames > 0) {
+        sortValidationRandom.seed(time(NULL));
+        writeSortValidationInput();
+    }
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    std::cout << "Loaded " << objects.size() << " objects in "
+              << std::chrono::duration<float, std::chrono::milliseconds::period>(endTime - startTime).count() << "ms" << std::endl;
+}
+
+void VulkanObjects::createCullPasses() {
+    // The cull results are read back on the host when validating
+    VkMemoryPropertyFlags readbackProperties =
+        settings->validateCullingFrames > 0 ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT : 0;
+    graphBuffers.drawCommands = rg->buffer("DrawCommands", drawCommandsBuffer);
+    graphBuffers.culledMaterialIndices = rg->buffer("CulledMaterialIndices", _totalInstanceCount);
+    graphBuffers.culledDrawCommands =
+        rg->buffer("CulledDrawCommands", maxCulledDrawCount, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, readbackProperties);
+    graphBuffers.culledDrawTriangleOffsets = rg->scratchBuffer("CulledDrawTriangleOffsets", maxCulledDrawCount);
+    graphBuffers.culledDrawIndirectCount = rg->buffer(
+        "CulledDrawIndirectCount", 1, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, readbackProperties);
+    uint32_t drawScanStateCount = getGroupCount(indirectDraws.size(), device->scanWorkGroupSize()) + 1;
+    graphBuffers.drawScanStates = rg->scratchBuffer("DrawScanStates", drawScanStateCount, VK_BUFFER_USAGE_TRANSFER_DST_BIT, 0);
+    graphBuffers.culledInstanceIndices = rg->buffer("CulledInstanceIndices", _totalInstanceCount, 0, readbackProperties);
+    rg->buffer("MeshBounds", meshBounds, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    graphBuffers.prefixSum = rg->scratchBuffer("PrefixSum", _totalInstanceCount, 0, readbackProperties);
+    // one ticket counter and one state per workgroup
+    graphBuffers.scanStates =
+        rg->scratchBuffer("ScanStates", getGroupCount(_totalInstanceCount, device->scanWorkGroupSize()) + 1,
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT, 0);
+
+    if (occlusionCulling) {
+        // one flag per slot, whether the instance was visible last frame
+        // NOTE:
+        // Never cleared, stale flags only cost a frame of overdraw or a late draw
+        graphBuffers.visibilityHistory = rg->buffer("VisibilityHistory", _totalInstanceCount);
+    }
+    if (meshletCulling) {
+        rg->buffer("Meshlets", meshlets, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+        graphBuffers.meshletDraws = rg->buffer("MeshletDraws", meshletDrawsBuffer);
+        graphBuffers.meshletScanStates =
+            rg->scratchBuffer("MeshletScanStates", meshletGroupCount + 1, VK_BUFFER_USAGE_TRANSFER_DST_BIT, 0);
+    }
+
+    specData.local_size_x = device->scanWorkGroupSize();
     specData.subgroup_size = device->maxSubgroupSize();
-    shaderOptions.specData = &specData;
+
+    // ensure previous frame reads of Objects and the scan states completed before overwriting them
+    // NOTE:
+    // The visibility buffer resolve reads the objects and draws in the fragment shader
+    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT |
+                          VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                      VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+    rg->upload(graphBuffers.objects);
+    rg->upload(graphBuffers.cullData);
+    rg->upload(graphBuffers.instances);
+    rg->upload(graphBuffers.materialIndices);
+    rg->upload(graphBuffers.slotLods);
+    rg->upload(graphBuffers.drawCommands);
+    if (meshletCulling) {
+        rg->upload(graphBuffers.meshletDraws);
+    }
+    // resets the workgroup tickets and the look-back states
+    rg->setBuffer(graphBuffers.scanStates, 0);
+    rg->memoryBarrier(VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                      VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT |
+                          VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT);
 
     rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 0);
-    // ensure previous frame vertex read completed before writing
-    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
-    rg->shader("cull_frustum_pass.comp", getGroupCount(computePushConstants.totalInstanceCount, device->maxComputeWorkGroupInvocations()),
-               1, 1, shaderOptions);
-    // wait until the frustum culling is done
-    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
-                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+    addCullPass(occlusionCulling ? "cull_early_pass.comp" : "cull_frustum_pass.comp");
+    rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 1);
+    if (!occlusionCulling) {
+        rg->endAsyncCompute();
+    }
+
+    // wait until culling is completed
+    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                      VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT);
+
+    rg->queryReset(queryPool, 2, 2);
+    rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 2);
+    if (!occlusionCulling) {
+        drawCulled(VulkanRenderGraph::RenderingOptions{});
+        rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 3);
+        return;
+    }
+
+    // NOTE:
+    // Two phase occlusion culling
+    // The early pass draws the instances that were visible last frame and are still in the frustum,
+    // their depth is reduced into a pyramid and the late pass draws the rest of the frustum that isn't behind it
+    // Both phases compact into the same buffers, so the draw is the same and the timestamps 2 and 3 cover both phases
+    VulkanRenderGraph::RenderingOptions earlyOptions{};
+    earlyOptions.lastPass = false;
+    drawCulled(earlyOptions);
+
+    rg->depthPyramid("depth_reduce.comp");
 
-    rg->shader("reduce_prefix_sum.comp", getGroupCount(computePushConstants.totalInstanceCount, device->maxComputeWorkGroupInvocations()),
-               1, 1, shaderOptions);
-    // wait until finished
+    // the late pass overwrites the cull outputs the early draw and resolve read
+    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT,
+                      VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT |
+                          VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+                      VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+    rg->setBuffer(graphBuffers.scanStates, 0);
+    rg->memoryBarrier(VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                      VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+    addCullPass("cull_late_pass.comp");
+    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                      VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT);
+
+    VulkanRenderGraph::RenderingOptions lateOptions{};
+    lateOptions.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    drawCulled(lateOptions);
+    rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 3);
+}
+
+void VulkanObjects::addCullPass(std::string cullShader) {
+    VulkanRenderGraph::ShaderOptions shaderOptions{};
+    shaderOptions.specData = &specData;
+
+    // ensure previous frame vertex and resolve reads completed before writing
+    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                      VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+    // culls, scans and compacts the visible instances in a single pass
+    rg->shader(cullShader, &frustumGroupCount, &oneGroup, &oneGroup, shaderOptions);
+    // wait until the frustum culling is done
     rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
                       VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
 
@@ -328,49 +570,623 @@ VulkanObjects::VulkanObjects(std::shared_ptr<VulkanDevice> device, VulkanRenderG
     rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
                       VK_PIPELINE_STAGE_2_TRANSFER_BIT);
 
-    rg->setBuffer("CulledDrawIndirectCount", 0);
+    rg->setBuffer(graphBuffers.culledDrawIndirectCount, 0);
+    rg->setBuffer(graphBuffers.drawScanStates, 0);
+    if (meshletCulling) {
+        rg->setBuffer(graphBuffers.meshletScanStates, 0);
+    }
 
-    drawCount = indirectDraws.size();
     shaderOptions.pushConstantData = &drawCount;
-    // barrier until the CulledDrawIndirectCount buffer has been cleared
-    rg->memoryBarrier(VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
-                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+    // barrier until the CulledDrawIndirectCount and the scan states have been cleared
+    rg->memoryBarrier(VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                      VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
 
-    rg->shader("cull_draw_pass.comp", getGroupCount(drawCount, device->maxComputeWorkGroupInvocations()), 1, 1, shaderOptions);
-    rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 1);
+    rg->shader("cull_draw_pass.comp", getGroupCount(drawCount, device->scanWorkGroupSize()), 1, 1, shaderOptions);
+    if (!meshletCulling) {
+        return;
+    }
 
-    // wait until culling is completed
+    // the meshlet pass appends to the compacted draws after the count of the draw pass and reads the prefix sum
     rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-                      VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT);
+                      VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+    shaderOptions.pushConstantData = VK_NULL_HANDLE;
+    // the late pass only sees the instances the early draw didn't cover, so their meshlets can be tested against its depth too
+    std::string meshletShader = cullShader == "cull_late_pass.comp" ? "cull_meshlet_late_pass.comp" : "cull_meshlet_pass.comp";
+    rg->shader(meshletShader, &meshletGroupCount, &oneGroup, &oneGroup, shaderOptions);
+}
 
+void VulkanObjects::drawCulled(VulkanRenderGraph::RenderingOptions renderingOptions) {
     VulkanRenderGraph::ShaderOptions vertOptions{};
     VulkanRenderGraph::ShaderOptions fragOptions{};
+    if (visibilityBuffer) {
+        // NOTE:
+        // The IDs are cleared every phase and the depth follows the load op, the resolve loads the depth and only
+        // overwrites the pixels this phase drew so the late occlusion phase keeps the early pixels
+        // The resolve already shades every pixel once, so the depth prepass is skipped
+        VulkanRenderGraph::RenderingOptions geometryOptions = renderingOptions;
+        geometryOptions.visibilityBuffer = true;
+        geometryOptions.lastPass = false;
+        vertOptions.pushConstantData = &visibilityPushConstants;
+        rg->shader("visibility.vert", "visibility.frag", vertOptions, fragOptions, vertexBuffer, indexBuffer, geometryOptions);
+        rg->drawIndirect(graphBuffers.culledDrawCommands, 0, graphBuffers.culledDrawIndirectCount, 0, &maxCulledDrawCount,
+                         sizeof(indirectDraws[0]));
 
-    rg->shader("triangle.vert", "triangle.frag", vertOptions, fragOptions, vertexBuffer, indexBuffer);
+        fragOptions.pushConstantData = &visibilityPushConstants;
+        rg->resolve("visibility_resolve.vert", "visibility_resolve.frag", fragOptions, renderingOptions);
+        return;
+    }
+    if (settings->depthPrepass) {
+        // NOTE:
+        // The prepass takes over the load op, the shading pass loads its depth and only passes the nearest fragment
+        // Both vertex shaders declare gl_Position invariant so the depths match exactly
+        VulkanRenderGraph::RenderingOptions prepassOptions = renderingOptions;
+        prepassOptions.lastPass = false;
+        rg->shader("depth_prepass.vert", vertOptions, vertexBuffer, indexBuffer, prepassOptions);
+        rg->drawIndirect(graphBuffers.culledDrawCommands, 0, graphBuffers.culledDrawIndirectCount, 0, &maxCulledDrawCount,
+                         sizeof(indirectDraws[0]));
 
-    rg->imageInfos("samplers", &samplerInfos);
-    rg->imageInfos("images", &imageInfos);
-    rg->imageInfos("normals", &normalMapInfos);
-    rg->imageInfos("metallicRoughnesses", &metallicRoughnessMapInfos);
-    rg->imageInfos("aos", &aoMapInfos);
+        renderingOptions.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+        renderingOptions.depthCompareOp = VK_COMPARE_OP_EQUAL;
+        renderingOptions.depthWrite = false;
+    }
+    rg->shader("triangle.vert", "triangle.frag", vertOptions, fragOptions, vertexBuffer, indexBuffer, renderingOptions);
+    rg->drawIndirect(graphBuffers.culledDrawCommands, 0, graphBuffers.culledDrawIndirectCount, 0, &maxCulledDrawCount,
+                     sizeof(indirectDraws[0]));
+}
+
+void VulkanObjects::buildMeshlets() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    std::vector<glm::vec3> positions;
+    for (uint32_t drawIndex = 0; drawIndex < indirectDraws.size(); ++drawIndex) {
+        VkDrawIndexedIndirectCommand& draw = indirectDraws[drawIndex];
+        // a single meshlet wouldn't cull anything the instance test doesn't
+        if (draw.indexCount <= MeshletBuilder::maxTriangles * 3) {
+            continue;
+        }
+        // the draw's indices are relative to vertexOffset, the positions are gathered so the meshlets can use them directly
+        const uint32_t* drawIndices = indices.data() + draw.firstIndex;
+        uint32_t vertexCount = *std::max_element(drawIndices, drawIndices + draw.indexCount) + 1;
+        positions.resize(vertexCount);
+        for (uint32_t vertex = 0; vertex < vertexCount; ++vertex) {
+            positions[vertex] = vertices[draw.vertexOffset + vertex].pos;
+        }
+        uint32_t firstMeshlet = meshlets.size();
+        MeshletBuilder::build(positions, drawIndices, draw.indexCount, draw.firstIndex, drawIndex, meshlets);
+        drawMeshletCounts[drawIndex] = meshlets.size() - firstMeshlet;
+        meshletDraws.push_back({0, firstMeshlet, drawMeshletCounts[drawIndex], drawIndex});
+        // NOTE:
+        // The draw keeps its instances and slots for the instance cull, cull_draw_pass.comp skips it without indices
+        draw.indexCount = 0;
+    }
+    // no primitive is large enough, the meshlet pass would have nothing to do
+    if (meshlets.empty()) {
+        meshletCulling = false;
+    } else {
+        // firstItem is written by writeMeshletDraws once the draws have their capacities
+        meshletDrawsBuffer = std::make_shared<DirtyRangeBuffer>(device, meshletDraws.size(), sizeof(MeshletDraw), 0);
+        cullGlobals.meshletDrawCount = meshletDraws.size();
+    }
+    auto endTime = std::chrono::high_resolution_clock::now();
+    std::cout << "Built " << meshlets.size() << " meshlets in "
+              << std::chrono::duration<float, std::chrono::milliseconds::period>(endTime - startTime).count() << "ms" << std::endl;
+}
+
+uint32_t VulkanObjects::visibilityTriangleBits() {
+    uint32_t maxTriangles = 1;
+    for (const VkDrawIndexedIndirectCommand& draw : indirectDraws) {
+        maxTriangles = std::max(maxTriangles, draw.indexCount / 3);
+    }
+    for (const Meshlet& meshlet : meshlets) {
+        uint32_t drawFirstIndex = indirectDraws[meshlet.drawIndex].firstIndex;
+        maxTriangles = std::max(maxTriangles, (meshlet.firstIndex + meshlet.indexCount - drawFirstIndex) / 3);
+    }
+    uint32_t bits = 1;
+    while (bits < 32 && (1u << bits) < maxTriangles) {
+        ++bits;
+    }
+    return bits;
+}
+
+void VulkanObjects::writeMeshletDraws() {
+    uint32_t itemCount = 0;
+    for (MeshletDraw& meshletDraw : meshletDraws) {
+        meshletDraw.firstItem = itemCount;
+        itemCount += meshletDraw.meshletCount * drawCapacities[meshletDraw.drawIndex];
+    }
+    std::copy(meshletDraws.begin(), meshletDraws.end(), meshletDrawsBuffer->data<MeshletDraw>());
+    meshletDrawsBuffer->markAllDirty();
+    cullGlobals.meshletItemCount = itemCount;
+    meshletGroupCount = getGroupCount(itemCount, device->scanWorkGroupSize());
+}
 
+void VulkanObjects::updateMaxCulledDrawCount() {
+    culledDrawBound = 0;
+    for (uint32_t drawIndex = 0; drawIndex < indirectDraws.size(); ++drawIndex) {
+        // NOTE:
+        // a split draw has no indices of its own, only its meshlets are drawn
+        culledDrawBound += drawMeshletCounts[drawIndex] == 0 ? 1 : drawMeshletCounts[drawIndex] * indirectDraws[drawIndex].instanceCount;
+    }
+    growCulledDraws();
+}
+
+void VulkanObjects::growCulledDraws() {
+    if (culledDrawBound <= maxCulledDrawCount) {
+        return;
+    }
+    bool created = maxCulledDrawCount != 0;
+    // slack like the instance slots, so spawning doesn't resize for every new instance
+    // CpuCull sizes its culled draws by the draw count, which never changes without meshlets
+    maxCulledDrawCount = meshletCulling ? culledDrawBound + culledDrawBound / slotSlackDivisor : culledDrawBound;
+    if (created) {
+        rg->resizeBuffer(graphBuffers.culledDrawCommands, maxCulledDrawCount);
+        rg->resizeBuffer(graphBuffers.culledDrawTriangleOffsets, maxCulledDrawCount);
+    }
+}
+
+void VulkanObjects::createHostCullOps() {
+    // CpuCull writes the culled buffers, they are uploaded through the per frame staging buffers like the instance data
+    culledInstanceIndicesBuffer = std::make_shared<DirtyRangeBuffer>(device, slotBufferCount, sizeof(uint32_t), 0);
+    culledMaterialIndicesBuffer = std::make_shared<DirtyRangeBuffer>(device, slotBufferCount, sizeof(uint32_t), 0);
+    culledDrawCommandsBuffer =
+        std::make_shared<DirtyRangeBuffer>(device, drawCount, sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+    culledDrawCountBuffer = std::make_shared<DirtyRangeBuffer>(device, 1, sizeof(uint32_t), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+    graphBuffers.culledInstanceIndices = rg->buffer("CulledInstanceIndices", culledInstanceIndicesBuffer);
+    graphBuffers.culledMaterialIndices = rg->buffer("CulledMaterialIndices", culledMaterialIndicesBuffer);
+    graphBuffers.culledDrawCommands = rg->buffer("CulledDrawCommands", culledDrawCommandsBuffer);
+    graphBuffers.culledDrawIndirectCount = rg->buffer("CulledDrawIndirectCount", culledDrawCountBuffer);
+
+    // ensure previous frame reads completed before overwriting the dirty ranges
+    rg->memoryBarrier(VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT,
+                      VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+    // NOTE:
+    // The copies run in the upload command buffer before the frame, the timestamps are only kept for the query readback
+    rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 0);
+    rg->upload(graphBuffers.objects);
+    rg->upload(graphBuffers.culledInstanceIndices);
+    rg->upload(graphBuffers.culledMaterialIndices);
+    rg->upload(graphBuffers.culledDrawCommands);
+    rg->upload(graphBuffers.culledDrawIndirectCount);
+    rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 1);
+    rg->memoryBarrier(VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                      VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT);
+
+    rg->queryReset(queryPool, 2, 2);
     rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 2);
-    rg->drawIndirect("CulledDrawCommands", 0, "CulledDrawIndirectCount", 0, indirectDraws.size(), sizeof(indirectDraws[0]));
+    drawCulled(VulkanRenderGraph::RenderingOptions{});
     rg->timestamp(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, 3);
-    rg->compile();
+}
+
+void VulkanObjects::cullOnHost() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    CpuCull::Input input{};
+    input.instances = ssboBuffers->instanceIndicesMapped;
+    input.instanceCount = _totalInstanceCount;
+    input.cullData = ssboBuffers->cullMapped;
+    input.objects = ssboBuffers->ssboMapped;
+    input.meshBounds = meshBounds.data();
+    input.materialIndices = ssboBuffers->materialIndicesMapped;
+    input.slotLods = ssboBuffers->slotLodsMapped;
+    input.draws = indirectDraws.data();
+    input.drawCount = drawCount;
+
+    hostPrefixSum.resize(_totalInstanceCount);
+    CpuCull::Output output{};
+    output.prefixSum = hostPrefixSum.data();
+    output.culledInstanceIndices = culledInstanceIndicesBuffer->data<uint32_t>();
+    output.culledMaterialIndices = culledMaterialIndicesBuffer->data<uint32_t>();
+    output.culledDraws = culledDrawCommandsBuffer->data<VkDrawIndexedIndirectCommand>();
+    output.culledDrawCount = culledDrawCountBuffer->data<uint32_t>();
+    cpuCull.cull(cullGlobals, input, output);
+
+    // Only the compacted front of each buffer is read by the draws
+    uint32_t visibleCount = _totalInstanceCount > 0 ? hostPrefixSum.back() : 0;
+    culledInstanceIndicesBuffer->markRangeDirty(0, visibleCount);
+    culledMaterialIndicesBuffer->markRangeDirty(0, visibleCount);
+    culledDrawCommandsBuffer->markRangeDirty(0, *output.culledDrawCount);
+    culledDrawCountBuffer->markDirty(0);
 
     auto endTime = std::chrono::high_resolution_clock::now();
-    std::cout << "Loaded " << objects.size() << " objects in "
-              << std::chrono::duration<float, std::chrono::milliseconds::period>(endTime - startTime).count() << "ms" << std::endl;
+    hostCullTime = std::chrono::duration<float, std::chrono::milliseconds::period>(endTime - startTime).count();
+}
+
+void VulkanObjects::mortonReorder() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    std::unordered_map<VulkanModel*, std::vector<VulkanObject*>> modelObjects;
+    for (VulkanObject* object : objects) {
+        modelObjects[object->model.get()].push_back(object);
+    }
+    for (auto& modelObjectsPair : modelObjects) {
+        VulkanModel* model = modelObjectsPair.first;
+        std::vector<VulkanObject*>& sameModelObjects = modelObjectsPair.second;
+        if (sameModelObjects.size() < 2) {
+            continue;
+        }
+
+        AABB bounds;
+        for (VulkanObject* object : sameModelObjects) {
+            bounds.update(object->position());
+        }
+        glm::vec3 extent = glm::max(bounds.max() - bounds.min(), glm::vec3(std::numeric_limits<float>::epsilon()));
+
+        std::vector<std::pair<uint32_t, VulkanObject*>> codes(sameModelObjects.size());
+        std::vector<uint32_t> firstInstanceIDs(sameModelObjects.size());
+        for (size_t i = 0; i < sameModelObjects.size(); ++i) {
+            codes[i] = {mortonCode((sameModelObjects[i]->position() - bounds.min()) / extent), sameModelObjects[i]};
+            firstInstanceIDs[i] = sameModelObjects[i]->firstInstanceID;
+        }
+        std::sort(std::execution::par_unseq, codes.begin(), codes.end(),
+                  [](auto const& a, auto const& b) { return a.first < b.first; });
+        std::sort(firstInstanceIDs.begin(), firstInstanceIDs.end());
+
+        // NOTE:
+        // Handing out the model's id blocks in morton order makes the Objects buffer spatially ordered,
+        // and re-adding the instances in the same order keeps every draw range sorted by instance id
+        for (auto& meshPair : model->meshIDMap) {
+            meshPair.second->instanceIDs.clear();
+        }
+        for (size_t i = 0; i < codes.size(); ++i) {
+            codes[i].second->firstInstanceID = firstInstanceIDs[i];
+            model->addInstance(firstInstanceIDs[i], ssboBuffers);
+        }
+    }
+    auto endTime = std::chrono::high_resolution_clock::now();
+    std::cout << "Morton reorder took " << std::chrono::duration<float, std::chrono::milliseconds::period>(endTime - startTime).count()
+              << "ms" << std::endl;
+}
+
+void VulkanObjects::applyMortonOrder() {
+    mortonReorder();
+    // the objects got other instance IDs, so every model matrix is written again
+    std::for_each(std::execution::par_unseq, objects.begin(), objects.end(), [this](auto&& object) {
+        object->invalidateBuffer();
+        object->updateModelMatrix(ssboBuffers);
+    });
+    ssboBuffers->ssboBuffer()->markAllDirty();
+    ssboBuffers->cullBuffer()->markAllDirty();
+    for (auto& meshDrawsPair : meshDraws) {
+        VulkanMesh* mesh = meshDrawsPair.first;
+        for (uint32_t slot = 0; slot < mesh->instanceIDs.size(); ++slot) {
+            instanceSlots[mesh->instanceIDs[slot]] = slot;
+        }
+    }
+    relayout();
+}
+
+void VulkanObjects::layoutDraws() {
+    _totalInstanceCount = 0;
+    for (uint32_t drawIndex = 0; drawIndex < indirectDraws.size(); ++drawIndex) {
+        uint32_t instanceCount = drawMeshes[drawIndex]->instanceIDs.size();
+        // NOTE:
+        // slack lets instances be spawned without moving every range after this one
+        drawCapacities[drawIndex] = instanceCount + std::max(instanceCount / slotSlackDivisor, minSlotSlack);
+        indirectDraws[drawIndex].instanceCount = instanceCount;
+        indirectDraws[drawIndex].firstInstance = _totalInstanceCount;
+        _totalInstanceCount += drawCapacities[drawIndex];
+    }
+}
+
+void VulkanObjects::writeSlots() {
+    for (uint32_t drawIndex = 0; drawIndex < indirectDraws.size(); ++drawIndex) {
+        VulkanMesh* mesh = drawMeshes[drawIndex];
+        uint32_t firstInstance = indirectDraws[drawIndex].firstInstance;
+        ssboBuffers->materialIndicesMapped[firstInstance] = drawMaterials[drawIndex];
+        std::fill(ssboBuffers->slotLodsMapped + firstInstance, ssboBuffers->slotLodsMapped + firstInstance + drawCapacities[drawIndex],
+                  drawLods[drawIndex]);
+        std::copy(mesh->instanceIDs.begin(), mesh->instanceIDs.end(), ssboBuffers->instanceIndicesMapped + firstInstance);
+        std::fill(ssboBuffers->instanceIndicesMapped + firstInstance + mesh->instanceIDs.size(),
+                  ssboBuffers->instanceIndicesMapped + firstInstance + drawCapacities[drawIndex], SSBOBuffers::invalidInstance);
+    }
+    std::copy(indirectDraws.begin(), indirectDraws.end(), drawCommandsBuffer->data<VkDrawIndexedIndirectCommand>());
+    ssboBuffers->instanceIndicesBuffer()->markAllDirty();
+    ssboBuffers->materialIndicesBuffer()->markAllDirty();
+    ssboBuffers->slotLodsBuffer()->markAllDirty();
+    drawCommandsBuffer->markAllDirty();
+}
+
+void VulkanObjects::relayout() {
+    // the culled instance indices go up to the instance count
+    if (visibilityBuffer && !fitsVisibilityIDs(_totalInstanceCount)) {
+        throw std::runtime_error("relayout: the visibility buffer IDs can't hold " + std::to_string(_totalInstanceCount) +
+                                 " instances with " + std::to_string(visibilityPushConstants.triangleBits) + " triangle bits");
+    }
+    layoutDraws();
+    if (_totalInstanceCount > slotBufferCount) {
+        slotBufferCount = std::max<uint32_t>(_totalInstanceCount, slotBufferCount * 2);
+        rg->resizeBuffer(graphBuffers.instances, slotBufferCount);
+        rg->resizeBuffer(graphBuffers.materialIndices, slotBufferCount);
+        rg->resizeBuffer(graphBuffers.slotLods, slotBufferCount);
+        rg->resizeBuffer(graphBuffers.culledMaterialIndices, slotBufferCount);
+        rg->resizeBuffer(graphBuffers.culledInstanceIndices, slotBufferCount);
+        if (!hostCulling) {
+            rg->resizeBuffer(graphBuffers.prefixSum, slotBufferCount);
+            rg->resizeBuffer(graphBuffers.scanStates, getGroupCount(slotBufferCount, device->scanWorkGroupSize()) + 1);
+            if (occlusionCulling) {
+                rg->resizeBuffer(graphBuffers.visibilityHistory, slotBufferCount);
+            }
+        }
+        ssboBuffers->updateMapped();
+    }
+    writeSlots();
+    if (meshletCulling) {
+        uint32_t previousGroupCount = meshletGroupCount;
+        writeMeshletDraws();
+        if (meshletGroupCount > previousGroupCount) {
+            rg->resizeBuffer(graphBuffers.meshletScanStates, meshletGroupCount + 1);
+        }
+    }
+    updateMaxCulledDrawCount();
+    cullGlobals.totalInstanceCount = _totalInstanceCount;
+    frustumGroupCount = getGroupCount(_totalInstanceCount, device->scanWorkGroupSize());
+}
+
+void VulkanObjects::updateDraw(uint32_t drawIndex) {
+    drawCommandsBuffer->data<VkDrawIndexedIndirectCommand>()[drawIndex] = indirectDraws[drawIndex];
+    drawCommandsBuffer->markDirty(drawIndex);
+}
+
+VulkanObject* VulkanObjects::spawn(std::string modelPath, glm::vec3 position) {
+    auto modelIt = models.find(modelPath);
+    if (modelIt == models.end()) {
+        throw std::runtime_error("spawn: model not loaded: " + modelPath);
+    }
+    std::shared_ptr<VulkanModel> model = modelIt->second;
+
+    uint32_t firstInstanceID;
+    std::vector<uint32_t>& freeIDs = freeInstanceIDs[model.get()];
+    if (!freeIDs.empty()) {
+        firstInstanceID = freeIDs.back();
+        freeIDs.pop_back();
+    } else {
+        firstInstanceID = ssboBuffers->uniqueInstanceID.fetch_add(model->totalInstanceCount(), std::memory_order_relaxed);
+        uint32_t instanceCount = firstInstanceID + model->totalInstanceCount();
+        if (instanceCount > ssboBuffers->ssboBuffer()->count()) {
+            uint32_t newCount = std::max(instanceCount, ssboBuffers->ssboBuffer()->count() * 2);
+            rg->resizeBuffer(graphBuffers.objects, newCount);
+            rg->resizeBuffer(graphBuffers.cullData, newCount);
+            ssboBuffers->updateMapped();
+        }
+        instanceSlots.resize(ssboBuffers->ssboBuffer()->count());
+    }
+
+    VulkanObject* object = new VulkanObject(model, ssboBuffers, modelPath, firstInstanceID);
+    object->setPostion(position);
+    object->updateModelMatrix(ssboBuffers);
+    object->objectIndex = objects.size();
+    objects.push_back(object);
+    if (model->hasAnimations()) {
+        animatedObjects.push_back(object);
+    }
+
+    bool needsLayout = false;
+    model->forEachInstance(firstInstanceID, [&](VulkanMesh* mesh, uint32_t instanceID) {
+        // addInstance appended the id, so it is near the end
+        uint32_t slot = mesh->instanceIDs.size() - 1;
+        while (mesh->instanceIDs[slot] != instanceID) {
+            --slot;
+        }
+        instanceSlots[instanceID] = slot;
+        for (uint32_t drawIndex : meshDraws[mesh]) {
+            if (slot >= drawCapacities[drawIndex]) {
+                needsLayout = true;
+                continue;
+            }
+            uint32_t firstInstance = indirectDraws[drawIndex].firstInstance;
+            ssboBuffers->instanceIndicesMapped[firstInstance + slot] = instanceID;
+            ssboBuffers->instanceIndicesBuffer()->markDirty(firstInstance + slot);
+            indirectDraws[drawIndex].instanceCount = mesh->instanceIDs.size();
+            updateDraw(drawIndex);
+            culledDrawBound += drawMeshletCounts[drawIndex];
+        }
+    });
+    if (needsLayout) {
+        relayout();
+    } else {
+        growCulledDraws();
+    }
+    return object;
+}
+
+void VulkanObjects::despawn(VulkanObject* object) {
+    bool needsLayout = false;
+    object->model->forEachInstance(object->firstInstanceID, [&](VulkanMesh* mesh, uint32_t instanceID) {
+        // swap the last instance into the freed slot so the live slots of each range stay packed
+        uint32_t slot = instanceSlots[instanceID];
+        uint32_t lastSlot = mesh->instanceIDs.size() - 1;
+        uint32_t lastID = mesh->instanceIDs[lastSlot];
+        mesh->instanceIDs[slot] = lastID;
+        instanceSlots[lastID] = slot;
+        mesh->instanceIDs.pop_back();
+        for (uint32_t drawIndex : meshDraws[mesh]) {
+            uint32_t firstInstance = indirectDraws[drawIndex].firstInstance;
+            ssboBuffers->instanceIndicesMapped[firstInstance + slot] = lastID;
+            ssboBuffers->instanceIndicesMapped[firstInstance + lastSlot] = SSBOBuffers::invalidInstance;
+            ssboBuffers->instanceIndicesBuffer()->markDirty(firstInstance + slot);
+            ssboBuffers->instanceIndicesBuffer()->markDirty(firstInstance + lastSlot);
+            indirectDraws[drawIndex].instanceCount = mesh->instanceIDs.size();
+            updateDraw(drawIndex);
+            culledDrawBound -= drawMeshletCounts[drawIndex];
+            // compact ranges that are mostly empty
+            if (drawCapacities[drawIndex] > minSlotSlack && mesh->instanceIDs.size() < drawCapacities[drawIndex] / 4) {
+                needsLayout = true;
+            }
+        }
+    });
+    freeInstanceIDs[object->model.get()].push_back(object->firstInstanceID);
+
+    objects[object->objectIndex] = objects.back();
+    objects[object->objectIndex]->objectIndex = object->objectIndex;
+    objects.pop_back();
+    if (object->model->hasAnimations()) {
+        animatedObjects.erase(std::find(animatedObjects.begin(), animatedObjects.end(), object));
+    }
+    delete object;
+
+    if (needsLayout) {
+        relayout();
+    }
+}
+
+void VulkanObjects::churn(uint32_t count) {
+    static std::mt19937 mt(time(NULL));
+    std::uniform_real_distribution<float> distribution(0, settings->randLimit);
+    for (uint32_t i = 0; i < count && objects.size() > staticObjectCount; ++i) {
+        std::uniform_int_distribution<uint32_t> objectDistribution(staticObjectCount, objects.size() - 1);
+        despawn(objects[objectDistribution(mt)]);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        spawn(extraObjectModel, {distribution(mt), distribution(mt), distribution(mt)});
+    }
+}
+
+void VulkanObjects::validateCulling() {
+    if (hostCulling) {
+        throw std::runtime_error("validateCulling: compares the GPU cull passes against CpuCull, disable cpuCulling");
+    }
+    rg->waitForFrame(0);
+    // NOTE:
+    // With asyncCompute the cull outputs have a copy per frame in flight, frameData picks the one of the frame waited for
+    const uint32_t* prefixSum = reinterpret_cast<uint32_t*>(rg->frameData(graphBuffers.prefixSum));
+    const uint32_t* culledInstanceIndices = reinterpret_cast<uint32_t*>(rg->frameData(graphBuffers.culledInstanceIndices));
+    if (prefixSum == nullptr || culledInstanceIndices == nullptr) {
+        throw std::runtime_error("validateCulling: cull buffers aren't host visible, validateCullingFrames must be set at load");
+    }
+
+    CpuCull::Input input{};
+    input.instances = ssboBuffers->instanceIndicesMapped;
+    input.instanceCount = cullGlobals.totalInstanceCount;
+    input.cullData = ssboBuffers->cullMapped;
+    input.objects = ssboBuffers->ssboMapped;
+    input.meshBounds = meshBounds.data();
+    input.slotLods = ssboBuffers->slotLodsMapped;
+
+    uint32_t instanceCount = cullGlobals.totalInstanceCount;
+    referenceVisibility.resize(instanceCount);
+    for (uint32_t i = 0; i < instanceCount; ++i) {
+        uint32_t gpuVisible = prefixSum[i] - (i > 0 ? prefixSum[i - 1] : 0);
+        // NOTE:
+        // The bounds are grown and shrunk a little,
+        // if that changes the result the instance is on a frustum edge and float differences between the host and the GPU are fine
+        bool visibleGrown = CpuCull::isVisible(cullGlobals, input, i, 1e-3f);
+        bool visibleShrunk = CpuCull::isVisible(cullGlobals, input, i, -1e-3f);
+        if (visibleGrown == visibleShrunk) {
+            referenceVisibility[i] = visibleGrown;
+        } else {
+            // only check that the GPU result is a valid count
+            referenceVisibility[i] = gpuVisible <= 1 ? gpuVisible : 1;
+        }
+    }
+    CpuCull::inclusiveScan(referenceVisibility, referencePrefixSum);
+
+    uint32_t errorCount = 0;
+    std::stringstream firstError;
+    for (uint32_t i = 0; i < instanceCount; ++i) {
+        uint32_t instance = ssboBuffers->instanceIndicesMapped[i];
+        if (prefixSum[i] != referencePrefixSum[i]) {
+            if (errorCount++ == 0) {
+                firstError << "PrefixSum[" << i << "] is " << prefixSum[i] << ", expected " << referencePrefixSum[i];
+            }
+        } else if (referenceVisibility[i] && culledInstanceIndices[prefixSum[i] - 1] != instance) {
+            if (errorCount++ == 0) {
+                firstError << "CulledInstanceIndices[" << prefixSum[i] - 1 << "] is " << culledInstanceIndices[prefixSum[i] - 1]
+                           << ", expected " << instance;
+            }
+        }
+    }
+
+    // The culled draws must be the visible draws in their original order
+    const VkDrawIndexedIndirectCommand* culledDraws =
+        reinterpret_cast<VkDrawIndexedIndirectCommand*>(rg->frameData(graphBuffers.culledDrawCommands));
+    const uint32_t culledDrawCount = *reinterpret_cast<uint32_t*>(rg->frameData(graphBuffers.culledDrawIndirectCount));
+    uint32_t referenceDrawCount = 0;
+    for (const VkDrawIndexedIndirectCommand& draw : indirectDraws) {
+        if (draw.instanceCount == 0 || draw.indexCount == 0) {
+            continue;
+        }
+        uint32_t firstVisible = draw.firstInstance > 0 ? referencePrefixSum[draw.firstInstance - 1] : 0;
+        uint32_t visibleCount = referencePrefixSum[draw.firstInstance + draw.instanceCount - 1] - firstVisible;
+        if (visibleCount == 0) {
+            continue;
+        }
+        if (referenceDrawCount < culledDrawCount) {
+            const VkDrawIndexedIndirectCommand& culledDraw = culledDraws[referenceDrawCount];
+            if (culledDraw.firstIndex != draw.firstIndex || culledDraw.instanceCount != visibleCount ||
+                culledDraw.firstInstance != firstVisible) {
+                if (errorCount++ == 0) {
+                    firstError << "CulledDrawCommands[" << referenceDrawCount << "] doesn't match the draw with firstIndex "
+                               << draw.firstIndex;
+                }
+            }
+        }
+        ++referenceDrawCount;
+    }
+    if (culledDrawCount != referenceDrawCount && errorCount++ == 0) {
+        firstError << "CulledDrawIndirectCount is " << culledDrawCount << ", expected " << referenceDrawCount;
+    }
+
+    if (errorCount > 0) {
+        throw std::runtime_error("cull validation failed with " + std::to_string(errorCount) + " errors over " +
+                                 std::to_string(instanceCount) + " instances, first: " + firstError.str());
+    }
+}
+
+void VulkanObjects::writeSortValidationInput() {
+    uint32_t* keys = reinterpret_cast<uint32_t*>(rg->getBuffer(graphBuffers.sortValidationKeys)->mapped());
+    uint32_t* values = reinterpret_cast<uint32_t*>(rg->getBuffer(graphBuffers.sortValidationValues)->mapped());
+    // partial tiles and few distinct keys, so the tile edges and the stability are checked
+    sortValidationCount = std::uniform_int_distribution<uint32_t>(0, sortValidationCapacity)(sortValidationRandom);
+    uint32_t keyShift = std::uniform_int_distribution<uint32_t>(0, 31)(sortValidationRandom);
+    std::uniform_int_distribution<uint32_t> keyDistribution;
+    for (uint32_t i = 0; i < sortValidationCount; ++i) {
+        keys[i] = keyDistribution(sortValidationRandom) >> keyShift;
+        values[i] = i;
+    }
+
+    std::vector<uint32_t> order(sortValidationCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+    sortReferenceKeys.resize(sortValidationCount);
+    sortReferenceValues.resize(sortValidationCount);
+    for (uint32_t i = 0; i < sortValidationCount; ++i) {
+        sortReferenceKeys[i] = keys[order[i]];
+        sortReferenceValues[i] = values[order[i]];
+    }
+}
+
+void VulkanObjects::validateSort() {
+    rg->waitForFrame(0);
+    const uint32_t* keys = reinterpret_cast<uint32_t*>(rg->getBuffer(graphBuffers.sortValidationKeys)->mapped());
+    const uint32_t* values = reinterpret_cast<uint32_t*>(rg->getBuffer(graphBuffers.sortValidationValues)->mapped());
+    uint32_t errorCount = 0;
+    std::stringstream firstError;
+    for (uint32_t i = 0; i < sortValidationCount; ++i) {
+        if (keys[i] != sortReferenceKeys[i] || values[i] != sortReferenceValues[i]) {
+            if (errorCount++ == 0) {
+                firstError << "pair " << i << " is (" << keys[i] << ", " << values[i] << "), expected (" << sortReferenceKeys[i] << ", "
+                           << sortReferenceValues[i] << ")";
+            }
+        }
+    }
+    if (errorCount > 0) {
+        throw std::runtime_error("sort validation failed with " + std::to_string(errorCount) + " errors over " +
+                                 std::to_string(sortValidationCount) + " pairs, first: " + firstError.str());
+    }
+    writeSortValidationInput();
 }
 
 void VulkanObjects::updateModels() {
+    if (settings->churnPerFrame > 0) {
+        churn(settings->churnPerFrame);
+    }
     for (VulkanModel* model : animatedModels) {
         model->updateAnimations();
     }
     for (VulkanObject* object : animatedObjects) {
         object->updateModelMatrix(ssboBuffers);
     }
+    if (hostCulling) {
+        cullOnHost();
+    }
 }
 
 VulkanObject* VulkanObjects::getObjectByName(std::string name) {
@@ -1,6 +1,8 @@
 #ifndef VULKAN_OBJECTS_H_
 #define VULKAN_OBJECTS_H_
 #include "common.hpp"
+#include "cpu_cull.hpp"
+#include "meshlet_builder.hpp"
 #include "vulkan_buffer.hpp"
 #include "vulkan_descriptors.hpp"
 #include "vulkan_device.hpp"
@@ -9,10 +11,12 @@
 #include <future>
 #include <map>
 #include <memory>
+#include <random>
 #include <vector>
 #include <vulkan/vulkan_core.h>
 
-struct ComputePushConstants {
+// Per frame inputs of the cull passes, same layout as CullGlobals in cull.glsl
+struct CullGlobals {
     uint32_t totalInstanceCount;
     float nearD;
     float farD;
@@ -20,14 +24,20 @@ struct ComputePushConstants {
     float sphereFactorX;
     float sphereFactorY;
     float tang;
-    uint32_t pad0;
+    // instances whose bounding sphere projects to fewer pixels across are culled, 0 to disable
+    float minPixelSize;
     glm::vec3 X;
-    uint32_t pad1;
+    // swap chain extent, for projecting bounds to pixels
+    float viewportWidth;
     glm::vec3 Y;
-    uint32_t pad2;
+    float viewportHeight;
     glm::vec3 Z;
-    uint32_t pad3;
+    // the sphere size in pixels below which the next LOD is picked, halved for every further LOD, 0 to disable
+    float lodPixelSize;
     glm::vec3 camPos;
+    // read by the meshlet cull passes, one work item per meshlet and instance slot of the draws split into meshlets
+    uint32_t meshletItemCount;
+    uint32_t meshletDrawCount;
 };
 
 class VulkanObjects {
@@ -36,11 +46,35 @@ class VulkanObjects {
     ~VulkanObjects();
     void updateModels();
     VulkanObject* getObjectByName(std::string name);
+    // Adds an object of an already loaded model at runtime
+    VulkanObject* spawn(std::string modelPath, glm::vec3 position);
+    // Removes and deletes an object, its instance IDs are reused by the next spawn of the same model
+    void despawn(VulkanObject* object);
+    // Sorts the instances of the loaded objects by morton code at runtime, like the mortonOrder setting does at load
+    void applyMortonOrder();
+    // Reads back the cull results of the last rendered frame and compares them with CpuCull
+    // Throws on a mismatch
+    // NOTE:
+    // waits on the device timeline for the last submitted frame, only meant for validating the cull shaders
+    void validateCulling();
+    // Reads back the sort of the last rendered frame, compares it with std::stable_sort and writes new random keys
+    // Throws on a mismatch
+    // NOTE:
+    // waits on the device timeline for the last submitted frame, only meant for validating the sort shaders
+    void validateSort();
     const std::vector<VkDrawIndexedIndirectCommand>& draws() const { return indirectDraws; }
     int totalInstanceCount() { return _totalInstanceCount; }
+    // True if CpuCull replaces the cull passes, either from the cpuCulling setting or missing subgroup support
+    bool cullsOnHost() { return hostCulling; }
+    // Time spent in CpuCull last frame, in ms
+    float hostCullTime = 0.0f;
     std::shared_ptr<SSBOBuffers> ssboBuffers;
-    ComputePushConstants computePushConstants{};
+    CullGlobals cullGlobals{};
     VkQueryPool queryPool;
+    // UniformBufferObject, written every frame
+    VulkanRenderGraph::BufferHandle globalsBuffer;
+    // cullGlobals, written every frame after updateModels() so the counts match the layout
+    VulkanRenderGraph::BufferHandle cullGlobalsBuffer;
 
   private:
     std::shared_ptr<VulkanBuffer> vertexBuffer;
@@ -54,6 +88,7 @@ class VulkanObjects {
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
     std::vector<VkDrawIndexedIndirectCommand> indirectDraws;
+    std::vector<MeshBounds> meshBounds;
     std::vector<VkDescriptorImageInfo> samplerInfos;
     std::vector<VkDescriptorImageInfo> imageInfos;
     std::vector<VkDescriptorImageInfo> normalMapInfos;
@@ -63,9 +98,129 @@ class VulkanObjects {
     uint32_t drawCount;
 
     std::shared_ptr<VulkanDevice> device;
+    VulkanRenderGraph* rg;
+    std::shared_ptr<Settings> settings;
+    // The render graph buffers that are uploaded, filled, drawn from, resized or read back
+    struct GraphBuffers {
+        VulkanRenderGraph::BufferHandle objects;
+        VulkanRenderGraph::BufferHandle cullData;
+        VulkanRenderGraph::BufferHandle instances;
+        VulkanRenderGraph::BufferHandle materialIndices;
+        VulkanRenderGraph::BufferHandle slotLods;
+        VulkanRenderGraph::BufferHandle drawCommands;
+        VulkanRenderGraph::BufferHandle culledMaterialIndices;
+        VulkanRenderGraph::BufferHandle culledInstanceIndices;
+        VulkanRenderGraph::BufferHandle culledDrawCommands;
+        VulkanRenderGraph::BufferHandle culledDrawTriangleOffsets;
+        VulkanRenderGraph::BufferHandle culledDrawIndirectCount;
+        VulkanRenderGraph::BufferHandle drawScanStates;
+        VulkanRenderGraph::BufferHandle meshletDraws;
+        VulkanRenderGraph::BufferHandle meshletScanStates;
+        VulkanRenderGraph::BufferHandle prefixSum;
+        VulkanRenderGraph::BufferHandle scanStates;
+        VulkanRenderGraph::BufferHandle visibilityHistory;
+        VulkanRenderGraph::BufferHandle sortValidationKeys;
+        VulkanRenderGraph::BufferHandle sortValidationValues;
+    } graphBuffers;
 
     VulkanDescriptors* descriptorManager;
 
+    // Every draw (one per primitive and LOD) owns the instance slots [firstInstance, firstInstance + capacity)
+    // The first instanceCount slots hold the mesh's instanceIDs in order, the rest hold SSBOBuffers::invalidInstance
+    std::shared_ptr<DirtyRangeBuffer> drawCommandsBuffer;
+    std::vector<uint32_t> drawCapacities;
+    std::vector<VulkanMesh*> drawMeshes;
+    std::vector<uint32_t> drawMaterials;
+    // lod | lodCount << 16, written to every slot of the draw
+    std::vector<uint32_t> drawLods;
+    std::unordered_map<VulkanMesh*, std::vector<uint32_t>> meshDraws;
+    // instanceID -> index in mesh->instanceIDs
+    std::vector<uint32_t> instanceSlots;
+    // free firstInstanceIDs of despawned objects, per model since the id block size depends on the model
+    std::unordered_map<VulkanModel*, std::vector<uint32_t>> freeInstanceIDs;
+    uint32_t slotBufferCount;
+    uint32_t staticObjectCount;
+    static constexpr uint32_t slotSlackDivisor = 8;
+    static constexpr uint32_t minSlotSlack = 64;
+    // Reassigns instance ids so that instances of a model are ordered along a morton curve
+    void mortonReorder();
+    void layoutDraws();
+    void writeSlots();
+    void relayout();
+    void updateDraw(uint32_t drawIndex);
+    // the model the extra objects are spawned from, churn spawns it as well
+    std::string extraObjectModel;
+    void churn(uint32_t count);
+
+    bool hostCulling;
+    // Two phase occlusion culling, see createCullPasses
+    bool occlusionCulling;
+    void createCullPasses();
+    // Culls with cullShader and compacts the visible draws into CulledDrawCommands
+    // ScanStates must have been cleared
+    void addCullPass(std::string cullShader);
+    void drawCulled(VulkanRenderGraph::RenderingOptions renderingOptions);
+    // Splits the draws with more than one meshlet of indices, see cull_meshlet.glsl
+    bool meshletCulling;
+    void buildMeshlets();
+    // Same layout as MeshletDrawData in cull_meshlet.glsl, one per draw split into meshlets
+    struct MeshletDraw {
+        // the draw owns the work items [firstItem, firstItem + meshletCount * capacity), slot major
+        uint32_t firstItem;
+        uint32_t firstMeshlet;
+        uint32_t meshletCount;
+        uint32_t drawIndex;
+    };
+    std::vector<MeshletDraw> meshletDraws;
+    std::shared_ptr<DirtyRangeBuffer> meshletDrawsBuffer;
+    // Must be called after the capacities changed
+    void writeMeshletDraws();
+    // Recounts culledDrawBound and grows the culled draw buffers to fit it
+    void updateMaxCulledDrawCount();
+    void growCulledDraws();
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> drawMeshletCounts;
+    uint32_t meshletGroupCount = 0;
+    // The most draws the cull passes can emit, one per whole draw and one per meshlet of every live instance of a split draw
+    uint32_t culledDrawBound = 0;
+    // draws the culled draw commands can hold, at least culledDrawBound
+    uint32_t maxCulledDrawCount = 0;
+    // Draws the triangle IDs into a visibility image and shades them in a full screen pass, see drawCulled
+    bool visibilityBuffer;
+    // Same layout as the push constants of visibility_resolve.frag, visibility.vert only reads triangleBits
+    struct VisibilityPushConstants {
+        // low bits of the IDs that hold the triangle, the rest hold the culled instance
+        uint32_t triangleBits;
+        uint32_t drawCount;
+    } visibilityPushConstants;
+    // Enough bits for the triangles of the largest draw, a meshlet's triangles count from the start of its draw
+    uint32_t visibilityTriangleBits();
+    // True if the IDs of instanceCount culled instances stay below VulkanRenderGraph::visibilityClearValue
+    bool fitsVisibilityIDs(uint32_t instanceCount) {
+        return (uint64_t(instanceCount) << visibilityPushConstants.triangleBits) <= VulkanRenderGraph::visibilityClearValue;
+    }
+    void createHostCullOps();
+    void cullOnHost();
+    CpuCull cpuCull;
+    std::vector<uint32_t> hostPrefixSum;
+    std::shared_ptr<DirtyRangeBuffer> culledInstanceIndicesBuffer;
+    std::shared_ptr<DirtyRangeBuffer> culledMaterialIndicesBuffer;
+    std::shared_ptr<DirtyRangeBuffer> culledDrawCommandsBuffer;
+    std::shared_ptr<DirtyRangeBuffer> culledDrawCountBuffer;
+
+    uint32_t frustumGroupCount;
+    std::vector<uint32_t> referenceVisibility;
+    std::vector<uint32_t> referencePrefixSum;
+    uint32_t oneGroup = 1;
+
+    static constexpr uint32_t sortValidationCapacity = 1 << 20;
+    uint32_t sortValidationCount = 0;
+    std::vector<uint32_t> sortReferenceKeys;
+    std::vector<uint32_t> sortReferenceValues;
+    std::mt19937 sortValidationRandom;
+    // Fills the sort validation buffers with a random count of random keys and sorts a copy on the host
+    void writeSortValidationInput();
+
     struct SpecData {
         uint32_t local_size_x;
         uint32_t subgroup_size;
@@ -14,8 +14,23 @@
 
 GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanSwapChain* swapChain,
                                    VkPipelineShaderStageCreateInfo vertInfo, VkPipelineShaderStageCreateInfo fragInfo,
-                                   std::vector<VkDescriptorSetLayout>& descriptorLayouts, std::vector<VkPushConstantRange>& pushConstants)
+                                   std::vector<VkDescriptorSetLayout>& descriptorLayouts, std::vector<VkPushConstantRange>& pushConstants,
+                                   VkFormat colorFormat)
     : VulkanPipeline(device) {
+    create(swapChain, {vertInfo, fragInfo}, descriptorLayouts, pushConstants, colorFormat);
+}
+
+GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanSwapChain* swapChain,
+                                   VkPipelineShaderStageCreateInfo vertInfo, std::vector<VkDescriptorSetLayout>& descriptorLayouts,
+                                   std::vector<VkPushConstantRange>& pushConstants)
+    : VulkanPipeline(device) {
+    create(swapChain, {vertInfo}, descriptorLayouts, pushConstants, VK_FORMAT_UNDEFINED);
+}
+
+void GraphicsPipeline::create(VulkanSwapChain* swapChain, std::vector<VkPipelineShaderStageCreateInfo> shaderStages,
+                              std::vector<VkDescriptorSetLayout>& descriptorLayouts, std::vector<VkPushConstantRange>& pushConstants,
+                              VkFormat colorFormat) {
+    bool depthOnly = shaderStages.size() == 1;
 
     VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
     inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -58,16 +73,19 @@ GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanS
     VkPipelineMultisampleStateCreateInfo multisampling{};
     multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
     multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = device->getMsaaSamples();
-    multisampling.sampleShadingEnable = device->getSampleShading();
+    multisampling.rasterizationSamples = _device->getMsaaSamples();
+    multisampling.sampleShadingEnable = _device->getSampleShading();
     multisampling.minSampleShading = 1.0f;
     multisampling.pSampleMask = nullptr;
     multisampling.alphaToCoverageEnable = VK_FALSE;
     multisampling.alphaToOneEnable = VK_FALSE;
 
     VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    // NOTE:
+    // A depth only pipeline still has the color attachment, dynamic rendering needs the attachment counts of the pass and the pipeline
+    // to match
     colorBlendAttachment.colorWriteMask =
-        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+        depthOnly ? 0 : VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
     colorBlendAttachment.blendEnable = VK_FALSE;
     colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
     colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
@@ -87,7 +105,9 @@ GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanS
     colorBlending.blendConstants[2] = 0.0f;
     colorBlending.blendConstants[3] = 0.0f;
 
-    std::vector<VkDynamicState> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    // the depth test is set per pass, see VulkanRenderGraph::RenderingOptions
+    std::vector<VkDynamicState> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR, VK_DYNAMIC_STATE_DEPTH_COMPARE_OP,
+                                                 VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE};
 
     VkPipelineDynamicStateCreateInfo dynamicState{};
     dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
@@ -131,7 +151,9 @@ GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanS
     VkPipelineRenderingCreateInfo renderingInfo{};
     renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
     renderingInfo.colorAttachmentCount = 1;
-    VkFormat colorFormat = swapChain->getSwapChainImageFormat();
+    if (colorFormat == VK_FORMAT_UNDEFINED) {
+        colorFormat = swapChain->getSwapChainImageFormat();
+    }
     renderingInfo.pColorAttachmentFormats = &colorFormat;
     renderingInfo.depthAttachmentFormat = swapChain->findDepthFormat();
     pipelineInfo.pNext = &renderingInfo;
@@ -187,8 +209,6 @@ GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanS
     fragShaderStageInfo.pName = "main";
     */
 
-    VkPipelineShaderStageCreateInfo shaderStages[] = {vertInfo, fragInfo};
-
     auto bindingDescription = Vertex::getBindingDescription();
     auto attributeDescriptions = Vertex::getAttributeDescriptions();
 
@@ -196,16 +216,17 @@ GraphicsPipeline::GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanS
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     vertexInputInfo.vertexBindingDescriptionCount = 1;
     vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+    // the position is the first attribute
+    vertexInputInfo.vertexAttributeDescriptionCount = depthOnly ? 1 : static_cast<uint32_t>(attributeDescriptions.size());
     vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
 
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.stageCount = shaderStages.size();
+    pipelineInfo.pStages = shaderStages.data();
     pipelineInfo.pVertexInputState = &vertexInputInfo;
     createPipelineLayout(descriptorLayouts, pushConstants);
     pipelineInfo.layout = _pipelineLayout;
 
-    checkResult(vkCreateGraphicsPipelines(device->device(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &_pipeline),
+    checkResult(vkCreateGraphicsPipelines(_device->device(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &_pipeline),
                 "failed to create graphics pipeline");
 
     /*
@@ -47,8 +47,17 @@ class GraphicsPipeline : public VulkanPipeline {
   public:
     GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanSwapChain* swapChain, VkPipelineShaderStageCreateInfo vertInfo,
                      VkPipelineShaderStageCreateInfo fragInfo, std::vector<VkDescriptorSetLayout>& descriptorLayouts,
-                     std::vector<VkPushConstantRange>& pushConstants);
+                     std::vector<VkPushConstantRange>& pushConstants, VkFormat colorFormat = VK_FORMAT_UNDEFINED);
+    // Depth only pipeline without a fragment shader, color writes or any vertex attribute but the position
+    GraphicsPipeline(std::shared_ptr<VulkanDevice> device, VulkanSwapChain* swapChain, VkPipelineShaderStageCreateInfo vertInfo,
+                     std::vector<VkDescriptorSetLayout>& descriptorLayouts, std::vector<VkPushConstantRange>& pushConstants);
     //   void bind();
+
+  private:
+    // colorFormat VK_FORMAT_UNDEFINED renders to the swap chain image
+    void create(VulkanSwapChain* swapChain, std::vector<VkPipelineShaderStageCreateInfo> shaderStages,
+                std::vector<VkDescriptorSetLayout>& descriptorLayouts, std::vector<VkPushConstantRange>& pushConstants,
+                VkFormat colorFormat);
 };
 
 class ComputePipeline : public VulkanPipeline {
@@ -5,7 +5,10 @@
 #include "vulkan_descriptors.hpp"
 #include "vulkan_pipeline.hpp"
 #include "vulkan_window.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -24,11 +27,36 @@ static VkDescriptorType switchStorageType(glslang::TStorageQualifier storageType
 
 VulkanRenderGraph::VulkanRenderGraph(std::shared_ptr<VulkanDevice> device, VulkanWindow* window, std::shared_ptr<Settings> settings)
     : _device{device}, _window{window}, _settings{settings} {
+    // NOTE:
+    // A single queue, like on lavapipe, runs the async compute section serialized in the graphics command buffer
+    asyncCompute = _settings->asyncCompute && _device->hasComputeQueue();
+    // before any buffer the async compute section might use is created
+    if (asyncCompute) {
+        _device->enableConcurrentBuffers();
+    }
     swapChain = new VulkanSwapChain(device, _window->getExtent());
+    if (asyncCompute) {
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &typeInfo;
+        checkResult(vkCreateSemaphore(_device->device(), &semaphoreInfo, nullptr, &computeTimeline),
+                    "failed to create the compute timeline semaphore");
+    }
     createCommandBuffers();
     descriptorManager = std::make_shared<VulkanDescriptors>(device);
 }
 
+VulkanRenderGraph::~VulkanRenderGraph() {
+    // the scratch buffers don't own their memory
+    for (VkDeviceMemory memory : scratchMemory) {
+        vkFreeMemory(_device->device(), memory, nullptr);
+    }
+}
+
 void VulkanRenderGraph::resetViewScissor(VkCommandBuffer commandBuffer) {
     // Reset viewport and scissor
     VkViewport viewport{};
@@ -44,25 +72,53 @@ void VulkanRenderGraph::resetViewScissor(VkCommandBuffer commandBuffer) {
     viewport.minDepth = 0.0f;
     viewport.maxDepth = 1.0f;
 
-    setViewportOp(viewport)(getCurrentCommandBuffer());
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
 
     VkRect2D scissor{};
     scissor.offset = {0, 0};
     scissor.extent = swapChain->getExtent();
 
-    setScissorOp(scissor)(getCurrentCommandBuffer());
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 }
 bool VulkanRenderGraph::render() {
     startFrame();
-    // FIXME:
-    // only do this if the swapChain extent changed
-    resetViewScissor(getCurrentCommandBuffer());
-    recordRenderOps(getCurrentCommandBuffer());
+    _recordTime = 0.0;
+    if (recording) {
+        // FIXME:
+        // only do this if the swapChain extent changed
+        resetViewScissor(getCurrentCommandBuffer());
+        auto recordStart = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < dynamicOffsets.size(); ++i) {
+            dynamicOffsets[i] = transientOffsets[dynamicOffsetTransients[i]];
+        }
+        if (asyncCompute) {
+            recordRenderOps(computeCommandBuffers[getCurrentCommandBufferIndex()], 0, asyncCommandCount);
+        }
+        if (recordingChunks.empty()) {
+            recordRenderOps(getCurrentCommandBuffer(), asyncCommandCount, commands.size());
+        } else {
+            recordChunks(getCurrentCommandBuffer());
+        }
+        _recordTime = std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() -
+                                                                                        recordStart)
+                          .count();
+    }
     return endFrame();
 }
 
 void VulkanRenderGraph::createCommandBuffers() {
-    commandBuffers.resize(VulkanSwapChain::MAX_FRAMES_IN_FLIGHT);
+    if (!commandBuffers.empty()) {
+        vkFreeCommandBuffers(_device->device(), _device->getCommandPool(), commandBuffers.size(), commandBuffers.data());
+    }
+    // NOTE:
+    // A reused command buffer is recorded for one swap chain image, so there is one per image for every frame in flight
+    size_t count = VulkanSwapChain::MAX_FRAMES_IN_FLIGHT;
+    if (_settings->reuseCommandBuffers) {
+        count *= swapChain->imageCount();
+    }
+    commandBuffers.resize(count);
+    recordedStates.clear();
+    recordedStates.resize(count);
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.commandPool = _device->getCommandPool();
@@ -70,6 +126,76 @@ void VulkanRenderGraph::createCommandBuffers() {
     allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
 
     checkResult(vkAllocateCommandBuffers(_device->device(), &allocInfo, commandBuffers.data()), "failed to create command buffers");
+
+    if (asyncCompute) {
+        if (!computeCommandBuffers.empty()) {
+            vkFreeCommandBuffers(_device->device(), _device->getComputeCommandPool(), computeCommandBuffers.size(),
+                                 computeCommandBuffers.data());
+        }
+        computeCommandBuffers.resize(count);
+        allocInfo.commandPool = _device->getComputeCommandPool();
+        checkResult(vkAllocateCommandBuffers(_device->device(), &allocInfo, computeCommandBuffers.data()),
+                    "failed to create compute command buffers");
+    }
+
+    if (recordingPools.empty()) {
+        for (uint32_t i = 0; i < _settings->recordingThreads; ++i) {
+            recordingPools.push_back(_device->createCommandPool(VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT));
+        }
+        recordingCommandBuffers.resize(recordingPools.size());
+    }
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    for (size_t i = 0; i < recordingPools.size(); ++i) {
+        std::vector<VkCommandBuffer>& secondaries = recordingCommandBuffers[i];
+        if (!secondaries.empty()) {
+            vkFreeCommandBuffers(_device->device(), recordingPools[i], secondaries.size(), secondaries.data());
+        }
+        secondaries.resize(count);
+        allocInfo.commandPool = recordingPools[i];
+        checkResult(vkAllocateCommandBuffers(_device->device(), &allocInfo, secondaries.data()),
+                    "failed to create secondary command buffers");
+    }
+}
+
+void VulkanRenderGraph::createUploadCommandBuffers() {
+    if (uploadBuffers.empty()) {
+        return;
+    }
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = asyncCompute && asyncUploads ? _device->getComputeCommandPool() : _device->getCommandPool();
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = VulkanSwapChain::MAX_FRAMES_IN_FLIGHT;
+    uploadCommandBuffers.resize(VulkanSwapChain::MAX_FRAMES_IN_FLIGHT);
+    checkResult(vkAllocateCommandBuffers(_device->device(), &allocInfo, uploadCommandBuffers.data()),
+                "failed to create upload command buffers");
+}
+
+void VulkanRenderGraph::recordUploads() {
+    uploading = false;
+    for (const auto& buffer : uploadBuffers) {
+        uploading |= buffer->dirty();
+    }
+    if (!uploading) {
+        return;
+    }
+    VkCommandBuffer commandBuffer = uploadCommandBuffers[getCurrentFrame()];
+    vkResetCommandBuffer(commandBuffer, 0);
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    checkResult(vkBeginCommandBuffer(commandBuffer, &beginInfo), "failed to begin recording upload command buffer");
+    // NOTE:
+    // The barriers of the graph around the uploads are recorded after the copies, so the command buffer brings its own
+    // The frames before it on the queue may still read the buffers
+    recordMemoryBarrier(commandBuffer, VK_ACCESS_2_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                        VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+    for (const auto& buffer : uploadBuffers) {
+        buffer->flush(commandBuffer, getCurrentFrame());
+    }
+    recordMemoryBarrier(commandBuffer, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                        VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+    checkResult(vkEndCommandBuffer(commandBuffer), "failed to end upload command buffer");
 }
 
 void VulkanRenderGraph::recreateSwapChain() {
@@ -85,9 +211,72 @@ void VulkanRenderGraph::recreateSwapChain() {
     vkDeviceWaitIdle(_device->device());
 
     swapChain = new VulkanSwapChain(_device, _window->getExtent(), swapChain);
+    // the new swap chain starts at frame 0, the copies are allocated again for it
+    transientFrameStarted = false;
+    if (_settings->reuseCommandBuffers) {
+        // the image count can change and the recorded commands use the old images
+        createCommandBuffers();
+        invalidateCommandBuffers();
+    }
+    if (hasDepthPyramid || hasVisibilityBuffer) {
+        // The depth image, pyramid and visibility image were recreated with the swap chain
+        // NOTE:
+        // Updates every descriptor since they don't track which image infos they use, only happens on resize
+        if (hasDepthPyramid) {
+            updateDepthImageInfos();
+        }
+        if (hasVisibilityBuffer) {
+            updateVisibilityImageInfos();
+        }
+        for (auto& descriptorPair : descriptorManager->descriptors) {
+            descriptorPair.second->update();
+        }
+    }
+}
+
+void VulkanRenderGraph::updateDepthImageInfos() {
+    // NOTE:
+    // The vectors are only refilled, descriptors keep pointers to them
+    depthImageInfos.resize(1);
+    depthImageInfos[0].sampler = VK_NULL_HANDLE;
+    depthImageInfos[0].imageView = swapChain->getDepthImageView();
+    depthImageInfos[0].imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+    depthPyramidInfos.resize(1);
+    depthPyramidInfos[0].sampler = VK_NULL_HANDLE;
+    depthPyramidInfos[0].imageView = swapChain->getDepthPyramidView();
+    depthPyramidInfos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    // Every element of the array has to be valid, levels past the last one repeat it
+    depthPyramidLevelInfos.resize(VulkanSwapChain::MAX_DEPTH_PYRAMID_LEVELS);
+    for (uint32_t level = 0; level < VulkanSwapChain::MAX_DEPTH_PYRAMID_LEVELS; ++level) {
+        depthPyramidLevelInfos[level].sampler = VK_NULL_HANDLE;
+        depthPyramidLevelInfos[level].imageView =
+            swapChain->getDepthPyramidLevelView(std::min(level, swapChain->getDepthPyramidLevels() - 1));
+        depthPyramidLevelInfos[level].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+}
+
+void VulkanRenderGraph::enableVisibilityBuffer() {
+    if (!hasVisibilityBuffer) {
+        swapChain->enableVisibilityBuffer();
+        hasVisibilityBuffer = true;
+        updateVisibilityImageInfos();
+        imageInfos("visibilityImage", &visibilityImageInfos);
+    }
+}
+
+void VulkanRenderGraph::updateVisibilityImageInfos() {
+    visibilityImageInfos.resize(1);
+    visibilityImageInfos[0].sampler = VK_NULL_HANDLE;
+    visibilityImageInfos[0].imageView = swapChain->getVisibilityImageView();
+    visibilityImageInfos[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 }
 
 void VulkanRenderGraph::startFrame() {
+    startTransientFrame();
+    // the current frame was waited for, so its staging buffers are free
+    recordUploads();
     VkResult result = swapChain->acquireNextImage();
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
@@ -99,6 +288,11 @@ void VulkanRenderGraph::startFrame() {
         throw std::runtime_error("failed to acquire swap chain image");
     }
 
+    recording = needsRecording();
+    if (!recording) {
+        return;
+    }
+
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = 0;
@@ -107,11 +301,61 @@ void VulkanRenderGraph::startFrame() {
     vkResetCommandBuffer(getCurrentCommandBuffer(), 0);
 
     checkResult(vkBeginCommandBuffer(getCurrentCommandBuffer(), &beginInfo), "failed to begin recording command buffer");
+    if (asyncCompute) {
+        VkCommandBuffer computeCommandBuffer = computeCommandBuffers[getCurrentCommandBufferIndex()];
+        vkResetCommandBuffer(computeCommandBuffer, 0);
+        checkResult(vkBeginCommandBuffer(computeCommandBuffer, &beginInfo), "failed to begin recording compute command buffer");
+    }
+}
+
+bool VulkanRenderGraph::needsRecording() {
+    if (!_settings->reuseCommandBuffers) {
+        return true;
+    }
+    // NOTE:
+    // acquireNextImage waited on the device timeline for the last submission of the current frame,
+    // so its command buffers aren't in use
+    // The uploads are in the upload command buffer, dirty ranges don't invalidate the recorded ones
+    RecordedState& state = recordedStates[getCurrentCommandBufferIndex()];
+    bool changed = state.generation != commandGeneration;
+    // vkCmdPushConstants and the dynamic counts copy their values when recorded, so compare them with the recorded ones
+    // NOTE:
+    // Only structural inputs are expected here, data that changes every frame goes in transient buffers
+    state.inputs.resize(recordInputsSize);
+    char* recorded = state.inputs.data();
+    for (const RecordInput& input : recordInputs) {
+        if (changed || std::memcmp(recorded, input.data, input.size) != 0) {
+            changed = true;
+            std::memcpy(recorded, input.data, input.size);
+        }
+        recorded += input.size;
+    }
+    state.generation = commandGeneration;
+    return changed;
 }
 
 bool VulkanRenderGraph::endFrame() {
-    checkResult(vkEndCommandBuffer(getCurrentCommandBuffer()), "failed to end command buffer");
-    VkResult result = swapChain->submitCommandBuffers(&commandBuffers[swapChain->currentFrame()]);
+    if (recording) {
+        checkResult(vkEndCommandBuffer(getCurrentCommandBuffer()), "failed to end command buffer");
+        if (asyncCompute) {
+            checkResult(vkEndCommandBuffer(computeCommandBuffers[getCurrentCommandBufferIndex()]), "failed to end compute command buffer");
+        }
+    }
+    // the upload command buffer goes first in the submission of the queue the uploads are on
+    std::vector<VkCommandBuffer> submitBuffers;
+    if (uploading && !(asyncCompute && asyncUploads)) {
+        submitBuffers.push_back(uploadCommandBuffers[getCurrentFrame()]);
+    }
+    submitBuffers.push_back(getCurrentCommandBuffer());
+    VkResult result;
+    if (asyncCompute) {
+        submitAsyncCompute();
+        VulkanSwapChain::TimelineWait timeline{computeTimeline, computeTimelineValue};
+        result = swapChain->submitCommandBuffers(submitBuffers.data(), submitBuffers.size(), &timeline);
+    } else {
+        result = swapChain->submitCommandBuffers(submitBuffers.data(), submitBuffers.size());
+    }
+    transientFrameStarted = false;
     if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
         recreateSwapChain();
         // return true if framebuffer was resized
@@ -122,4 +366,190 @@ bool VulkanRenderGraph::endFrame() {
     return false;
 }
 
-void VulkanRenderGraph::bufferWrite(std::string name, void* data) { globalBuffers[name]->write(data); }
+void VulkanRenderGraph::submitAsyncCompute() {
+    // NOTE:
+    // Waits for the graphics commands of the last frame that used the same copies of the buffers the section writes,
+    // so it overlaps the graphics commands of the frames in between
+    // The single time commands submitted since, like the copy of a grown buffer, are waited for as well
+    VkSemaphoreSubmitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    waitInfo.semaphore = _device->timelineSemaphore();
+    waitInfo.value =
+        std::max(swapChain->frameTimelineValue(VulkanSwapChain::MAX_FRAMES_IN_FLIGHT - 1), _device->singleTimeTimelineValue());
+    waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    VkSemaphoreSubmitInfo signalInfo{};
+    signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    signalInfo.semaphore = computeTimeline;
+    signalInfo.value = ++computeTimelineValue;
+    signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    std::vector<VkCommandBufferSubmitInfo> commandBufferInfos;
+    VkCommandBufferSubmitInfo commandBufferInfo{};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+    if (uploading && asyncUploads) {
+        commandBufferInfo.commandBuffer = uploadCommandBuffers[getCurrentFrame()];
+        commandBufferInfos.push_back(commandBufferInfo);
+    }
+    commandBufferInfo.commandBuffer = computeCommandBuffers[getCurrentCommandBufferIndex()];
+    commandBufferInfos.push_back(commandBufferInfo);
+
+    VkSubmitInfo2 submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.waitSemaphoreInfoCount = 1;
+    submitInfo.pWaitSemaphoreInfos = &waitInfo;
+    submitInfo.commandBufferInfoCount = commandBufferInfos.size();
+    submitInfo.pCommandBufferInfos = commandBufferInfos.data();
+    submitInfo.signalSemaphoreInfoCount = 1;
+    submitInfo.pSignalSemaphoreInfos = &signalInfo;
+
+    // waiting for the graphics submission also covers this one, the graphics commands wait for it
+    checkResult(vkQueueSubmit2(_device->computeQueue(), 1, &submitInfo, VK_NULL_HANDLE), "failed to submit compute command buffer");
+}
+
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::bufferHandle(std::string name) {
+    auto it = std::find(bufferNames.begin(), bufferNames.end(), name);
+    if (it != bufferNames.end()) {
+        return {uint32_t(it - bufferNames.begin())};
+    }
+    bufferNames.push_back(name);
+    bufferSlots.push_back(nullptr);
+    bufferTransients.push_back(UINT32_MAX);
+    return {uint32_t(bufferNames.size() - 1)};
+}
+
+void VulkanRenderGraph::updateBufferSlots() {
+    for (uint32_t i = 0; i < bufferNames.size(); ++i) {
+        auto it = globalBuffers.find(bufferNames[i]);
+        bufferSlots[i] = it == globalBuffers.end() ? nullptr : it->second;
+    }
+}
+
+void VulkanRenderGraph::bufferWrite(BufferHandle buffer, void* data) {
+    uint32_t transient = bufferTransients[buffer.index];
+    if (transient == UINT32_MAX) {
+        bufferSlots[buffer.index]->write(data);
+        return;
+    }
+    startTransientFrame();
+    std::memcpy(transientBuffers[transient].data, data, transientBuffers[transient].size);
+}
+
+void VulkanRenderGraph::createTransientRing() {
+    // NOTE:
+    // One alignment for every copy, a block can be bound as a uniform and a storage buffer
+    transientAlignment = std::max(_device->minUniformBufferOffsetAlignment(), _device->minStorageBufferOffsetAlignment());
+    VkDeviceSize frameSize = 0;
+    for (const TransientBuffer& transient : transientBuffers) {
+        frameSize += (transient.size + transientAlignment - 1) / transientAlignment * transientAlignment;
+    }
+    transientRing =
+        std::make_unique<FrameRingBuffer>(_device, frameSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    for (TransientBuffer& transient : transientBuffers) {
+        transient.bufferInfo = {transientRing->buffer()->buffer(), 0, transient.size};
+    }
+    transientOffsets.resize(transientBuffers.size());
+}
+
+void VulkanRenderGraph::startTransientFrame() {
+    if (transientFrameStarted || !transientRing) {
+        return;
+    }
+    swapChain->waitForCurrentFrame();
+    transientRing->reset(getCurrentFrame());
+    // NOTE:
+    // Same allocations in the same order every frame, so the offsets only depend on the frame index
+    // and the command buffers reused with reuseCommandBuffers stay valid
+    for (size_t i = 0; i < transientBuffers.size(); ++i) {
+        FrameRingBuffer::Allocation allocation = transientRing->allocate(transientBuffers[i].size, transientAlignment);
+        transientBuffers[i].data = allocation.data;
+        transientOffsets[i] = allocation.offset;
+    }
+    transientFrameStarted = true;
+}
+
+std::shared_ptr<VulkanBuffer> VulkanRenderGraph::getBuffer(BufferHandle buffer) {
+    if (bufferSlots.at(buffer.index) == nullptr) {
+        throw std::runtime_error("getBuffer: buffer " + bufferNames[buffer.index] + " wasn't created yet");
+    }
+    return bufferSlots[buffer.index];
+}
+
+void* VulkanRenderGraph::frameData(BufferHandle buffer) {
+    char* data = reinterpret_cast<char*>(getBuffer(buffer)->mapped());
+    auto copies = frameCopies.find(bufferNames[buffer.index]);
+    if (data == nullptr || copies == frameCopies.end()) {
+        return data;
+    }
+    // render() moved on to the next frame after submitting
+    size_t lastFrame = (getCurrentFrame() + VulkanSwapChain::MAX_FRAMES_IN_FLIGHT - 1) % VulkanSwapChain::MAX_FRAMES_IN_FLIGHT;
+    return data + lastFrame * copies->second.stride;
+}
+
+void VulkanRenderGraph::resizeBuffer(BufferHandle buffer, uint32_t count) {
+    std::string name = bufferNames.at(buffer.index);
+    if (globalBuffers.count(name) == 0) {
+        throw std::runtime_error("resizeBuffer: buffer " + name + " not found");
+    }
+    // descriptors and in flight frames might still be using the old buffer
+    // the last frame waited for its compute work, so it finishing covers every queue
+    waitForFrame(0);
+
+    std::shared_ptr<VulkanBuffer> oldBuffer = globalBuffers.at(name);
+    if (dirtyBuffers.count(name) == 1) {
+        std::shared_ptr<DirtyRangeBuffer> dirtyBuffer = dirtyBuffers.at(name);
+        dirtyBuffer->grow(count);
+        globalBuffers[name] = dirtyBuffer->buffer();
+        if (frameCopies.count(name) == 1) {
+            frameCopies[name] = {dirtyBuffer->count() * dirtyBuffer->stride(), dirtyBuffer->frameStride()};
+        }
+    } else if (bufferCreateInfos.count(name) == 1) {
+        uint32_t oldCount = std::get<0>(bufferCreateInfos.at(name));
+        bool perFrame = frameCopies.count(name) == 1;
+        VkDeviceSize elementSize = (perFrame ? frameCopies.at(name).size : oldBuffer->size()) / oldCount;
+        std::get<0>(bufferCreateInfos.at(name)) = count;
+        if (perFrame) {
+            createFrameBuffer(name, elementSize * count, oldBuffer->usageFlags(), oldBuffer->memoryProperties());
+        } else {
+            // NOTE:
+            // A resized scratch buffer gets its own memory, the barriers of its old place in the shared memory stay but are redundant
+            globalBuffers[name] =
+                std::make_shared<VulkanBuffer>(_device, elementSize * count, oldBuffer->usageFlags(), oldBuffer->memoryProperties());
+            if (oldBuffer->memoryProperties() & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+                globalBuffers.at(name)->map();
+            }
+        }
+    } else {
+        throw std::runtime_error("resizeBuffer: buffer " + name + " is not owned by the render graph");
+    }
+    bufferSlots[buffer.index] = globalBuffers.at(name);
+    rebindBuffer(name, oldBuffer);
+    if (bufferAliases.count("SortKeys") == 1 && (name == bufferAliases.at("SortKeys") || name == bufferAliases.at("SortValues"))) {
+        resizeSortBuffers();
+    }
+    // the commands hold the handle of the old buffer
+    if (compiled) {
+        resolveCommands();
+    }
+}
+
+void VulkanRenderGraph::resizeSortBuffers() {
+    uint32_t capacity = std::min(uintBufferCount(bufferAliases.at("SortKeys")), uintBufferCount(bufferAliases.at("SortValues")));
+    if (capacity <= sortCapacity) {
+        return;
+    }
+    sortCapacity = capacity;
+    uint32_t histogramCount = sortRadixSize * getGroupCount(sortCapacity, sortTileSize);
+    resizeBuffer(sortKeysTempBuffer, sortCapacity);
+    resizeBuffer(sortValuesTempBuffer, sortCapacity);
+    resizeBuffer(sortHistogramsBuffer, histogramCount);
+    resizeBuffer(sortScanStatesBuffer, getGroupCount(histogramCount, sortGroupSize) + 1);
+}
+
+void VulkanRenderGraph::rebindBuffer(std::string name, std::shared_ptr<VulkanBuffer> oldBuffer) {
+    for (auto& descriptorPair : descriptorManager->descriptors) {
+        if (descriptorPair.second->replaceBuffer(oldBuffer, globalBuffers.at(name))) {
+            descriptorPair.second->update();
+        }
+    }
+}
@@ -5,8 +5,10 @@
 #include "vulkan_pipeline.hpp"
 #include "vulkan_swapchain.hpp"
 #include <cstdint>
+#include <exception>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -15,13 +17,55 @@
 class VulkanRenderGraph {
   public:
     typedef std::unordered_map<std::string, std::shared_ptr<VulkanBuffer>> bufferMap;
+    typedef std::unordered_map<std::string, std::shared_ptr<DirtyRangeBuffer>> dirtyBufferMap;
     typedef std::unordered_map<std::string, std::vector<VkDescriptorImageInfo>*> imageInfosMap;
     typedef std::unordered_map<std::string, std::tuple<uint32_t, VkBufferUsageFlags, VkMemoryPropertyFlags>> bufferCreateInfoMap;
     struct ShaderOptions {
         void* pushConstantData = VK_NULL_HANDLE;
         void* specData = VK_NULL_HANDLE;
     };
+    // Attachment handling of a graphics shader, for splitting a frame into multiple passes over the same attachments
+    struct RenderingOptions {
+        // LOAD continues from the color and depth of the previous pass instead of clearing them
+        VkAttachmentLoadOp loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        // The last pass presents the swap chain image, earlier passes store depth for the passes after them
+        bool lastPass = true;
+        // EQUAL without depth writes after a depth prepass only shades the fragments that end up visible
+        VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
+        bool depthWrite = true;
+        // Renders the IDs of the fragment shader into the visibility image instead of the swap chain image
+        // The IDs are always cleared to visibilityClearValue, loadOp only applies to the depth
+        bool visibilityBuffer = false;
+        // Loads the depth even if loadOp clears the color, for full screen passes between passes that use the depth
+        bool loadDepth = false;
+    };
+    // Visibility image value of the pixels no triangle was drawn to
+    static const uint32_t visibilityClearValue = UINT32_MAX;
+    // A buffer declared with buffer(), an index into the buffers of the graph
+    // The writes, fills and draws take handles so they don't look the buffer up by name,
+    // names are only matched against the shader blocks in compile()
+    struct BufferHandle {
+        uint32_t index = UINT32_MAX;
+        bool valid() const { return index != UINT32_MAX; }
+    };
+    // Host written data with a copy per frame in flight, see transientBuffer()
+    struct TransientBuffer {
+        std::string name;
+        BufferHandle handle;
+        VkDeviceSize size;
+        // range of one copy in the ring buffer, the copy of a frame is selected with a dynamic offset
+        VkDescriptorBufferInfo bufferInfo;
+        // copy of the current frame
+        void* data;
+    };
+    // A buffer read or written by an op, compile() infers the barriers between the ops from these
+    struct BufferAccess {
+        std::string name;
+        VkPipelineStageFlags2 stage;
+        VkAccessFlags2 access;
+    };
     VulkanRenderGraph(std::shared_ptr<VulkanDevice> device, VulkanWindow* window, std::shared_ptr<Settings> settings);
+    ~VulkanRenderGraph();
     class VulkanShader {
       public:
         VulkanShader(std::string path, std::shared_ptr<VulkanDevice> device);
@@ -50,48 +94,195 @@ class VulkanRenderGraph {
         VkSpecializationInfo specInfo{};
         std::vector<VkSpecializationMapEntry> specEntries;
         bool hasSpecConstants = false;
+        // a vertex shader without a fragment shader, see the depth only shader()
+        bool depthOnly = false;
+        // a fragment shader that writes the visibility image
+        bool visibilityOutput = false;
+        // storage and uniform buffers by graph name, readonly and writeonly blocks only read or write
+        std::vector<BufferAccess> bufferAccesses;
+        // (set, binding) -> index of the transient buffer, in the order of the dynamic offsets
+        std::map<std::pair<uint32_t, uint32_t>, uint32_t> transientBindings;
+        // set by compile(), so the commands don't look them up by name
+        VulkanDescriptors::VulkanDescriptor* descriptor = nullptr;
+        VulkanPipeline* pipeline = nullptr;
 
         void setDescriptorBuffers(VulkanDescriptors::VulkanDescriptor* descriptor, bufferCreateInfoMap& bufferCounts,
-                                  bufferMap& globalBuffers, imageInfosMap& globalImageInfos);
+                                  bufferMap& globalBuffers, imageInfosMap& globalImageInfos,
+                                  const std::unordered_map<std::string, std::string>& bufferAliases,
+                                  std::vector<TransientBuffer>& transientBuffers, const std::set<std::string>& scratchBuffers);
         friend class VulkanRenderGraph;
     };
 
     VulkanRenderGraph& shader(std::string computePath, uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ,
                               ShaderOptions shaderOptions);
+    // Group counts are read when the op is recorded, for dispatches that change size at runtime
+    VulkanRenderGraph& shader(std::string computePath, uint32_t* groupCountX, uint32_t* groupCountY, uint32_t* groupCountZ,
+                              ShaderOptions shaderOptions);
     VulkanRenderGraph& shader(std::string vertPath, std::string fragPath, ShaderOptions vertOptions, ShaderOptions fragOptions,
                               std::shared_ptr<VulkanBuffer> vertexBuffer, std::shared_ptr<VulkanBuffer> indexBuffer);
-    VulkanRenderGraph& buffer(std::string name, uint32_t count);
-    VulkanRenderGraph& buffer(std::string name, uint32_t count, VkBufferUsageFlags additionalUsage,
-                              VkMemoryPropertyFlags additionalProperties);
-    VulkanRenderGraph& buffer(std::string name, std::shared_ptr<VulkanBuffer> buffer);
-
-    template <typename T> VulkanRenderGraph& buffer(std::string name, std::vector<T> data, VkBufferUsageFlags additionalUsage) {
-        buffer(name, VulkanBuffer::StagedBuffer(_device, (void*)data.data(), sizeof(data[0]) * data.size(), additionalUsage));
-        return *this;
+    VulkanRenderGraph& shader(std::string vertPath, std::string fragPath, ShaderOptions vertOptions, ShaderOptions fragOptions,
+                              std::shared_ptr<VulkanBuffer> vertexBuffer, std::shared_ptr<VulkanBuffer> indexBuffer,
+                              RenderingOptions renderingOptions);
+    // Depth only graphics pass, vertPath only gets the position attribute and there is no fragment shader
+    VulkanRenderGraph& shader(std::string vertPath, ShaderOptions vertOptions, std::shared_ptr<VulkanBuffer> vertexBuffer,
+                              std::shared_ptr<VulkanBuffer> indexBuffer, RenderingOptions renderingOptions);
+    // Full screen pass that shades the visibility image of the previous visibility pass with fragPath,
+    // vertPath only has to cover the screen with the 3 vertices of vkCmdDraw
+    // Binds the visibility image as "visibilityImage"
+    VulkanRenderGraph& resolve(std::string vertPath, std::string fragPath, ShaderOptions fragOptions, RenderingOptions renderingOptions);
+    // Reduces the depth of the previous graphics pass into a max depth pyramid with reducePath
+    // Binds the depth image as "depthImage", the whole pyramid as "depthPyramid" and its levels as "depthPyramidLevels"
+    // NOTE:
+    // The previous pass must not be the last pass, so its depth is stored
+    VulkanRenderGraph& depthPyramid(std::string reducePath);
+    // Stable radix sort of the first *count uint keys of the keys buffer and their uint values in the values buffer by the low keyBits
+    // bits of the keys, in place
+    // keyBits must be 16 or 32, an even number of passes leaves the result in the keys and values buffers
+    // *count is read when the op is recorded and must not be larger than either buffer
+    // The writes of the pairs before and the reads after the sort need barriers like any other compute pass
+    // NOTE:
+    // The sort shaders bind the buffers through the aliases SortKeys and SortValues,
+    // descriptors are per shader so every sort in a graph has to use the same buffers
+    VulkanRenderGraph& sort(BufferHandle keys, BufferHandle values, uint32_t* count, uint32_t keyBits = 32);
+    // Buffers created by the graph in compile(), with count elements of the size of the shader block they are bound to
+    BufferHandle buffer(std::string name, uint32_t count);
+    BufferHandle buffer(std::string name, uint32_t count, VkBufferUsageFlags additionalUsage, VkMemoryPropertyFlags additionalProperties);
+    // Buffers owned by the caller, declaring a name again rebinds it and returns the same handle
+    BufferHandle buffer(std::string name, std::shared_ptr<VulkanBuffer> buffer);
+    BufferHandle buffer(std::string name, std::shared_ptr<DirtyRangeBuffer> buffer);
+    // Uniform or storage block of size bytes that the host writes every frame with bufferWrite
+    // Every frame in flight gets its own copy in a ring buffer, so writing it never waits for the GPU or overwrites data
+    // a frame in flight still reads, the descriptors select the copy with a dynamic offset
+    // NOTE:
+    // The sort and depthPyramid shaders bind their sets without dynamic offsets, so they can't read transient buffers
+    BufferHandle transientBuffer(std::string name, VkDeviceSize size);
+    // Like buffer(), for contents that only live from the first to the last access in a frame, so every frame writes the
+    // buffer before reading it
+    // With aliasScratchBuffers, scratch buffers whose accesses don't overlap share memory
+    // NOTE:
+    // Host visible scratch buffers keep their own memory, the host reads them after the frame
+    BufferHandle scratchBuffer(std::string name, uint32_t count, VkBufferUsageFlags additionalUsage = 0,
+                               VkMemoryPropertyFlags additionalProperties = 0);
+
+    template <typename T> BufferHandle buffer(std::string name, std::vector<T> data, VkBufferUsageFlags additionalUsage) {
+        return buffer(name, VulkanBuffer::StagedBuffer(_device, (void*)data.data(), sizeof(data[0]) * data.size(), additionalUsage));
     }
     VulkanRenderGraph& imageInfos(std::string name, std::vector<VkDescriptorImageInfo>* imageInfos);
-    VulkanRenderGraph& fillBuffer(std::string name, VkDeviceSize offset, VkDeviceSize size, uint32_t value);
-    VulkanRenderGraph& setBuffer(std::string name, uint32_t value);
-    VulkanRenderGraph& drawIndirect(std::string buffer, VkDeviceSize offset, std::string countBuffer, VkDeviceSize countBufferOffset,
+    VulkanRenderGraph& fillBuffer(BufferHandle buffer, VkDeviceSize offset, VkDeviceSize size, uint32_t value);
+    VulkanRenderGraph& setBuffer(BufferHandle buffer, uint32_t value);
+    // Copies the dirty ranges of a DirtyRangeBuffer to the device
+    // NOTE:
+    // The copies are recorded into the upload command buffer that runs before the frame,
+    // the op only places the write in the graph for the barriers and the copies per frame in flight
+    VulkanRenderGraph& upload(BufferHandle buffer);
+    VulkanRenderGraph& drawIndirect(BufferHandle buffer, VkDeviceSize offset, BufferHandle countBuffer, VkDeviceSize countBufferOffset,
                                     uint32_t maxDrawCount, uint32_t stride);
+    // maxDrawCount is read when the op is recorded, for indirect buffers that are resized at runtime
+    VulkanRenderGraph& drawIndirect(BufferHandle buffer, VkDeviceSize offset, BufferHandle countBuffer, VkDeviceSize countBufferOffset,
+                                    uint32_t* maxDrawCount, uint32_t stride);
     VulkanRenderGraph& timestamp(VkPipelineStageFlags2 stageFlags, VkQueryPool queryPool, uint32_t query);
     VulkanRenderGraph& queryReset(VkQueryPool queryPool, uint32_t firstQuery, uint32_t count);
+    // Dropped by compile() with the autoBarriers setting, checked against the buffer accesses with validateBarriers
     VulkanRenderGraph& memoryBarrier(VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 dstAccessMask,
                                      VkPipelineStageFlags2 dstStageMask);
+    // Full barrier for debugging, always kept
     VulkanRenderGraph& debugBarrier();
+    // The ops until endAsyncCompute() run on the dedicated compute queue with the asyncCompute setting,
+    // the graphics commands of the frame wait for them with a timeline semaphore
+    // Without the setting or a compute queue they are recorded into the graphics command buffer like every other op
+    // The section has to start the graph and can only hold compute, transfer, barrier and query ops
+    // NOTE:
+    // The buffers the section writes and the graphics commands read get a copy per frame in flight, so the section only waits
+    // for the graphics commands of the frame that used the same copy, the commands after the section can't write them
+    VulkanRenderGraph& beginAsyncCompute();
+    VulkanRenderGraph& endAsyncCompute();
     VulkanRenderGraph& resetViewport(VkViewport viewport);
     VulkanRenderGraph& resetScissor(VkRect2D scissor);
     void compile();
-    void bufferWrite(std::string name, void* data);
+    // Only valid after compile(), the graph creates its buffers there
+    // Transient buffers are written to the copy of the frame the next render() submits, after that frame left the GPU
+    void bufferWrite(BufferHandle buffer, void* data);
+    std::shared_ptr<VulkanBuffer> getBuffer(BufferHandle buffer);
+    // Mapped memory of the copy the last submitted frame used, for the buffers with a copy per frame in flight,
+    // nullptr if the buffer isn't mapped
+    void* frameData(BufferHandle buffer);
+    // Reallocates a buffer with room for count elements and rebinds its descriptors
+    // Contents are kept for DirtyRangeBuffers and discarded for buffers created by the graph
+    // NOTE:
+    // Waits on the device timeline for the last submitted frame, so it should only be used for rare geometric growth
+    void resizeBuffer(BufferHandle buffer, uint32_t count);
     VkExtent2D getSwapChainExtent() { return swapChain->getExtent(); }
+    // Headless only, writes the last rendered frame to a PNG file
+    void saveFrame(std::string path) { swapChain->saveImage(path); }
     bool render();
+    // Blocks until the frame submitted framesAgo frames before the last one finished on the GPU, 0 waits for the last frame
+    // For reading back what a frame wrote or destroying what it used without waiting for the whole device
+    void waitForFrame(uint32_t framesAgo) { _device->waitTimeline(swapChain->frameTimelineValue(framesAgo)); }
+    // Records every command buffer again on its next use, for changes the graph can't see
+    void invalidateCommandBuffers() { ++commandGeneration; }
+    // CPU time of recording the commands of the last frame in ms
+    double recordTime() const { return _recordTime; }
 
   private:
+    // One per frame in flight, or one per frame in flight and swap chain image with reuseCommandBuffers
     std::vector<VkCommandBuffer> commandBuffers;
     VulkanSwapChain* swapChain;
     void createCommandBuffers();
     size_t getCurrentFrame() const { return swapChain->currentFrame(); }
-    VkCommandBuffer getCurrentCommandBuffer() { return commandBuffers[getCurrentFrame()]; }
+    size_t getCurrentCommandBufferIndex() const {
+        return _settings->reuseCommandBuffers ? getCurrentFrame() * swapChain->imageCount() + swapChain->currentImage() : getCurrentFrame();
+    }
+    VkCommandBuffer getCurrentCommandBuffer() { return commandBuffers[getCurrentCommandBufferIndex()]; }
+
+    // asyncCompute is set and the device has a dedicated compute queue
+    bool asyncCompute = false;
+    // between beginAsyncCompute() and endAsyncCompute()
+    bool buildingAsyncCompute = false;
+    // renderOps index of the end of the async compute section when it was built, the accesses of the ops before it are on the
+    // compute queue
+    size_t asyncComputeEnd = 0;
+    // the first asyncCommandCount commands are recorded into the compute command buffers
+    size_t asyncCommandCount = 0;
+    // indexed like commandBuffers
+    std::vector<VkCommandBuffer> computeCommandBuffers;
+    // signaled by the compute submissions with the count of submissions so far, the graphics submissions signal the device timeline
+    // NOTE:
+    // Separate from the device timeline, the queues run concurrently so their signals wouldn't be in increasing order
+    VkSemaphore computeTimeline = VK_NULL_HANDLE;
+    uint64_t computeTimelineValue = 0;
+    void submitAsyncCompute();
+    // Buffers the async compute section and the commands after it share, with any write, by name
+    // Every frame in flight uses its own copy, the copy of frame f starts at f * stride
+    struct FrameCopies {
+        // bytes of one copy
+        VkDeviceSize size;
+        VkDeviceSize stride;
+    };
+    std::unordered_map<std::string, FrameCopies> frameCopies;
+    VkDeviceSize frameAlignment = 0;
+    // Replaces the shared buffers with buffers holding a copy per frame in flight and binds the copies per frame
+    // NOTE:
+    // The buffers are created concurrent on both queue families, the semaphores order the queues without ownership transfers
+    void createFrameCopies();
+    void createFrameBuffer(std::string name, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties);
+
+    // A range of graphics queue commands recorded into one secondary command buffer
+    struct RecordingChunk {
+        size_t first;
+        size_t last;
+        // thrown by a callback on the recording thread, rethrown on the main thread
+        std::exception_ptr exception;
+    };
+    // Split at the pass starts into at most recordingThreads chunks of similar command counts by resolveCommands()
+    std::vector<RecordingChunk> recordingChunks;
+    // NOTE:
+    // Command pools are externally synchronized, every chunk has its own pool so the threads never share one
+    std::vector<VkCommandPool> recordingPools;
+    // by chunk, then indexed like commandBuffers
+    std::vector<std::vector<VkCommandBuffer>> recordingCommandBuffers;
+    void splitRecording();
+    // Records the chunks in parallel and executes them in order from commandBuffer
+    void recordChunks(VkCommandBuffer commandBuffer);
     void addComputePipeline(std::shared_ptr<VulkanShader> computeShader, std::vector<VkDescriptorSetLayout>& layouts);
     void addGraphicsPipeline(std::shared_ptr<VulkanShader> vertShader, std::shared_ptr<VulkanShader> fragShader);
     std::vector<VkPushConstantRange> getPushConstants(std::shared_ptr<VulkanRenderGraph::VulkanShader> shader);
@@ -104,9 +295,126 @@ class VulkanRenderGraph {
     std::unordered_map<std::string, std::shared_ptr<VulkanPipeline>> pipelines;
     //    std::vector<std::shared_ptr<GraphicsPipeline>> graphicsPipelines;
     bufferMap globalBuffers;
+    dirtyBufferMap dirtyBuffers;
     bufferCreateInfoMap bufferCreateInfos;
+    // indexed by BufferHandle, bufferSlots is null until the buffer exists and is kept in sync with globalBuffers
+    std::vector<std::string> bufferNames;
+    std::vector<std::shared_ptr<VulkanBuffer>> bufferSlots;
+    // The handle of name, adds it if it wasn't declared yet
+    BufferHandle bufferHandle(std::string name);
+    // Points the slot of every declared buffer at its current buffer
+    void updateBufferSlots();
+    std::vector<TransientBuffer> transientBuffers;
+    // indexed by BufferHandle, the index in transientBuffers or UINT32_MAX
+    std::vector<uint32_t> bufferTransients;
+    // dynamic offsets of the transient buffers in the current frame, indexed like transientBuffers
+    std::vector<uint32_t> transientOffsets;
+    std::unique_ptr<FrameRingBuffer> transientRing;
+    VkDeviceSize transientAlignment = 0;
+    bool transientFrameStarted = false;
+    // Sized in compile(), every transient buffer gets an aligned copy in the region of each frame
+    void createTransientRing();
+    // Waits for the current frame and allocates its copies of the transient buffers, once per frame
+    // NOTE:
+    // bufferWrite calls it before acquireNextImage, waiting on the timeline doesn't depend on the acquire
+    void startTransientFrame();
     imageInfosMap globalImageInfos;
+    // block name -> buffer name, for passes that bind buffers chosen by the caller
+    std::unordered_map<std::string, std::string> bufferAliases;
     std::vector<std::shared_ptr<VulkanShader>> shaders;
+    // Returns the shader already used for path, or adds a new one
+    // Shaders used by multiple passes share a pipeline and descriptors
+    std::shared_ptr<VulkanShader> getShader(std::string path);
+    // lastPass of the current graphics shader, read by drawIndirect to end the rendering
+    bool renderingLastPass = true;
+
+    // Buffer accesses of an op, recorded by the builder functions
+    // Images are left out, the ops that write them transition and synchronize them themselves
+    struct OpAccesses {
+        // index in renderOps, the inferred barriers go right before it
+        size_t op;
+        // names the op in the barrier reports
+        std::string label;
+        // shaders whose descriptor buffers the op accesses, only known after the reflection in compile()
+        std::vector<std::shared_ptr<VulkanShader>> shaders;
+        std::vector<BufferAccess> buffers;
+    };
+    std::vector<OpAccesses> opAccesses;
+    // accesses of the current graphics pass, drawIndirect adds its indirect buffers
+    // NOTE:
+    // Barriers can't be recorded inside a rendering, so graphics passes record their accesses at startRendering
+    size_t renderingAccesses = 0;
+    void recordAccesses(std::string label, std::vector<std::shared_ptr<VulkanShader>> shaders, std::vector<BufferAccess> buffers);
+    void addIndirectAccesses(BufferHandle buffer, BufferHandle countBuffer);
+    struct ManualBarrier {
+        size_t op;
+        VkAccessFlags2 srcAccessMask;
+        VkPipelineStageFlags2 srcStageMask;
+        VkAccessFlags2 dstAccessMask;
+        VkPipelineStageFlags2 dstStageMask;
+    };
+    std::vector<ManualBarrier> manualBarriers;
+    struct BufferBarrier {
+        std::string name;
+        VkPipelineStageFlags2 srcStageMask;
+        VkAccessFlags2 srcAccessMask;
+        VkPipelineStageFlags2 dstStageMask;
+        VkAccessFlags2 dstAccessMask;
+    };
+    // Tracks the last writer and the readers of every buffer through two frames of renderOps,
+    // the second frame starts after the first like every frame after it
+    // Inserts the barriers the accesses need with autoBarriers and reports the missing and redundant manual ones with
+    // validateBarriers, see vulkan_rendergraph_barriers.cpp
+    void compileBarriers();
+
+    // declared with scratchBuffer() and aliasScratchBuffers set
+    std::set<std::string> scratchBuffers;
+    // the memory the scratch buffers are bound into, one block per set of memory types
+    std::vector<VkDeviceMemory> scratchMemory;
+    // Places the scratch buffers in shared memory by their lifetimes in renderOps and inserts the barriers between the
+    // buffers that share memory, see vulkan_rendergraph_aliasing.cpp
+    void aliasScratchBuffers();
+
+    bool hasDepthPyramid = false;
+    std::vector<VkDescriptorImageInfo> depthImageInfos;
+    std::vector<VkDescriptorImageInfo> depthPyramidInfos;
+    std::vector<VkDescriptorImageInfo> depthPyramidLevelInfos;
+    // Points the depth image infos at the current swap chain
+    void updateDepthImageInfos();
+
+    bool hasVisibilityBuffer = false;
+    std::vector<VkDescriptorImageInfo> visibilityImageInfos;
+    void enableVisibilityBuffer();
+    void updateVisibilityImageInfos();
+    // NOTE:
+    // Must match the local size of the depth reduce shader
+    static const uint32_t depthReduceGroupSize = 8;
+
+    // NOTE:
+    // Must match radix_sort.glsl
+    static const uint32_t sortGroupSize = 256;
+    static const uint32_t sortItemsPerInvocation = 4;
+    static const uint32_t sortTileSize = sortGroupSize * sortItemsPerInvocation;
+    static const uint32_t sortRadixBits = 8;
+    static const uint32_t sortRadixSize = 1 << sortRadixBits;
+    struct SortPushConstants {
+        uint32_t count;
+        uint32_t shift;
+        uint32_t groupCount;
+    };
+    struct SortSpecData {
+        uint32_t subgroup_size;
+    } sortSpecData;
+    // pairs the temp buffers of the sort have room for
+    uint32_t sortCapacity = 0;
+    // Element count of a uint buffer, defined by the graph or not
+    uint32_t uintBufferCount(std::string name);
+    // Grows the temp buffers of the sort to the smaller of its keys and values buffers
+    void resizeSortBuffers();
+    BufferHandle sortKeysTempBuffer;
+    BufferHandle sortValuesTempBuffer;
+    BufferHandle sortHistogramsBuffer;
+    BufferHandle sortScanStatesBuffer;
 
     // Adds support for multiple push constant layouts in a single pipeline
     // For example, if you want different push constants for vertex and fragment shader
@@ -115,28 +423,199 @@ class VulkanRenderGraph {
     void startFrame();
     bool endFrame();
 
+    // Host memory a recording reads, a command buffer is recorded again once any of it changed
+    struct RecordInput {
+        const void* data;
+        size_t size;
+    };
+    // registered by the callbacks, resolveCommands() adds the inputs of the commands
+    std::vector<RecordInput> callbackInputs;
+    std::vector<RecordInput> recordInputs;
+    size_t recordInputsSize = 0;
+    // DirtyRangeBuffers flushed by upload()
+    std::vector<std::shared_ptr<DirtyRangeBuffer>> uploadBuffers;
+    // true if the uploads were added in the async compute section, they all have to be on the same queue
+    bool asyncUploads = false;
+    // One per frame in flight, recorded every frame so the reused command buffers don't depend on what is dirty
+    // Submitted first on the queue of the uploads, from its command pool
+    std::vector<VkCommandBuffer> uploadCommandBuffers;
+    // true if the upload command buffer of the current frame copies anything this frame
+    bool uploading = false;
+    void createUploadCommandBuffers();
+    // Flushes the uploaded buffers between a barrier after the previous frames and one before every later command
+    void recordUploads();
+    // What a command buffer was recorded with
+    struct RecordedState {
+        uint64_t generation = 0;
+        std::vector<char> inputs;
+    };
+    std::vector<RecordedState> recordedStates;
+    // Bumped when the commands or the swap chain change, invalidating every recorded command buffer
+    uint64_t commandGeneration = 1;
+    // true if the current command buffer is recorded this frame
+    bool recording = true;
+    // Compares the recorded state of the current command buffer with the inputs and updates it
+    bool needsRecording();
+
     void recreateSwapChain();
 
-    std::vector<RenderOp> renderOps;
-    void recordRenderOps(VkCommandBuffer commandBuffer);
-    RenderOp bindPipeline(std::shared_ptr<VulkanRenderGraph::VulkanShader> shader);
-    RenderOp bindDescriptorSets(std::shared_ptr<VulkanShader> shader);
-    RenderOp pushConstants(std::shared_ptr<VulkanShader> shader, void* data);
-    RenderOp fillBufferOp(std::string bufferName, VkDeviceSize offset, VkDeviceSize size, uint32_t value);
-    RenderOp dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ);
-    RenderOp drawIndexedIndirectCount(std::string bufferName, VkDeviceSize offset, std::string countBufferName,
-                                      VkDeviceSize countBufferOffset, uint32_t maxDrawCount, uint32_t stride);
-    RenderOp startRendering();
-    RenderOp endRendering();
-    RenderOp writeTimestamp(VkPipelineStageFlags2 stageFlags, VkQueryPool queryPool, uint32_t query);
-    RenderOp resetQueryPool(VkQueryPool queryPool, uint32_t firstQuery, uint32_t count);
-    RenderOp bindVertexBuffer(std::shared_ptr<VulkanBuffer> vertexBuffer);
-    RenderOp bindIndexBuffer(std::shared_ptr<VulkanBuffer> indexBuffer);
-
-    RenderOp memoryBarrierOp(VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 dstAccessMask,
-                             VkPipelineStageFlags2 dstStageMask);
-    RenderOp setViewportOp(VkViewport viewport);
-    RenderOp setScissorOp(VkRect2D scissor);
+    // A render op as a tagged POD command
+    // The builder functions fill in what they know, resolveCommands() lowers the ops into commands with every handle resolved,
+    // so recording a frame is a switch over a flat array without lookups, string work or allocation
+    struct RenderCommand {
+        enum Type : uint32_t {
+            BIND_PIPELINE,
+            // one BIND_DESCRIPTOR_SETS per shader in renderOps, one per set in commands
+            BIND_DESCRIPTOR_SETS,
+            PUSH_CONSTANTS,
+            DISPATCH,
+            // group counts are read through the pointers when recorded
+            DISPATCH_DYNAMIC,
+            DRAW,
+            DRAW_INDEXED_INDIRECT_COUNT,
+            FILL_BUFFER,
+            BIND_VERTEX_BUFFER,
+            BIND_INDEX_BUFFER,
+            MEMORY_BARRIER,
+            // pendingBufferBarriers index in renderOps, bufferBarriers range in commands
+            BUFFER_BARRIERS,
+            WRITE_TIMESTAMP,
+            RESET_QUERY_POOL,
+            // ops that depend on the frame, like the acquired swap chain image, run from callbacks
+            CALLBACK,
+            // end of the async compute section, only in renderOps
+            ASYNC_COMPUTE_END,
+        } type;
+        // what resolveCommands() resolves the handles from, the buffers are BufferHandle indices
+        VulkanShader* shader;
+        uint32_t buffer;
+        uint32_t countBuffer;
+        // the pass binds all the state it uses from here on, so a secondary command buffer can start at this command
+        bool passStart;
+        union {
+            struct {
+                VkPipelineBindPoint bindPoint;
+                VkPipeline pipeline;
+            } bindPipeline;
+            struct {
+                VkPipelineBindPoint bindPoint;
+                VkPipelineLayout layout;
+                uint32_t set;
+                // indexed by frame in flight, the same set for every frame without per frame bindings
+                VkDescriptorSet descriptorSets[VulkanSwapChain::MAX_FRAMES_IN_FLIGHT];
+                // range in dynamicOffsets
+                uint32_t firstDynamicOffset;
+                uint32_t dynamicOffsetCount;
+            } bindDescriptorSet;
+            struct {
+                VkPipelineLayout layout;
+                VkShaderStageFlags stageFlags;
+                uint32_t offset;
+                uint32_t size;
+                const void* data;
+            } pushConstants;
+            struct {
+                uint32_t x, y, z;
+            } dispatch;
+            struct {
+                const uint32_t *x, *y, *z;
+            } dispatchDynamic;
+            struct {
+                uint32_t vertexCount;
+            } draw;
+            struct {
+                VkBuffer buffer;
+                VkDeviceSize offset;
+                VkBuffer countBuffer;
+                VkDeviceSize countBufferOffset;
+                // added per frame for the buffers with a copy per frame in flight, 0 otherwise
+                VkDeviceSize bufferFrameStride;
+                VkDeviceSize countBufferFrameStride;
+                // read through dynamicMaxDrawCount when it is set
+                uint32_t maxDrawCount;
+                const uint32_t* dynamicMaxDrawCount;
+                uint32_t stride;
+            } drawIndirect;
+            struct {
+                VkBuffer buffer;
+                VkDeviceSize offset;
+                VkDeviceSize size;
+                uint32_t value;
+                VkDeviceSize frameStride;
+            } fillBuffer;
+            struct {
+                VkBuffer buffer;
+            } bindBuffer;
+            VkMemoryBarrier2 memoryBarrier;
+            struct {
+                uint32_t first;
+                uint32_t count;
+            } bufferBarriers;
+            struct {
+                VkPipelineStageFlags2 stage;
+                VkQueryPool queryPool;
+                uint32_t query;
+            } timestamp;
+            struct {
+                VkQueryPool queryPool;
+                uint32_t firstQuery;
+                uint32_t count;
+            } resetQueryPool;
+            struct {
+                uint32_t index;
+            } callback;
+        };
+    };
+    // The ops in builder order, lowered into commands by resolveCommands()
+    std::vector<RenderCommand> renderOps;
+    std::vector<RenderCommand> commands;
+    std::vector<RenderOp> callbacks;
+    std::vector<std::vector<BufferBarrier>> pendingBufferBarriers;
+    std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+    // dynamic offsets of the BIND_DESCRIPTOR_SETS commands, refreshed from transientOffsets before recording
+    std::vector<uint32_t> dynamicOffsets;
+    std::vector<uint32_t> dynamicOffsetTransients;
+    // SortScanStates, reset by the sort callback between its passes
+    VkBuffer sortScanStates = VK_NULL_HANDLE;
+    double _recordTime = 0.0;
+    bool compiled = false;
+    RenderCommand makeCommand(RenderCommand::Type type, VulkanShader* shader = nullptr);
+    // Lowers renderOps into commands, again after the buffers or the swap chain were recreated
+    void resolveCommands();
+    void recordRenderOps(VkCommandBuffer commandBuffer, size_t first, size_t last);
+    RenderCommand callback(RenderOp op);
+    RenderCommand bindPipeline(std::shared_ptr<VulkanRenderGraph::VulkanShader> shader);
+    RenderCommand bindDescriptorSets(std::shared_ptr<VulkanShader> shader);
+    RenderCommand pushConstants(std::shared_ptr<VulkanShader> shader, void* data);
+    RenderCommand fillBufferOp(BufferHandle buffer, VkDeviceSize offset, VkDeviceSize size, uint32_t value);
+    RenderCommand dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ);
+    RenderCommand dispatch(uint32_t* groupCountX, uint32_t* groupCountY, uint32_t* groupCountZ);
+    void addComputeShader(std::shared_ptr<VulkanShader> shader, ShaderOptions shaderOptions);
+    void rebindBuffer(std::string name, std::shared_ptr<VulkanBuffer> oldBuffer);
+    RenderCommand drawIndexedIndirectCount(BufferHandle buffer, VkDeviceSize offset, BufferHandle countBuffer,
+                                           VkDeviceSize countBufferOffset, uint32_t maxDrawCount, uint32_t stride);
+    RenderCommand drawIndexedIndirectCount(BufferHandle buffer, VkDeviceSize offset, BufferHandle countBuffer,
+                                           VkDeviceSize countBufferOffset, uint32_t* maxDrawCount, uint32_t stride);
+    RenderCommand startRendering(RenderingOptions renderingOptions);
+    RenderCommand draw(uint32_t vertexCount);
+    RenderCommand endRendering(bool present);
+    RenderCommand reduceDepthOp(std::shared_ptr<VulkanShader> shader);
+    RenderCommand sortOp(std::shared_ptr<VulkanShader> countShader, std::shared_ptr<VulkanShader> scanShader,
+                         std::shared_ptr<VulkanShader> scatterShader, uint32_t* count, uint32_t keyBits);
+    RenderCommand writeTimestamp(VkPipelineStageFlags2 stageFlags, VkQueryPool queryPool, uint32_t query);
+    RenderCommand resetQueryPool(VkQueryPool queryPool, uint32_t firstQuery, uint32_t count);
+    RenderCommand bindVertexBuffer(std::shared_ptr<VulkanBuffer> vertexBuffer);
+    RenderCommand bindIndexBuffer(std::shared_ptr<VulkanBuffer> indexBuffer);
+
+    RenderCommand memoryBarrierOp(VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 dstAccessMask,
+                                  VkPipelineStageFlags2 dstStageMask);
+    // For the callbacks, records the barrier right away
+    static void recordMemoryBarrier(VkCommandBuffer commandBuffer, VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask,
+                                    VkAccessFlags2 dstAccessMask, VkPipelineStageFlags2 dstStageMask);
+    // One vkCmdPipelineBarrier2 with a buffer barrier per element
+    RenderCommand bufferBarriersOp(std::vector<BufferBarrier> barriers);
+    // Inserts op before renderOps[index], moving the op indices recorded by the builder
+    void insertRenderOp(size_t index, RenderCommand op);
 };
 
 #endif // VULKAN_RENDERGRAPH_H_
@@ -0,0 +1,159 @@
+#include "common.hpp"
+#include "vulkan_rendergraph.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <vulkan/vulkan_core.h>
+
+namespace {
+struct ScratchBuffer {
+    std::string name;
+    std::shared_ptr<VulkanBuffer> buffer;
+    VkMemoryRequirements requirements;
+    // first and last renderOps index that accesses the buffer
+    size_t first;
+    size_t last;
+    VkPipelineStageFlags2 stages = 0;
+    VkAccessFlags2 access = 0;
+    VkDeviceSize offset = 0;
+};
+
+bool overlaps(const ScratchBuffer& a, const ScratchBuffer& b) { return a.first <= b.last && b.first <= a.last; }
+
+bool sharesMemory(const ScratchBuffer& a, const ScratchBuffer& b) {
+    return a.offset < b.offset + b.requirements.size && b.offset < a.offset + a.requirements.size;
+}
+
+VkDeviceSize alignUp(VkDeviceSize offset, VkDeviceSize alignment) { return (offset + alignment - 1) / alignment * alignment; }
+} // namespace
+
+void VulkanRenderGraph::insertRenderOp(size_t index, RenderCommand op) {
+    renderOps.insert(renderOps.begin() + index, op);
+    for (OpAccesses& accesses : opAccesses) {
+        if (accesses.op >= index) {
+            ++accesses.op;
+        }
+    }
+    for (ManualBarrier& barrier : manualBarriers) {
+        if (barrier.op >= index) {
+            ++barrier.op;
+        }
+    }
+    if (asyncComputeEnd > 0 && asyncComputeEnd >= index) {
+        ++asyncComputeEnd;
+    }
+}
+
+void VulkanRenderGraph::aliasScratchBuffers() {
+    size_t opCount = renderOps.size();
+    std::map<std::string, ScratchBuffer> buffers;
+    for (const std::string& name : scratchBuffers) {
+        // host visible scratch buffers were created with their own memory
+        if (globalBuffers.count(name) == 1 && globalBuffers.at(name)->memory() == VK_NULL_HANDLE) {
+            std::shared_ptr<VulkanBuffer> buffer = globalBuffers.at(name);
+            buffers[name] = {name, buffer, buffer->memoryRequirements(), SIZE_MAX, 0};
+        }
+    }
+    if (buffers.empty()) {
+        return;
+    }
+
+    for (const OpAccesses& op : opAccesses) {
+        std::vector<BufferAccess> accesses = op.buffers;
+        for (const std::shared_ptr<VulkanShader>& shader : op.shaders) {
+            accesses.insert(accesses.end(), shader->bufferAccesses.begin(), shader->bufferAccesses.end());
+        }
+        for (const BufferAccess& access : accesses) {
+            if (buffers.count(access.name) == 1) {
+                ScratchBuffer& buffer = buffers.at(access.name);
+                buffer.first = std::min(buffer.first, op.op);
+                buffer.last = std::max(buffer.last, op.op);
+                buffer.stages |= access.stage;
+                buffer.access |= access.access;
+            }
+        }
+    }
+    for (auto& [name, buffer] : buffers) {
+        // NOTE:
+        // Buffers the graph doesn't see the accesses of, like the ones bound by the sort, and the buffers of the async compute
+        // section live for the whole frame, so they are pooled but never share memory
+        // The section of the next frame runs while the graphics commands of this one still do
+        if (buffer.first == SIZE_MAX || (asyncCompute && buffer.first < asyncComputeEnd)) {
+            buffer.first = 0;
+            buffer.last = opCount;
+            buffer.stages = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            buffer.access = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+        }
+    }
+
+    // Largest first, every buffer goes into the lowest gap between the placed buffers that are alive at the same time
+    // Buffers with different memory types go into different blocks
+    std::map<uint32_t, std::vector<ScratchBuffer*>> blocks;
+    for (auto& [name, buffer] : buffers) {
+        blocks[buffer.requirements.memoryTypeBits].push_back(&buffer);
+    }
+    VkDeviceSize totalSize = 0;
+    VkDeviceSize aliasedSize = 0;
+    for (auto& [memoryTypeBits, blockBuffers] : blocks) {
+        std::sort(blockBuffers.begin(), blockBuffers.end(),
+                  [](const ScratchBuffer* a, const ScratchBuffer* b) { return a->requirements.size > b->requirements.size; });
+        VkMemoryRequirements blockRequirements{0, 1, memoryTypeBits};
+        std::vector<ScratchBuffer*> placed;
+        for (ScratchBuffer* buffer : blockBuffers) {
+            std::vector<ScratchBuffer*> alive;
+            for (ScratchBuffer* other : placed) {
+                if (overlaps(*buffer, *other)) {
+                    alive.push_back(other);
+                }
+            }
+            std::sort(alive.begin(), alive.end(), [](const ScratchBuffer* a, const ScratchBuffer* b) { return a->offset < b->offset; });
+            VkDeviceSize offset = 0;
+            for (ScratchBuffer* other : alive) {
+                if (alignUp(offset, buffer->requirements.alignment) + buffer->requirements.size <= other->offset) {
+                    break;
+                }
+                offset = std::max(offset, other->offset + other->requirements.size);
+            }
+            buffer->offset = alignUp(offset, buffer->requirements.alignment);
+            placed.push_back(buffer);
+            blockRequirements.size = std::max(blockRequirements.size, buffer->offset + buffer->requirements.size);
+            blockRequirements.alignment = std::max(blockRequirements.alignment, buffer->requirements.alignment);
+            totalSize += buffer->requirements.size;
+        }
+        VkDeviceMemory memory = _device->allocateMemory(blockRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        scratchMemory.push_back(memory);
+        for (ScratchBuffer* buffer : blockBuffers) {
+            buffer->buffer->bind(memory, buffer->offset);
+        }
+        aliasedSize += blockRequirements.size;
+    }
+
+    // NOTE:
+    // A buffer barrier only covers its own buffer, so the buffers that share memory are ordered with memory barriers
+    // The previous user of the memory is either earlier in the frame or later in the previous frame,
+    // either way its accesses have to finish before the first access of the next buffer
+    std::map<size_t, VkMemoryBarrier2> barriers;
+    for (auto& [name, buffer] : buffers) {
+        for (auto& [otherName, other] : buffers) {
+            if (name == otherName || overlaps(buffer, other) || !sharesMemory(buffer, other) ||
+                buffer.requirements.memoryTypeBits != other.requirements.memoryTypeBits) {
+                continue;
+            }
+            VkMemoryBarrier2& barrier = barriers[buffer.first];
+            barrier.srcStageMask |= other.stages;
+            barrier.srcAccessMask |= other.access & (VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT);
+            barrier.dstStageMask |= buffer.stages;
+            barrier.dstAccessMask |= buffer.access;
+        }
+    }
+    // from the back, so the indices of the earlier insertions stay valid
+    for (auto barrier = barriers.rbegin(); barrier != barriers.rend(); ++barrier) {
+        insertRenderOp(barrier->first, memoryBarrierOp(barrier->second.srcAccessMask, barrier->second.srcStageMask,
+                                                       barrier->second.dstAccessMask, barrier->second.dstStageMask));
+    }
+
+    std::cout << "Aliased " << buffers.size() << " scratch buffers into " << aliasedSize / (1024.0 * 1024.0) << " MiB instead of "
+              << totalSize / (1024.0 * 1024.0) << " MiB, saving " << (totalSize - aliasedSize) / (1024.0 * 1024.0) << " MiB with "
+              << barriers.size() << " barriers" << std::endl;
+}
@@ -0,0 +1,279 @@
+#include "common.hpp"
+#include "vulkan_rendergraph.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vulkan/vulkan_core.h>
+
+namespace {
+const VkAccessFlags2 readAccesses = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_UNIFORM_READ_BIT |
+                                    VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_HOST_READ_BIT;
+const VkAccessFlags2 writeAccesses = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT;
+
+// Logical order of the graphics stages, a barrier scope includes the stages before (first scope) or after (second scope) its stages
+const VkPipelineStageFlags2 graphicsStages[] = {
+    VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,          VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT,
+    VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+    VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT,   VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+    VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,    VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+};
+const VkPipelineStageFlags2 allGraphics = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT |
+                                          VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT |
+                                          VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT |
+                                          VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+const VkPipelineStageFlags2 allCommands = allGraphics | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+
+VkPipelineStageFlags2 expandStages(VkPipelineStageFlags2 stages, bool firstScope) {
+    if (stages & VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT) {
+        stages |= allCommands;
+    }
+    if (stages & VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT) {
+        stages |= allGraphics;
+    }
+    // compute only follows the indirect stage
+    if (firstScope && (stages & VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT)) {
+        stages |= VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT;
+    }
+    if (!firstScope && (stages & VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT)) {
+        stages |= VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    }
+    size_t count = sizeof(graphicsStages) / sizeof(graphicsStages[0]);
+    for (size_t i = 0; i < count; ++i) {
+        if (stages & graphicsStages[i]) {
+            for (size_t j = 0; j < count; ++j) {
+                if (firstScope ? j < i : j > i) {
+                    stages |= graphicsStages[j];
+                }
+            }
+        }
+    }
+    return stages & (allCommands | VK_PIPELINE_STAGE_2_HOST_BIT);
+}
+
+VkAccessFlags2 expandAccess(VkAccessFlags2 access) {
+    if (access & VK_ACCESS_2_MEMORY_READ_BIT) {
+        access |= readAccesses;
+    }
+    if (access & VK_ACCESS_2_MEMORY_WRITE_BIT) {
+        access |= writeAccesses;
+    }
+    if (access & VK_ACCESS_2_SHADER_READ_BIT) {
+        access |= VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+    }
+    if (access & VK_ACCESS_2_SHADER_WRITE_BIT) {
+        access |= VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    }
+    return access & (readAccesses | writeAccesses);
+}
+
+bool covers(VkFlags64 mask, VkFlags64 flags) { return flags != 0 && (mask & flags) == flags; }
+
+struct BufferState {
+    // the last write
+    VkPipelineStageFlags2 writeStages = 0;
+    VkAccessFlags2 writeAccess = 0;
+    size_t writePosition = 0;
+    std::string writeLabel;
+    // the write is available once a barrier covers it, and visible to these stages and accesses
+    bool available = false;
+    VkPipelineStageFlags2 visibleStages = 0;
+    VkAccessFlags2 visibleAccess = 0;
+    // stages that only start after the write finished, through a chain of barriers
+    VkPipelineStageFlags2 writeChain = 0;
+    // the reads since the last write and the stages that only start after they finished
+    VkPipelineStageFlags2 readStages = 0;
+    size_t readPosition = 0;
+    std::string readLabel;
+    VkPipelineStageFlags2 readChain = 0;
+    // manual barriers that made the write visible or ordered the reads
+    std::set<size_t> writeBarriers;
+    std::set<size_t> readBarriers;
+};
+} // namespace
+
+void VulkanRenderGraph::compileBarriers() {
+    bool validate = _settings->validateBarriers;
+    size_t opCount = renderOps.size();
+
+    // The accesses of an op by buffer, the reflection of its shaders is known now
+    std::map<size_t, std::map<std::string, BufferAccess>> accesses;
+    std::map<size_t, std::string> labels;
+    std::set<std::string> writtenBuffers;
+    for (const OpAccesses& op : opAccesses) {
+        std::vector<BufferAccess> buffers = op.buffers;
+        for (const std::shared_ptr<VulkanShader>& shader : op.shaders) {
+            buffers.insert(buffers.end(), shader->bufferAccesses.begin(), shader->bufferAccesses.end());
+        }
+        for (const BufferAccess& buffer : buffers) {
+            BufferAccess& access = accesses[op.op].emplace(buffer.name, BufferAccess{buffer.name, 0, 0}).first->second;
+            access.stage |= buffer.stage;
+            access.access |= buffer.access;
+            if (buffer.access & writeAccesses) {
+                writtenBuffers.insert(buffer.name);
+            }
+        }
+        labels[op.op] = op.label;
+    }
+    // NOTE:
+    // The host reads the host visible buffers the frame wrote after waiting for it on the device timeline,
+    // the writes still have to be made available to the host
+    for (const std::string& name : writtenBuffers) {
+        if (globalBuffers.at(name)->memoryProperties() & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            accesses[opCount][name] = {name, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT};
+        }
+    }
+    labels[opCount] = "host readback";
+    std::map<size_t, const ManualBarrier*> manual;
+    for (const ManualBarrier& barrier : manualBarriers) {
+        manual[barrier.op] = &barrier;
+    }
+
+    std::map<std::string, BufferState> states;
+    // inferred barriers by the op they go before
+    std::map<size_t, std::vector<BufferBarrier>> batches;
+    std::set<size_t> usedBarriers;
+    std::set<std::string> missing;
+    auto addBarrier = [&](size_t index, BufferBarrier barrier) {
+        for (BufferBarrier& batched : batches[index]) {
+            if (batched.name == barrier.name) {
+                batched.srcStageMask |= barrier.srcStageMask;
+                batched.srcAccessMask |= barrier.srcAccessMask;
+                batched.dstStageMask |= barrier.dstStageMask;
+                batched.dstAccessMask |= barrier.dstAccessMask;
+                return;
+            }
+        }
+        batches[index].push_back(barrier);
+    };
+
+    // NOTE:
+    // The first frame starts without accesses, the second one after the first like every frame after it
+    // Barriers are only inserted and reported in the second frame, they cover the first one too
+    for (size_t frame = 0; frame < 2; ++frame) {
+        bool emit = frame == 1;
+        // the barriers of a frame are inserted at the latest barrier point that is after the conflicting accesses
+        size_t batchPosition = SIZE_MAX;
+        for (size_t index = 0; index <= opCount; ++index) {
+            size_t position = frame * (opCount + 1) + index;
+            if (manual.count(index) == 1 && validate) {
+                const ManualBarrier& barrier = *manual.at(index);
+                VkPipelineStageFlags2 srcStages = expandStages(barrier.srcStageMask, true);
+                VkPipelineStageFlags2 dstStages = expandStages(barrier.dstStageMask, false);
+                VkAccessFlags2 srcAccess = expandAccess(barrier.srcAccessMask);
+                VkAccessFlags2 dstAccess = expandAccess(barrier.dstAccessMask);
+                for (auto& [name, state] : states) {
+                    if (covers(srcStages, state.writeStages) && covers(srcAccess, state.writeAccess)) {
+                        state.available = true;
+                    }
+                    if (srcStages & state.writeChain) {
+                        state.writeChain |= dstStages;
+                        if (state.available) {
+                            state.visibleStages |= dstStages;
+                            state.visibleAccess |= dstAccess;
+                            state.writeBarriers.insert(index);
+                        }
+                    }
+                    if (srcStages & state.readChain) {
+                        state.readChain |= dstStages;
+                        state.readBarriers.insert(index);
+                    }
+                }
+            } else if (manual.count(index) == 1 && emit) {
+                batchPosition = position;
+            }
+            if (accesses.count(index) == 0) {
+                continue;
+            }
+
+            for (const auto& [name, access] : accesses.at(index)) {
+                BufferState& state = states[name];
+                bool writes = access.access & writeAccesses;
+                // read after write needs the write to be visible, write after write only available and finished,
+                // write after read only needs the reads to finish
+                VkAccessFlags2 reads = access.access & readAccesses;
+                bool writeHazard = state.writeStages != 0 && !(covers(state.visibleStages, access.stage) &&
+                                                               (reads == 0 || covers(state.visibleAccess, reads)));
+                bool readHazard = writes && state.readStages != 0 && !covers(state.readChain, access.stage);
+                if (writeHazard || readHazard) {
+                    size_t conflict = std::max(writeHazard ? state.writePosition : 0, readHazard ? state.readPosition : 0);
+                    if (validate && emit) {
+                        missing.insert(labels.at(index) + " accesses " + name + " after " +
+                                       (writeHazard ? state.writeLabel : state.readLabel) + " without a barrier");
+                    } else if (!validate && emit) {
+                        if (batchPosition == SIZE_MAX || batchPosition <= conflict) {
+                            batchPosition = position;
+                        }
+                        addBarrier(batchPosition - frame * (opCount + 1),
+                                   {name, (writeHazard ? state.writeStages : 0) | (readHazard ? state.readStages : 0),
+                                    writeHazard ? state.writeAccess : 0, access.stage, writeHazard ? access.access : 0});
+                    }
+                    // the access behaves as if the barrier was there, so one missing barrier is reported once
+                    if (writeHazard) {
+                        state.available = true;
+                        state.visibleStages |= access.stage;
+                        state.visibleAccess |= access.access;
+                        state.writeChain |= access.stage;
+                    }
+                    state.readChain |= access.stage;
+                } else if (emit) {
+                    if (state.writeStages != 0) {
+                        usedBarriers.insert(state.writeBarriers.begin(), state.writeBarriers.end());
+                    }
+                    if (writes && state.readStages != 0) {
+                        usedBarriers.insert(state.readBarriers.begin(), state.readBarriers.end());
+                    }
+                }
+
+                if (writes) {
+                    state = BufferState{};
+                    state.writeStages = access.stage;
+                    state.writeAccess = access.access & writeAccesses;
+                    state.writePosition = position;
+                    state.writeLabel = labels.at(index);
+                    state.writeChain = access.stage;
+                } else if (access.stage != VK_PIPELINE_STAGE_2_HOST_BIT) {
+                    // NOTE:
+                    // The frame waits order the host reads before the next frame that writes the buffer
+                    // A new read isn't ordered by the barriers after the earlier reads
+                    state.readStages |= access.stage;
+                    state.readPosition = position;
+                    state.readLabel = labels.at(index);
+                    state.readChain = 0;
+                    state.readBarriers.clear();
+                }
+            }
+        }
+    }
+
+    if (validate) {
+        for (const std::string& report : missing) {
+            std::cout << "Barrier validation: " << report << std::endl;
+        }
+        for (const ManualBarrier& barrier : manualBarriers) {
+            if (usedBarriers.count(barrier.op) == 0) {
+                // the host readback is always after the last barrier
+                auto next = accesses.upper_bound(barrier.op);
+                std::cout << "Barrier validation: the barrier before " << labels.at(next == accesses.end() ? opCount : next->first)
+                          << " orders no tracked buffer access, it might only be needed for images" << std::endl;
+            }
+        }
+        return;
+    }
+
+    std::vector<RenderCommand> ops;
+    size_t barrierCount = 0;
+    for (size_t index = 0; index <= opCount; ++index) {
+        if (batches.count(index) == 1) {
+            ops.push_back(bufferBarriersOp(batches.at(index)));
+            barrierCount += batches.at(index).size();
+        }
+        if (index < opCount && manual.count(index) == 0) {
+            ops.push_back(renderOps[index]);
+        }
+    }
+    renderOps = ops;
+    std::cout << "Inferred " << barrierCount << " buffer barriers in " << batches.size() << " batches, replacing "
+              << manualBarriers.size() << " manual barriers" << std::endl;
+}
@@ -1,15 +1,31 @@
 #include "common.hpp"
 #include "vulkan_pipeline.hpp"
 #include "vulkan_rendergraph.hpp"
+#include <algorithm>
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <set>
 #include <stdexcept>
 #include <vulkan/vulkan_core.h>
 
-VulkanRenderGraph& VulkanRenderGraph::shader(std::string computePath, uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ,
-                                             ShaderOptions shaderOptions) {
-    std::shared_ptr<VulkanRenderGraph::VulkanShader> shader = std::make_shared<VulkanRenderGraph::VulkanShader>(computePath, _device);
-    shaders.push_back(shader);
+std::shared_ptr<VulkanRenderGraph::VulkanShader> VulkanRenderGraph::getShader(std::string path) {
+    for (std::shared_ptr<VulkanShader> shader : shaders) {
+        if (shader->path == path) {
+            return shader;
+        }
+    }
+    shaders.push_back(std::make_shared<VulkanRenderGraph::VulkanShader>(path, _device));
+    return shaders.back();
+}
+
+void VulkanRenderGraph::recordAccesses(std::string label, std::vector<std::shared_ptr<VulkanShader>> shaders,
+                                       std::vector<BufferAccess> buffers) {
+    opAccesses.push_back({renderOps.size(), label, shaders, buffers});
+}
+
+void VulkanRenderGraph::addComputeShader(std::shared_ptr<VulkanShader> shader, ShaderOptions shaderOptions) {
+    recordAccesses(shader->path, {shader}, {});
     renderOps.push_back(bindPipeline(shader));
     renderOps.push_back(bindDescriptorSets(shader));
     ShaderOptions defaultOptions{};
@@ -19,6 +35,18 @@ VulkanRenderGraph& VulkanRenderGraph::shader(std::string computePath, uint32_t g
         renderOps.push_back(pushConstants(shader, shaderOptions.pushConstantData));
     }
     shader->specInfo.pData = shaderOptions.specData;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::shader(std::string computePath, uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ,
+                                             ShaderOptions shaderOptions) {
+    addComputeShader(getShader(computePath), shaderOptions);
+    renderOps.push_back(dispatch(groupCountX, groupCountY, groupCountZ));
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::shader(std::string computePath, uint32_t* groupCountX, uint32_t* groupCountY, uint32_t* groupCountZ,
+                                             ShaderOptions shaderOptions) {
+    addComputeShader(getShader(computePath), shaderOptions);
     renderOps.push_back(dispatch(groupCountX, groupCountY, groupCountZ));
     return *this;
 }
@@ -26,11 +54,25 @@ VulkanRenderGraph& VulkanRenderGraph::shader(std::string computePath, uint32_t g
 VulkanRenderGraph& VulkanRenderGraph::shader(std::string vertPath, std::string fragPath, ShaderOptions vertOptions,
                                              ShaderOptions fragOptions, std::shared_ptr<VulkanBuffer> vertexBuffer,
                                              std::shared_ptr<VulkanBuffer> indexBuffer) {
-    std::shared_ptr<VulkanRenderGraph::VulkanShader> vert = std::make_shared<VulkanRenderGraph::VulkanShader>(vertPath, _device);
-    std::shared_ptr<VulkanRenderGraph::VulkanShader> frag = std::make_shared<VulkanRenderGraph::VulkanShader>(fragPath, _device);
-    shaders.push_back(vert);
-    shaders.push_back(frag);
-    renderOps.push_back(startRendering());
+    shader(vertPath, fragPath, vertOptions, fragOptions, vertexBuffer, indexBuffer, RenderingOptions{});
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::shader(std::string vertPath, std::string fragPath, ShaderOptions vertOptions,
+                                             ShaderOptions fragOptions, std::shared_ptr<VulkanBuffer> vertexBuffer,
+                                             std::shared_ptr<VulkanBuffer> indexBuffer, RenderingOptions renderingOptions) {
+    // NOTE:
+    // fragment always has to come right after vertex in shaders, see compile()
+    std::shared_ptr<VulkanRenderGraph::VulkanShader> vert = getShader(vertPath);
+    std::shared_ptr<VulkanRenderGraph::VulkanShader> frag = getShader(fragPath);
+    if (renderingOptions.visibilityBuffer) {
+        enableVisibilityBuffer();
+        frag->visibilityOutput = true;
+    }
+    renderingAccesses = opAccesses.size();
+    recordAccesses(vertPath + " " + fragPath, {vert, frag}, {});
+    renderOps.push_back(startRendering(renderingOptions));
+    renderingLastPass = renderingOptions.lastPass;
 
     renderOps.push_back(bindPipeline(vert));
     // FIXME:
@@ -60,24 +102,180 @@ VulkanRenderGraph& VulkanRenderGraph::shader(std::string vertPath, std::string f
     return *this;
 }
 
-VulkanRenderGraph& VulkanRenderGraph::buffer(std::string name, uint32_t count) {
-    buffer(name, count, 0, 0);
+VulkanRenderGraph& VulkanRenderGraph::shader(std::string vertPath, ShaderOptions vertOptions, std::shared_ptr<VulkanBuffer> vertexBuffer,
+                                             std::shared_ptr<VulkanBuffer> indexBuffer, RenderingOptions renderingOptions) {
+    std::shared_ptr<VulkanRenderGraph::VulkanShader> vert = getShader(vertPath);
+    vert->depthOnly = true;
+    renderingAccesses = opAccesses.size();
+    recordAccesses(vertPath, {vert}, {});
+    renderOps.push_back(startRendering(renderingOptions));
+    renderingLastPass = renderingOptions.lastPass;
+
+    renderOps.push_back(bindPipeline(vert));
+    renderOps.push_back(bindDescriptorSets(vert));
+    ShaderOptions defaultOptions{};
+    if (vertOptions.pushConstantData != defaultOptions.pushConstantData) {
+        renderOps.push_back(pushConstants(vert, vertOptions.pushConstantData));
+    }
+    renderOps.push_back(bindVertexBuffer(vertexBuffer));
+    if (vert->hasSpecConstants) {
+        vert->specInfo.pData = vertOptions.specData;
+    }
+    renderOps.push_back(bindIndexBuffer(indexBuffer));
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::resolve(std::string vertPath, std::string fragPath, ShaderOptions fragOptions,
+                                              RenderingOptions renderingOptions) {
+    enableVisibilityBuffer();
+    std::shared_ptr<VulkanRenderGraph::VulkanShader> vert = getShader(vertPath);
+    std::shared_ptr<VulkanRenderGraph::VulkanShader> frag = getShader(fragPath);
+    // NOTE:
+    // The swap chain and its visibility image change on resize, so the image is read when the op is recorded
+    renderOps.push_back(callback([=](VkCommandBuffer commandBuffer) {
+        _device->transitionImageLayout(commandBuffer, swapChain->getVisibilityImage(), VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                       VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
+    }));
+    // every pixel is shaded once, the depth is only kept for the passes after this one
+    renderingOptions.depthCompareOp = VK_COMPARE_OP_ALWAYS;
+    renderingOptions.depthWrite = false;
+    renderingOptions.loadDepth = true;
+    recordAccesses(vertPath + " " + fragPath, {vert, frag}, {});
+    renderOps.push_back(startRendering(renderingOptions));
+    renderingLastPass = renderingOptions.lastPass;
+
+    renderOps.push_back(bindPipeline(vert));
+    renderOps.push_back(bindDescriptorSets(vert));
+    renderOps.push_back(bindDescriptorSets(frag));
+    ShaderOptions defaultOptions{};
+    if (fragOptions.pushConstantData != defaultOptions.pushConstantData) {
+        renderOps.push_back(pushConstants(frag, fragOptions.pushConstantData));
+    }
+    if (frag->hasSpecConstants) {
+        frag->specInfo.pData = fragOptions.specData;
+    }
+    renderOps.push_back(draw(3));
+    renderOps.push_back(endRendering(renderingOptions.lastPass));
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::depthPyramid(std::string reducePath) {
+    if (buildingAsyncCompute) {
+        throw std::runtime_error("depthPyramid: the async compute section can't read the depth image");
+    }
+    if (!hasDepthPyramid) {
+        swapChain->enableDepthPyramid();
+        hasDepthPyramid = true;
+        updateDepthImageInfos();
+        imageInfos("depthImage", &depthImageInfos);
+        imageInfos("depthPyramid", &depthPyramidInfos);
+        imageInfos("depthPyramidLevels", &depthPyramidLevelInfos);
+    }
+    std::shared_ptr<VulkanShader> reduceShader = getShader(reducePath);
+    renderOps.push_back(bindPipeline(reduceShader));
+    renderOps.push_back(bindDescriptorSets(reduceShader));
+    renderOps.push_back(reduceDepthOp(reduceShader));
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::sort(BufferHandle keys, BufferHandle values, uint32_t* count, uint32_t keyBits) {
+    if (!_device->supportsSubgroupScan()) {
+        throw std::runtime_error("sort: needs subgroup ballot and arithmetic support");
+    }
+    if (sortGroupSize > _device->scanWorkGroupSize()) {
+        throw std::runtime_error("sort: subgroups of " + std::to_string(_device->maxSubgroupSize()) + " can't scan workgroups of " +
+                                 std::to_string(sortGroupSize));
+    }
+    if (keyBits != 16 && keyBits != 32) {
+        throw std::runtime_error("sort: keyBits must be 16 or 32, got " + std::to_string(keyBits));
+    }
+    std::string keysBuffer = bufferNames[keys.index];
+    std::string valuesBuffer = bufferNames[values.index];
+    if (bufferAliases.count("SortKeys") == 0) {
+        bufferAliases["SortKeys"] = keysBuffer;
+        bufferAliases["SortValues"] = valuesBuffer;
+        sortSpecData.subgroup_size = _device->maxSubgroupSize();
+        sortCapacity = std::min(uintBufferCount(keysBuffer), uintBufferCount(valuesBuffer));
+        uint32_t histogramCount = sortRadixSize * getGroupCount(sortCapacity, sortTileSize);
+        sortKeysTempBuffer = buffer("SortKeysTemp", sortCapacity);
+        sortValuesTempBuffer = buffer("SortValuesTemp", sortCapacity);
+        sortHistogramsBuffer = buffer("SortHistograms", histogramCount);
+        // one ticket counter and one state per workgroup, see scan.glsl
+        sortScanStatesBuffer =
+            buffer("SortScanStates", getGroupCount(histogramCount, sortGroupSize) + 1, VK_BUFFER_USAGE_TRANSFER_DST_BIT, 0);
+    } else if (bufferAliases.at("SortKeys") != keysBuffer || bufferAliases.at("SortValues") != valuesBuffer) {
+        throw std::runtime_error("sort: the graph already sorts " + bufferAliases.at("SortKeys") + " and " +
+                                 bufferAliases.at("SortValues") + ", not " + keysBuffer + " and " + valuesBuffer);
+    }
+
+    std::shared_ptr<VulkanShader> countShader = getShader("radix_sort_count.comp");
+    std::shared_ptr<VulkanShader> scanShader = getShader("radix_sort_scan.comp");
+    std::shared_ptr<VulkanShader> scatterShader = getShader("radix_sort_scatter.comp");
+    scanShader->specInfo.pData = &sortSpecData;
+    // NOTE:
+    // The sort synchronizes its own passes and temporary buffers, only the sorted buffers are tracked
+    VkAccessFlags2 readWrite = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    recordAccesses("sort " + keysBuffer, {},
+                   {{keysBuffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, readWrite},
+                    {valuesBuffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, readWrite}});
+    renderOps.push_back(sortOp(countShader, scanShader, scatterShader, count, keyBits));
     return *this;
 }
 
-VulkanRenderGraph& VulkanRenderGraph::buffer(std::string name, uint32_t count, VkBufferUsageFlags additionalUsage,
-                                             VkMemoryPropertyFlags additionalProperties) {
+uint32_t VulkanRenderGraph::uintBufferCount(std::string name) {
+    if (bufferCreateInfos.count(name) == 1) {
+        return std::get<0>(bufferCreateInfos.at(name));
+    } else if (dirtyBuffers.count(name) == 1) {
+        // the device buffer might hold a copy per frame in flight
+        return dirtyBuffers.at(name)->count() * dirtyBuffers.at(name)->stride() / sizeof(uint32_t);
+    } else if (globalBuffers.count(name) == 1) {
+        return globalBuffers.at(name)->size() / sizeof(uint32_t);
+    }
+    throw std::runtime_error("buffer " + name + " not found");
+}
+
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::buffer(std::string name, uint32_t count) { return buffer(name, count, 0, 0); }
+
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::buffer(std::string name, uint32_t count, VkBufferUsageFlags additionalUsage,
+                                                          VkMemoryPropertyFlags additionalProperties) {
     if (bufferCreateInfos.count(name) == 0) {
         bufferCreateInfos[name] = {count, additionalUsage, additionalProperties};
     } else {
         throw std::runtime_error("multiple buffer definitions for: " + name);
     }
-    return *this;
+    return bufferHandle(name);
 }
 
-VulkanRenderGraph& VulkanRenderGraph::buffer(std::string name, std::shared_ptr<VulkanBuffer> buffer) {
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::scratchBuffer(std::string name, uint32_t count, VkBufferUsageFlags additionalUsage,
+                                                                 VkMemoryPropertyFlags additionalProperties) {
+    BufferHandle handle = buffer(name, count, additionalUsage, additionalProperties);
+    if (_settings->aliasScratchBuffers) {
+        scratchBuffers.insert(name);
+    }
+    return handle;
+}
+
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::buffer(std::string name, std::shared_ptr<VulkanBuffer> buffer) {
     globalBuffers[name] = buffer;
-    return *this;
+    BufferHandle handle = bufferHandle(name);
+    bufferSlots[handle.index] = buffer;
+    return handle;
+}
+
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::buffer(std::string name, std::shared_ptr<DirtyRangeBuffer> buffer) {
+    dirtyBuffers[name] = buffer;
+    return this->buffer(name, buffer->buffer());
+}
+
+VulkanRenderGraph::BufferHandle VulkanRenderGraph::transientBuffer(std::string name, VkDeviceSize size) {
+    BufferHandle handle = bufferHandle(name);
+    if (bufferTransients[handle.index] != UINT32_MAX || bufferCreateInfos.count(name) == 1 || globalBuffers.count(name) == 1) {
+        throw std::runtime_error("multiple buffer definitions for: " + name);
+    }
+    bufferTransients[handle.index] = transientBuffers.size();
+    transientBuffers.push_back({name, handle, size, {}, nullptr});
+    return handle;
 }
 
 VulkanRenderGraph& VulkanRenderGraph::imageInfos(std::string name, std::vector<VkDescriptorImageInfo>* imageInfos) {
@@ -85,16 +283,50 @@ VulkanRenderGraph& VulkanRenderGraph::imageInfos(std::string name, std::vector<V
     return *this;
 }
 
-VulkanRenderGraph& VulkanRenderGraph::fillBuffer(std::string bufferName, VkDeviceSize offset, VkDeviceSize size, uint32_t value) {
-    if (globalBuffers.count(bufferName) == 0 && bufferCreateInfos.count(bufferName) == 0) {
-        throw std::runtime_error("fillBuffer: buffer " + bufferName + " not found");
+VulkanRenderGraph& VulkanRenderGraph::fillBuffer(BufferHandle buffer, VkDeviceSize offset, VkDeviceSize size, uint32_t value) {
+    std::string bufferName = bufferNames.at(buffer.index);
+    recordAccesses("fill " + bufferName, {}, {{bufferName, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT}});
+    renderOps.push_back(fillBufferOp(buffer, offset, size, value));
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::setBuffer(BufferHandle buffer, uint32_t value) {
+    fillBuffer(buffer, 0, VK_WHOLE_SIZE, value);
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::upload(BufferHandle buffer) {
+    std::string bufferName = bufferNames.at(buffer.index);
+    if (dirtyBuffers.count(bufferName) == 0) {
+        throw std::runtime_error("upload: " + bufferName + " is not a dirty range buffer");
     }
-    renderOps.push_back(fillBufferOp(bufferName, offset, size, value));
+    if (!uploadBuffers.empty() && asyncUploads != buildingAsyncCompute) {
+        throw std::runtime_error("upload: " + bufferName + " is on another queue than the uploads before it, they share a command buffer");
+    }
+    asyncUploads = buildingAsyncCompute;
+    // NOTE:
+    // No op is recorded, the accesses go before the next op as if the copies ran there
+    recordAccesses("upload " + bufferName, {}, {{bufferName, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT}});
+    // DirtyRangeBuffers keep their object when they grow, only the device buffer inside is replaced
+    uploadBuffers.push_back(dirtyBuffers.at(bufferName));
     return *this;
 }
 
-VulkanRenderGraph& VulkanRenderGraph::setBuffer(std::string bufferName, uint32_t value) {
-    fillBuffer(bufferName, 0, VK_WHOLE_SIZE, value);
+VulkanRenderGraph& VulkanRenderGraph::beginAsyncCompute() {
+    if (!renderOps.empty()) {
+        throw std::runtime_error("beginAsyncCompute: the async compute section has to start the graph");
+    }
+    buildingAsyncCompute = true;
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::endAsyncCompute() {
+    if (!buildingAsyncCompute) {
+        throw std::runtime_error("endAsyncCompute: no async compute section was begun");
+    }
+    buildingAsyncCompute = false;
+    asyncComputeEnd = renderOps.size();
+    renderOps.push_back(makeCommand(RenderCommand::ASYNC_COMPUTE_END));
     return *this;
 }
 
@@ -111,25 +343,39 @@ VulkanRenderGraph& VulkanRenderGraph::timestamp(VkPipelineStageFlags2 stageFlags
 
 VulkanRenderGraph& VulkanRenderGraph::memoryBarrier(VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask,
                                                     VkAccessFlags2 dstAccessMask, VkPipelineStageFlags2 dstStageMask) {
+    manualBarriers.push_back({renderOps.size(), srcAccessMask, srcStageMask, dstAccessMask, dstStageMask});
     renderOps.push_back(memoryBarrierOp(srcAccessMask, srcStageMask, dstAccessMask, dstStageMask));
     return *this;
 }
 VulkanRenderGraph& VulkanRenderGraph::debugBarrier() {
-    memoryBarrier(VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
-                      VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-                  VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
-                  VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
-                      VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-                  VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+    VkAccessFlags2 access = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    renderOps.push_back(memoryBarrierOp(access, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, access, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT));
     return *this;
 }
 
-VulkanRenderGraph& VulkanRenderGraph::drawIndirect(std::string buffer, VkDeviceSize offset, std::string countBuffer,
+void VulkanRenderGraph::addIndirectAccesses(BufferHandle buffer, BufferHandle countBuffer) {
+    for (BufferHandle handle : {buffer, countBuffer}) {
+        std::string name = bufferNames.at(handle.index);
+        opAccesses.at(renderingAccesses)
+            .buffers.push_back({name, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT});
+    }
+}
+
+VulkanRenderGraph& VulkanRenderGraph::drawIndirect(BufferHandle buffer, VkDeviceSize offset, BufferHandle countBuffer,
                                                    VkDeviceSize countBufferOffset, uint32_t maxDrawCount, uint32_t stride) {
+    addIndirectAccesses(buffer, countBuffer);
     renderOps.push_back(drawIndexedIndirectCount(buffer, offset, countBuffer, countBufferOffset, maxDrawCount, stride));
     // FIXME:
     // Find a better way to manage start and end rendering
-    renderOps.push_back(endRendering());
+    renderOps.push_back(endRendering(renderingLastPass));
+    return *this;
+}
+
+VulkanRenderGraph& VulkanRenderGraph::drawIndirect(BufferHandle buffer, VkDeviceSize offset, BufferHandle countBuffer,
+                                                   VkDeviceSize countBufferOffset, uint32_t* maxDrawCount, uint32_t stride) {
+    addIndirectAccesses(buffer, countBuffer);
+    renderOps.push_back(drawIndexedIndirectCount(buffer, offset, countBuffer, countBufferOffset, maxDrawCount, stride));
+    renderOps.push_back(endRendering(renderingLastPass));
     return *this;
 }
 
@@ -156,6 +402,7 @@ void VulkanRenderGraph::addComputePipeline(std::shared_ptr<VulkanRenderGraph::Vu
     pushConstants = getPushConstants(computeShader);
     pipelines[getFilenameNoExt(computeShader->name)] =
         std::make_shared<ComputePipeline>(_device, layouts, pushConstants, computeShader->stageInfo);
+    computeShader->pipeline = pipelines.at(getFilenameNoExt(computeShader->name)).get();
 }
 
 void VulkanRenderGraph::addGraphicsPipeline(std::shared_ptr<VulkanRenderGraph::VulkanShader> vertShader,
@@ -163,6 +410,14 @@ void VulkanRenderGraph::addGraphicsPipeline(std::shared_ptr<VulkanRenderGraph::V
     if (vertShader->stageFlags != VK_SHADER_STAGE_VERTEX_BIT) {
         throw std::runtime_error("graphics pipeline vertShader has incorrect stageFlags: " + std::to_string(vertShader->stageFlags));
     }
+    if (fragShader == nullptr) {
+        std::vector<VkDescriptorSetLayout> layouts = descriptorManager->descriptors[vertShader->path]->getLayouts();
+        std::vector<VkPushConstantRange> pushConstants = getPushConstants(vertShader);
+        pipelines[getFilenameNoExt(vertShader->name)] =
+            std::make_shared<GraphicsPipeline>(_device, swapChain, vertShader->stageInfo, layouts, pushConstants);
+        vertShader->pipeline = pipelines.at(getFilenameNoExt(vertShader->name)).get();
+        return;
+    }
     if (fragShader->stageFlags != VK_SHADER_STAGE_FRAGMENT_BIT) {
         throw std::runtime_error("graphics pipeline fragShader has incorrect stageFlags: " + std::to_string(fragShader->stageFlags));
     }
@@ -193,11 +448,77 @@ void VulkanRenderGraph::addGraphicsPipeline(std::shared_ptr<VulkanRenderGraph::V
     if (fragShader->hasPushConstants) {
         pushConstants.push_back(fragShader->pushConstantRange);
     }
-    pipelines[getFilenameNoExt(vertShader->name)] =
-        std::make_shared<GraphicsPipeline>(_device, swapChain, vertShader->stageInfo, fragShader->stageInfo, layouts, pushConstants);
+    VkFormat colorFormat = fragShader->visibilityOutput ? VulkanSwapChain::VISIBILITY_FORMAT : VK_FORMAT_UNDEFINED;
+    pipelines[getFilenameNoExt(vertShader->name)] = std::make_shared<GraphicsPipeline>(
+        _device, swapChain, vertShader->stageInfo, fragShader->stageInfo, layouts, pushConstants, colorFormat);
+    vertShader->pipeline = pipelines.at(getFilenameNoExt(vertShader->name)).get();
+    fragShader->pipeline = vertShader->pipeline;
+}
+
+void VulkanRenderGraph::createFrameCopies() {
+    std::map<std::string, VkAccessFlags2> computeAccess;
+    std::map<std::string, VkAccessFlags2> graphicsAccess;
+    for (const OpAccesses& op : opAccesses) {
+        std::map<std::string, VkAccessFlags2>& access = op.op < asyncComputeEnd ? computeAccess : graphicsAccess;
+        for (const BufferAccess& buffer : op.buffers) {
+            access[buffer.name] |= buffer.access;
+        }
+        for (const std::shared_ptr<VulkanShader>& shader : op.shaders) {
+            for (const BufferAccess& buffer : shader->bufferAccesses) {
+                access[buffer.name] |= buffer.access;
+            }
+        }
+    }
+    // NOTE:
+    // One alignment for every copy, a buffer can be bound as a uniform and a storage buffer
+    frameAlignment = std::max(_device->minUniformBufferOffsetAlignment(), _device->minStorageBufferOffsetAlignment());
+    const VkAccessFlags2 writeAccess = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    for (const auto& [name, access] : computeAccess) {
+        if (graphicsAccess.count(name) == 0 || globalBuffers.count(name) == 0 || !((access | graphicsAccess.at(name)) & writeAccess)) {
+            continue;
+        }
+        if (graphicsAccess.at(name) & writeAccess) {
+            throw std::runtime_error("compile: " + name + " is written after the async compute section, which the section of the " +
+                                     "next frame accesses while the graphics commands still run");
+        }
+        std::shared_ptr<VulkanBuffer> oldBuffer = globalBuffers.at(name);
+        if (dirtyBuffers.count(name) == 1) {
+            std::shared_ptr<DirtyRangeBuffer> dirtyBuffer = dirtyBuffers.at(name);
+            dirtyBuffer->copyPerFrame(frameAlignment);
+            globalBuffers[name] = dirtyBuffer->buffer();
+            frameCopies[name] = {dirtyBuffer->count() * dirtyBuffer->stride(), dirtyBuffer->frameStride()};
+        } else if (bufferCreateInfos.count(name) == 1) {
+            createFrameBuffer(name, oldBuffer->size(), oldBuffer->usageFlags(), oldBuffer->memoryProperties());
+        } else {
+            throw std::runtime_error("compile: " + name + " is written by the async compute section and read after it, so it needs " +
+                                     "a copy per frame in flight, which only buffers of the graph and DirtyRangeBuffers get");
+        }
+        for (auto& descriptorPair : descriptorManager->descriptors) {
+            descriptorPair.second->replaceBuffer(oldBuffer, globalBuffers.at(name));
+            descriptorPair.second->bindPerFrame(globalBuffers.at(name));
+        }
+    }
+}
+
+void VulkanRenderGraph::createFrameBuffer(std::string name, VkDeviceSize size, VkBufferUsageFlags usage,
+                                          VkMemoryPropertyFlags properties) {
+    VkDeviceSize stride = (size + frameAlignment - 1) / frameAlignment * frameAlignment;
+    // NOTE:
+    // Always with its own memory, so aliasScratchBuffers() leaves it alone
+    globalBuffers[name] = std::make_shared<VulkanBuffer>(_device, stride * VulkanSwapChain::MAX_FRAMES_IN_FLIGHT, usage, properties);
+    if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        globalBuffers.at(name)->map();
+    }
+    frameCopies[name] = {size, stride};
 }
 
 void VulkanRenderGraph::compile() {
+    if (buildingAsyncCompute) {
+        throw std::runtime_error("compile: endAsyncCompute was not called");
+    }
+    if (!transientBuffers.empty()) {
+        createTransientRing();
+    }
     std::shared_ptr<VulkanShader> prev;
     for (auto shader : shaders) {
 
@@ -210,15 +531,27 @@ void VulkanRenderGraph::compile() {
         // These re-used buffers only need to be bound once
         // Total set bindings might have to be identical though, so maybe this won't work
         VulkanDescriptors::VulkanDescriptor* descriptor = descriptorManager->createDescriptor(shader->path, shader->stageFlags);
-        shader->setDescriptorBuffers(descriptor, bufferCreateInfos, globalBuffers, globalImageInfos);
+        shader->setDescriptorBuffers(descriptor, bufferCreateInfos, globalBuffers, globalImageInfos, bufferAliases, transientBuffers,
+                                     scratchBuffers);
+        shader->descriptor = descriptor;
+    }
+    if (asyncCompute) {
+        createFrameCopies();
+    }
+    for (auto shader : shaders) {
+        // after createFrameCopies(), the sets of the shaders with per frame bindings are copied per frame
+        shader->descriptor->allocateSets();
 
         switch (shader->stageFlags) {
         case VK_SHADER_STAGE_COMPUTE_BIT: {
-            std::vector<VkDescriptorSetLayout> layouts = descriptor->getLayouts();
+            std::vector<VkDescriptorSetLayout> layouts = shader->descriptor->getLayouts();
             addComputePipeline(shader, layouts);
             break;
         }
         case VK_SHADER_STAGE_VERTEX_BIT: {
+            if (shader->depthOnly) {
+                addGraphicsPipeline(shader, nullptr);
+            }
             break;
         }
         case VK_SHADER_STAGE_FRAGMENT_BIT:
@@ -233,4 +566,15 @@ void VulkanRenderGraph::compile() {
         }
         prev = shader;
     }
+    aliasScratchBuffers();
+    // the scratch buffers have memory now
+    for (auto shader : shaders) {
+        shader->descriptor->update();
+    }
+    if (_settings->autoBarriers || _settings->validateBarriers) {
+        compileBarriers();
+    }
+    createUploadCommandBuffers();
+    compiled = true;
+    resolveCommands();
 }
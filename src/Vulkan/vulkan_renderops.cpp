@@ -3,52 +3,102 @@
 #include "vulkan_rendergraph.hpp"
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <execution>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vulkan/vulkan_core.h>
 
-RenderOp VulkanRenderGraph::bindPipeline(std::shared_ptr<VulkanRenderGraph::VulkanShader> shader) {
-    return [&, shader](VkCommandBuffer commandBuffer) {
-        vkCmdBindPipeline(commandBuffer, shader->bindPoint, pipelines[getFilenameNoExt(shader->name)]->pipeline());
-    };
+namespace {
+// Drops the stages a compute queue doesn't have from a barrier of the async compute section, and the accesses only they perform
+// NOTE:
+// The semaphores between the queues already order the accesses of the graphics queue
+void limitToComputeQueue(VkPipelineStageFlags2& stages, VkAccessFlags2& access) {
+    stages &= VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT |
+              VK_PIPELINE_STAGE_2_HOST_BIT | VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    VkAccessFlags2 supported = 0;
+    if (stages & (VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT)) {
+        supported |= VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_UNIFORM_READ_BIT |
+                     VK_ACCESS_2_SHADER_SAMPLED_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    }
+    if (stages & (VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT)) {
+        supported |= VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    }
+    if (stages & (VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT)) {
+        supported |= VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT;
+    }
+    if (stages & (VK_PIPELINE_STAGE_2_HOST_BIT | VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT)) {
+        supported |= VK_ACCESS_2_HOST_READ_BIT | VK_ACCESS_2_HOST_WRITE_BIT;
+    }
+    if (stages != 0) {
+        supported |= VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+    }
+    access &= supported;
 }
+} // namespace
 
-RenderOp VulkanRenderGraph::bindDescriptorSets(std::shared_ptr<VulkanShader> shader) {
-    return [&, shader](VkCommandBuffer commandBuffer) {
-        // NOTE:
-        // Have to bind one at a time because descriptor sets might not be sequential
-        // TODO
-        // Check if binding sequential sets is faster. It probably isn't due to the low amount of sets
-        // NOTE:
-        // Does shader->path, shader->bindPoint, etc get called at lambda creation time or lambda run time?
-        // Might be undefined behavior, compiler could optimize it for creation time and break this.
-        // Default seems to be run time.
-        // https://stackoverflow.com/a/37221299
-        // https://johannesugb.github.io/cpu-programming/how-to-pass-lambda-functions-in-C++/
-        for (auto set : descriptorManager->descriptors[shader->path]->getSets()) {
-            // FIXME:
-            // Better pipeline naming
-            vkCmdBindDescriptorSets(commandBuffer, shader->bindPoint, pipelines[getFilenameNoExt(shader->name)]->pipelineLayout(),
-                                    set.first, 1, &set.second, 0, nullptr);
-        }
-    };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::makeCommand(RenderCommand::Type type, VulkanShader* shader) {
+    RenderCommand renderCommand;
+    std::memset(&renderCommand, 0, sizeof(renderCommand));
+    renderCommand.type = type;
+    renderCommand.shader = shader;
+    renderCommand.buffer = UINT32_MAX;
+    renderCommand.countBuffer = UINT32_MAX;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::startRendering() {
-    return [&](VkCommandBuffer commandBuffer) {
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::callback(RenderOp op) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::CALLBACK);
+    renderCommand.callback.index = callbacks.size();
+    callbacks.push_back(op);
+    return renderCommand;
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::bindPipeline(std::shared_ptr<VulkanRenderGraph::VulkanShader> shader) {
+    return makeCommand(RenderCommand::BIND_PIPELINE, shader.get());
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::bindDescriptorSets(std::shared_ptr<VulkanShader> shader) {
+    // NOTE:
+    // Have to bind one at a time because descriptor sets might not be sequential
+    // TODO
+    // Check if binding sequential sets is faster. It probably isn't due to the low amount of sets
+    return makeCommand(RenderCommand::BIND_DESCRIPTOR_SETS, shader.get());
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::startRendering(RenderingOptions renderingOptions) {
+    if (buildingAsyncCompute) {
+        throw std::runtime_error("graphics passes can't run in the async compute section");
+    }
+    // NOTE:
+    // A callback because the swap chain image changes every frame
+    RenderCommand renderCommand = callback([=](VkCommandBuffer commandBuffer) {
+        VkImage colorImage = renderingOptions.visibilityBuffer ? swapChain->getVisibilityImage() : swapChain->getSwapChainImage();
+        VkAttachmentLoadOp colorLoadOp = renderingOptions.visibilityBuffer ? VK_ATTACHMENT_LOAD_OP_CLEAR : renderingOptions.loadOp;
+        VkAttachmentLoadOp depthLoadOp = renderingOptions.loadDepth ? VK_ATTACHMENT_LOAD_OP_LOAD : renderingOptions.loadOp;
+
         VkRenderingAttachmentInfo colorAttachment{};
         colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
-        colorAttachment.imageView = swapChain->getSwapChainImageView();
+        colorAttachment.imageView =
+            renderingOptions.visibilityBuffer ? swapChain->getVisibilityImageView() : swapChain->getSwapChainImageView();
         colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        colorAttachment.loadOp = colorLoadOp;
         colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        colorAttachment.clearValue.color = {0.0f, 0.0f, 0.0f, 1.0f};
+        if (renderingOptions.visibilityBuffer) {
+            colorAttachment.clearValue.color.uint32[0] = visibilityClearValue;
+        } else {
+            colorAttachment.clearValue.color = {0.0f, 0.0f, 0.0f, 1.0f};
+        }
 
         VkRenderingAttachmentInfo depthAttachment{};
         depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
         depthAttachment.imageView = swapChain->getDepthImageView();
         depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
-        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.loadOp = depthLoadOp;
+        // depth is only read after the last pass by the passes that load it or reduce it into a pyramid
+        depthAttachment.storeOp = renderingOptions.lastPass ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
         depthAttachment.clearValue.depthStencil = {1.0f, 0};
 
         VkRenderingInfo passInfo{};
@@ -58,101 +108,518 @@ RenderOp VulkanRenderGraph::startRendering() {
         passInfo.colorAttachmentCount = 1;
         passInfo.pColorAttachments = &colorAttachment;
         passInfo.pDepthAttachment = &depthAttachment;
-        _device->transitionImageLayout(swapChain->getSwapChainImage(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                                       VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1})(commandBuffer);
-
-        _device->transitionImageLayout(swapChain->getDepthImage(), VK_IMAGE_LAYOUT_UNDEFINED,
-                                       VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-                                       VkImageSubresourceRange{VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1})(commandBuffer);
+        if (colorLoadOp == VK_ATTACHMENT_LOAD_OP_LOAD || depthLoadOp == VK_ATTACHMENT_LOAD_OP_LOAD) {
+            // NOTE:
+            // The loaded attachments are already in attachment layouts,
+            // only the attachment writes of the previous pass have to finish
+            recordMemoryBarrier(commandBuffer, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                                VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+                                    VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT |
+                                    VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT);
+        }
+        // the cleared attachments don't keep their contents, the visibility image might still be read by a previous resolve
+        if (colorLoadOp == VK_ATTACHMENT_LOAD_OP_CLEAR) {
+            _device->transitionImageLayout(commandBuffer, colorImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                           VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
+        }
+        if (depthLoadOp == VK_ATTACHMENT_LOAD_OP_CLEAR) {
+            _device->transitionImageLayout(commandBuffer, swapChain->getDepthImage(), VK_IMAGE_LAYOUT_UNDEFINED,
+                                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                                           VkImageSubresourceRange{VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1});
+        }
 
         vkCmdBeginRendering(commandBuffer, &passInfo);
-    };
+        vkCmdSetDepthCompareOp(commandBuffer, renderingOptions.depthCompareOp);
+        vkCmdSetDepthWriteEnable(commandBuffer, renderingOptions.depthWrite);
+    });
+    renderCommand.passStart = true;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::endRendering() {
-    return [=](VkCommandBuffer commandBuffer) {
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::draw(uint32_t vertexCount) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::DRAW);
+    renderCommand.draw.vertexCount = vertexCount;
+    return renderCommand;
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::endRendering(bool present) {
+    return callback([=](VkCommandBuffer commandBuffer) {
         vkCmdEndRendering(commandBuffer);
 
-        _device->transitionImageLayout(swapChain->getSwapChainImage(), VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                                       VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                                       VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1})(commandBuffer);
-    };
+        if (present) {
+            _device->transitionImageLayout(commandBuffer, swapChain->getSwapChainImage(), VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                           swapChain->presentLayout(), VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
+        }
+    });
 }
 
-RenderOp VulkanRenderGraph::pushConstants(std::shared_ptr<VulkanShader> shader, void* data) {
-    return [=](VkCommandBuffer commandBuffer) {
-        vkCmdPushConstants(commandBuffer, pipelines[getFilenameNoExt(shader->name)]->pipelineLayout(), shader->stageFlags,
-                           shader->pushConstantRange.offset, shader->pushConstantRange.size, data);
-    };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::reduceDepthOp(std::shared_ptr<VulkanShader> shader) {
+    return callback([=](VkCommandBuffer commandBuffer) {
+        VkImageSubresourceRange depthRange{VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+        _device->transitionImageLayout(commandBuffer, swapChain->getDepthImage(), VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                                       VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, depthRange);
+        // previous frame reads of the pyramid have to finish before it's overwritten
+        recordMemoryBarrier(commandBuffer, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                            VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+        // NOTE:
+        // One dispatch per level, every level reads the one before it
+        // The level count depends on the swap chain extent so the loop runs at record time
+        for (uint32_t level = 0; level < swapChain->getDepthPyramidLevels(); ++level) {
+            VkExtent2D extent = swapChain->getDepthPyramidExtent(level);
+            vkCmdPushConstants(commandBuffer, shader->pipeline->pipelineLayout(), shader->stageFlags, shader->pushConstantRange.offset,
+                               sizeof(level), &level);
+            vkCmdDispatch(commandBuffer, getGroupCount(extent.width, depthReduceGroupSize),
+                          getGroupCount(extent.height, depthReduceGroupSize), 1);
+            recordMemoryBarrier(commandBuffer, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+        }
+        _device->transitionImageLayout(commandBuffer, swapChain->getDepthImage(), VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                                       VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, depthRange);
+    });
 }
 
-RenderOp VulkanRenderGraph::fillBufferOp(std::string bufferName, VkDeviceSize offset, VkDeviceSize size, uint32_t value) {
-    bufferMap* buffers = &globalBuffers;
-    return [=](VkCommandBuffer commandBuffer) { vkCmdFillBuffer(commandBuffer, buffers->at(bufferName)->buffer(), offset, size, value); };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::sortOp(std::shared_ptr<VulkanShader> countShader,
+                                                           std::shared_ptr<VulkanShader> scanShader,
+                                                           std::shared_ptr<VulkanShader> scatterShader, uint32_t* count, uint32_t keyBits) {
+    // NOTE:
+    // A callback because the passes and group counts depend on *count
+    callbackInputs.push_back({count, sizeof(*count)});
+    RenderCommand renderCommand = callback([=](VkCommandBuffer commandBuffer) {
+        if (*count > sortCapacity) {
+            throw std::runtime_error("sort: " + std::to_string(*count) + " pairs don't fit the " + std::to_string(sortCapacity) +
+                                     " of the sort buffers");
+        }
+        if (*count == 0) {
+            return;
+        }
+        SortPushConstants constants{};
+        constants.count = *count;
+        constants.groupCount = getGroupCount(*count, sortTileSize);
+        uint32_t scanGroupCount = getGroupCount(sortRadixSize * constants.groupCount, sortGroupSize);
+        auto runShader = [&](VulkanShader* shader, uint32_t groupCount) {
+            VkPipelineLayout layout = shader->pipeline->pipelineLayout();
+            vkCmdBindPipeline(commandBuffer, shader->bindPoint, shader->pipeline->pipeline());
+            for (const auto& set : shader->descriptor->getSets(getCurrentFrame())) {
+                vkCmdBindDescriptorSets(commandBuffer, shader->bindPoint, layout, set.first, 1, &set.second, 0, nullptr);
+            }
+            vkCmdPushConstants(commandBuffer, layout, shader->stageFlags, shader->pushConstantRange.offset, sizeof(constants), &constants);
+            vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+            recordMemoryBarrier(commandBuffer, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+        };
+        // NOTE:
+        // One count, scan and scatter per digit, every pass reads the output of the one before it
+        // The pass count depends on keyBits and the group counts on *count, so the loop runs at record time
+        for (constants.shift = 0; constants.shift < keyBits; constants.shift += sortRadixBits) {
+            // the previous scan has to finish with the states before they are reset
+            recordMemoryBarrier(commandBuffer, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+            vkCmdFillBuffer(commandBuffer, sortScanStates, 0, VK_WHOLE_SIZE, 0);
+            recordMemoryBarrier(commandBuffer, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                                VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+            runShader(countShader.get(), constants.groupCount);
+            runShader(scanShader.get(), scanGroupCount);
+            runShader(scatterShader.get(), constants.groupCount);
+        }
+    });
+    // binds its own pipelines
+    renderCommand.passStart = true;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ) {
-    return [=](VkCommandBuffer commandBuffer) { vkCmdDispatch(commandBuffer, groupCountX, groupCountY, groupCountZ); };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::pushConstants(std::shared_ptr<VulkanShader> shader, void* data) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::PUSH_CONSTANTS, shader.get());
+    renderCommand.pushConstants.data = data;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::drawIndexedIndirectCount(std::string bufferName, VkDeviceSize offset, std::string countBufferName,
-                                                     VkDeviceSize countBufferOffset, uint32_t maxDrawCount, uint32_t stride) {
-    bufferMap* buffers = &globalBuffers;
-    return [=](VkCommandBuffer commandBuffer) {
-        vkCmdDrawIndexedIndirectCount(commandBuffer, buffers->at(bufferName)->buffer(), offset, buffers->at(countBufferName)->buffer(),
-                                      countBufferOffset, maxDrawCount, stride);
-    };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::fillBufferOp(BufferHandle buffer, VkDeviceSize offset, VkDeviceSize size,
+                                                                 uint32_t value) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::FILL_BUFFER);
+    renderCommand.buffer = buffer.index;
+    renderCommand.fillBuffer.offset = offset;
+    renderCommand.fillBuffer.size = size;
+    renderCommand.fillBuffer.value = value;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::writeTimestamp(VkPipelineStageFlags2 stageFlags, VkQueryPool queryPool, uint32_t query) {
-    return [=](VkCommandBuffer commandBuffer) { vkCmdWriteTimestamp2(commandBuffer, stageFlags, queryPool, query); };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::DISPATCH);
+    renderCommand.dispatch = {groupCountX, groupCountY, groupCountZ};
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::resetQueryPool(VkQueryPool queryPool, uint32_t firstQuery, uint32_t count) {
-    return [=](VkCommandBuffer commandBuffer) { vkCmdResetQueryPool(commandBuffer, queryPool, firstQuery, count); };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::dispatch(uint32_t* groupCountX, uint32_t* groupCountY, uint32_t* groupCountZ) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::DISPATCH_DYNAMIC);
+    renderCommand.dispatchDynamic = {groupCountX, groupCountY, groupCountZ};
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::bindVertexBuffer(std::shared_ptr<VulkanBuffer> vertexBuffer) {
-    VkBuffer vertexBuffers[] = {vertexBuffer->buffer()};
-    VkDeviceSize offsets[] = {0};
-    return [=](VkCommandBuffer commandBuffer) { vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets); };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::drawIndexedIndirectCount(BufferHandle buffer, VkDeviceSize offset,
+                                                                             BufferHandle countBuffer, VkDeviceSize countBufferOffset,
+                                                                             uint32_t maxDrawCount, uint32_t stride) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::DRAW_INDEXED_INDIRECT_COUNT);
+    renderCommand.buffer = buffer.index;
+    renderCommand.countBuffer = countBuffer.index;
+    renderCommand.drawIndirect.offset = offset;
+    renderCommand.drawIndirect.countBufferOffset = countBufferOffset;
+    renderCommand.drawIndirect.maxDrawCount = maxDrawCount;
+    renderCommand.drawIndirect.stride = stride;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::bindIndexBuffer(std::shared_ptr<VulkanBuffer> indexBuffer) {
-    return [=](VkCommandBuffer commandBuffer) { vkCmdBindIndexBuffer(commandBuffer, indexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32); };
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::drawIndexedIndirectCount(BufferHandle buffer, VkDeviceSize offset,
+                                                                             BufferHandle countBuffer, VkDeviceSize countBufferOffset,
+                                                                             uint32_t* maxDrawCount, uint32_t stride) {
+    RenderCommand renderCommand = drawIndexedIndirectCount(buffer, offset, countBuffer, countBufferOffset, uint32_t(0), stride);
+    renderCommand.drawIndirect.dynamicMaxDrawCount = maxDrawCount;
+    return renderCommand;
 }
 
-RenderOp VulkanRenderGraph::memoryBarrierOp(VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 dstAccessMask,
-                                            VkPipelineStageFlags2 dstStageMask) {
-    return [=](VkCommandBuffer commandBuffer) {
-        VkMemoryBarrier2 memoryBarrier{};
-        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
-        memoryBarrier.pNext = VK_NULL_HANDLE;
-        memoryBarrier.srcAccessMask = srcAccessMask;
-        memoryBarrier.srcStageMask = srcStageMask;
-        memoryBarrier.dstAccessMask = dstAccessMask;
-        memoryBarrier.dstStageMask = dstStageMask;
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::writeTimestamp(VkPipelineStageFlags2 stageFlags, VkQueryPool queryPool,
+                                                                   uint32_t query) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::WRITE_TIMESTAMP);
+    renderCommand.timestamp = {stageFlags, queryPool, query};
+    return renderCommand;
+}
 
-        VkDependencyInfo dependencyInfo{};
-        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
-        dependencyInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-        dependencyInfo.memoryBarrierCount = 1;
-        dependencyInfo.pMemoryBarriers = &memoryBarrier;
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::resetQueryPool(VkQueryPool queryPool, uint32_t firstQuery, uint32_t count) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::RESET_QUERY_POOL);
+    renderCommand.resetQueryPool = {queryPool, firstQuery, count};
+    return renderCommand;
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::bindVertexBuffer(std::shared_ptr<VulkanBuffer> vertexBuffer) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::BIND_VERTEX_BUFFER);
+    renderCommand.bindBuffer.buffer = vertexBuffer->buffer();
+    return renderCommand;
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::bindIndexBuffer(std::shared_ptr<VulkanBuffer> indexBuffer) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::BIND_INDEX_BUFFER);
+    renderCommand.bindBuffer.buffer = indexBuffer->buffer();
+    return renderCommand;
+}
 
-        vkCmdPipelineBarrier2(getCurrentCommandBuffer(), &dependencyInfo);
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::memoryBarrierOp(VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask,
+                                                                    VkAccessFlags2 dstAccessMask, VkPipelineStageFlags2 dstStageMask) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::MEMORY_BARRIER);
+    renderCommand.memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    renderCommand.memoryBarrier.pNext = VK_NULL_HANDLE;
+    renderCommand.memoryBarrier.srcAccessMask = srcAccessMask;
+    renderCommand.memoryBarrier.srcStageMask = srcStageMask;
+    renderCommand.memoryBarrier.dstAccessMask = dstAccessMask;
+    renderCommand.memoryBarrier.dstStageMask = dstStageMask;
+    return renderCommand;
+}
+
+void VulkanRenderGraph::recordMemoryBarrier(VkCommandBuffer commandBuffer, VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 srcStageMask,
+                                            VkAccessFlags2 dstAccessMask, VkPipelineStageFlags2 dstStageMask) {
+    VkMemoryBarrier2 memoryBarrier{};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    memoryBarrier.pNext = VK_NULL_HANDLE;
+    memoryBarrier.srcAccessMask = srcAccessMask;
+    memoryBarrier.srcStageMask = srcStageMask;
+    memoryBarrier.dstAccessMask = dstAccessMask;
+    memoryBarrier.dstStageMask = dstStageMask;
+
+    VkDependencyInfo dependencyInfo{};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    dependencyInfo.memoryBarrierCount = 1;
+    dependencyInfo.pMemoryBarriers = &memoryBarrier;
+
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+VulkanRenderGraph::RenderCommand VulkanRenderGraph::bufferBarriersOp(std::vector<BufferBarrier> barriers) {
+    RenderCommand renderCommand = makeCommand(RenderCommand::BUFFER_BARRIERS);
+    renderCommand.bufferBarriers.first = pendingBufferBarriers.size();
+    renderCommand.bufferBarriers.count = barriers.size();
+    pendingBufferBarriers.push_back(barriers);
+    return renderCommand;
+}
+
+void VulkanRenderGraph::resolveCommands() {
+    // NOTE:
+    // The buffers are recreated when they are resized, so this runs again after every resize
+    updateBufferSlots();
+    auto resolveBuffer = [&](uint32_t buffer) { return bufferSlots[buffer]->buffer(); };
+    auto frameStride = [&](uint32_t buffer) {
+        auto copies = frameCopies.find(bufferNames[buffer]);
+        return copies == frameCopies.end() ? VkDeviceSize(0) : copies->second.stride;
     };
+    commands.clear();
+    bufferBarriers.clear();
+    dynamicOffsetTransients.clear();
+    asyncCommandCount = 0;
+    for (RenderCommand renderCommand : renderOps) {
+        VulkanShader* shader = renderCommand.shader;
+        switch (renderCommand.type) {
+        case RenderCommand::BIND_PIPELINE:
+            renderCommand.bindPipeline.bindPoint = shader->bindPoint;
+            renderCommand.bindPipeline.pipeline = shader->pipeline->pipeline();
+            // graphics pipelines are bound inside a rendering, the pass starts with the rendering
+            renderCommand.passStart = shader->bindPoint == VK_PIPELINE_BIND_POINT_COMPUTE;
+            break;
+        case RenderCommand::BIND_DESCRIPTOR_SETS:
+            for (const auto& set : shader->descriptor->getSets(0)) {
+                RenderCommand setCommand = renderCommand;
+                setCommand.bindDescriptorSet.bindPoint = shader->bindPoint;
+                setCommand.bindDescriptorSet.layout = shader->pipeline->pipelineLayout();
+                setCommand.bindDescriptorSet.set = set.first;
+                for (size_t frame = 0; frame < VulkanSwapChain::MAX_FRAMES_IN_FLIGHT; ++frame) {
+                    setCommand.bindDescriptorSet.descriptorSets[frame] = shader->descriptor->getSets(frame).at(set.first);
+                }
+                // dynamic offsets go in binding order, transientBindings is sorted by set and binding
+                setCommand.bindDescriptorSet.firstDynamicOffset = dynamicOffsetTransients.size();
+                for (const auto& transientBinding : shader->transientBindings) {
+                    if (transientBinding.first.first == set.first) {
+                        dynamicOffsetTransients.push_back(transientBinding.second);
+                    }
+                }
+                setCommand.bindDescriptorSet.dynamicOffsetCount =
+                    dynamicOffsetTransients.size() - setCommand.bindDescriptorSet.firstDynamicOffset;
+                commands.push_back(setCommand);
+            }
+            continue;
+        case RenderCommand::PUSH_CONSTANTS:
+            renderCommand.pushConstants.layout = shader->pipeline->pipelineLayout();
+            renderCommand.pushConstants.stageFlags = shader->stageFlags;
+            renderCommand.pushConstants.offset = shader->pushConstantRange.offset;
+            renderCommand.pushConstants.size = shader->pushConstantRange.size;
+            break;
+        case RenderCommand::DRAW_INDEXED_INDIRECT_COUNT:
+            renderCommand.drawIndirect.buffer = resolveBuffer(renderCommand.buffer);
+            renderCommand.drawIndirect.countBuffer = resolveBuffer(renderCommand.countBuffer);
+            renderCommand.drawIndirect.bufferFrameStride = frameStride(renderCommand.buffer);
+            renderCommand.drawIndirect.countBufferFrameStride = frameStride(renderCommand.countBuffer);
+            break;
+        case RenderCommand::FILL_BUFFER:
+            renderCommand.fillBuffer.buffer = resolveBuffer(renderCommand.buffer);
+            renderCommand.fillBuffer.frameStride = frameStride(renderCommand.buffer);
+            // the whole size of a buffer with copies would run into the copies after the one of the frame
+            if (renderCommand.fillBuffer.frameStride != 0 && renderCommand.fillBuffer.size == VK_WHOLE_SIZE) {
+                renderCommand.fillBuffer.size = frameCopies.at(bufferNames[renderCommand.buffer]).size - renderCommand.fillBuffer.offset;
+            }
+            break;
+        case RenderCommand::BUFFER_BARRIERS: {
+            const std::vector<BufferBarrier>& barriers = pendingBufferBarriers[renderCommand.bufferBarriers.first];
+            renderCommand.bufferBarriers.first = bufferBarriers.size();
+            for (const BufferBarrier& barrier : barriers) {
+                VkBufferMemoryBarrier2 bufferBarrier{};
+                bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+                bufferBarrier.srcStageMask = barrier.srcStageMask;
+                bufferBarrier.srcAccessMask = barrier.srcAccessMask;
+                bufferBarrier.dstStageMask = barrier.dstStageMask;
+                bufferBarrier.dstAccessMask = barrier.dstAccessMask;
+                bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                bufferBarrier.buffer = globalBuffers.at(barrier.name)->buffer();
+                bufferBarrier.offset = 0;
+                bufferBarrier.size = VK_WHOLE_SIZE;
+                bufferBarriers.push_back(bufferBarrier);
+            }
+            break;
+        }
+        case RenderCommand::ASYNC_COMPUTE_END:
+            // NOTE:
+            // Without asyncCompute the section is recorded into the graphics command buffer like the ops after it
+            if (asyncCompute) {
+                asyncCommandCount = commands.size();
+            }
+            continue;
+        default:
+            break;
+        }
+        commands.push_back(renderCommand);
+    }
+    for (size_t i = 0; i < asyncCommandCount; ++i) {
+        RenderCommand& renderCommand = commands[i];
+        if (renderCommand.type == RenderCommand::MEMORY_BARRIER) {
+            limitToComputeQueue(renderCommand.memoryBarrier.srcStageMask, renderCommand.memoryBarrier.srcAccessMask);
+            limitToComputeQueue(renderCommand.memoryBarrier.dstStageMask, renderCommand.memoryBarrier.dstAccessMask);
+        } else if (renderCommand.type == RenderCommand::BUFFER_BARRIERS) {
+            for (uint32_t j = 0; j < renderCommand.bufferBarriers.count; ++j) {
+                VkBufferMemoryBarrier2& bufferBarrier = bufferBarriers[renderCommand.bufferBarriers.first + j];
+                limitToComputeQueue(bufferBarrier.srcStageMask, bufferBarrier.srcAccessMask);
+                limitToComputeQueue(bufferBarrier.dstStageMask, bufferBarrier.dstAccessMask);
+            }
+        }
+    }
+    if (sortScanStatesBuffer.valid()) {
+        sortScanStates = bufferSlots[sortScanStatesBuffer.index]->buffer();
+    }
+
+    dynamicOffsets.resize(dynamicOffsetTransients.size());
+
+    recordInputs = callbackInputs;
+    if (!transientOffsets.empty()) {
+        recordInputs.push_back({transientOffsets.data(), transientOffsets.size() * sizeof(uint32_t)});
+    }
+    for (const RenderCommand& renderCommand : commands) {
+        if (renderCommand.type == RenderCommand::PUSH_CONSTANTS) {
+            recordInputs.push_back({renderCommand.pushConstants.data, renderCommand.pushConstants.size});
+        } else if (renderCommand.type == RenderCommand::DISPATCH_DYNAMIC) {
+            recordInputs.push_back({renderCommand.dispatchDynamic.x, sizeof(uint32_t)});
+            recordInputs.push_back({renderCommand.dispatchDynamic.y, sizeof(uint32_t)});
+            recordInputs.push_back({renderCommand.dispatchDynamic.z, sizeof(uint32_t)});
+        } else if (renderCommand.type == RenderCommand::DRAW_INDEXED_INDIRECT_COUNT && renderCommand.drawIndirect.dynamicMaxDrawCount) {
+            recordInputs.push_back({renderCommand.drawIndirect.dynamicMaxDrawCount, sizeof(uint32_t)});
+        }
+    }
+    recordInputsSize = 0;
+    for (const RecordInput& input : recordInputs) {
+        recordInputsSize += input.size;
+    }
+    splitRecording();
+    invalidateCommandBuffers();
 }
 
-RenderOp VulkanRenderGraph::setViewportOp(VkViewport viewport) {
-    return [=](VkCommandBuffer commandBuffer) { vkCmdSetViewport(commandBuffer, 0, 1, &viewport); };
+void VulkanRenderGraph::recordRenderOps(VkCommandBuffer commandBuffer, size_t first, size_t last) {
+    VkDeviceSize offset = 0;
+    // selects the copies of the buffers and sets with a copy per frame in flight
+    size_t frame = getCurrentFrame();
+    for (size_t i = first; i < last; ++i) {
+        const RenderCommand& renderCommand = commands[i];
+        switch (renderCommand.type) {
+        case RenderCommand::BIND_PIPELINE:
+            vkCmdBindPipeline(commandBuffer, renderCommand.bindPipeline.bindPoint, renderCommand.bindPipeline.pipeline);
+            break;
+        case RenderCommand::BIND_DESCRIPTOR_SETS:
+            vkCmdBindDescriptorSets(commandBuffer, renderCommand.bindDescriptorSet.bindPoint, renderCommand.bindDescriptorSet.layout,
+                                    renderCommand.bindDescriptorSet.set, 1, &renderCommand.bindDescriptorSet.descriptorSets[frame],
+                                    renderCommand.bindDescriptorSet.dynamicOffsetCount,
+                                    dynamicOffsets.data() + renderCommand.bindDescriptorSet.firstDynamicOffset);
+            break;
+        case RenderCommand::PUSH_CONSTANTS:
+            vkCmdPushConstants(commandBuffer, renderCommand.pushConstants.layout, renderCommand.pushConstants.stageFlags,
+                               renderCommand.pushConstants.offset, renderCommand.pushConstants.size, renderCommand.pushConstants.data);
+            break;
+        case RenderCommand::DISPATCH:
+            vkCmdDispatch(commandBuffer, renderCommand.dispatch.x, renderCommand.dispatch.y, renderCommand.dispatch.z);
+            break;
+        case RenderCommand::DISPATCH_DYNAMIC:
+            vkCmdDispatch(commandBuffer, *renderCommand.dispatchDynamic.x, *renderCommand.dispatchDynamic.y,
+                          *renderCommand.dispatchDynamic.z);
+            break;
+        case RenderCommand::DRAW:
+            vkCmdDraw(commandBuffer, renderCommand.draw.vertexCount, 1, 0, 0);
+            break;
+        case RenderCommand::DRAW_INDEXED_INDIRECT_COUNT: {
+            const auto& drawIndirect = renderCommand.drawIndirect;
+            uint32_t maxDrawCount = drawIndirect.dynamicMaxDrawCount ? *drawIndirect.dynamicMaxDrawCount : drawIndirect.maxDrawCount;
+            vkCmdDrawIndexedIndirectCount(commandBuffer, drawIndirect.buffer, drawIndirect.offset + frame * drawIndirect.bufferFrameStride,
+                                          drawIndirect.countBuffer,
+                                          drawIndirect.countBufferOffset + frame * drawIndirect.countBufferFrameStride, maxDrawCount,
+                                          drawIndirect.stride);
+            break;
+        }
+        case RenderCommand::FILL_BUFFER:
+            vkCmdFillBuffer(commandBuffer, renderCommand.fillBuffer.buffer,
+                            renderCommand.fillBuffer.offset + frame * renderCommand.fillBuffer.frameStride, renderCommand.fillBuffer.size,
+                            renderCommand.fillBuffer.value);
+            break;
+        case RenderCommand::BIND_VERTEX_BUFFER:
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &renderCommand.bindBuffer.buffer, &offset);
+            break;
+        case RenderCommand::BIND_INDEX_BUFFER:
+            vkCmdBindIndexBuffer(commandBuffer, renderCommand.bindBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+            break;
+        case RenderCommand::MEMORY_BARRIER: {
+            VkDependencyInfo dependencyInfo{};
+            dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+            dependencyInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+            dependencyInfo.memoryBarrierCount = 1;
+            dependencyInfo.pMemoryBarriers = &renderCommand.memoryBarrier;
+            vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+            break;
+        }
+        case RenderCommand::BUFFER_BARRIERS: {
+            VkDependencyInfo dependencyInfo{};
+            dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+            dependencyInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+            dependencyInfo.bufferMemoryBarrierCount = renderCommand.bufferBarriers.count;
+            dependencyInfo.pBufferMemoryBarriers = &bufferBarriers[renderCommand.bufferBarriers.first];
+            vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+            break;
+        }
+        case RenderCommand::WRITE_TIMESTAMP:
+            vkCmdWriteTimestamp2(commandBuffer, renderCommand.timestamp.stage, renderCommand.timestamp.queryPool,
+                                 renderCommand.timestamp.query);
+            break;
+        case RenderCommand::RESET_QUERY_POOL:
+            vkCmdResetQueryPool(commandBuffer, renderCommand.resetQueryPool.queryPool, renderCommand.resetQueryPool.firstQuery,
+                                renderCommand.resetQueryPool.count);
+            break;
+        case RenderCommand::CALLBACK:
+            callbacks[renderCommand.callback.index](commandBuffer);
+            break;
+        case RenderCommand::ASYNC_COMPUTE_END:
+            // dropped by resolveCommands()
+            break;
+        }
+    }
 }
 
-RenderOp VulkanRenderGraph::setScissorOp(VkRect2D scissor) {
-    return [=](VkCommandBuffer commandBuffer) { vkCmdSetScissor(commandBuffer, 0, 1, &scissor); };
+void VulkanRenderGraph::splitRecording() {
+    recordingChunks.clear();
+    size_t threadCount = _settings->recordingThreads;
+    if (threadCount == 0 || asyncCommandCount == commands.size()) {
+        return;
+    }
+    // NOTE:
+    // The command count is only a rough measure of the recording cost, the callbacks record more than one command
+    size_t chunkSize = (commands.size() - asyncCommandCount + threadCount - 1) / threadCount;
+    RecordingChunk chunk{asyncCommandCount, asyncCommandCount, nullptr};
+    for (size_t i = asyncCommandCount; i < commands.size(); ++i) {
+        if (commands[i].passStart && i - chunk.first >= chunkSize && recordingChunks.size() + 1 < threadCount) {
+            chunk.last = i;
+            recordingChunks.push_back(chunk);
+            chunk.first = i;
+        }
+    }
+    chunk.last = commands.size();
+    recordingChunks.push_back(chunk);
 }
 
-void VulkanRenderGraph::recordRenderOps(VkCommandBuffer commandBuffer) {
-    for (RenderOp renderOp : renderOps) {
-        renderOp(commandBuffer);
+void VulkanRenderGraph::recordChunks(VkCommandBuffer commandBuffer) {
+    size_t index = getCurrentCommandBufferIndex();
+    // NOTE:
+    // The chunks start and end outside of the renderings, so they don't inherit a rendering
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+    std::for_each(std::execution::par, recordingChunks.begin(), recordingChunks.end(), [&](RecordingChunk& chunk) {
+        // an exception escaping a parallel algorithm terminates
+        try {
+            VkCommandBuffer secondary = recordingCommandBuffers[&chunk - recordingChunks.data()][index];
+            vkResetCommandBuffer(secondary, 0);
+            checkResult(vkBeginCommandBuffer(secondary, &beginInfo), "failed to begin recording secondary command buffer");
+            // dynamic state isn't inherited from the primary command buffer
+            resetViewScissor(secondary);
+            recordRenderOps(secondary, chunk.first, chunk.last);
+            checkResult(vkEndCommandBuffer(secondary), "failed to end secondary command buffer");
+        } catch (...) {
+            chunk.exception = std::current_exception();
+        }
+    });
+
+    std::vector<VkCommandBuffer> secondaries(recordingChunks.size());
+    for (size_t i = 0; i < recordingChunks.size(); ++i) {
+        if (recordingChunks[i].exception) {
+            std::rethrow_exception(std::exchange(recordingChunks[i].exception, nullptr));
+        }
+        secondaries[i] = recordingCommandBuffers[i][index];
     }
+    vkCmdExecuteCommands(commandBuffer, secondaries.size(), secondaries.data());
 }
@@ -4,6 +4,7 @@
 #include "vulkan_descriptors.hpp"
 #include "vulkan_pipeline.hpp"
 #include "vulkan_rendergraph.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <glslang/Include/ResourceLimits.h>
 #include <glslang/MachineIndependent/Versions.h>
@@ -30,6 +31,33 @@ static std::pair<EShLanguage, VkShaderStageFlagBits> getStage(std::string shader
     }
 }
 
+// Resolves #include "file" relative to the shader directory
+class ShaderIncluder : public glslang::TShader::Includer {
+  public:
+    ShaderIncluder(std::string basePath) : basePath{basePath} {}
+
+    IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+        std::vector<char>* source;
+        try {
+            source = new std::vector<char>(readFile(basePath + headerName));
+        } catch (std::exception& e) {
+            // glslang reports the failed include as a parse error
+            return nullptr;
+        }
+        return new IncludeResult(headerName, source->data(), source->size(), source);
+    }
+
+    void releaseInclude(IncludeResult* result) override {
+        if (result != nullptr) {
+            delete reinterpret_cast<std::vector<char>*>(result->userData);
+            delete result;
+        }
+    }
+
+  private:
+    std::string basePath;
+};
+
 static inline VkPipelineBindPoint flagToBindPoint(VkShaderStageFlagBits stageFlags) {
     switch (stageFlags) {
     case VK_SHADER_STAGE_VERTEX_BIT:
@@ -102,9 +130,7 @@ void VulkanRenderGraph::VulkanShader::compile() {
         rules = static_cast<EShMessages>(rules | EShMsgDebugInfo);
     }
 
-    // TODO
-    // Custom includer
-    glslang::TShader::ForbidIncluder includer;
+    ShaderIncluder includer(basePath);
 
     result = shader.parse(limits, defaultVersion, defaultProfile, forceDefaultVersionAndProfile, forwardCompatible, rules, includer);
     if (!result) {
@@ -143,20 +169,42 @@ void VulkanRenderGraph::VulkanShader::compile() {
 
 void VulkanRenderGraph::VulkanShader::setDescriptorBuffers(VulkanDescriptors::VulkanDescriptor* descriptor,
                                                            bufferCreateInfoMap& bufferCreateInfos, bufferMap& globalBuffers,
-                                                           imageInfosMap& globalImageInfos) {
+                                                           imageInfosMap& globalImageInfos,
+                                                           const std::unordered_map<std::string, std::string>& bufferAliases,
+                                                           std::vector<TransientBuffer>& transientBuffers,
+                                                           const std::set<std::string>& scratchBuffers) {
     // Generate reflection with spirv-cross
     spirv_cross::Compiler comp(spirv);
     spirv_cross::ShaderResources res = comp.get_shader_resources();
 
-    auto loadBuffer = [&](const spirv_cross::Resource& resource, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties) {
+    VkPipelineStageFlags2 stage = stageFlags == VK_SHADER_STAGE_VERTEX_BIT     ? VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT
+                                  : stageFlags == VK_SHADER_STAGE_FRAGMENT_BIT ? VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT
+                                                                               : VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    auto loadBuffer = [&](const spirv_cross::Resource& resource, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                          VkAccessFlags2 access) {
         uint32_t set = comp.get_decoration(resource.id, spv::DecorationDescriptorSet);
         uint32_t binding = comp.get_decoration(resource.id, spv::DecorationBinding);
-        std::string name = resource.name;
+        std::string name = bufferAliases.count(resource.name) == 1 ? bufferAliases.at(resource.name) : resource.name;
         const spirv_cross::SPIRType& type = comp.get_type(resource.base_type_id);
         // Get size of array if it has 1 element,
         // so size of the array type, like sizeof(array[0])
         size_t size = comp.get_declared_struct_size_runtime_array(type, 1);
 
+        auto transient = std::find_if(transientBuffers.begin(), transientBuffers.end(),
+                                      [&](const TransientBuffer& transientBuffer) { return transientBuffer.name == name; });
+        if (transient != transientBuffers.end()) {
+            if (size > transient->size) {
+                throw std::runtime_error("transient buffer " + name + " is smaller than its block in file: " + path);
+            }
+            VkDescriptorType descriptorType = usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+                                                                               : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+            descriptor->addDynamicBinding(set, binding, &transient->bufferInfo, descriptorType);
+            transientBindings[{set, binding}] = transient - transientBuffers.begin();
+            // NOTE:
+            // No access for the barriers, every frame reads its own copy and the host writes it before the frame is submitted
+            return;
+        }
+
         uint32_t bufferExists = globalBuffers.count(name) == 1;
         uint32_t bufferHasCount = bufferCreateInfos.count(name) == 1;
         // NOTE:
@@ -173,20 +221,35 @@ void VulkanRenderGraph::VulkanShader::setDescriptorBuffers(VulkanDescriptors::Vu
             std::tie(count, additionalUsage, additionalProperties) = bufferCreateInfos.at(name);
             usage |= additionalUsage;
             properties |= additionalProperties;
-            globalBuffers[name] = std::make_shared<VulkanBuffer>(_device, size * count, usage, properties);
+            if (scratchBuffers.count(name) == 1 && !(properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+                // bound by aliasScratchBuffers() before the descriptors are written
+                globalBuffers[name] = VulkanBuffer::UnboundBuffer(_device, size * count, usage, properties);
+            } else {
+                globalBuffers[name] = std::make_shared<VulkanBuffer>(_device, size * count, usage, properties);
+            }
             if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
                 globalBuffers.at(name)->map();
             }
         }
         descriptor->addBinding(set, binding, globalBuffers.at(name));
+        bufferAccesses.push_back({name, stage, access});
     };
 
     for (const spirv_cross::Resource& resource : res.storage_buffers) {
-        loadBuffer(resource, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        // readonly and writeonly are decorated on every member of the block
+        spirv_cross::Bitset flags = comp.get_buffer_block_flags(resource.id);
+        VkAccessFlags2 access = 0;
+        if (!flags.get(spv::DecorationNonReadable)) {
+            access |= VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+        }
+        if (!flags.get(spv::DecorationNonWritable)) {
+            access |= VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        }
+        loadBuffer(resource, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, access);
     }
     for (const spirv_cross::Resource& resource : res.uniform_buffers) {
-        loadBuffer(resource, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        loadBuffer(resource, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                   VK_ACCESS_2_UNIFORM_READ_BIT);
     }
     for (const spirv_cross::Resource& resource : res.separate_samplers) {
         uint32_t set = comp.get_decoration(resource.id, spv::DecorationDescriptorSet);
@@ -209,6 +272,16 @@ void VulkanRenderGraph::VulkanShader::setDescriptorBuffers(VulkanDescriptors::Vu
             throw std::runtime_error("missing image info named: '" + name + "' for file: " + path);
         }
     }
+    for (const spirv_cross::Resource& resource : res.storage_images) {
+        uint32_t set = comp.get_decoration(resource.id, spv::DecorationDescriptorSet);
+        uint32_t binding = comp.get_decoration(resource.id, spv::DecorationBinding);
+        std::string name = resource.name;
+        if (globalImageInfos.count(name) == 1) {
+            descriptor->setImageInfos(set, binding, globalImageInfos[name], true);
+        } else {
+            throw std::runtime_error("missing image info named: '" + name + "' for file: " + path);
+        }
+    }
     for (const spirv_cross::Resource& resource : res.push_constant_buffers) {
         const spirv_cross::SPIRType& type = comp.get_type(resource.base_type_id);
         size_t size = comp.get_declared_struct_size(type);
@@ -244,9 +317,6 @@ void VulkanRenderGraph::VulkanShader::setDescriptorBuffers(VulkanDescriptors::Vu
         // offset should be the total size of the spec constants by the end of the loop
         specInfo.dataSize = offset;
     }
-
-    descriptor->allocateSets();
-    descriptor->update();
 }
 
 VulkanRenderGraph::VulkanShader::VulkanShader(std::string path, std::shared_ptr<VulkanDevice> device) : path{path}, _device{device} {
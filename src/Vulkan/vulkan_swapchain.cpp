@@ -10,6 +10,8 @@
 #include <memory>
 #include <vector>
 #include <vulkan/vulkan_core.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
 
 VulkanSwapChain::VulkanSwapChain(std::shared_ptr<VulkanDevice> deviceRef, VkExtent2D windowExtent)
     : device{deviceRef}, windowExtent{windowExtent}, oldSwapChain(VK_NULL_HANDLE) {
@@ -17,7 +19,8 @@ VulkanSwapChain::VulkanSwapChain(std::shared_ptr<VulkanDevice> deviceRef, VkExte
 }
 
 VulkanSwapChain::VulkanSwapChain(std::shared_ptr<VulkanDevice> deviceRef, VkExtent2D windowExtent, VulkanSwapChain* oldSwapChain)
-    : device{deviceRef}, windowExtent{windowExtent}, oldSwapChain(oldSwapChain->swapChain) {
+    : device{deviceRef}, windowExtent{windowExtent}, depthPyramidEnabled{oldSwapChain->depthPyramidEnabled},
+      visibilityBufferEnabled{oldSwapChain->visibilityBufferEnabled}, oldSwapChain(oldSwapChain->swapChain) {
     init();
     delete oldSwapChain;
 }
@@ -31,21 +34,46 @@ VulkanSwapChain::~VulkanSwapChain() {
     vkDestroyImage(device->device(), depthImage, nullptr);
     vkFreeMemory(device->device(), depthImageMemory, nullptr);
 
+    if (depthPyramidEnabled) {
+        for (VkImageView levelView : depthPyramidLevelViews) {
+            vkDestroyImageView(device->device(), levelView, nullptr);
+        }
+        vkDestroyImageView(device->device(), depthPyramidView, nullptr);
+        vkDestroyImage(device->device(), depthPyramidImage, nullptr);
+        vkFreeMemory(device->device(), depthPyramidImageMemory, nullptr);
+    }
+
+    if (visibilityBufferEnabled) {
+        vkDestroyImageView(device->device(), visibilityImageView, nullptr);
+        vkDestroyImage(device->device(), visibilityImage, nullptr);
+        vkFreeMemory(device->device(), visibilityImageMemory, nullptr);
+    }
+
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         vkDestroySemaphore(device->device(), renderFinishedSemaphores[i], nullptr);
         vkDestroySemaphore(device->device(), imageAvailableSemaphores[i], nullptr);
-        vkDestroyFence(device->device(), inFlightFences[i], nullptr);
     }
 
     for (size_t i = 0; i < swapChainImageViews.size(); i++) {
         vkDestroyImageView(device->device(), swapChainImageViews[i], nullptr);
     }
 
-    vkDestroySwapchainKHR(device->device(), swapChain, nullptr);
+    if (device->headless()) {
+        for (size_t i = 0; i < swapChainImages.size(); i++) {
+            vkDestroyImage(device->device(), swapChainImages[i], nullptr);
+            vkFreeMemory(device->device(), offscreenImageMemory[i], nullptr);
+        }
+    } else {
+        vkDestroySwapchainKHR(device->device(), swapChain, nullptr);
+    }
 }
 
 void VulkanSwapChain::init() {
-    createSwapChain();
+    if (device->headless()) {
+        createOffscreenImages();
+    } else {
+        createSwapChain();
+    }
     createImageViews();
     createColorResources();
     createDepthResources();
@@ -141,6 +169,20 @@ void VulkanSwapChain::createSwapChain() {
     swapChainExtent = extent;
 }
 
+void VulkanSwapChain::createOffscreenImages() {
+    // NOTE:
+    // RGBA so the read back frames can be written as they are
+    swapChainImageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+    swapChainExtent = windowExtent;
+    swapChainImages.resize(MAX_FRAMES_IN_FLIGHT);
+    offscreenImageMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < swapChainImages.size(); i++) {
+        device->createImage(swapChainExtent.width, swapChainExtent.height, 1, VK_SAMPLE_COUNT_1_BIT, swapChainImageFormat,
+                            VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapChainImages[i], offscreenImageMemory[i]);
+    }
+}
+
 void VulkanSwapChain::createImageViews() {
     swapChainImageViews.resize(swapChainImages.size());
     for (size_t i = 0; i < swapChainImages.size(); i++) {
@@ -152,66 +194,111 @@ void VulkanSwapChain::createImageViews() {
 void VulkanSwapChain::createSyncObjects() {
     imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
     renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
 
     VkSemaphoreCreateInfo semaphoreInfo{};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
     for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         checkResult((vkCreateSemaphore(device->device(), &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) |
-                     vkCreateSemaphore(device->device(), &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) |
-                     vkCreateFence(device->device(), &fenceInfo, nullptr, &inFlightFences[i])),
+                     vkCreateSemaphore(device->device(), &semaphoreInfo, nullptr, &renderFinishedSemaphores[i])),
                     "failed to create synchronization objects for a frame!");
     }
 }
 
-VkResult VulkanSwapChain::acquireNextImage() {
-    vkWaitForFences(device->device(), 1, &inFlightFences[currentFrame()], VK_TRUE, UINT64_MAX);
-
-    VkResult result = vkAcquireNextImageKHR(device->device(), swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame()],
-                                            VK_NULL_HANDLE, &imageIndex);
-
-    vkResetFences(device->device(), 1, &inFlightFences[currentFrame()]);
+void VulkanSwapChain::waitForCurrentFrame() { device->waitTimeline(frameTimelineValues[currentFrame()]); }
 
-    return result;
+uint64_t VulkanSwapChain::frameTimelineValue(uint32_t framesAgo) {
+    if (framesAgo >= MAX_FRAMES_IN_FLIGHT) {
+        // older frames finished before the current one started
+        return 0;
+    }
+    return frameTimelineValues[(_currentFrame + MAX_FRAMES_IN_FLIGHT - 1 - framesAgo) % MAX_FRAMES_IN_FLIGHT];
 }
 
-VkResult VulkanSwapChain::submitCommandBuffers(const VkCommandBuffer* buffer) {
-
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-    VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame()]};
-    VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = waitSemaphores;
-    submitInfo.pWaitDstStageMask = waitStages;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = buffer;
+VkResult VulkanSwapChain::acquireNextImage() {
+    waitForCurrentFrame();
 
-    VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame()]};
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = signalSemaphores;
+    if (device->headless()) {
+        // every frame in flight has its own image
+        imageIndex = currentFrame();
+        return VK_SUCCESS;
+    }
 
-    checkResult(vkQueueSubmit(device->graphicsQueue(), 1, &submitInfo, inFlightFences[currentFrame()]),
-                "failed to submit draw command buffer");
+    return vkAcquireNextImageKHR(device->device(), swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame()], VK_NULL_HANDLE,
+                                 &imageIndex);
+}
 
-    VkPresentInfoKHR presentInfo{};
-    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = signalSemaphores;
+VkResult VulkanSwapChain::submitCommandBuffers(const VkCommandBuffer* buffers, uint32_t bufferCount, const TimelineWait* timeline) {
+    std::vector<VkSemaphoreSubmitInfo> waitInfos;
+    std::vector<VkSemaphoreSubmitInfo> signalInfos;
+    // NOTE:
+    // Offscreen images aren't acquired or presented, so headless frames only use the timeline semaphores
+    if (!device->headless()) {
+        VkSemaphoreSubmitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+        waitInfo.semaphore = imageAvailableSemaphores[currentFrame()];
+        waitInfo.stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+        waitInfos.push_back(waitInfo);
+
+        VkSemaphoreSubmitInfo signalInfo{};
+        signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+        signalInfo.semaphore = renderFinishedSemaphores[currentFrame()];
+        signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        signalInfos.push_back(signalInfo);
+    }
+    // NOTE:
+    // The single time commands aren't waited for on the host, the frame waits for the ones submitted before it
+    if (device->singleTimeTimelineValue() > 0) {
+        VkSemaphoreSubmitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+        waitInfo.semaphore = device->timelineSemaphore();
+        waitInfo.value = device->singleTimeTimelineValue();
+        waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        waitInfos.push_back(waitInfo);
+    }
+    if (timeline) {
+        VkSemaphoreSubmitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+        waitInfo.semaphore = timeline->semaphore;
+        waitInfo.value = timeline->value;
+        waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        waitInfos.push_back(waitInfo);
+    }
 
-    VkSwapchainKHR swapChains[] = {swapChain};
-    presentInfo.swapchainCount = 1;
-    presentInfo.pSwapchains = swapChains;
-    presentInfo.pImageIndices = &imageIndex;
-    presentInfo.pResults = nullptr;
+    std::vector<VkCommandBufferSubmitInfo> commandBufferInfos(bufferCount);
+    for (uint32_t i = 0; i < bufferCount; ++i) {
+        commandBufferInfos[i].sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+        commandBufferInfos[i].commandBuffer = buffers[i];
+    }
 
-    VkResult result = vkQueuePresentKHR(device->presentQueue(), &presentInfo);
+    VkSubmitInfo2 submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.waitSemaphoreInfoCount = waitInfos.size();
+    submitInfo.pWaitSemaphoreInfos = waitInfos.data();
+    submitInfo.commandBufferInfoCount = commandBufferInfos.size();
+    submitInfo.pCommandBufferInfos = commandBufferInfos.data();
+    submitInfo.signalSemaphoreInfoCount = signalInfos.size();
+    submitInfo.pSignalSemaphoreInfos = signalInfos.data();
+
+    frameTimelineValues[currentFrame()] = device->submitGraphics(submitInfo);
+    // frees the staging buffers of the uploads that finished
+    device->releaseCompletedCommands();
+
+    VkResult result = VK_SUCCESS;
+    if (!device->headless()) {
+        VkPresentInfoKHR presentInfo{};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &renderFinishedSemaphores[currentFrame()];
+
+        VkSwapchainKHR swapChains[] = {swapChain};
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = swapChains;
+        presentInfo.pImageIndices = &imageIndex;
+        presentInfo.pResults = nullptr;
+
+        result = vkQueuePresentKHR(device->presentQueue(), &presentInfo);
+    }
 
     _currentFrame = (_currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
 
@@ -221,9 +308,76 @@ VkResult VulkanSwapChain::submitCommandBuffers(const VkCommandBuffer* buffer) {
 void VulkanSwapChain::createDepthResources() {
     VkFormat depthFormat = findDepthFormat();
     device->createImage(swapChainExtent.width, swapChainExtent.height, 1, device->getMsaaSamples(), depthFormat, VK_IMAGE_TILING_OPTIMAL,
-                        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
+                        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        depthImage, depthImageMemory);
     device->setDebugName(VK_OBJECT_TYPE_IMAGE, (uint64_t)depthImage, "depthImage");
     depthImageView = device->createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
+    if (depthPyramidEnabled) {
+        createDepthPyramid();
+    }
+    if (visibilityBufferEnabled) {
+        createVisibilityBuffer();
+    }
+}
+
+void VulkanSwapChain::enableDepthPyramid() {
+    if (!depthPyramidEnabled) {
+        depthPyramidEnabled = true;
+        createDepthPyramid();
+    }
+}
+
+void VulkanSwapChain::createDepthPyramid() {
+    // NOTE:
+    // Rounding up keeps every texel aligned to a power of two block of depth pixels,
+    // texel x of level n covers the depth pixels [x << (n + 1), (x + 1) << (n + 1))
+    depthPyramidExtents.clear();
+    VkExtent2D extent = {(swapChainExtent.width + 1) / 2, (swapChainExtent.height + 1) / 2};
+    depthPyramidExtents.push_back(extent);
+    while ((extent.width > 1 || extent.height > 1) && depthPyramidExtents.size() < MAX_DEPTH_PYRAMID_LEVELS) {
+        extent = {(extent.width + 1) / 2, (extent.height + 1) / 2};
+        depthPyramidExtents.push_back(extent);
+    }
+    uint32_t levels = depthPyramidExtents.size();
+
+    const VkFormat pyramidFormat = VK_FORMAT_R32_SFLOAT;
+    device->createImage(depthPyramidExtents[0].width, depthPyramidExtents[0].height, levels, VK_SAMPLE_COUNT_1_BIT, pyramidFormat,
+                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthPyramidImage, depthPyramidImageMemory);
+    device->setDebugName(VK_OBJECT_TYPE_IMAGE, (uint64_t)depthPyramidImage, "depthPyramidImage");
+    depthPyramidView = device->createImageView(depthPyramidImage, pyramidFormat, VK_IMAGE_ASPECT_COLOR_BIT, levels);
+
+    depthPyramidLevelViews.resize(levels);
+    for (uint32_t level = 0; level < levels; ++level) {
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = depthPyramidImage;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = pyramidFormat;
+        viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1};
+        checkResult(vkCreateImageView(device->device(), &viewInfo, nullptr, &depthPyramidLevelViews[level]),
+                    "failed to create depth pyramid level view");
+    }
+
+    // The pyramid stays in the general layout, it's written as a storage image and sampled in the same frame
+    device->singleTimeCommands()
+        .transitionImageLayout(depthPyramidImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, levels)
+        .submit();
+}
+
+void VulkanSwapChain::enableVisibilityBuffer() {
+    if (!visibilityBufferEnabled) {
+        visibilityBufferEnabled = true;
+        createVisibilityBuffer();
+    }
+}
+
+void VulkanSwapChain::createVisibilityBuffer() {
+    device->createImage(swapChainExtent.width, swapChainExtent.height, 1, device->getMsaaSamples(), VISIBILITY_FORMAT,
+                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, visibilityImage, visibilityImageMemory);
+    device->setDebugName(VK_OBJECT_TYPE_IMAGE, (uint64_t)visibilityImage, "visibilityImage");
+    visibilityImageView = device->createImageView(visibilityImage, VISIBILITY_FORMAT, VK_IMAGE_ASPECT_COLOR_BIT, 1);
 }
 
 void VulkanSwapChain::createColorResources() {
@@ -260,3 +414,28 @@ VkFormat VulkanSwapChain::findDepthFormat() {
 bool VulkanSwapChain::hasStencilComponent(VkFormat format) {
     return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
+
+void VulkanSwapChain::saveImage(std::string path) {
+    if (!device->headless()) {
+        throw std::runtime_error("only offscreen images can be saved");
+    }
+    VkDeviceSize size = swapChainExtent.width * swapChainExtent.height * 4;
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    device->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         buffer, memory);
+    // imageIndex still points at the image of the last submitted frame
+    device->singleTimeCommands()
+        .copyImageToBuffer(swapChainImages[imageIndex], buffer, swapChainExtent.width, swapChainExtent.height)
+        .run();
+
+    void* data;
+    vkMapMemory(device->device(), memory, 0, size, 0, &data);
+    bool written = stbi_write_png(path.c_str(), swapChainExtent.width, swapChainExtent.height, 4, data, swapChainExtent.width * 4);
+    vkUnmapMemory(device->device(), memory);
+    vkDestroyBuffer(device->device(), buffer, nullptr);
+    vkFreeMemory(device->device(), memory, nullptr);
+    if (!written) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
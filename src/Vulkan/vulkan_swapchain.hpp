@@ -3,18 +3,35 @@
 
 #include "vulkan_device.hpp"
 #include <memory>
+#include <string>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
 class VulkanSwapChain {
   public:
     const static int MAX_FRAMES_IN_FLIGHT = 2;
+    // Enough for a 65536 pixel wide swap chain
+    const static uint32_t MAX_DEPTH_PYRAMID_LEVELS = 16;
+    // One packed (instance, triangle) ID per pixel
+    const static VkFormat VISIBILITY_FORMAT = VK_FORMAT_R32_UINT;
 
     VulkanSwapChain(std::shared_ptr<VulkanDevice> deviceRef, VkExtent2D windowExtent);
     VulkanSwapChain(std::shared_ptr<VulkanDevice> deviceRef, VkExtent2D windowExtent, VulkanSwapChain* oldSwapChain);
     ~VulkanSwapChain();
     VkResult acquireNextImage();
-    VkResult submitCommandBuffers(const VkCommandBuffer* buffer);
+    // Waits until the GPU is done with the previous submission of the current frame, acquireNextImage waits on it as well
+    void waitForCurrentFrame();
+    // Device timeline value of the frame submitted framesAgo frames before the last one, for VulkanDevice::waitTimeline
+    // 0 for frames that already finished before the frames in flight
+    uint64_t frameTimelineValue(uint32_t framesAgo);
+    // A timeline semaphore of work on another queue, the submission waits for value before any of its commands run
+    struct TimelineWait {
+        VkSemaphore semaphore;
+        uint64_t value;
+    };
+    // Signals the device timeline, the value is kept for waiting on the frame
+    // The command buffers run in order, like the ones the frame uploads with before its own
+    VkResult submitCommandBuffers(const VkCommandBuffer* buffers, uint32_t bufferCount, const TimelineWait* timeline = nullptr);
 
     VkExtent2D getExtent() { return swapChainExtent; }
     VkImage getDepthImage() { return depthImage; }
@@ -22,15 +39,37 @@ class VulkanSwapChain {
     VkImage getSwapChainImage() { return swapChainImages[imageIndex]; }
     VkImageView getSwapChainImageView() { return swapChainImageViews[imageIndex]; }
     size_t currentFrame() const { return _currentFrame; }
+    uint32_t currentImage() const { return imageIndex; }
+    size_t imageCount() const { return swapChainImages.size(); }
     VkFormat getSwapChainImageFormat() { return swapChainImageFormat; }
+    // The layout the image is left in at the end of the frame, offscreen images are left for reading back
+    VkImageLayout presentLayout() { return device->headless() ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; }
+    // Writes the image of the last submitted frame to a PNG file, only for offscreen images
+    void saveImage(std::string path);
     VkFormat findDepthFormat();
+    // Creates the depth pyramid, it's recreated with the swap chain from then on
+    void enableDepthPyramid();
+    // View of every level, for sampling
+    VkImageView getDepthPyramidView() { return depthPyramidView; }
+    // View of a single level, for storage
+    VkImageView getDepthPyramidLevelView(uint32_t level) { return depthPyramidLevelViews[level]; }
+    uint32_t getDepthPyramidLevels() { return depthPyramidExtents.size(); }
+    VkExtent2D getDepthPyramidExtent(uint32_t level) { return depthPyramidExtents[level]; }
+    // Creates the visibility image, it's recreated with the swap chain from then on
+    void enableVisibilityBuffer();
+    VkImage getVisibilityImage() { return visibilityImage; }
+    VkImageView getVisibilityImageView() { return visibilityImageView; }
 
   private:
     void init();
     void createSwapChain();
+    // Headless, one offscreen image per frame in flight instead of the swap chain images
+    void createOffscreenImages();
     void createImageViews();
     void createColorResources();
     void createDepthResources();
+    void createDepthPyramid();
+    void createVisibilityBuffer();
     void createSyncObjects();
     void startFrame();
 
@@ -51,14 +90,30 @@ class VulkanSwapChain {
 
     std::vector<VkImage> swapChainImages;
     std::vector<VkImageView> swapChainImageViews;
+    std::vector<VkDeviceMemory> offscreenImageMemory;
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
-    std::vector<VkFence> inFlightFences;
+    // device timeline value of the last submission of every frame in flight
+    uint64_t frameTimelineValues[MAX_FRAMES_IN_FLIGHT] = {};
 
     VkImage depthImage;
     VkDeviceMemory depthImageMemory;
     VkImageView depthImageView;
 
+    // Max depth of the depth image, level 0 is half its size and every level is half the size of the one before it, rounded up
+    bool depthPyramidEnabled = false;
+    VkImage depthPyramidImage;
+    VkDeviceMemory depthPyramidImageMemory;
+    VkImageView depthPyramidView;
+    std::vector<VkImageView> depthPyramidLevelViews;
+    std::vector<VkExtent2D> depthPyramidExtents;
+
+    // Rendered to instead of the swap chain image by the visibility passes, same size and sample count as the depth image
+    bool visibilityBufferEnabled = false;
+    VkImage visibilityImage;
+    VkDeviceMemory visibilityImageMemory;
+    VkImageView visibilityImageView;
+
     VkImage colorImage;
     VkDeviceMemory colorImageMemory;
     VkImageView colorImageView;
@@ -1,10 +1,25 @@
 #include "vulkan_window.hpp"
 
-VulkanWindow::VulkanWindow(int w, int h, std::string name) : width{w}, height{h}, windowName{name} { initWindow(); }
+VulkanWindow::VulkanWindow(int w, int h, std::string name, bool headless)
+    : width{w}, height{h}, windowName{name}, _headless{headless} {
+    if (!_headless) {
+        initWindow();
+    }
+}
 
 VulkanWindow::~VulkanWindow() {
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (!_headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+}
+
+void VulkanWindow::close() {
+    if (_headless) {
+        closed = true;
+    } else {
+        glfwSetWindowShouldClose(window, 1);
+    }
 }
 
 void VulkanWindow::initWindow() {
@@ -8,20 +8,25 @@
 
 class VulkanWindow {
   public:
-    VulkanWindow(int w, int h, std::string name);
+    // A headless window creates no GLFW window, the frames are rendered into offscreen images
+    VulkanWindow(int w, int h, std::string name, bool headless = false);
     ~VulkanWindow();
 
     GLFWwindow* getGLFWwindow() { return window; }
-    bool shouldClose() { return glfwWindowShouldClose(window); }
+    bool headless() const { return _headless; }
+    bool shouldClose() { return _headless ? closed : glfwWindowShouldClose(window); }
+    void close();
     VkExtent2D getExtent() { return {static_cast<uint32_t>(width), static_cast<uint32_t>(height)}; }
 
   private:
     void initWindow();
 
-    GLFWwindow* window;
+    GLFWwindow* window = nullptr;
     int width;
     int height;
     std::string windowName;
+    bool _headless;
+    bool closed = false;
 };
 
 #endif // VULKAN_WINDOW_H_
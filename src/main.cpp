@@ -6,8 +6,8 @@ using namespace std;
 
 int main(int argc, char* argv[]) {
 
-    Open4X game;
     try {
+        Open4X game(argc, argv);
         // gltf::GLTF("assets/glTF/basic_triangle.gltf");
         game.run();
         //   gltf::GLTF("assets/glTF/Box.glb");
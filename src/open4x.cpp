@@ -7,6 +7,7 @@
 #include <glm/trigonometric.hpp>
 #include <iomanip>
 #include <memory>
+#include <random>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -51,12 +52,36 @@ glm::mat4 perspectiveProjection(float vertical_fov, float aspect_ratio, float ne
     return projectionMatrix;
 }
 
-Open4X::Open4X() {
+Open4X::Open4X(int argc, char* argv[]) {
     creationTime = std::chrono::high_resolution_clock::now();
-    vulkanWindow = new VulkanWindow(640, 480, "Open 4X");
-    glfwSetKeyCallback(vulkanWindow->getGLFWwindow(), key_callback);
+    parseArguments(argc, argv);
+    vulkanWindow = new VulkanWindow(640, 480, "Open 4X", headless);
+    if (!headless) {
+        glfwSetKeyCallback(vulkanWindow->getGLFWwindow(), key_callback);
+    }
+
+    vulkanDevice = std::make_shared<VulkanDevice>(vulkanWindow, deviceName);
+}
 
-    vulkanDevice = std::make_shared<VulkanDevice>(vulkanWindow);
+void Open4X::parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "--headless") {
+            headless = true;
+        } else if (argument == "--device" && hasValue) {
+            deviceName = argv[++i];
+        } else if (argument == "--frames" && hasValue) {
+            frameLimit = std::stoul(argv[++i]);
+        } else if (argument == "--screenshot" && hasValue) {
+            screenshotPath = argv[++i];
+        } else {
+            throw std::runtime_error("unknown argument " + argument);
+        }
+    }
+    if (!screenshotPath.empty() && !headless) {
+        throw std::runtime_error("--screenshot needs --headless");
+    }
 }
 
 Open4X::~Open4X() {
@@ -66,24 +91,27 @@ Open4X::~Open4X() {
     delete vulkanWindow;
 }
 
-void fillComputePushConstants(ComputePushConstants& computePushConstants, float vFov, float aspectRatio, float nearClip, float farClip) {
-    computePushConstants.nearD = nearClip;
-    computePushConstants.farD = farClip;
-    computePushConstants.ratio = aspectRatio;
+void fillCullGlobals(CullGlobals& cullGlobals, float vFov, VkExtent2D extent, float nearClip, float farClip) {
+    float aspectRatio = extent.width / (float)extent.height;
+    cullGlobals.nearD = nearClip;
+    cullGlobals.farD = farClip;
+    cullGlobals.ratio = aspectRatio;
+    cullGlobals.viewportWidth = extent.width;
+    cullGlobals.viewportHeight = extent.height;
 
     vFov *= glm::pi<double>() / 360.0;
-    computePushConstants.tang = glm::tan(vFov);
-    computePushConstants.sphereFactorY = 1.0 / glm::cos(vFov);
+    cullGlobals.tang = glm::tan(vFov);
+    cullGlobals.sphereFactorY = 1.0 / glm::cos(vFov);
 
-    float angleX = glm::atan(computePushConstants.tang * aspectRatio);
-    computePushConstants.sphereFactorX = 1.0 / glm::cos(angleX);
+    float angleX = glm::atan(cullGlobals.tang * aspectRatio);
+    cullGlobals.sphereFactorX = 1.0 / glm::cos(angleX);
 }
 
-void setComputePushConstantsCamera(ComputePushConstants& computePushConstants, VulkanObject* camera) {
-    computePushConstants.camPos = camera->position();
-    computePushConstants.Z = glm::normalize(camera->rotation() * VulkanObject::forwardVector);
-    computePushConstants.X = glm::normalize(camera->rotation() * VulkanObject::rightVector);
-    computePushConstants.Y = glm::normalize(camera->rotation() * VulkanObject::upVector);
+void setCullGlobalsCamera(CullGlobals& cullGlobals, VulkanObject* camera) {
+    cullGlobals.camPos = camera->position();
+    cullGlobals.Z = glm::normalize(camera->rotation() * VulkanObject::forwardVector);
+    cullGlobals.X = glm::normalize(camera->rotation() * VulkanObject::rightVector);
+    cullGlobals.Y = glm::normalize(camera->rotation() * VulkanObject::upVector);
 }
 
 void Open4X::loadSettings() {
@@ -100,11 +128,30 @@ void Open4X::loadSettings() {
 
         settings->extraObjectCount = objectsJSON["extraObjectCount"].GetInt();
         settings->randLimit = objectsJSON["randLimit"].GetInt();
+        settings->churnPerFrame = objectsJSON["churnPerFrame"].GetInt();
+        settings->mortonOrder = objectsJSON["mortonOrder"].GetBool();
+        settings->lodCount = objectsJSON["lodCount"].GetInt();
 
         Value& miscJSON = d["misc"];
         assert(miscJSON.IsObject());
         settings->showFPS = miscJSON["showFPS"].GetBool();
         settings->pauseOnMinimization = miscJSON["pauseOnMinimization"].GetBool();
+        settings->benchmarkFrames = miscJSON["benchmarkFrames"].GetInt();
+        settings->validateCullingFrames = miscJSON["validateCullingFrames"].GetInt();
+        settings->validateSortFrames = miscJSON["validateSortFrames"].GetInt();
+        settings->cpuCulling = miscJSON["cpuCulling"].GetBool();
+        settings->occlusionCulling = miscJSON["occlusionCulling"].GetBool();
+        settings->minPixelSize = miscJSON["minPixelSize"].GetFloat();
+        settings->lodPixelSize = miscJSON["lodPixelSize"].GetFloat();
+        settings->meshletCulling = miscJSON["meshletCulling"].GetBool();
+        settings->depthPrepass = miscJSON["depthPrepass"].GetBool();
+        settings->visibilityBuffer = miscJSON["visibilityBuffer"].GetBool();
+        settings->autoBarriers = miscJSON["autoBarriers"].GetBool();
+        settings->validateBarriers = miscJSON["validateBarriers"].GetBool();
+        settings->reuseCommandBuffers = miscJSON["reuseCommandBuffers"].GetBool();
+        settings->asyncCompute = miscJSON["asyncCompute"].GetBool();
+        settings->recordingThreads = miscJSON["recordingThreads"].GetInt();
+        settings->aliasScratchBuffers = miscJSON["aliasScratchBuffers"].GetBool();
 
     } else {
         std::cout << "Failed to open settings file, using defaults" << std::endl;
@@ -131,21 +178,41 @@ void Open4X::run() {
 
     glm::mat4 proj = perspectiveProjection(vFov, aspectRatio, nearClip, farClip);
 
-    objects.computePushConstants.totalInstanceCount = objects.totalInstanceCount();
-    fillComputePushConstants(objects.computePushConstants, vFov, aspectRatio, nearClip, farClip);
+    objects.cullGlobals.totalInstanceCount = objects.totalInstanceCount();
+    fillCullGlobals(objects.cullGlobals, vFov, renderGraph.getSwapChainExtent(), nearClip, farClip);
 
     auto startTime = std::chrono::high_resolution_clock::now();
     std::cout << "Total load time: " << std::chrono::duration<float, std::chrono::milliseconds::period>(startTime - creationTime).count()
               << "ms" << std::endl;
     float titleFrametime = 0.0f;
     std::string title;
-    while (!glfwWindowShouldClose(vulkanWindow->getGLFWwindow())) {
-        glfwPollEvents();
-
+    uint32_t benchmarkFrame = 0;
+    // 0 measures the load order, 1 the morton order
+    uint32_t benchmarkLayout = 0;
+    double benchmarkCullTime[2] = {};
+    double benchmarkDrawTime[2] = {};
+    double benchmarkRecordTime[2] = {};
+    uint32_t validateCullingFrame = 0;
+    uint32_t validateSortFrame = 0;
+    std::mt19937 validateCullingRandom(time(NULL));
+    uint32_t frame = 0;
+    while (!vulkanWindow->shouldClose()) {
         auto currentTime = std::chrono::high_resolution_clock::now();
         float frameTime = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
         startTime = currentTime;
-        camera->keyboardUpdate(vulkanWindow->getGLFWwindow(), frameTime);
+        if (!headless) {
+            glfwPollEvents();
+            camera->keyboardUpdate(vulkanWindow->getGLFWwindow(), frameTime);
+        }
+        if (settings->validateCullingFrames > 0) {
+            // Random cameras inside the object volume, so frames mix fully visible, fully culled and edge instances
+            std::uniform_real_distribution<float> positionDistribution(0, settings->randLimit);
+            std::uniform_real_distribution<float> angleDistribution(-glm::pi<float>(), glm::pi<float>());
+            camera->setPostion({positionDistribution(validateCullingRandom), positionDistribution(validateCullingRandom),
+                                positionDistribution(validateCullingRandom)});
+            camera->setRotation(glm::quat(glm::vec3(angleDistribution(validateCullingRandom), angleDistribution(validateCullingRandom),
+                                                    angleDistribution(validateCullingRandom))));
+        }
         if (titleFrametime == 0.0f) {
             titleFrametime = frameTime;
         } else {
@@ -158,21 +225,46 @@ void Open4X::run() {
         ubo.projView = proj * glm::inverse(cameraModel);
         ubo.camPos = camera->position();
 
-        renderGraph.bufferWrite("Globals", &ubo);
+        renderGraph.bufferWrite(objects.globalsBuffer, &ubo);
 
-        setComputePushConstantsCamera(objects.computePushConstants, camera);
+        setCullGlobalsCamera(objects.cullGlobals, camera);
 
         objects.updateModels();
+        // after updateModels, spawning can change the instance and meshlet counts
+        renderGraph.bufferWrite(objects.cullGlobalsBuffer, &objects.cullGlobals);
+
+        bool swapChainRecreated = renderGraph.render();
+
+        // NOTE:
+        // skipped when the swap chain was recreated, the frame may not have been submitted
+        if (settings->validateCullingFrames > 0 && !swapChainRecreated) {
+            objects.validateCulling();
+            if (++validateCullingFrame == settings->validateCullingFrames) {
+                std::cout << "Cull validation passed over " << settings->validateCullingFrames << " frames" << std::endl;
+                vulkanWindow->close();
+            }
+        }
+        if (settings->validateSortFrames > 0 && !swapChainRecreated) {
+            objects.validateSort();
+            if (++validateSortFrame == settings->validateSortFrames) {
+                std::cout << "Sort validation passed over " << settings->validateSortFrames << " frames" << std::endl;
+                vulkanWindow->close();
+            }
+        }
 
-        if (renderGraph.render()) {
+        if (swapChainRecreated) {
             aspectRatio = renderGraph.getSwapChainExtent().width / (float)renderGraph.getSwapChainExtent().height;
             proj = perspectiveProjection(vFov, aspectRatio, nearClip, farClip);
-            fillComputePushConstants(objects.computePushConstants, vFov, aspectRatio, nearClip, farClip);
+            fillCullGlobals(objects.cullGlobals, vFov, renderGraph.getSwapChainExtent(), nearClip, farClip);
+        }
+
+        if (++frame == frameLimit) {
+            vulkanWindow->close();
         }
 
         //        std::this_thread::sleep_for(std::chrono::seconds(1));
 
-        if (settings->showFPS) {
+        if (settings->showFPS || settings->benchmarkFrames > 0) {
             const uint32_t queryCount = 4;
             std::vector<uint64_t> queryResults(queryCount);
             const bool wait = true;
@@ -185,19 +277,58 @@ void Open4X::run() {
                                   VK_QUERY_RESULT_64_BIT | (wait ? VK_QUERY_RESULT_WAIT_BIT : VK_QUERY_RESULT_64_BIT));
 
             float cullTime = (queryResults[1] - queryResults[0]) * vulkanDevice->timestampPeriod() * 1e-6;
+            if (objects.cullsOnHost()) {
+                // the culled buffers are uploaded by the upload command buffer before the queries, they measure nothing
+                cullTime = objects.hostCullTime;
+            }
             float drawTime = (queryResults[3] - queryResults[2]) * vulkanDevice->timestampPeriod() * 1e-6;
 
-            std::stringstream title;
-            title << "Frametime: " << std::fixed << std::setprecision(2) << (titleFrametime * 1000) << "ms"
-                  << " "
-                  << "Framerate: " << 1.0 / titleFrametime << " "
-                  << "Drawtime: " << drawTime << "ms"
-                  << " "
-                  << "Culltime: " << cullTime << "ms";
-
-            glfwSetWindowTitle(vulkanWindow->getGLFWwindow(), title.str().c_str());
+            if (settings->benchmarkFrames > 0) {
+                // NOTE:
+                // skipping the first frames in flight, their queries haven't been written yet
+                // or they still measure the previous layout
+                if (benchmarkFrame >= VulkanSwapChain::MAX_FRAMES_IN_FLIGHT) {
+                    benchmarkCullTime[benchmarkLayout] += cullTime / settings->benchmarkFrames;
+                    benchmarkDrawTime[benchmarkLayout] += drawTime / settings->benchmarkFrames;
+                    benchmarkRecordTime[benchmarkLayout] += renderGraph.recordTime() / settings->benchmarkFrames;
+                }
+                if (++benchmarkFrame == settings->benchmarkFrames + VulkanSwapChain::MAX_FRAMES_IN_FLIGHT) {
+                    std::cout << "Benchmark over " << settings->benchmarkFrames << " frames, "
+                              << "layout: " << (benchmarkLayout == 0 ? "load order" : "morton order") << " "
+                              << "average Culltime: " << benchmarkCullTime[benchmarkLayout] << "ms "
+                              << "average Drawtime: " << benchmarkDrawTime[benchmarkLayout] << "ms "
+                              << "average Recordtime: " << benchmarkRecordTime[benchmarkLayout] << "ms" << std::endl;
+                    benchmarkFrame = 0;
+                    if (++benchmarkLayout == 1) {
+                        objects.applyMortonOrder();
+                    } else {
+                        std::cout << "Morton order delta, "
+                                  << "Culltime: " << benchmarkCullTime[1] - benchmarkCullTime[0] << "ms "
+                                  << "Drawtime: " << benchmarkDrawTime[1] - benchmarkDrawTime[0] << "ms" << std::endl;
+                        vulkanWindow->close();
+                    }
+                }
+            }
+
+            if (settings->showFPS && !headless) {
+                std::stringstream title;
+                title << "Frametime: " << std::fixed << std::setprecision(2) << (titleFrametime * 1000) << "ms"
+                      << " "
+                      << "Framerate: " << 1.0 / titleFrametime << " "
+                      << "Drawtime: " << drawTime << "ms"
+                      << " "
+                      << "Culltime: " << cullTime << "ms";
+
+                glfwSetWindowTitle(vulkanWindow->getGLFWwindow(), title.str().c_str());
+            }
         }
     }
     vkDeviceWaitIdle(vulkanDevice->device());
+    // the pending staging buffers hold the device
+    vulkanDevice->releaseCompletedCommands();
+    if (!screenshotPath.empty()) {
+        renderGraph.saveFrame(screenshotPath);
+        std::cout << "Saved the last frame to " << screenshotPath << std::endl;
+    }
     delete camera;
 }
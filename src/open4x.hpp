@@ -10,10 +10,15 @@
 #include "glTF/GLTF.hpp"
 #include <chrono>
 #include <memory>
+#include <string>
 
 class Open4X {
   public:
-    Open4X();
+    // --headless renders offscreen without a window
+    // --device <name> uses the first suitable device whose name contains name, like llvmpipe
+    // --frames <count> closes after count frames
+    // --screenshot <path> writes the last frame to a PNG file, headless only
+    Open4X(int argc, char* argv[]);
     ~Open4X();
     void run();
 
@@ -30,6 +35,12 @@ class Open4X {
 
     std::shared_ptr<Settings> settings;
     void loadSettings();
+
+    bool headless = false;
+    std::string deviceName;
+    uint32_t frameLimit = 0;
+    std::string screenshotPath;
+    void parseArguments(int argc, char* argv[]);
 };
 
 #endif // OPEN4X_H_